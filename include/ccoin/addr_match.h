@@ -6,8 +6,8 @@
  */
 
 #include <stdbool.h>
-#include <gmp.h>
-#include <ccoin/parr.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,24 +18,74 @@ struct bp_keyset;
 struct bp_tx;
 struct bp_block;
 
+/* output masks: bit i of word i / 64 is set if output i matched */
+static inline unsigned int bp_mask_words(unsigned int n_bits)
+{
+	return (n_bits + 63) / 64;
+}
+
+static inline bool bp_mask_test(const uint64_t *mask, unsigned int i)
+{
+	return (mask[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bp_mask_set(uint64_t *mask, unsigned int i)
+{
+	mask[i / 64] |= 1ULL << (i % 64);
+}
+
 extern bool bp_txout_match(const struct bp_txout *txout,
 		    const struct bp_keyset *ks);
 extern bool bp_tx_match(const struct bp_tx *tx, const struct bp_keyset *ks);
-extern bool bp_tx_match_mask(mpz_t mask, const struct bp_tx *tx,
+extern bool bp_tx_match_mask(uint64_t *mask, const struct bp_tx *tx,
 		      const struct bp_keyset *ks);
 
+/*
+ * Streaming block match: fn is called for each tx with a matching
+ * output, in block order, with its mask.  The mask is only valid for
+ * the call.  fn returns false to stop the walk.
+ */
+typedef bool (*bp_block_match_fn)(void *ctx, unsigned int n,
+				  const uint64_t *mask, unsigned int n_words);
+
+extern bool bp_block_match_each(const struct bp_block *block,
+				const struct bp_keyset *ks,
+				bp_block_match_fn fn, void *ctx);
+
+/*
+ * The matches of one block, stored contiguously.  A mask of up to 64
+ * outputs is held inline; wider ones spill into the shared word array.
+ * Reusing one bp_block_matches across blocks reuses its storage.
+ */
 struct bp_block_match {
 	unsigned int	n;		/* block.vtx array index */
-	mpz_t		mask;		/* bitmask of matched txout's */
-	bool		self_alloc;	/* alloc'd by bbm_new? */
+	unsigned int	n_words;	/* mask words */
+	uint64_t	bits;		/* n_words == 1: outputs 0-63 */
+	size_t		spill;		/* n_words > 1: offset in spill */
 };
 
-extern void bbm_init(struct bp_block_match *match);
-extern struct bp_block_match *bbm_new(void);
-extern void bbm_free(void *bp_block_match_match);
+struct bp_block_matches {
+	struct bp_block_match	*match;
+	unsigned int		len;
+	unsigned int		alloc;
+
+	uint64_t		*spill;
+	size_t			spill_len;
+	size_t			spill_alloc;
+};
+
+static inline const uint64_t *bbm_mask(const struct bp_block_matches *bm,
+				       const struct bp_block_match *match)
+{
+	return (match->n_words == 1) ? &match->bits : bm->spill + match->spill;
+}
+
+extern void bbm_init(struct bp_block_matches *bm);
+extern void bbm_free(struct bp_block_matches *bm);
 
-extern parr *bp_block_match(const struct bp_block *block,
-			    const struct bp_keyset *ks);
+extern bool bp_block_match(struct bp_block_matches *bm,
+			   const struct bp_block *block,
+			   const struct bp_keyset *ks);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,110 @@
+#ifndef __LIBCCOIN_ADDRINDEX_H__
+#define __LIBCCOIN_ADDRINDEX_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ccoin/bucketfile.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+#include <ccoin/hashtab.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent scripthash -> outpoint index, for address history.
+ *
+ * A scripthash is the SHA256 of an output's scriptPubKey, so every
+ * script type is indexed alike, without parsing.  Each connected block
+ * records, under the scripthash of the script involved:
+ *
+ *   BP_ADDRINDEX_OUT	output txid:n was created, worth value
+ *   BP_ADDRINDEX_IN	output txid:n (with that script) was spent by
+ *			input spend_n of tx spend_txid
+ *
+ * so a script's unspent outputs are its OUT entries without a matching
+ * IN entry.  Disconnecting a block removes its entries again.
+ *
+ * Stored as a bucketfile.h FILE of entries sorted by (scripthash,
+ * height, txid, n, kind); FILE.log holds each block's adds and
+ * removes, followed by a commit record naming the new best block, and
+ * is merged into a new FILE by compaction.
+ *
+ * The index follows one chain: a block is connected only on top of
+ * the indexed best block, and only the best block is disconnected.
+ * A NULL filename gives a memory-only index.
+ */
+enum {
+	BP_ADDRINDEX_VERSION	= 1,
+	BP_ADDRINDEX_HDR_SZ	= BP_BUCKETFILE_HDR_SZ + 4 + 4 + 32,
+	BP_ADDRINDEX_ENT_SZ	= 32 + 4 + 32 + 4 + 4 + 8 + 32 + 4,
+	BP_ADDRINDEX_COMPACT_MIN = 1 << 16,	/* log entries */
+};
+
+enum bp_addrindex_kind {
+	BP_ADDRINDEX_OUT	= 0,
+	BP_ADDRINDEX_IN		= 1,
+};
+
+struct bp_addrindex_ent {
+	bu256_t		scripthash;
+	uint32_t	height;
+	bu256_t		txid;		/* output txid:n */
+	uint32_t	n;
+	uint32_t	kind;		/* enum bp_addrindex_kind */
+	int64_t		value;
+	bu256_t		spend_txid;	/* BP_ADDRINDEX_IN only */
+	uint32_t	spend_n;
+};
+
+struct bp_addrindex {
+	struct bp_bucketfile bf;	/* FILE and FILE.log */
+
+	/* log entries, and removals of FILE entries, by entry key */
+	struct bp_hashtab *recent;
+	/* scripthash -> parr of the same, for queries */
+	struct bp_hashtab *recent_script;
+
+	int		best_height;	/* -1 if empty */
+	bu256_t		best_hash;
+};
+
+extern void bp_addrindex_scripthash(bu256_t *scripthash,
+				    const cstring *script);
+extern bool bp_addrindex_open(struct bp_addrindex *idx, const char *fn,
+			      bool read_only);
+extern void bp_addrindex_close(struct bp_addrindex *idx);
+extern bool bp_addrindex_connect(struct bp_addrindex *idx,
+				 const struct bp_block *block,
+				 unsigned int height, const parr *undo);
+extern bool bp_addrindex_disconnect(struct bp_addrindex *idx,
+				    const struct bp_block *block,
+				    const parr *undo);
+extern bool bp_addrindex_history(const struct bp_addrindex *idx,
+				 const bu256_t *scripthash, parr *out);
+extern void bp_addrindex_unspent(const parr *history, parr *out);
+extern bool bp_addrindex_compact(struct bp_addrindex *idx);
+
+/* log large enough, relative to FILE, to be worth merging */
+static inline bool bp_addrindex_want_compact(const struct bp_addrindex *idx)
+{
+	uint64_t n_recent = bp_hashtab_size(idx->recent);
+
+	return idx->bf.fn && !idx->bf.read_only &&
+	       (n_recent >= BP_ADDRINDEX_COMPACT_MIN) &&
+	       (n_recent * 8 >= idx->bf.n_base);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_ADDRINDEX_H__ */
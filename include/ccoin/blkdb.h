@@ -20,13 +20,18 @@ struct blkinfo {
 	bu256_t		hash;
 	struct bp_block	hdr;
 
-	mpz_t		work;
+	bu256_t		work;		/* cumulative chain work */
 	int		height;
 
 	int32_t		n_file;		/* uninitialized == -1 */
 	int64_t		n_pos;		/* uninitialized == -1 */
+	int64_t		n_undo_pos;	/* uninitialized == -1 */
+
+	bool		invalid;	/* failed to connect, or descends
+					 * from a block that did */
 
 	struct blkinfo	*prev;
+	struct blkinfo	*skip;		/* ancestor, for O(log n) lookups */
 };
 
 struct blkdb_reorg {
@@ -46,6 +51,10 @@ struct blkdb {
 	struct bp_hashtab *blocks;
 
 	struct blkinfo	*best_chain;
+	parr		*chain;		/* of blkinfo, indexed by height */
+
+	uint32_t	log_tail_len;	/* last record in the log, and */
+	bu256_t		log_tail;	/* its SHA256; zero len if unknown */
 };
 
 extern struct blkinfo *bi_new(void);
@@ -57,14 +66,51 @@ extern void blkdb_free(struct blkdb *db);
 extern bool blkdb_read(struct blkdb *db, const char *idx_fn);
 extern bool blkdb_add(struct blkdb *db, struct blkinfo *bi,
 		      struct blkdb_reorg *reorg_info);
+extern bool blkdb_invalidate(struct blkdb *db, struct blkinfo *bi,
+			     struct blkdb_reorg *reorg_info);
 extern void blkdb_locator(struct blkdb *db, struct blkinfo *bi,
 		   struct bp_locator *locator);
 
+/*
+ * Binary checkpoint of the block index.  Fixed-size records, in height
+ * order, with height, cumulative work and prev-record index precomputed,
+ * followed by a SHA256 checksum of the file.  The checkpoint covers the
+ * first log_ofs bytes of the "rec" log; records appended after that are
+ * replayed from the log on load.  The header also carries the length and
+ * SHA256 of the last log record before log_ofs, so a checkpoint is only
+ * used against the log it was taken from.
+ */
+enum {
+	BLKDB_CKPT_VERSION	= 3,
+	BLKDB_CKPT_HDR_SZ	= 8 + 4 + 4 + 32 + 8 + 4 + 32 + 4 + 4,
+	BLKDB_CKPT_REC_SZ	= 32 + 4 + 32 + 4 + 4 + 4 +
+				  4 + 4 + 4 + 8 + 32,
+};
+
+extern bool blkdb_ckpt_write(struct blkdb *db, const char *ckpt_fn,
+			     uint64_t log_ofs);
+extern bool blkdb_ckpt_read(struct blkdb *db, const char *ckpt_fn,
+			    uint64_t *log_ofs);
+extern bool blkdb_read_ckpt(struct blkdb *db, const char *idx_fn,
+			    const char *ckpt_fn, bool *ckpt_stale);
+
 static inline struct blkinfo *blkdb_lookup(struct blkdb *db,const bu256_t *hash)
 {
 	return (struct blkinfo *)bp_hashtab_get(db->blocks, hash);
 }
 
+/* block at given height on the best chain, or NULL */
+static inline struct blkinfo *blkdb_at_height(struct blkdb *db, int height)
+{
+	if ((height < 0) || (height >= db->chain->len))
+		return NULL;
+
+	return (struct blkinfo *) parr_idx(db->chain, height);
+}
+
+extern struct blkinfo *blkdb_ancestor(struct blkdb *db, struct blkinfo *bi,
+				      int height);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,110 @@
+#ifndef __LIBCCOIN_BLKPIPE_H__
+#define __LIBCCOIN_BLKPIPE_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+#include <ccoin/message.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Staged block file ingestion:
+ *
+ *   read -> deserialize, txids, merkle -> bp_block_valid -> process
+ *
+ * One thread reads records, pools of threads run the two context-free
+ * stages, and the process callback runs on the calling thread, in file
+ * order.  Queues between stages are bounded, as is the number of
+ * blocks in flight.
+ */
+
+enum blkpipe_stage {
+	BLKPIPE_READ,
+	BLKPIPE_DESER,
+	BLKPIPE_VALID,
+	BLKPIPE_PROCESS,
+
+	BLKPIPE_N_STAGES
+};
+
+struct blkpipe_stage_stats {
+	uint64_t	n_items;
+	double		busy_secs;	/* summed over the stage's threads */
+	double		avg_depth;	/* of the stage's input queue */
+	size_t		max_depth;
+};
+
+struct blkpipe_stats {
+	uint64_t	n_blocks;
+	uint64_t	n_bytes;
+	double		wall_secs;
+	unsigned int	n_threads;
+
+	struct blkpipe_stage_stats stage[BLKPIPE_N_STAGES];
+};
+
+typedef bool (*blkpipe_read_fn)(int fd, struct p2p_message *msg,
+				bool *read_ok);
+typedef bool (*blkpipe_block_fn)(struct bp_block *block,
+				 const struct p2p_message_hdr *hdr,
+				 int64_t fpos, void *priv);
+
+struct blkpipe_opts {
+	blkpipe_read_fn	read_f;		/* fread_message or fread_block */
+	unsigned int	n_threads;	/* per parallel stage; 0 = # cpus */
+	unsigned int	queue_len;	/* 0 = default */
+	bool		validate;	/* run bp_block_valid stage */
+};
+
+struct blkpipe_result {
+	bool		read_ok;	/* false: I/O or framing error */
+	int64_t		fail_fpos;	/* record that stopped the run, or -1 */
+	const char	*fail_reason;
+};
+
+extern bool blkpipe_run(int fd, const struct blkpipe_opts *opts,
+			blkpipe_block_fn block_f, void *priv,
+			struct blkpipe_stats *stats,
+			struct blkpipe_result *result);
+
+/*
+ * Sharded ingestion: a framing-only pass splits the file into ranges
+ * of whole records, of about equal size, and each range is then read,
+ * decoded and processed start to end on a thread of its own.  Blocks
+ * of one shard reach block_f in file order; shards run concurrently,
+ * so per-shard state (shard_priv[i]) is merged by the caller, in
+ * shard order, afterwards.
+ */
+struct blkpipe_shard {
+	int64_t		start;		/* fpos of first record */
+	int64_t		end;		/* fpos past last record */
+	uint64_t	first_seq;	/* records in the file before start */
+	uint64_t	n_blocks;
+};
+
+extern bool blkpipe_split(int fd, blkpipe_read_fn read_f, int64_t start,
+			  unsigned int max_shards,
+			  struct blkpipe_shard *shards, unsigned int *n_shards,
+			  struct blkpipe_result *result);
+extern bool blkpipe_run_shards(const char *fn,
+			       const struct blkpipe_opts *opts,
+			       const struct blkpipe_shard *shards,
+			       unsigned int n_shards,
+			       blkpipe_block_fn block_f, void **shard_priv,
+			       struct blkpipe_stats *stats,
+			       struct blkpipe_result *result);
+extern cstring *blkpipe_stats_str(const struct blkpipe_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_BLKPIPE_H__ */
@@ -0,0 +1,67 @@
+#ifndef __LIBCCOIN_BLOCKFILTER_H__
+#define __LIBCCOIN_BLOCKFILTER_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ccoin/buffer.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * BIP 158 compact block filters.
+ *
+ * A filter is a Golomb-coded set: each item is hashed with SipHash,
+ * keyed by the first 16 bytes of the block hash, into [0, N * M).
+ * The sorted values are stored as deltas, Golomb-Rice coded with P
+ * low bits, behind a CompactSize N.  Matching is one pass over the
+ * filter, with the items to look for hashed and sorted the same way.
+ *
+ * The basic filter holds every output script of a block, except empty
+ * and OP_RETURN ones, and every script its inputs spent.  Filter
+ * headers chain the filters: dSHA256(dSHA256(filter) || prev header).
+ */
+enum {
+	BP_BASIC_FILTER_P	= 19,
+	BP_BASIC_FILTER_M	= 784931,
+};
+
+/* a filter and the block it is of, for batch matching */
+struct bp_block_filter_ref {
+	const bu256_t		*block_hash;
+	const void		*filter;
+	size_t			filter_len;
+};
+
+extern cstring *bp_gcs_build(const unsigned char key[16],
+			     const struct const_buffer *items,
+			     unsigned int n_items);
+extern bool bp_gcs_match_any(const void *filter, size_t filter_len,
+			     const unsigned char key[16],
+			     const struct const_buffer *items,
+			     unsigned int n_items, uint64_t *scratch);
+
+extern cstring *bp_block_filter_basic(const struct bp_block *block,
+				      const parr *undo);
+extern void bp_block_filter_header(bu256_t *header, const cstring *filter,
+				   const bu256_t *prev_header);
+extern bool bp_block_filter_match_batch(const struct bp_block_filter_ref *refs,
+					unsigned int n_refs,
+					const struct const_buffer *items,
+					unsigned int n_items, bool *match);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_BLOCKFILTER_H__ */
@@ -5,6 +5,7 @@
 #define LIBCCOIN_BLOOM_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <ccoin/buffer.h>
 #include <ccoin/cstr.h>
 
@@ -14,11 +15,24 @@ enum {
 	MAX_HASH_FUNCS = 50,
 };
 
+/* BIP 37 nFlags: which matched outputs are added to the filter */
+enum bloom_flags {
+	BLOOM_UPDATE_NONE		= 0,
+	BLOOM_UPDATE_ALL		= 1,
+	BLOOM_UPDATE_P2PUBKEY_ONLY	= 2,
+	BLOOM_UPDATE_MASK		= 3,
+};
+
 struct bloom {
 	cstring		*vData;
 	unsigned int	nHashFuncs;
+	uint32_t	nTweak;
+	unsigned char	nFlags;		/* enum bloom_flags */
 };
 
+struct bp_outpt;
+struct bp_tx;
+
 extern bool bloom_init(struct bloom *bf, unsigned int nElements,double nFPRate);
 extern void __bloom_init(struct bloom *bf);
 extern void bloom_free(struct bloom *bf);
@@ -28,7 +42,41 @@ extern void ser_bloom(cstring *s, const struct bloom *bf);
 
 extern void bloom_insert(struct bloom *bf, const void *data, size_t data_len);
 extern bool bloom_contains(struct bloom *bf, const void *data, size_t data_len);
+extern void bloom_insert_outpt(struct bloom *bf, const struct bp_outpt *outpt);
 
 extern bool bloom_size_ok(const struct bloom *bf);
 
+extern bool bloom_tx_match(struct bloom *bf, const struct bp_tx *tx);
+
+/*
+ * Local filters, for matching within this process; never sent to
+ * peers, as their probes are not BIP 37's.  All of an item's probes
+ * are derived from a single hashing pass, and in blocked mode they
+ * all land in one 64-byte cache line, at the cost of a somewhat larger
+ * filter for the same false positive rate.
+ */
+struct bloom_local {
+	uint64_t	*bits;		/* 64-byte aligned */
+	uint32_t	n_bits;
+	uint32_t	n_lines;	/* 512-bit cache lines */
+	unsigned int	nHashFuncs;
+	bool		blocked;
+};
+
+extern bool bloom_local_init(struct bloom_local *bf, unsigned int nElements,
+			     double nFPRate, bool blocked);
+extern void bloom_local_free(struct bloom_local *bf);
+
+extern void bloom_local_insert(struct bloom_local *bf,
+			       const void *data, size_t data_len);
+extern bool bloom_local_contains(const struct bloom_local *bf,
+				 const void *data, size_t data_len);
+
+extern void bloom_local_insert_batch(struct bloom_local *bf,
+				     const struct const_buffer *items,
+				     unsigned int n);
+extern unsigned int bloom_local_contains_batch(const struct bloom_local *bf,
+					       const struct const_buffer *items,
+					       unsigned int n, bool *match);
+
 #endif /* LIBCCOIN_BLOOM_H */
@@ -0,0 +1,113 @@
+#ifndef __LIBCCOIN_BUCKETFILE_H__
+#define __LIBCCOIN_BUCKETFILE_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ccoin/buffer.h>
+#include <ccoin/cstr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Storage shared by the on-disk indexes (txindex.h, addrindex.h).
+ *
+ * FILE holds fixed-size records sorted by their leading key bytes,
+ * behind a table of record offsets keyed by the first two key bytes,
+ * so a lookup is one bucket read plus a short binary search of a
+ * mapped file.  The header starts with magic, version, a reserved
+ * word and the record count; the rest of it belongs to the index.
+ *
+ * FILE.log holds records appended since FILE was written, one block
+ * at a time, each block ended by a commit record.  Which records are
+ * commits is up to the index.  Compaction writes a new FILE through
+ * a bp_bucketfile_writer and empties the log.
+ *
+ * A NULL filename gives a memory-only file: no FILE, and no log.
+ */
+enum {
+	BP_BUCKETFILE_HDR_SZ	= 8 + 4 + 4 + 8,	/* common part */
+	BP_BUCKETFILE_BUCKETS	= 1 << 16,
+	BP_BUCKETFILE_TAB_SZ	= (BP_BUCKETFILE_BUCKETS + 1) * 8,
+};
+
+struct bp_bucketfile {
+	const char	*magic;		/* 8 bytes */
+	uint32_t	version;
+	size_t		hdr_sz;		/* including the common part */
+	size_t		ent_sz;
+	bool		read_only;
+
+	char		*fn;
+	int		log_fd;
+
+	void		*map;		/* FILE, sorted */
+	size_t		map_len;
+	uint64_t	n_base;
+	const unsigned char *buckets;
+	const unsigned char *ents;
+};
+
+struct bp_bucketfile_writer {
+	struct bp_bucketfile *bf;
+	char		*tmpfn;
+	int		fd;
+	cstring		*buf;
+	uint64_t	n;
+	uint64_t	*counts;	/* per bucket */
+	bool		failed;
+};
+
+/*
+ * Called on each log record, in order.  Returns 1 if rec is a commit
+ * record closing a block, 0 for any other record, and -1 for a commit
+ * record that does not match its block.
+ */
+typedef int (*bp_bucketfile_rec_fn)(void *priv, const unsigned char *rec);
+
+extern void bp_bucketfile_init(struct bp_bucketfile *bf, const char *magic,
+			       uint32_t version, size_t hdr_sz, size_t ent_sz);
+extern bool bp_bucketfile_open(struct bp_bucketfile *bf, const char *fn,
+			       bool read_only);
+extern void bp_bucketfile_close(struct bp_bucketfile *bf);
+extern bool bp_bucketfile_hdr(const struct bp_bucketfile *bf,
+			      struct const_buffer *buf);
+extern uint64_t bp_bucketfile_lower_bound(const struct bp_bucketfile *bf,
+					  const void *key, size_t key_len);
+
+extern bool bp_bucketfile_replay_log(struct bp_bucketfile *bf,
+				     bp_bucketfile_rec_fn rec_fn, void *priv);
+extern bool bp_bucketfile_log_append(struct bp_bucketfile *bf,
+				     const void *data, size_t data_len);
+
+extern bool bp_bucketfile_write_begin(struct bp_bucketfile *bf,
+				      struct bp_bucketfile_writer *w);
+extern void bp_bucketfile_write_put(struct bp_bucketfile_writer *w,
+				    const void *rec);
+extern bool bp_bucketfile_write_end(struct bp_bucketfile_writer *w,
+				    const cstring *hdr);
+extern bool bp_bucketfile_reload(struct bp_bucketfile *bf);
+
+static inline unsigned int bp_bucketfile_bucket(const void *key)
+{
+	const unsigned char *p = key;
+	return (p[0] << 8) | p[1];
+}
+
+static inline const unsigned char *
+bp_bucketfile_ent(const struct bp_bucketfile *bf, uint64_t n)
+{
+	return bf->ents + (n * bf->ent_sz);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_BUCKETFILE_H__ */
@@ -51,6 +51,13 @@ extern unsigned long bu256_hash(const void *key);
 static inline void bu256_free(bu256_t *v) {}
 extern void bu256_freep(void *bu256_v);
 
+/* fixed-width 256-bit arithmetic; operands use bu256_t dword ordering */
+extern void bu256_add(bu256_t *vo, const bu256_t *a, const bu256_t *b);
+extern void bu256_sub(bu256_t *vo, const bu256_t *a, const bu256_t *b);
+extern int bu256_cmp(const bu256_t *a, const bu256_t *b);
+extern bool bu256_set_compact(bu256_t *vo, uint32_t compact);
+extern void bu256_target_work(bu256_t *work, const bu256_t *target);
+
 static inline bool bu256_is_zero(const bu256_t *v)
 {
 	return	v->dword[0] == 0 &&
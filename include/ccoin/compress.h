@@ -0,0 +1,52 @@
+#ifndef __LIBCCOIN_COMPRESS_H__
+#define __LIBCCOIN_COMPRESS_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/buffer.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact encodings for stored outputs, compatible with the reference
+ * client's UTXO database.
+ *
+ * A standard scriptPubKey is stored as a 1-byte template tag plus its
+ * hash or key:
+ *
+ *   0x00 + hash160		P2PKH
+ *   0x01 + hash160		P2SH
+ *   0x02/0x03 + x		P2PK, compressed pubkey
+ *   0x04/0x05 + x		P2PK, uncompressed pubkey (tag holds y parity)
+ *
+ * Any other script is stored as varint(len + BP_SCRIPT_N_SPECIAL) and
+ * its raw bytes.  Amounts drop trailing decimal zeros before being
+ * written as a varint, so round values take 1-3 bytes.
+ */
+enum {
+	BP_SCRIPT_N_SPECIAL	= 6,
+};
+
+extern uint64_t bp_amount_compress(uint64_t n);
+extern uint64_t bp_amount_decompress(uint64_t x);
+
+extern void bp_script_compress(cstring *s, const cstring *script);
+extern bool bp_script_decompress(cstring **so, struct const_buffer *buf);
+
+extern void ser_bp_txout_compressed(cstring *s, const struct bp_txout *txout);
+extern bool deser_bp_txout_compressed(struct bp_txout *txout,
+				      struct const_buffer *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_COMPRESS_H__ */
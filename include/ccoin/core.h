@@ -21,6 +21,7 @@ extern "C" {
 
 enum service_bits {
 	NODE_NETWORK	= (1 << 0),
+	NODE_BLOOM	= (1 << 2),	/* serves BIP 37 filtered blocks */
 };
 
 enum {
@@ -114,6 +115,21 @@ static inline void bp_outpt_copy(struct bp_outpt *dest,
 	memcpy(dest, src, sizeof(*dest));
 }
 
+/* mixes the whole txid, so ground txid prefixes don't collide */
+static inline unsigned long bp_outpt_hash(const struct bp_outpt *outpt)
+{
+	uint64_t h = outpt->n;
+	unsigned int i;
+
+	for (i = 0; i < BU256_WORDS; i++) {
+		h ^= outpt->hash.dword[i];
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+
+	return (unsigned long) h;
+}
+
 struct bp_txin {
 	struct bp_outpt	prevout;
 	cstring		*scriptSig;
@@ -210,6 +226,40 @@ extern void bp_utxo_set_free(struct bp_utxo_set *uset);
 extern bool bp_utxo_is_spent(struct bp_utxo_set *uset, const struct bp_outpt *outpt);
 extern bool bp_utxo_spend(struct bp_utxo_set *uset, const struct bp_outpt *outpt);
 
+struct bp_block;
+
+/*
+ * Undo record for one spent output: the outpoint, plus everything
+ * needed to recreate the coin if the spending block is disconnected.
+ * A block's undo data is a parr of these, in spend order.
+ */
+struct bp_utxo_undo {
+	struct bp_outpt	prevout;
+
+	bool		is_coinbase;
+	uint32_t	height;
+	uint32_t	version;
+
+	struct bp_txout	txout;
+};
+
+extern void bp_utxo_undo_init(struct bp_utxo_undo *undo);
+extern void bp_utxo_undo_free(struct bp_utxo_undo *undo);
+extern void bp_utxo_undo_freep(void *bp_utxo_undo_p);
+extern bool deser_bp_utxo_undo(struct bp_utxo_undo *undo,
+			       struct const_buffer *buf);
+extern void ser_bp_utxo_undo(cstring *s, const struct bp_utxo_undo *undo);
+extern bool deser_bp_block_undo(parr **undo_out, struct const_buffer *buf);
+extern void ser_bp_block_undo(cstring *s, const parr *undo);
+
+extern bool bp_utxo_spend_undo(struct bp_utxo_set *uset,
+			       const struct bp_outpt *outpt, parr *undo);
+extern bool bp_utxo_unspend(struct bp_utxo_set *uset,
+			    const struct bp_utxo_undo *undo);
+extern bool bp_utxo_disconnect_block(struct bp_utxo_set *uset,
+				     const struct bp_block *block,
+				     const parr *undo);
+
 static inline void bp_utxo_set_add(struct bp_utxo_set *uset,
 				   struct bp_utxo *coin)
 {
@@ -222,6 +272,44 @@ static inline struct bp_utxo *bp_utxo_lookup(struct bp_utxo_set *uset,
 	return (struct bp_utxo *)bp_hashtab_get(uset->map, hash);
 }
 
+/*
+ * A block's overlay on a UTXO set.  Spends and new coins are staged in
+ * the view, checked against it, and applied to the set together by
+ * bp_utxo_view_flush(); a view freed without flushing leaves the set
+ * untouched.  The coins a block's inputs spend are looked up in one
+ * batched, prefetched pass, and consumed in block order with
+ * bp_utxo_view_next().
+ */
+struct bp_utxo_view_op;
+
+struct bp_utxo_view {
+	struct bp_utxo_set	*uset;		/* backing set */
+	parr			*coins;		/* per input; NULL: look up late */
+	unsigned int		next;
+
+	struct bp_utxo_view_op	*ops;		/* staged changes, in order */
+	unsigned int		n_ops;
+	unsigned int		ops_alloc;
+	unsigned int		*slots;		/* open-addressed index of ops */
+	unsigned long		n_slots;
+
+	unsigned int		n_resolved;	/* found by the prefetch pass */
+	unsigned int		n_late;		/* looked up at spend time */
+};
+
+extern void bp_utxo_view_init(struct bp_utxo_view *view,
+			      struct bp_utxo_set *uset,
+			      const struct bp_block *block);
+extern void bp_utxo_view_free(struct bp_utxo_view *view);
+extern struct bp_utxo *bp_utxo_view_next(struct bp_utxo_view *view,
+					 const struct bp_outpt *outpt);
+extern bool bp_utxo_view_spend(struct bp_utxo_view *view,
+			       struct bp_utxo *coin,
+			       const struct bp_outpt *outpt);
+extern bool bp_utxo_view_add(struct bp_utxo_view *view,
+			     struct bp_utxo *coin);
+extern bool bp_utxo_view_flush(struct bp_utxo_view *view, parr *undo);
+
 
 struct bp_block {
 	/* serialized */
@@ -252,7 +340,11 @@ extern parr *bp_block_merkle_branch(const struct bp_block *block,
 			       unsigned int txidx);
 extern void bp_check_merkle_branch(bu256_t *hash, const bu256_t *txhash_in,
 			    const parr *mrkbranch, unsigned int txidx);
+extern bool bp_block_valid_hdr(struct bp_block *block);
 extern bool bp_block_valid(struct bp_block *block);
+extern bool bp_block_valid_hashed(struct bp_block *block);
+extern bool bp_block_valid_txs(const struct bp_block *block);
+extern bool bp_block_has_dup_spends(const struct bp_block *block);
 extern unsigned int bp_block_ser_size(const struct bp_block *block);
 extern void bp_block_free_cb(void *data);
 
@@ -12,6 +12,8 @@ extern "C" {
 enum {
 	BIP0031_VERSION		= 60000,
 	CADDR_TIME_VERSION	= 31402,
+	BIP0037_VERSION		= 70001,
+	NO_BLOOM_VERSION	= 70011,	/* bloom service needs NODE_BLOOM */
 
 	MIN_PROTO_VERSION	= 209,
 
@@ -0,0 +1,85 @@
+#ifndef __LIBCCOIN_AES_RECFILE_H__
+#define __LIBCCOIN_AES_RECFILE_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <ccoin/cstr.h>                 // for cstring
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Append-only file of encrypted, authenticated records.
+ *
+ * The passphrase is stretched once per session, when the file is
+ * opened or created, into an AES-256 key and an HMAC-SHA256 key; after
+ * that a record costs one AES-CTR pass and one HMAC over the record
+ * alone, however large the file has grown.
+ *
+ *   header:  magic, version, KDF rounds, salt, record count, HMAC of
+ *            the preceding fields (a wrong passphrase fails here)
+ *   record:  length, IV, AES-256-CTR ciphertext, HMAC-SHA256 of
+ *            (record number, length, IV, ciphertext)
+ *
+ * The record number in the MAC catches records dropped, repeated or
+ * moved; the count in the header, rewritten after each append is
+ * synced, catches records dropped from the end.  A record cut short at
+ * the end of the file (a crash during an append) is ignored, and
+ * overwritten by the next append; a whole record past the count (a
+ * crash before the header was rewritten) is kept.
+ *
+ * Replacing the whole file with an older copy of itself is not
+ * detected: that takes state kept outside the file.
+ */
+enum {
+	AES_RECFILE_VERSION	= 2,
+	AES_RECFILE_SALT_SZ	= 8,
+	AES_RECFILE_IV_SZ	= 16,
+	AES_RECFILE_MAC_SZ	= 32,
+	AES_RECFILE_HDR_SZ	= 8 + 4 + 4 + AES_RECFILE_SALT_SZ + 8 +
+				  AES_RECFILE_MAC_SZ,
+	AES_RECFILE_KDF_ROUNDS	= 25000,
+	AES_RECFILE_COMPACT_MIN	= 256,	/* records */
+};
+
+struct aes_recfile {
+	int		fd;
+	uint64_t	n_recs;		/* records in the file */
+	uint64_t	end;		/* offset past the last whole record */
+
+	uint32_t	rounds;
+	unsigned char	salt[AES_RECFILE_SALT_SZ];
+	unsigned char	enc_key[32];
+	unsigned char	mac_key[32];
+};
+
+extern bool aes_recfile_is(const char *filename);
+extern bool aes_recfile_new(struct aes_recfile *rf,
+			    const void *key_data, size_t key_data_len);
+extern bool aes_recfile_open(struct aes_recfile *rf, const char *filename,
+			     const void *key_data, size_t key_data_len,
+			     cstring **contents);
+extern bool aes_recfile_write(struct aes_recfile *rf, const char *filename,
+			      const void *data, size_t data_len);
+extern bool aes_recfile_append(struct aes_recfile *rf,
+			       const void *data, size_t data_len);
+extern void aes_recfile_close(struct aes_recfile *rf);
+
+/* enough appended records to be worth rewriting the file as one */
+static inline bool aes_recfile_want_compact(const struct aes_recfile *rf)
+{
+	return rf->n_recs >= AES_RECFILE_COMPACT_MIN;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_AES_RECFILE_H__ */
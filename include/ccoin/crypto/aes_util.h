@@ -22,6 +22,9 @@ extern "C" {
 #define MEMSET_BZERO(p,l)     memset((p), 0, (l))
 #define MEMCPY_BCOPY(d,s,l)   memcpy((d), (s), (l))
 
+extern int BytesToKeySHA512AES(unsigned char *salt, unsigned char *key_data,
+			       size_t key_data_len, int count,
+			       unsigned char *key, unsigned char *iv);
 extern cstring *read_aes_file(const char *filename, void *key, size_t key_len,
 			      size_t max_file_len);
 extern bool write_aes_file(const char *filename, void *key, size_t key_len,
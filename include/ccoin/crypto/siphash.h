@@ -0,0 +1,27 @@
+#ifndef __LIBCCOIN_SIPHASH_H__
+#define __LIBCCOIN_SIPHASH_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * SipHash-2-4 (Aumasson and Bernstein), 64-bit output.  The 128-bit
+ * key is k0 || k1, each read little-endian from key bytes 0-7, 8-15.
+ */
+extern uint64_t siphash24_k(uint64_t k0, uint64_t k1,
+			    const void *data, size_t len);
+extern uint64_t siphash24(const uint8_t key[16], const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_SIPHASH_H__ */
@@ -0,0 +1,81 @@
+#ifndef __LIBCCOIN_FILTERINDEX_H__
+#define __LIBCCOIN_FILTERINDEX_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ccoin/buffer.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent height -> BIP 158 basic filter and filter header index.
+ *
+ * FILE is a header, then one record per block in height order:
+ *
+ *   block hash, filter header, varstr filter, checksum
+ *
+ * where the checksum is the first 4 bytes of the dSHA256 of the rest
+ * of the record.  Each record is one write; a torn or damaged tail is
+ * cut off on open.  Disconnecting the best block truncates its record.
+ * Record positions are kept in memory, so the filters of a range of
+ * blocks are one read.
+ *
+ * Like addrindex.h, the index follows one chain, and a NULL filename
+ * gives a memory-only index.
+ */
+enum {
+	BP_FILTERINDEX_VERSION	= 1,
+	BP_FILTERINDEX_HDR_SZ	= 8 + 4,
+};
+
+struct bp_filterindex_ent {
+	bu256_t		block_hash;
+	bu256_t		header;		/* filter header */
+	uint64_t	pos;		/* record, in FILE */
+	uint32_t	filter_len;
+	cstring		*filter;	/* memory-only index */
+};
+
+struct bp_filterindex {
+	char		*fn;
+	int		fd;
+	uint64_t	file_end;
+
+	parr		*ents;		/* of struct bp_filterindex_ent */
+
+	int		best_height;	/* -1 if empty */
+	bu256_t		best_hash;
+};
+
+extern bool bp_filterindex_open(struct bp_filterindex *idx, const char *fn);
+extern void bp_filterindex_close(struct bp_filterindex *idx);
+extern bool bp_filterindex_connect(struct bp_filterindex *idx,
+				   const struct bp_block *block,
+				   unsigned int height, const parr *undo);
+extern bool bp_filterindex_disconnect(struct bp_filterindex *idx,
+				      const struct bp_block *block);
+extern bool bp_filterindex_get(const struct bp_filterindex *idx,
+			       unsigned int height,
+			       struct bp_filterindex_ent *ent,
+			       cstring **filter);
+extern bool bp_filterindex_match(const struct bp_filterindex *idx,
+				 unsigned int first, unsigned int n,
+				 const struct const_buffer *items,
+				 unsigned int n_items, bool *match);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_FILTERINDEX_H__ */
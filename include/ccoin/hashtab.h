@@ -59,6 +59,7 @@ static inline struct bp_hashtab *bp_hashtab_new(
 
 extern void bp_hashtab_unref(struct bp_hashtab *);
 extern bool bp_hashtab_clear(struct bp_hashtab *);
+extern bool bp_hashtab_reserve(struct bp_hashtab *ht, unsigned int n);
 
 static inline void bp_hashtab_ref(struct bp_hashtab *ht)
 {
@@ -88,6 +89,18 @@ static inline void *bp_hashtab_get(struct bp_hashtab *ht, const void *key)
 
 extern void bp_hashtab_iter(struct bp_hashtab *ht, bp_kvu_func f, void *priv);
 
+/*
+ * Prefetch hints for batched lookups: call bp_hashtab_prefetch_bucket()
+ * for a group of keys, then bp_hashtab_prefetch_ent() for each, then do
+ * the lookups, so the cache misses of the group overlap.
+ */
+extern void bp_hashtab_prefetch_bucket(const struct bp_hashtab *ht,
+				       const void *key);
+extern void bp_hashtab_prefetch_ent(const struct bp_hashtab *ht,
+				    const void *key);
+extern void bp_hashtab_prefetch_key(const struct bp_hashtab *ht,
+				    const void *key);
+
 #ifdef __cplusplus
 }
 #endif
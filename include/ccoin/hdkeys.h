@@ -36,6 +36,8 @@ extern void hd_extended_key_free(struct hd_extended_key *ek);
 
 extern bool hd_extended_key_deser(struct hd_extended_key *ek, const void *data,
 				  size_t len);
+extern bool hd_extended_key_deser_base58(struct hd_extended_key *ek,
+					 const char *s);
 extern bool hd_extended_key_ser_pub(const struct hd_extended_key *ek,
 				    cstring *s);
 extern bool hd_extended_key_ser_priv(const struct hd_extended_key *ek,
@@ -48,6 +50,31 @@ extern bool hd_extended_key_generate_child(const struct hd_extended_key *ek,
 					   uint32_t index,
 					   struct hd_extended_key *out_priv);
 
+/* drop the private half; ek is then an xpub */
+extern void hd_extended_key_neuter(struct hd_extended_key *ek);
+
+/*
+ * Public parent -> public child (CKDpub).  Uses the parent's public
+ * key only, so works on xpubs, and always yields an xpub; hardened
+ * indexes are refused.
+ */
+extern bool hd_extended_key_generate_child_pub(const struct hd_extended_key *ek,
+					       uint32_t index,
+					       struct hd_extended_key *out_pub);
+
+struct hd_pub_child {
+	uint8_t			pubkey[BP_PUBKEY_SZ];
+	uint8_t			pubkey_hash[20];	/* Hash160 of pubkey */
+};
+
+/*
+ * Public keys of children first .. first+n-1 of ek, by CKDpub, into
+ * out[0..n-1].  Spread over the bp_parallel_for() thread pool.
+ */
+extern bool hd_derive_pub_batch(const struct hd_extended_key *ek,
+				uint32_t first, unsigned int n,
+				struct hd_pub_child *out);
+
 extern bool hd_derive(struct hd_extended_key *out_child,
 		       const struct hd_extended_key *parent_,
 		       const struct hd_path_seg *hdpath,
@@ -17,11 +17,18 @@
 extern "C" {
 #endif
 
+enum {
+	BP_PUBKEY_SZ		= 33,	/* compressed */
+};
+
 struct bp_key {
 	uint8_t 		secret[32];
 	secp256k1_pubkey	pubkey;
 };
 
+/// Sets up internally allocated static data, which key functions
+/// otherwise create on first use; call before using keys from threads.
+extern bool bp_key_static_init();
 /// Frees any internally allocated static data.
 extern void bp_key_static_shutdown();
 
@@ -33,6 +40,9 @@ extern bool bp_pubkey_set(struct bp_key *key, const void *pubkey, size_t pk_len)
 extern bool bp_key_secret_set(struct bp_key *key, const void *privkey_, size_t pk_len);
 extern bool bp_privkey_get(const struct bp_key *key, void **privkey, size_t *pk_len);
 extern bool bp_pubkey_get(const struct bp_key *key, void **pubkey, size_t *pk_len);
+extern bool bp_pubkey_get_uncompressed(const struct bp_key *key, void **pubkey, size_t *pk_len);
+/// Compressed public key, into caller's BP_PUBKEY_SZ byte buffer.
+extern bool bp_pubkey_get_buf(const struct bp_key *key, uint8_t *pubkey);
 extern bool bp_key_secret_get(void *p, size_t len, const struct bp_key *key);
 extern bool bp_sign(const struct bp_key *key, const void *data, size_t data_len,
 	     void **sig_, size_t *sig_len_);
@@ -41,17 +51,32 @@ extern bool bp_verify(const struct bp_key *key, const void *data, size_t data_le
 extern bool bp_key_add_secret(struct bp_key *out,
 			      const struct bp_key *key,
 			      const uint8_t *tweak32);
+/// Public key tweak only; out never has a secret.
+extern bool bp_pubkey_add_tweak(struct bp_key *out,
+				const struct bp_key *key,
+				const uint8_t *tweak32);
 bool bp_pubkey_checklowS(const void *sig, size_t sig_len);
 
+/*
+ * Watched keys, key hashes and script hashes.  Alongside them, the
+ * keyset keeps the exact scriptPubKey bytes that pay each one (P2PK,
+ * P2PKH, P2SH), so an output is matched with a single lookup of its
+ * script, without parsing it.
+ */
 struct bp_keyset {
 	struct bp_hashtab	*pub;
 	struct bp_hashtab	*pubhash;
+	struct bp_hashtab	*scripts;
 };
 
 extern void bpks_init(struct bp_keyset *ks);
 extern bool bpks_add(struct bp_keyset *ks, struct bp_key *key);
+extern bool bpks_add_pubhash(struct bp_keyset *ks, const void *md160);
+extern bool bpks_add_scripthash(struct bp_keyset *ks, const void *md160);
 extern bool bpks_lookup(const struct bp_keyset *ks, const void *data, size_t data_len,
 		 bool is_pubkeyhash);
+extern bool bpks_lookup_script(const struct bp_keyset *ks,
+			       const void *script, size_t script_len);
 extern void bpks_free(struct bp_keyset *ks);
 
 struct bp_keystore {
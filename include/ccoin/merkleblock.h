@@ -0,0 +1,56 @@
+#ifndef __LIBCCOIN_MERKLEBLOCK_H__
+#define __LIBCCOIN_MERKLEBLOCK_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/buffer.h>
+#include <ccoin/core.h>
+#include <ccoin/cstr.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bloom;
+
+/*
+ * BIP 37 filtered block: a block header, and the part of its merkle
+ * tree needed to prove which of its transactions matched a filter.
+ *
+ * The tree is walked depth first.  Each node visited has a flag bit:
+ * set if it is, or is above, a matched transaction.  A node whose bit
+ * is clear, or a matched transaction itself, carries its hash and is
+ * not descended into.
+ */
+struct bp_merkle_block {
+	struct bp_block		hdr;		/* vtx unused */
+	uint32_t		nTransactions;
+	parr			*vHash;		/* of bu256_t */
+	cstring			*vBits;		/* flag bits, LSB first */
+};
+
+extern void bp_merkle_block_init(struct bp_merkle_block *mb);
+extern void bp_merkle_block_free(struct bp_merkle_block *mb);
+extern bool deser_bp_merkle_block(struct bp_merkle_block *mb,
+				  struct const_buffer *buf);
+extern void ser_bp_merkle_block(cstring *s, const struct bp_merkle_block *mb);
+
+extern bool bp_merkle_block_build(struct bp_merkle_block *mb,
+				  const struct bp_block *block,
+				  const bool *match);
+extern bool bp_merkle_block_filter(struct bp_merkle_block *mb,
+				   const struct bp_block *block,
+				   struct bloom *bf, bool *match);
+extern bool bp_merkle_block_extract(const struct bp_merkle_block *mb,
+				    parr *txids);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_MERKLEBLOCK_H__ */
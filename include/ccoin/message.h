@@ -37,6 +37,7 @@ struct p2p_message {
 enum {
 	MSG_TX = 1,
 	MSG_BLOCK,
+	MSG_FILTERED_BLOCK,		/* BIP 37 */
 };
 
 extern void parse_message_hdr(struct p2p_message_hdr *hdr, const unsigned char *data);
@@ -20,12 +20,20 @@
 extern "C" {
 #endif
 
+struct bloom;
+
 enum {
-	PROTO_VERSION	= 60002,
+	PROTO_VERSION	= 70001,
 };
 
 enum {
-	NC_MAX_CONN	= 8,
+	NC_MAX_CONN	= 8,		/* outgoing */
+	NC_MAX_INBOUND	= 32,
+	NC_MAX_GETBLOCKS = 500,		/* block invs per "getblocks" */
+	NC_MAX_GETDATA	= 50000,	/* blocks asked for, not yet sent */
+	NC_MAX_SEND_Q	= 2 * 1024 * 1024, /* bytes queued, before serving
+					    * more blocks */
+	NC_HANDSHAKE_TIMEOUT = 60,	/* seconds, to verack */
 };
 
 enum netcmds {
@@ -49,16 +57,30 @@ struct net_child_info {
 	struct event_base	*eb;
 
 	time_t			last_getblocks;
+	struct blkinfo		*getblocks_tip;	/* NULL: best chain */
 	unsigned int		net_conn_timeout;
 	const struct		chain_info *chain;
 	uint64_t		*instance_nonce;
 
 	bool			running;
 
+	struct event		*listen_ev;	/* NULL: outgoing only */
+
+	/*
+	 * SPV mode: a BIP 37 filter loaded into every peer.  Blocks are
+	 * then requested filtered, and handed to merkle_block_process
+	 * with the matched transactions only.
+	 */
+	struct bloom		*filter;
+
 	bool (*inv_block_process)(bu256_t *hash);
 	bool (*block_process)(struct bp_block *block,
                           struct p2p_message_hdr *hdr,
                           struct const_buffer *buf);
+	bool (*merkle_block_process)(struct bp_block *block);
+
+	/* serve stored blocks, filtered or whole, to peers; or NULL */
+	bool (*block_read)(const bu256_t *hash, struct bp_block *block);
 };
 
 struct nc_conn {
@@ -77,6 +99,9 @@ struct nc_conn {
 	struct event		*write_ev;
 	clist			*write_q;	/* of struct buffer */
 	unsigned int		write_partial;
+	size_t			write_q_bytes;	/* unsent, in write_q */
+
+	struct event		*handshake_ev;	/* until verack */
 
 	struct p2p_message	msg;
 
@@ -88,6 +113,16 @@ struct nc_conn {
 	bool			seen_version;
 	bool			seen_verack;
 	uint32_t		protover;
+	uint64_t		services;
+	bool			inbound;
+
+	struct bloom		*filter;	/* the peer's, if we serve */
+	bu256_t			hash_continue;	/* last "getblocks" inv */
+	parr			*getdata_q;	/* of struct bp_inv, to serve */
+	unsigned int		getdata_pos;	/* next in getdata_q */
+
+	struct bp_block		*mblock;	/* filtered block, its txs */
+	parr			*mblock_txids;	/* coming: of bu256_t */
 };
 
 struct net_engine {
@@ -103,6 +138,9 @@ struct net_engine {
 
 struct net_engine *neteng_new_start(void (*network_child)(int read_fd, int write_fd));
 
+extern bool nc_listen(struct net_child_info *nci, unsigned short port);
+extern void nc_listen_stop(struct net_child_info *nci);
+extern void nc_filter_load(struct net_child_info *nci, struct bloom *filter);
 extern void nc_conns_process(struct net_child_info *nci);
 extern void nc_conns_gc(struct net_child_info *nci, bool free_all);
 extern void nc_pipe_evt(int fd, short events, void *priv);
@@ -0,0 +1,80 @@
+#ifndef __LIBCCOIN_ORPHANS_H__
+#define __LIBCCOIN_ORPHANS_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/buffer.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/hashtab.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A block received before its parent, held as serialized bytes. */
+struct bp_orphan {
+	bu256_t			hash;
+	bu256_t			prev_hash;
+	struct buffer		*data;
+
+	struct bp_orphan	*older;		/* insertion order list */
+	struct bp_orphan	*newer;
+};
+
+extern void bp_orphan_freep(void *bp_orphan_p);
+extern bool bp_orphan_block(const struct bp_orphan *orphan,
+			    struct bp_block *block);
+
+/*
+ * Orphan blocks, indexed by hash and by hashPrevBlock.  The serialized
+ * size of all orphans is kept within max_bytes by evicting the oldest.
+ */
+struct bp_orphan_pool {
+	struct bp_hashtab	*by_hash;	/* hash -> bp_orphan */
+	struct bp_hashtab	*by_prev;	/* prev_hash -> parr of bp_orphan */
+
+	struct bp_orphan	*oldest;
+	struct bp_orphan	*newest;
+
+	size_t			max_bytes;
+	size_t			bytes;		/* current serialized size */
+	uint64_t		n_added;
+	uint64_t		n_evicted;
+};
+
+extern void bp_orphan_pool_init(struct bp_orphan_pool *pool, size_t max_bytes);
+extern void bp_orphan_pool_free(struct bp_orphan_pool *pool);
+extern bool bp_orphan_add(struct bp_orphan_pool *pool, const bu256_t *hash,
+			  const bu256_t *prev_hash, const void *data,
+			  size_t data_len);
+extern unsigned int bp_orphan_take_children(struct bp_orphan_pool *pool,
+					    const bu256_t *prev_hash,
+					    parr *out);
+
+static inline bool bp_orphan_have(struct bp_orphan_pool *pool,
+				  const bu256_t *hash)
+{
+	return bp_hashtab_get(pool->by_hash, hash) != NULL;
+}
+
+static inline unsigned int bp_orphan_count(const struct bp_orphan_pool *pool)
+{
+	return bp_hashtab_size(pool->by_hash);
+}
+
+static inline size_t bp_orphan_bytes(const struct bp_orphan_pool *pool)
+{
+	return pool->bytes;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_ORPHANS_H__ */
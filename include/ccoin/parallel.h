@@ -0,0 +1,35 @@
+#ifndef __LIBCCOIN_PARALLEL_H__
+#define __LIBCCOIN_PARALLEL_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Data-parallel loops over a shared, lazily started thread pool.  The
+ * calling thread works too, and several callers may run loops at once.
+ */
+
+typedef bool (*bp_parallel_fn)(void *ctx, unsigned int idx);
+
+/* run fn(ctx, 0..n-1), stopping early if any call returns false */
+extern bool bp_parallel_for(unsigned int n, bp_parallel_fn fn, void *ctx);
+
+/* max threads per loop, caller included; 0 = # cpus, 1 = serial */
+extern void bp_parallel_set_threads(unsigned int n_threads);
+extern unsigned int bp_parallel_threads(void);
+
+/* stop and join pool threads; the pool restarts on next use */
+extern void bp_parallel_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_PARALLEL_H__ */
@@ -0,0 +1,51 @@
+#ifndef __LIBCCOIN_QUEUE_H__
+#define __LIBCCOIN_QUEUE_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded, blocking FIFO of pointers, safe for any number of producer
+ * and consumer threads.  Once closed, pushes fail and pops drain what
+ * is left, then fail.
+ */
+struct bp_queue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	not_empty;
+	pthread_cond_t	not_full;
+
+	void		**ring;
+	size_t		cap;
+	size_t		head;
+	size_t		len;
+	bool		closed;
+
+	/* depth seen by each push, for occupancy stats */
+	uint64_t	n_push;
+	uint64_t	depth_sum;
+	size_t		depth_max;
+};
+
+extern bool bp_queue_init(struct bp_queue *q, size_t cap);
+extern void bp_queue_free(struct bp_queue *q);
+extern bool bp_queue_push(struct bp_queue *q, void *item);
+extern bool bp_queue_pop(struct bp_queue *q, void **item);
+extern void bp_queue_close(struct bp_queue *q);
+
+extern unsigned int bp_num_cpus(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_QUEUE_H__ */
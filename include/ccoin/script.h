@@ -14,6 +14,7 @@
 #include <ccoin/buint.h>
 #include <ccoin/key.h>
 #include <ccoin/parr.h>
+#include <ccoin/crypto/sha2.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -289,6 +290,21 @@ static inline void bsp_start(struct bscript_parser *bp,
 extern void bp_tx_sighash(bu256_t *hash, const cstring *scriptCode,
 		   const struct bp_tx *txTo, unsigned int nIn,
 		   int nHashType);
+
+struct bp_tx_sighasher {
+	const struct bp_tx	*tx;
+	cstring			*blank;		/* tx, all input scripts empty */
+	size_t			*script_ofs;	/* per input, into blank */
+	SHA256_CTX		*midstate;	/* blank hashed to script_ofs[i] */
+};
+
+extern bool bp_tx_sighasher_init(struct bp_tx_sighasher *sh,
+				 const struct bp_tx *txTo);
+extern void bp_tx_sighasher_free(struct bp_tx_sighasher *sh);
+extern void bp_tx_sighasher_hash(const struct bp_tx_sighasher *sh,
+				 bu256_t *hash, const cstring *scriptCode,
+				 unsigned int nIn);
+
 extern bool bp_script_verify(const cstring *scriptSig, const cstring *scriptPubKey,
 		      const struct bp_tx *txTo, unsigned int nIn,
 		      unsigned int flags, int nHashType);
@@ -302,6 +318,18 @@ extern bool bp_sign_sig(struct bp_keystore *ks, const struct bp_utxo *txFrom,
 		 struct bp_tx *txTo, unsigned int nIn,
 		 unsigned int flags, int nHashType);
 
+enum bp_sign_result {
+	BP_SIGN_OK		= 0,
+	BP_SIGN_SKIPPED,		/* no scriptPubKey given */
+	BP_SIGN_NONSTANDARD,		/* not a template we can sign */
+	BP_SIGN_NO_KEY,			/* key not in keystore */
+	BP_SIGN_FAILED,
+};
+
+extern unsigned int bp_tx_sign(struct bp_keystore *ks, struct bp_tx *txTo,
+			       const cstring * const *fromPubKeys,
+			       int nHashType, enum bp_sign_result *results);
+
 /*
  * script building
  */
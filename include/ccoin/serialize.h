@@ -31,6 +31,7 @@ static inline void ser_u256(cstring *s, const bu256_t *v_)
 extern void ser_varlen(cstring *s, uint32_t vlen);
 extern void ser_str(cstring *s, const char *s_in, size_t maxlen);
 extern void ser_varstr(cstring *s, cstring *s_in);
+extern void ser_varint(cstring *s, uint64_t v);
 
 static inline void ser_s32(cstring *s, int32_t v_)
 {
@@ -44,6 +45,22 @@ static inline void ser_s64(cstring *s, int64_t v_)
 
 extern void ser_u256_array(cstring *s, parr *arr);
 
+/* byte counts of ser_varlen() and ser_varstr() output */
+static inline unsigned int ser_varlen_size(uint32_t vlen)
+{
+	if (vlen < 253)
+		return 1;
+	if (vlen < 0x10000)
+		return 3;
+	return 5;
+}
+
+static inline unsigned int ser_varstr_size(const cstring *s_in)
+{
+	size_t len = s_in ? s_in->len : 0;
+	return ser_varlen_size(len) + len;
+}
+
 extern bool deser_skip(struct const_buffer *buf, size_t len);
 extern bool deser_bytes(void *po, struct const_buffer *buf, size_t len);
 extern bool deser_bool(bool *vo, struct const_buffer *buf);
@@ -59,6 +76,7 @@ static inline bool deser_u256(bu256_t *vo, struct const_buffer *buf)
 extern bool deser_varlen(uint32_t *lo, struct const_buffer *buf);
 extern bool deser_str(char *so, struct const_buffer *buf, size_t maxlen);
 extern bool deser_varstr(cstring **so, struct const_buffer *buf);
+extern bool deser_varint(uint64_t *vo, struct const_buffer *buf);
 
 static inline bool deser_s64(int64_t *vo, struct const_buffer *buf)
 {
@@ -67,7 +85,7 @@ static inline bool deser_s64(int64_t *vo, struct const_buffer *buf)
 
 extern bool deser_u256_array(parr **ao, struct const_buffer *buf);
 
-extern void u256_from_compact(mpz_t vo, uint32_t c);
+extern bool u256_from_compact(bu256_t *vo, uint32_t c);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,83 @@
+#ifndef __LIBCCOIN_TXINDEX_H__
+#define __LIBCCOIN_TXINDEX_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ccoin/bucketfile.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/hashtab.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent txid -> blocks file position index.
+ *
+ * Stored as a bucketfile.h FILE of entries sorted by txid.  New
+ * blocks are appended to FILE.log, each block's entries followed by a
+ * commit record, and kept in memory until compaction merges them into
+ * a new FILE.  The index can always be rebuilt from the blocks file,
+ * so it carries no checksum.
+ *
+ * A NULL filename gives a memory-only index.
+ */
+enum {
+	BP_TXINDEX_VERSION	= 1,
+	BP_TXINDEX_HDR_SZ	= BP_BUCKETFILE_HDR_SZ + 8,
+	BP_TXINDEX_ENT_SZ	= 32 + 8 + 4 + 4,
+	BP_TXINDEX_COMPACT_MIN	= 1 << 16,	/* log entries */
+};
+
+struct bp_txindex_ent {
+	bu256_t		txid;
+	uint64_t	blk_pos;	/* block record in blocks file */
+	uint32_t	tx_ofs;		/* tx, from blk_pos */
+	uint32_t	tx_len;
+};
+
+struct bp_txindex {
+	struct bp_bucketfile bf;	/* FILE and FILE.log */
+
+	struct bp_hashtab *recent;	/* txid -> struct bp_txindex_ent */
+	uint64_t	blocks_end;	/* blocks file bytes indexed */
+};
+
+extern bool bp_txindex_open(struct bp_txindex *idx, const char *fn);
+extern void bp_txindex_close(struct bp_txindex *idx);
+extern bool bp_txindex_add_block(struct bp_txindex *idx,
+				 const struct bp_block *block,
+				 uint64_t blk_pos, unsigned int hdr_len);
+extern bool bp_txindex_lookup(const struct bp_txindex *idx,
+			      const bu256_t *txid,
+			      struct bp_txindex_ent *ent);
+extern bool bp_txindex_compact(struct bp_txindex *idx);
+extern bool bp_txindex_read_tx(int fd, const struct bp_txindex_ent *ent,
+			       struct bp_tx *tx);
+
+/* log large enough, relative to FILE, to be worth merging */
+static inline bool bp_txindex_want_compact(const struct bp_txindex *idx)
+{
+	uint64_t n_recent = bp_hashtab_size(idx->recent);
+
+	return idx->bf.fn && (n_recent >= BP_TXINDEX_COMPACT_MIN) &&
+	       (n_recent * 8 >= idx->bf.n_base);
+}
+
+/* entries; a txid in both FILE and the log counts twice */
+static inline uint64_t bp_txindex_size(const struct bp_txindex *idx)
+{
+	return idx->bf.n_base + bp_hashtab_size(idx->recent);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_TXINDEX_H__ */
@@ -20,6 +20,16 @@
 #ifndef MIN
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef bp_prefetch
+#ifdef __GNUC__
+#define bp_prefetch(p) __builtin_prefetch(p)
+#else
+#define bp_prefetch(p) do { (void)(p); } while (0)
+#endif
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -0,0 +1,55 @@
+#ifndef __LIBCCOIN_UTXOSNAP_H__
+#define __LIBCCOIN_UTXOSNAP_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * UTXO set snapshot: the unspent outputs as of one best block, coins
+ * sorted by txid, followed by a SHA256 checksum of the file.  The
+ * encoding is canonical, so the checksum doubles as the snapshot hash:
+ * any two nodes with the same UTXO set at the same block produce the
+ * same file, and a node can check a snapshot against a known hash
+ * before starting from it.
+ *
+ * Coins are grouped in chunks of fixed coin count, with a chunk offset
+ * table in the header, so chunks can be decoded in parallel.
+ */
+enum {
+	BP_UTXOSNAP_VERSION	= 3,
+	BP_UTXOSNAP_HDR_SZ	= 8 + 4 + 4 + 32 + 4 + 8 + 4 + 4,
+	BP_UTXOSNAP_CHUNK	= 4096,		/* coins per chunk */
+};
+
+struct bp_utxosnap_info {
+	unsigned char	netmagic[4];
+	bu256_t		best_hash;	/* block the set is current to */
+	uint32_t	height;
+	uint64_t	n_coins;
+	bu256_t		snap_hash;	/* trailing checksum */
+};
+
+extern bool bp_utxosnap_write(const char *fn, struct bp_utxo_set *uset,
+			      const unsigned char *netmagic,
+			      const bu256_t *best_hash, uint32_t height,
+			      struct bp_utxosnap_info *info);
+extern bool bp_utxosnap_read_info(const char *fn,
+				  struct bp_utxosnap_info *info);
+extern bool bp_utxosnap_load(const char *fn, struct bp_utxo_set *uset,
+			     struct bp_utxosnap_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_UTXOSNAP_H__ */
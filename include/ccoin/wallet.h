@@ -17,11 +17,22 @@ extern "C" {
 #endif
 
 struct chain_info;
+struct hd_extended_key;
+
+enum wallet_chain {
+	WALLET_CHAIN_EXTERNAL	= 0,	/* receiving addresses */
+	WALLET_CHAIN_CHANGE	= 1,
+};
 
 struct wallet_account {
 	cstring			*name;
 	uint32_t		acct_idx;
 	uint32_t		next_key_idx;
+
+	/* m/44'/0'/acct_idx'/chain, public half only; derived on first
+	 * use, not stored
+	 */
+	struct hd_extended_key	*chain_keys[2];
 };
 
 struct wallet {
@@ -40,7 +51,14 @@ struct const_buffer;
 extern bool wallet_init(struct wallet *wlt, const struct chain_info *chain);
 extern void wallet_free(struct wallet *wlt);
 extern cstring *wallet_new_address(struct wallet *wlt);
+extern parr *wallet_new_addresses(struct wallet *wlt, unsigned int n);
+extern const struct hd_extended_key *
+wallet_account_chain_key(struct wallet *wlt, struct wallet_account *acct,
+			 enum wallet_chain chain);
 extern cstring *ser_wallet(const struct wallet *wlt);
+extern cstring *ser_wallet_root_rec(const struct wallet *wlt);
+extern cstring *ser_wallet_account_rec(const struct wallet *wlt,
+				       const struct wallet_account *acct);
 extern bool deser_wallet(struct wallet *wlt, struct const_buffer *buf);
 extern bool wallet_create(struct wallet *wlt, const void *seed, size_t seed_len);
 extern bool wallet_createAccount(struct wallet *wlt, const char *name);
@@ -0,0 +1,145 @@
+#ifndef __LIBCCOIN_WALLETTRACK_H__
+#define __LIBCCOIN_WALLETTRACK_H__
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ccoin/buint.h>
+#include <ccoin/core.h>
+#include <ccoin/hashtab.h>
+#include <ccoin/hdkeys.h>
+#include <ccoin/parr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Wallet coin tracker: the unspent outputs paying a wallet's keys, kept
+ * up to date one block at a time.
+ *
+ * The tracker watches public keys only: the account chain xpubs
+ * (m/44'/0'/acct'/chain) and the wallet's non-HD keys, so it can be
+ * stored and maintained without the wallet passphrase.  Each HD chain
+ * is watched WALLET_TRACK_GAP keys past both the last address handed
+ * out and the last address paid, so payments to addresses handed out
+ * by another copy of the wallet are found too (BIP 44 gap limit).
+ *
+ * P2PKH and P2PK outputs are matched.  The running balance is kept
+ * with the coins, so it costs nothing to query.
+ *
+ * The tracker follows one chain, like the indexes: a block is
+ * connected only on top of the best block, and only the best block is
+ * disconnected.  The coins each block added and spent are remembered
+ * for the last WALLET_TRACK_DEPTH blocks; a deeper reorg needs
+ * wallet_track_reset() and a rescan.
+ */
+enum {
+	WALLET_TRACK_VERSION	= 1,
+	WALLET_TRACK_GAP	= 20,
+	WALLET_TRACK_DEPTH	= 100,
+
+	WALLET_TRACK_LOOSE	= 0xffffffffU,	/* chain_idx of a non-HD key */
+};
+
+struct wallet_track_chain {
+	uint32_t		acct_idx;
+	uint32_t		chain;		/* enum wallet_chain */
+	struct hd_extended_key	xpub;
+
+	uint32_t		n_issued;	/* addresses handed out */
+	uint32_t		n_used;		/* 1 + highest index paid */
+	uint32_t		n_watched;	/* keys [0, n_watched) watched */
+};
+
+/* a watched key, by Hash160 of its public key */
+struct wallet_track_key {
+	bu160_t			pkhash;
+	uint32_t		chain_idx;	/* into chains, or LOOSE */
+	uint32_t		index;
+};
+
+struct wallet_coin {
+	struct bp_outpt		outpt;
+	int64_t			value;
+	uint32_t		height;
+
+	bu160_t			pkhash;		/* key paid */
+	uint32_t		chain_idx;
+	uint32_t		index;
+};
+
+struct wallet_track_block {
+	bu256_t			hash;
+	bu256_t			prev_hash;
+	uint32_t		height;
+	parr			*added;		/* struct bp_outpt */
+	parr			*spent;		/* struct wallet_coin */
+};
+
+struct wallet_tracker {
+	unsigned char		netmagic[4];
+
+	int			best_height;	/* -1 if nothing scanned */
+	bu256_t			best_hash;
+
+	parr			*chains;	/* struct wallet_track_chain */
+	parr			*loose;		/* bu160_t */
+	struct bp_hashtab	*keys;		/* pkhash -> wallet_track_key */
+	struct bp_hashtab	*coins;		/* outpt -> wallet_coin */
+	parr			*journal;	/* wallet_track_block, oldest 1st */
+
+	int64_t			balance;
+};
+
+struct wallet;
+struct bp_key;
+struct bloom;
+
+extern void wallet_track_init(struct wallet_tracker *wt,
+			      const unsigned char *netmagic);
+extern void wallet_track_free(struct wallet_tracker *wt);
+extern void wallet_track_reset(struct wallet_tracker *wt);
+
+extern bool wallet_track_add_chain(struct wallet_tracker *wt,
+				   const struct hd_extended_key *xpub,
+				   uint32_t acct_idx, uint32_t chain,
+				   uint32_t n_issued);
+extern bool wallet_track_add_key(struct wallet_tracker *wt,
+				 const struct bp_key *key);
+extern bool wallet_track_watch(struct wallet_tracker *wt,
+			       struct wallet *wlt);
+
+extern bool wallet_track_connect(struct wallet_tracker *wt,
+				 const struct bp_block *block,
+				 unsigned int height);
+extern bool wallet_track_disconnect(struct wallet_tracker *wt,
+				    const bu256_t *hash);
+
+extern void wallet_track_unspent(const struct wallet_tracker *wt, parr *out);
+extern bool wallet_track_filter(const struct wallet_tracker *wt,
+				struct bloom *bf, double fp_rate,
+				uint32_t nTweak);
+
+extern bool wallet_track_read(struct wallet_tracker *wt, const char *fn);
+extern bool wallet_track_write(const struct wallet_tracker *wt,
+			       const char *fn);
+
+static inline int64_t wallet_track_balance(const struct wallet_tracker *wt)
+{
+	return wt->balance;
+}
+
+static inline unsigned int wallet_track_n_coins(const struct wallet_tracker *wt)
+{
+	return bp_hashtab_size(wt->coins);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCCOIN_WALLETTRACK_H__ */
@@ -7,51 +7,21 @@
 #include <ccoin/core.h>
 #include <ccoin/script.h>
 #include <ccoin/key.h>
-#include <ccoin/clist.h>
 #include <ccoin/addr_match.h>
-#include <ccoin/compat.h>		/* for parr_new */
+#include <ccoin/util.h>		/* for MAX */
 
+#include <stdlib.h>
+#include <string.h>
+
+/* one hash and probe of the script bytes; nothing is parsed or allocated */
 bool bp_txout_match(const struct bp_txout *txout,
 		    const struct bp_keyset *ks)
 {
 	if (!txout || !txout->scriptPubKey || !ks)
 		return false;
 
-	bool rc = false;
-
-	struct bscript_addr addrs;
-	if (!bsp_addr_parse(&addrs, txout->scriptPubKey->str,
-			    txout->scriptPubKey->len))
-		return false;
-
-	struct const_buffer *buf;
-	clist *tmp = addrs.pub;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
-
-		if (bpks_lookup(ks, buf->p, buf->len, false)) {
-			rc = true;
-			goto out;
-		}
-	}
-
-	tmp = addrs.pubhash;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
-
-		if (bpks_lookup(ks, buf->p, buf->len, true)) {
-			rc = true;
-			goto out;
-		}
-	}
-
-out:
-	clist_free_ext(addrs.pub, buffer_freep);
-	clist_free_ext(addrs.pubhash, buffer_freep);
-
-	return rc;
+	return bpks_lookup_script(ks, txout->scriptPubKey->str,
+				  txout->scriptPubKey->len);
 }
 
 bool bp_tx_match(const struct bp_tx *tx, const struct bp_keyset *ks)
@@ -71,95 +41,138 @@ bool bp_tx_match(const struct bp_tx *tx, const struct bp_keyset *ks)
 	return false;
 }
 
-bool bp_tx_match_mask(mpz_t mask, const struct bp_tx *tx,
+/*
+ * Set mask bits for tx's matching outputs; mask holds
+ * bp_mask_words(tx->vout->len) words.  True if any output matched.
+ */
+bool bp_tx_match_mask(uint64_t *mask, const struct bp_tx *tx,
 		      const struct bp_keyset *ks)
 {
 	if (!tx || !tx->vout || !ks || !mask)
 		return false;
 
-	mpz_set_ui(mask, 0);
+	unsigned int n_vout = tx->vout->len;
+	memset(mask, 0, bp_mask_words(n_vout) * sizeof(uint64_t));
 
+	bool rc = false;
 	unsigned int i;
-	for (i = 0; i < tx->vout->len; i++) {
+	for (i = 0; i < n_vout; i++) {
 		struct bp_txout *txout;
 
 		txout = parr_idx(tx->vout, i);
-		if (bp_txout_match(txout, ks))
-			mpz_setbit(mask, i);
+		if (bp_txout_match(txout, ks)) {
+			bp_mask_set(mask, i);
+			rc = true;
+		}
 	}
 
-	return true;
+	return rc;
 }
 
-void bbm_init(struct bp_block_match *match)
+/* masks up to this wide are built on the stack */
+#define MATCH_STACK_WORDS 16
+
+bool bp_block_match_each(const struct bp_block *block,
+			 const struct bp_keyset *ks,
+			 bp_block_match_fn fn, void *ctx)
 {
-	memset(match, 0, sizeof(*match));
+	if (!block || !block->vtx || !ks)
+		return false;
 
-	mpz_init(match->mask);
-}
+	uint64_t stack_mask[MATCH_STACK_WORDS];
+	unsigned int n;
+	for (n = 0; n < block->vtx->len; n++) {
+		struct bp_tx *tx = parr_idx(block->vtx, n);
+		if (!tx->vout)
+			continue;
+
+		unsigned int n_words = bp_mask_words(tx->vout->len);
+		uint64_t *mask = stack_mask;
+		if (n_words > MATCH_STACK_WORDS) {
+			mask = malloc(n_words * sizeof(uint64_t));
+			if (!mask)
+				return false;
+		}
 
-struct bp_block_match *bbm_new(void)
-{
-	struct bp_block_match *match = malloc(sizeof(struct bp_block_match));
-	if (!match)
-		return NULL;
+		bool ok = !bp_tx_match_mask(mask, tx, ks) ||
+			  fn(ctx, n, mask, n_words);
 
-	bbm_init(match);
-	match->self_alloc = true;
+		if (mask != stack_mask)
+			free(mask);
+		if (!ok)
+			return false;
+	}
 
-	return match;
+	return true;
 }
 
-void bbm_free(void *match_)
+void bbm_init(struct bp_block_matches *bm)
 {
-	struct bp_block_match *match = match_;
-	if (!match)
-		return;
-
-	mpz_clear(match->mask);
-
-	if (match->self_alloc)
-		free(match);
+	memset(bm, 0, sizeof(*bm));
 }
 
-parr *bp_block_match(const struct bp_block *block,
-			  const struct bp_keyset *ks)
+void bbm_free(struct bp_block_matches *bm)
 {
-	if (!block || !block->vtx || !ks)
-		return NULL;
-
-	parr *arr = parr_new(block->vtx->len, bbm_free);
-	if (!arr)
-		return NULL;
+	if (!bm)
+		return;
 
-	mpz_t tmp_mask;
-	mpz_init(tmp_mask);
+	free(bm->match);
+	free(bm->spill);
+	memset(bm, 0, sizeof(*bm));
+}
 
-	unsigned int n;
-	for (n = 0; n < block->vtx->len; n++) {
-		struct bp_tx *tx;
+static bool bbm_append(void *ctx, unsigned int n, const uint64_t *mask,
+		       unsigned int n_words)
+{
+	struct bp_block_matches *bm = ctx;
+
+	if (bm->len == bm->alloc) {
+		unsigned int alloc = bm->alloc ? bm->alloc * 2 : 16;
+		void *p = realloc(bm->match, alloc * sizeof(*bm->match));
+		if (!p)
+			return false;
+		bm->match = p;
+		bm->alloc = alloc;
+	}
 
-		tx = parr_idx(block->vtx, n);
-		if (!bp_tx_match_mask(tmp_mask, tx, ks))
-			goto err_out;
+	struct bp_block_match *match = &bm->match[bm->len];
+	match->n = n;
+	match->n_words = n_words;
+	match->bits = mask[0];
+	match->spill = 0;
+
+	if (n_words > 1) {
+		if (bm->spill_len + n_words > bm->spill_alloc) {
+			size_t alloc = MAX(bm->spill_alloc * 2,
+					   bm->spill_len + n_words);
+			void *p = realloc(bm->spill, alloc * sizeof(uint64_t));
+			if (!p)
+				return false;
+			bm->spill = p;
+			bm->spill_alloc = alloc;
+		}
 
-		if (mpz_sgn(tmp_mask) != 0) {
-			struct bp_block_match *match;
+		match->spill = bm->spill_len;
+		memcpy(bm->spill + bm->spill_len, mask,
+		       n_words * sizeof(uint64_t));
+		bm->spill_len += n_words;
+	}
 
-			match = bbm_new();
-			match->n = n;
-			mpz_set(match->mask, tmp_mask);
+	bm->len++;
+	return true;
+}
 
-			parr_add(arr, match);
-		}
-	}
+/* Replace bm's contents with block's matches. */
+bool bp_block_match(struct bp_block_matches *bm, const struct bp_block *block,
+		    const struct bp_keyset *ks)
+{
+	bm->len = 0;
+	bm->spill_len = 0;
 
-	mpz_clear(tmp_mask);
-	return arr;
+	if (bp_block_match_each(block, ks, bbm_append, bm))
+		return true;
 
-err_out:
-	mpz_clear(tmp_mask);
-	parr_free(arr, true);
-	return NULL;
+	bm->len = 0;
+	bm->spill_len = 0;
+	return false;
 }
-
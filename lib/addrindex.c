@@ -0,0 +1,560 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ccoin/addrindex.h>
+#include <ccoin/crypto/sha2.h>
+#include <ccoin/serialize.h>
+
+static const char addrindex_magic[8] = "ccaddrix";
+
+/* log records only: the entry is to be removed */
+#define ADDRINDEX_REMOVE	0x80000000U
+
+struct addrindex_op {
+	struct bp_addrindex_ent	ent;
+	bool			removed;
+};
+
+/* the recent ops of one scripthash */
+struct addrindex_list {
+	bu256_t		scripthash;
+	parr		*ops;
+};
+
+void bp_addrindex_scripthash(bu256_t *scripthash, const cstring *script)
+{
+	sha256_Raw(script->str, script->len, (uint8_t *) scripthash);
+}
+
+static void ser_addrindex_ent(cstring *s, const struct bp_addrindex_ent *ent,
+			      uint32_t flags)
+{
+	ser_u256(s, &ent->scripthash);
+	ser_u32(s, ent->height);
+	ser_u256(s, &ent->txid);
+	ser_u32(s, ent->n);
+	ser_u32(s, ent->kind | flags);
+	ser_s64(s, ent->value);
+	ser_u256(s, &ent->spend_txid);
+	ser_u32(s, ent->spend_n);
+}
+
+static bool deser_addrindex_ent(struct bp_addrindex_ent *ent,
+				struct const_buffer *buf)
+{
+	if (!deser_u256(&ent->scripthash, buf)) return false;
+	if (!deser_u32(&ent->height, buf)) return false;
+	if (!deser_u256(&ent->txid, buf)) return false;
+	if (!deser_u32(&ent->n, buf)) return false;
+	if (!deser_u32(&ent->kind, buf)) return false;
+	if (!deser_s64(&ent->value, buf)) return false;
+	if (!deser_u256(&ent->spend_txid, buf)) return false;
+	if (!deser_u32(&ent->spend_n, buf)) return false;
+	return true;
+}
+
+static int addrindex_ent_cmp(const struct bp_addrindex_ent *a,
+			     const struct bp_addrindex_ent *b)
+{
+	int cmp = memcmp(&a->scripthash, &b->scripthash, sizeof(bu256_t));
+	if (cmp)
+		return cmp;
+	if (a->height != b->height)
+		return (a->height < b->height) ? -1 : 1;
+	cmp = memcmp(&a->txid, &b->txid, sizeof(bu256_t));
+	if (cmp)
+		return cmp;
+	if (a->n != b->n)
+		return (a->n < b->n) ? -1 : 1;
+	if (a->kind != b->kind)
+		return (a->kind < b->kind) ? -1 : 1;
+	return 0;
+}
+
+/* hashtab callbacks over the entry key */
+static unsigned long addrindex_key_hash(const void *key)
+{
+	const struct bp_addrindex_ent *ent = key;
+	return bu256_hash(&ent->scripthash) ^ bu256_hash(&ent->txid) ^
+	       ent->n ^ ((unsigned long) ent->kind << 31);
+}
+
+static bool addrindex_key_equal(const void *a, const void *b)
+{
+	return addrindex_ent_cmp(a, b) == 0;
+}
+
+static void addrindex_list_free(void *p)
+{
+	struct addrindex_list *list = p;
+	if (!list)
+		return;
+
+	parr_free(list->ops, true);
+	free(list);
+}
+
+static bool addrindex_is_commit(const struct bp_addrindex_ent *ent)
+{
+	static const bu256_t zero;
+	return bu256_equal(&ent->scripthash, &zero);
+}
+
+static bool addrindex_read_hdr(struct bp_addrindex *idx)
+{
+	struct const_buffer buf;
+	uint32_t best_height, pad;
+	bu256_t best_hash;
+
+	if (!bp_bucketfile_hdr(&idx->bf, &buf))
+		return true;
+	if (!deser_u32(&best_height, &buf) ||
+	    !deser_u32(&pad, &buf) ||
+	    !deser_u256(&best_hash, &buf))
+		return false;
+
+	idx->best_height = (int32_t) best_height;
+	bu256_copy(&idx->best_hash, &best_hash);
+	return true;
+}
+
+/* an op replaces any earlier one for the same entry */
+static void addrindex_apply(struct bp_addrindex *idx, struct addrindex_op *op)
+{
+	struct addrindex_op *old = bp_hashtab_get(idx->recent, &op->ent);
+	if (old) {
+		*old = *op;
+		free(op);
+		return;
+	}
+
+	bp_hashtab_put(idx->recent, &op->ent, op);
+
+	struct addrindex_list *list = bp_hashtab_get(idx->recent_script,
+						     &op->ent.scripthash);
+	if (!list) {
+		list = malloc(sizeof(*list));
+		bu256_copy(&list->scripthash, &op->ent.scripthash);
+		list->ops = parr_new(0, NULL);
+		bp_hashtab_put(idx->recent_script, &list->scripthash, list);
+	}
+	parr_add(list->ops, op);
+}
+
+/* move a block's ops, committed, into the in-memory maps */
+static void addrindex_publish(struct bp_addrindex *idx, parr *pending,
+			      int best_height, const bu256_t *best_hash)
+{
+	unsigned int i;
+	for (i = 0; i < pending->len; i++)
+		addrindex_apply(idx, parr_idx(pending, i));
+
+	/* owned by idx->recent now */
+	pending->len = 0;
+
+	idx->best_height = best_height;
+	bu256_copy(&idx->best_hash, best_hash);
+}
+
+struct addrindex_replay {
+	struct bp_addrindex	*idx;
+	parr			*pending;
+};
+
+/* the commit record of a block carries its op count, in n, and the
+ * new best block, in height and txid
+ */
+static int addrindex_replay_rec(void *priv, const unsigned char *rec)
+{
+	struct addrindex_replay *r = priv;
+	struct const_buffer buf = { rec, BP_ADDRINDEX_ENT_SZ };
+	struct addrindex_op *op = malloc(sizeof(*op));
+	deser_addrindex_ent(&op->ent, &buf);
+
+	if (!addrindex_is_commit(&op->ent)) {
+		op->removed = (op->ent.kind & ADDRINDEX_REMOVE);
+		op->ent.kind &= ~ADDRINDEX_REMOVE;
+		parr_add(r->pending, op);
+		return 0;
+	}
+
+	bool valid = (op->ent.n == r->pending->len);
+	int best_height = (int32_t) op->ent.height;
+	bu256_t best_hash;
+	bu256_copy(&best_hash, &op->ent.txid);
+	free(op);
+	if (!valid)
+		return -1;
+
+	addrindex_publish(r->idx, r->pending, best_height, &best_hash);
+	return 1;
+}
+
+/*
+ * Open the index at fn.  A read-only index replays the log but never
+ * writes it, so it may be opened while brd appends to it.
+ */
+bool bp_addrindex_open(struct bp_addrindex *idx, const char *fn,
+		       bool read_only)
+{
+	memset(idx, 0, sizeof(*idx));
+	bp_bucketfile_init(&idx->bf, addrindex_magic, BP_ADDRINDEX_VERSION,
+			   BP_ADDRINDEX_HDR_SZ, BP_ADDRINDEX_ENT_SZ);
+	idx->best_height = -1;
+	idx->recent = bp_hashtab_new_ext(addrindex_key_hash,
+					 addrindex_key_equal, NULL, free);
+	idx->recent_script = bp_hashtab_new_ext(bu256_hash, bu256_equal_,
+						NULL, addrindex_list_free);
+
+	struct addrindex_replay r = { idx, parr_new(0, free) };
+	bool rc = bp_bucketfile_open(&idx->bf, fn, read_only) &&
+		  addrindex_read_hdr(idx) &&
+		  bp_bucketfile_replay_log(&idx->bf, addrindex_replay_rec, &r);
+
+	parr_free(r.pending, true);
+	if (!rc)
+		bp_addrindex_close(idx);
+	return rc;
+}
+
+void bp_addrindex_close(struct bp_addrindex *idx)
+{
+	bp_bucketfile_close(&idx->bf);
+	bp_hashtab_unref(idx->recent_script);
+	bp_hashtab_unref(idx->recent);
+
+	memset(idx, 0, sizeof(*idx));
+	idx->bf.log_fd = -1;
+	idx->best_height = -1;
+}
+
+/*
+ * The entries of a block, in block order: each input's spent output
+ * (from the block's undo data, in spend order), then the tx's outputs.
+ */
+static bool addrindex_block_ops(parr *ops, const struct bp_block *block,
+				unsigned int height, const parr *undo,
+				bool removed)
+{
+	unsigned int n_tx = block->vtx ? block->vtx->len : 0;
+	unsigned int undo_idx = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < n_tx; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		bp_tx_calc_sha256(tx);
+
+		for (j = 0; (i > 0) && (j < tx->vin->len); j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			const struct bp_utxo_undo *u;
+
+			if (!undo || (undo_idx >= undo->len))
+				return false;
+			u = parr_idx(undo, undo_idx++);
+			if (!bp_outpt_equal(&u->prevout, &txin->prevout) ||
+			    !u->txout.scriptPubKey)
+				return false;
+
+			struct addrindex_op *op = calloc(1, sizeof(*op));
+			bp_addrindex_scripthash(&op->ent.scripthash,
+						u->txout.scriptPubKey);
+			op->ent.height = height;
+			bu256_copy(&op->ent.txid, &txin->prevout.hash);
+			op->ent.n = txin->prevout.n;
+			op->ent.kind = BP_ADDRINDEX_IN;
+			op->ent.value = u->txout.nValue;
+			bu256_copy(&op->ent.spend_txid, &tx->sha256);
+			op->ent.spend_n = j;
+			op->removed = removed;
+			parr_add(ops, op);
+		}
+
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bp_txout *txout = parr_idx(tx->vout, j);
+
+			struct addrindex_op *op = calloc(1, sizeof(*op));
+			bp_addrindex_scripthash(&op->ent.scripthash,
+						txout->scriptPubKey);
+			op->ent.height = height;
+			bu256_copy(&op->ent.txid, &tx->sha256);
+			op->ent.n = j;
+			op->ent.kind = BP_ADDRINDEX_OUT;
+			op->ent.value = txout->nValue;
+			op->removed = removed;
+			parr_add(ops, op);
+		}
+	}
+
+	return (!undo && (n_tx < 2)) || (undo && (undo_idx == undo->len));
+}
+
+/* log a block's ops with their commit record, then apply them */
+static bool addrindex_commit(struct bp_addrindex *idx, parr *ops,
+			     int best_height, const bu256_t *best_hash)
+{
+	cstring *s = cstr_new_sz((ops->len + 1) * BP_ADDRINDEX_ENT_SZ);
+	bool rc = false;
+	unsigned int i;
+
+	for (i = 0; i < ops->len; i++) {
+		struct addrindex_op *op = parr_idx(ops, i);
+		ser_addrindex_ent(s, &op->ent,
+				  op->removed ? ADDRINDEX_REMOVE : 0);
+	}
+
+	struct bp_addrindex_ent commit = {
+		.height	= best_height,
+		.n	= ops->len,
+	};
+	bu256_copy(&commit.txid, best_hash);
+	ser_addrindex_ent(s, &commit, 0);
+
+	if (!bp_bucketfile_log_append(&idx->bf, s->str, s->len))
+		goto out;
+
+	addrindex_publish(idx, ops, best_height, best_hash);
+	rc = true;
+
+out:
+	cstr_free(s, true);
+	return rc;
+}
+
+/*
+ * Index a block connected at height on top of the indexed best block.
+ * undo lists the outputs its inputs spent, as from bp_utxo_view_flush.
+ */
+bool bp_addrindex_connect(struct bp_addrindex *idx,
+			  const struct bp_block *block,
+			  unsigned int height, const parr *undo)
+{
+	if (idx->bf.read_only)
+		return false;
+	if (idx->best_height < 0 ? (height != 0) :
+	    ((height != idx->best_height + 1) ||
+	     !bu256_equal(&block->hashPrevBlock, &idx->best_hash)))
+		return false;
+
+	struct bp_block hdr;
+	bp_block_init(&hdr);
+	bp_block_copy_hdr(&hdr, block);
+	bp_block_calc_sha256(&hdr);
+
+	parr *ops = parr_new(0, free);
+	bool rc = addrindex_block_ops(ops, block, height, undo, false) &&
+		  addrindex_commit(idx, ops, height, &hdr.sha256);
+
+	parr_free(ops, true);
+	bp_block_free(&hdr);
+	return rc;
+}
+
+/* Remove the indexed best block, with the undo data it was connected with. */
+bool bp_addrindex_disconnect(struct bp_addrindex *idx,
+			     const struct bp_block *block, const parr *undo)
+{
+	if (idx->bf.read_only || (idx->best_height < 0))
+		return false;
+
+	struct bp_block hdr;
+	bp_block_init(&hdr);
+	bp_block_copy_hdr(&hdr, block);
+	bp_block_calc_sha256(&hdr);
+
+	parr *ops = parr_new(0, free);
+	bool rc = bu256_equal(&hdr.sha256, &idx->best_hash) &&
+		  addrindex_block_ops(ops, block, idx->best_height, undo,
+				      true) &&
+		  addrindex_commit(idx, ops, idx->best_height - 1,
+				   &block->hashPrevBlock);
+
+	parr_free(ops, true);
+	bp_block_free(&hdr);
+	return rc;
+}
+
+static int addrindex_ent_cmpp(const void *a_, const void *b_)
+{
+	const struct bp_addrindex_ent *a = *(const struct bp_addrindex_ent * const *) a_;
+	const struct bp_addrindex_ent *b = *(const struct bp_addrindex_ent * const *) b_;
+
+	return addrindex_ent_cmp(a, b);
+}
+
+static void addrindex_out_add(parr *out, const struct bp_addrindex_ent *ent)
+{
+	struct bp_addrindex_ent *copy = malloc(sizeof(*copy));
+	*copy = *ent;
+	parr_add(out, copy);
+}
+
+/*
+ * Append copies of every entry for scripthash to out, in height
+ * (then txid, n, kind) order.  Create out with free() as its element
+ * destructor.
+ */
+bool bp_addrindex_history(const struct bp_addrindex *idx,
+			  const bu256_t *scripthash, parr *out)
+{
+	const struct bp_bucketfile *bf = &idx->bf;
+	unsigned int start = out->len;
+	uint64_t n;
+
+	for (n = bp_bucketfile_lower_bound(bf, scripthash, sizeof(bu256_t));
+	     n < bf->n_base; n++) {
+		const unsigned char *p = bp_bucketfile_ent(bf, n);
+		if (memcmp(p, scripthash, sizeof(bu256_t)))
+			break;
+
+		struct bp_addrindex_ent ent;
+		struct const_buffer buf = { p, BP_ADDRINDEX_ENT_SZ };
+		if (!deser_addrindex_ent(&ent, &buf))
+			return false;
+
+		/* superseded by the log */
+		if (bp_hashtab_get(idx->recent, &ent))
+			continue;
+
+		addrindex_out_add(out, &ent);
+	}
+
+	struct addrindex_list *list = bp_hashtab_get(idx->recent_script,
+						     scripthash);
+	unsigned int i;
+	for (i = 0; list && (i < list->ops->len); i++) {
+		struct addrindex_op *op = parr_idx(list->ops, i);
+		if (!op->removed)
+			addrindex_out_add(out, &op->ent);
+	}
+
+	qsort(out->data + start, out->len - start, sizeof(void *),
+	      addrindex_ent_cmpp);
+	return true;
+}
+
+static unsigned long addrindex_outpt_hash(const void *key)
+{
+	return bp_outpt_hash(key);
+}
+
+static bool addrindex_outpt_equal(const void *a, const void *b)
+{
+	return bp_outpt_equal(a, b);
+}
+
+/*
+ * Point out at the BP_ADDRINDEX_OUT entries of a scripthash's history
+ * that no BP_ADDRINDEX_IN entry spends.  out does not own them.
+ */
+void bp_addrindex_unspent(const parr *history, parr *out)
+{
+	struct bp_hashtab *spent = bp_hashtab_new_ext(addrindex_outpt_hash,
+						      addrindex_outpt_equal,
+						      free, NULL);
+	unsigned int i;
+
+	for (i = 0; i < history->len; i++) {
+		const struct bp_addrindex_ent *ent = parr_idx(history, i);
+		if (ent->kind != BP_ADDRINDEX_IN)
+			continue;
+
+		struct bp_outpt *outpt = malloc(sizeof(*outpt));
+		bu256_copy(&outpt->hash, &ent->txid);
+		outpt->n = ent->n;
+		bp_hashtab_put(spent, outpt, outpt);
+	}
+
+	for (i = 0; i < history->len; i++) {
+		struct bp_addrindex_ent *ent = parr_idx(history, i);
+		struct bp_outpt outpt;
+
+		if (ent->kind != BP_ADDRINDEX_OUT)
+			continue;
+
+		bu256_copy(&outpt.hash, &ent->txid);
+		outpt.n = ent->n;
+		if (!bp_hashtab_get(spent, &outpt))
+			parr_add(out, ent);
+	}
+
+	bp_hashtab_unref(spent);
+}
+
+static void addrindex_collect(void *key, void *value, void *priv)
+{
+	parr_add(priv, value);
+}
+
+/*
+ * Merge the log into a new FILE: one pass over the sorted base and the
+ * sorted log ops, an op replacing the equal base entry, and removals
+ * dropping out.
+ */
+bool bp_addrindex_compact(struct bp_addrindex *idx)
+{
+	struct bp_bucketfile *bf = &idx->bf;
+	struct bp_bucketfile_writer w;
+
+	if (!bf->fn || bf->read_only || !bp_hashtab_size(idx->recent))
+		return true;
+	if (!bp_bucketfile_write_begin(bf, &w))
+		return false;
+
+	parr *recent = parr_new(bp_hashtab_size(idx->recent), NULL);
+	bp_hashtab_iter(idx->recent, addrindex_collect, recent);
+	qsort(recent->data, recent->len, sizeof(void *), addrindex_ent_cmpp);
+
+	cstring *rec = cstr_new_sz(BP_ADDRINDEX_ENT_SZ);
+	uint64_t i = 0;
+	unsigned int j = 0;
+
+	while ((i < bf->n_base) || (j < recent->len)) {
+		const unsigned char *base = NULL;
+		struct bp_addrindex_ent base_ent;
+		if (i < bf->n_base) {
+			base = bp_bucketfile_ent(bf, i);
+			struct const_buffer buf = { base, BP_ADDRINDEX_ENT_SZ };
+			deser_addrindex_ent(&base_ent, &buf);
+		}
+		const struct addrindex_op *op = (j < recent->len) ?
+						parr_idx(recent, j) : NULL;
+		int cmp = !base ? 1 : !op ? -1 :
+			  addrindex_ent_cmp(&base_ent, &op->ent);
+
+		if (cmp < 0) {
+			bp_bucketfile_write_put(&w, base);
+			i++;
+			continue;
+		}
+
+		if (!op->removed) {
+			cstr_resize(rec, 0);
+			ser_addrindex_ent(rec, &op->ent, 0);
+			bp_bucketfile_write_put(&w, rec->str);
+		}
+		j++;
+		if (cmp == 0)
+			i++;
+	}
+	cstr_free(rec, true);
+	parr_free(recent, true);
+
+	cstring *hdr = cstr_new_sz(4 + 4 + 32);
+	ser_u32(hdr, (uint32_t) idx->best_height);
+	ser_u32(hdr, 0);
+	ser_u256(hdr, &idx->best_hash);
+	bool rc = bp_bucketfile_write_end(&w, hdr);
+	cstr_free(hdr, true);
+	if (!rc)
+		return false;
+
+	/* FILE now holds the log ops */
+	bp_hashtab_clear(idx->recent_script);
+	bp_hashtab_clear(idx->recent);
+	return bp_bucketfile_reload(bf);
+}
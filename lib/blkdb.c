@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -18,16 +19,17 @@
 #include <ccoin/util.h>
 #include <ccoin/cstr.h>
 #include <ccoin/compat.h>		/* for fdatasync */
+#include <ccoin/crypto/sha2.h>
 
 struct blkinfo *bi_new(void)
 {
 	struct blkinfo *bi;
 
 	bi = calloc(1, sizeof(*bi));
-	mpz_init(bi->work);
 	bi->height = -1;
 	bi->n_file = -1;
 	bi->n_pos = -1LL;
+	bi->n_undo_pos = -1LL;
 
 	bp_block_init(&bi->hdr);
 
@@ -39,8 +41,6 @@ void bi_free(struct blkinfo *bi)
 	if (!bi)
 		return;
 
-	mpz_clear(bi->work);
-
 	bp_block_free(&bi->hdr);
 
 	memset(bi, 0, sizeof(*bi));
@@ -59,10 +59,115 @@ bool blkdb_init(struct blkdb *db, const unsigned char *netmagic,
 	memcpy(db->netmagic, netmagic, sizeof(db->netmagic));
 	db->blocks = bp_hashtab_new_ext(bu256_hash, bu256_equal_,
 					NULL, (bp_freefunc) bi_free);
+	db->chain = parr_new(0, NULL);
 
 	return true;
 }
 
+/* work contributed by block bi alone.  difficulty changes rarely, so when
+ * bi shares nBits with its parent, reuse the parent's work rather than
+ * dividing again.
+ */
+static void blkinfo_block_work(bu256_t *work, const struct blkinfo *bi)
+{
+	const struct blkinfo *prev = bi->prev;
+
+	if (prev && (prev->hdr.nBits == bi->hdr.nBits)) {
+		if (prev->prev)
+			bu256_sub(work, &prev->work, &prev->prev->work);
+		else
+			bu256_copy(work, &prev->work);
+		return;
+	}
+
+	bu256_t target;
+	u256_from_compact(&target, bi->hdr.nBits);
+	bu256_target_work(work, &target);
+}
+
+static int invert_lowest_one(int n)
+{
+	return n & (n - 1);
+}
+
+/* height that the skip pointer of a block at height points to.  any
+ * number of blocks can be crossed in O(log n) skip/prev steps.
+ */
+static int blkinfo_skip_height(int height)
+{
+	if (height < 2)
+		return 0;
+
+	if (height & 1)
+		return invert_lowest_one(invert_lowest_one(height - 1)) + 1;
+	return invert_lowest_one(height);
+}
+
+static struct blkinfo *blkinfo_ancestor(struct blkinfo *bi, int height)
+{
+	if (!bi || (height > bi->height) || (height < 0))
+		return NULL;
+
+	int walk_height = bi->height;
+	while (walk_height > height) {
+		int skip_height = blkinfo_skip_height(walk_height);
+		int skip_height_prev = blkinfo_skip_height(walk_height - 1);
+
+		if (bi->skip &&
+		    ((skip_height == height) ||
+		     ((skip_height > height) &&
+		      !((skip_height_prev < skip_height - 2) &&
+			(skip_height_prev >= height))))) {
+			bi = bi->skip;
+			walk_height = skip_height;
+		} else {
+			bi = bi->prev;
+			walk_height--;
+		}
+	}
+
+	return bi;
+}
+
+struct blkinfo *blkdb_ancestor(struct blkdb *db, struct blkinfo *bi,
+			       int height)
+{
+	if (!bi || (height > bi->height) || (height < 0))
+		return NULL;
+
+	/* active chain: direct index */
+	if (blkdb_at_height(db, bi->height) == bi)
+		return blkdb_at_height(db, height);
+
+	return blkinfo_ancestor(bi, height);
+}
+
+/* make tip the end of the active chain array.  returns the last block
+ * shared with the previous active chain, or NULL if there is none.
+ */
+static struct blkinfo *blkdb_set_tip(struct blkdb *db, struct blkinfo *tip)
+{
+	struct blkinfo *fork = tip;
+	while (fork && (blkdb_at_height(db, fork->height) != fork))
+		fork = fork->prev;
+
+	parr_resize(db->chain, tip->height + 1);
+
+	struct blkinfo *bi;
+	for (bi = tip; bi != fork; bi = bi->prev)
+		db->chain->data[bi->height] = bi;
+
+	return fork;
+}
+
+static void blkdb_reset(struct blkdb *db)
+{
+	bp_hashtab_clear(db->blocks);
+	parr_resize(db->chain, 0);
+	db->best_chain = NULL;
+	db->log_tail_len = 0;
+}
+
 static bool blkdb_connect(struct blkdb *db, struct blkinfo *bi,
 			  struct blkdb_reorg *reorg_info)
 {
@@ -71,23 +176,20 @@ static bool blkdb_connect(struct blkdb *db, struct blkinfo *bi,
 	if (blkdb_lookup(db, &bi->hash))
 		return false;
 
-	bool rc = false;
-	mpz_t cur_work;
-	mpz_init(cur_work);
-
-	u256_from_compact(cur_work, bi->hdr.nBits);
-
+	bu256_t cur_work;
 	bool best_chain = false;
 
 	/* verify genesis block matches first record */
 	if (bp_hashtab_size(db->blocks) == 0) {
 		if (!bu256_equal(&bi->hdr.sha256, &db->block0))
-			goto out;
+			return false;
 
 		/* bi->prev = NULL; */
 		bi->height = 0;
 
-		mpz_set(bi->work, cur_work);
+		blkinfo_block_work(&cur_work, bi);
+
+		bu256_copy(&bi->work, &cur_work);
 
 		best_chain = true;
 	}
@@ -96,14 +198,19 @@ static bool blkdb_connect(struct blkdb *db, struct blkinfo *bi,
 	else {
 		struct blkinfo *prev = blkdb_lookup(db, &bi->hdr.hashPrevBlock);
 		if (!prev)
-			goto out;
+			return false;
 
 		bi->prev = prev;
 		bi->height = prev->height + 1;
+		bi->skip = blkinfo_ancestor(prev, blkinfo_skip_height(bi->height));
+		bi->invalid = prev->invalid;
+
+		blkinfo_block_work(&cur_work, bi);
 
-		mpz_add(bi->work, cur_work, prev->work);
+		bu256_add(&bi->work, &cur_work, &prev->work);
 
-		if (mpz_cmp(bi->work, db->best_chain->work) > 0)
+		if (!bi->invalid &&
+		    (bu256_cmp(&bi->work, &db->best_chain->work) > 0))
 			best_chain = true;
 	}
 
@@ -113,49 +220,91 @@ static bool blkdb_connect(struct blkdb *db, struct blkinfo *bi,
 	/* if new best chain found, update pointers */
 	if (best_chain) {
 		struct blkinfo *old_best = db->best_chain;
-		struct blkinfo *new_best = bi;
+		struct blkinfo *fork = blkdb_set_tip(db, bi);
+		int fork_height = fork ? fork->height : -1;
 
 		reorg_info->old_best = old_best;
+		reorg_info->conn = bi->height - fork_height;
+		if (old_best)
+			reorg_info->disconn = old_best->height - fork_height;
 
-		/* likely case: new best chain has greater height */
-		if (!old_best) {
-			while (new_best) {
-				new_best = new_best->prev;
-				reorg_info->conn++;
-			}
-		} else {
-			while (new_best &&
-			       (new_best->height > old_best->height)) {
-				new_best = new_best->prev;
-				reorg_info->conn++;
-			}
-		}
+		/* reorg analyzed. update database's best-chain pointer */
+		db->best_chain = bi;
+	}
 
-		/* unlikely case: old best chain has greater height */
-		while (old_best && new_best &&
-		       (old_best->height > new_best->height)) {
-			old_best = old_best->prev;
-			reorg_info->disconn++;
-		}
+	return true;
+}
 
-		/* height matches, but we are still walking parallel chains */
-		while (old_best && new_best && (old_best != new_best)) {
-			new_best = new_best->prev;
-			reorg_info->conn++;
+struct invalidate_info {
+	struct blkinfo	*bad;
+	struct blkinfo	*best;
+};
 
-			old_best = old_best->prev;
-			reorg_info->disconn++;
-		}
+static void blkdb_invalidate_iter(void *key, void *value, void *user_private)
+{
+	struct invalidate_info *ii = user_private;
+	struct blkinfo *bi = value;
 
-		/* reorg analyzed. update database's best-chain pointer */
-		db->best_chain = bi;
-	}
+	if (!bi->invalid &&
+	    (blkinfo_ancestor(bi, ii->bad->height) == ii->bad))
+		bi->invalid = true;
+}
 
-	rc = true;
+static void blkdb_best_iter(void *key, void *value, void *user_private)
+{
+	struct invalidate_info *ii = user_private;
+	struct blkinfo *bi = value;
 
-out:
-	mpz_clear(cur_work);
-	return rc;
+	if (!bi->invalid && (bu256_cmp(&bi->work, &ii->best->work) > 0))
+		ii->best = bi;
+}
+
+/* mark bi and its descendants invalid, and fall back to the valid
+ * block with the most work.  Ties go to the current chain.
+ */
+static bool blkdb_mark_invalid(struct blkdb *db, struct blkinfo *bi,
+			       struct blkdb_reorg *reorg_info)
+{
+	memset(reorg_info, 0, sizeof(*reorg_info));
+
+	if (!bi->prev)
+		return false;		/* genesis */
+
+	struct invalidate_info ii = { bi, NULL };
+	bp_hashtab_iter(db->blocks, blkdb_invalidate_iter, &ii);
+
+	ii.best = db->best_chain;
+	while (ii.best->invalid)
+		ii.best = ii.best->prev;
+	bp_hashtab_iter(db->blocks, blkdb_best_iter, &ii);
+
+	struct blkinfo *old_best = db->best_chain;
+	if (ii.best == old_best)
+		return true;
+
+	struct blkinfo *fork = blkdb_set_tip(db, ii.best);
+	int fork_height = fork ? fork->height : -1;
+
+	reorg_info->old_best = old_best;
+	reorg_info->conn = ii.best->height - fork_height;
+	reorg_info->disconn = old_best->height - fork_height;
+
+	db->best_chain = ii.best;
+	return true;
+}
+
+static bool blkdb_read_bad(struct blkdb *db, const struct p2p_message *msg)
+{
+	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+	bu256_t hash;
+
+	if (!deser_u256(&hash, &buf))
+		return false;
+
+	struct blkinfo *bi = blkdb_lookup(db, &hash);
+	struct blkdb_reorg dummy;
+
+	return bi && blkdb_mark_invalid(db, bi, &dummy);
 }
 
 static bool blkdb_read_rec(struct blkdb *db, const struct p2p_message *msg)
@@ -163,6 +312,8 @@ static bool blkdb_read_rec(struct blkdb *db, const struct p2p_message *msg)
 	struct blkinfo *bi;
 	struct const_buffer buf = { msg->data, msg->hdr.data_len };
 
+	if (!strncmp(msg->hdr.command, "bad", 12))
+		return blkdb_read_bad(db, msg);
 	if (strncmp(msg->hdr.command, "rec", 12))
 		return false;
 
@@ -216,21 +367,79 @@ static cstring *blkdb_ser_rec(struct blkdb *db, const struct blkinfo *bi)
 	return rs;
 }
 
-bool blkdb_read(struct blkdb *db, const char *idx_fn)
+static void blkdb_set_log_tail(struct blkdb *db, const void *rec,
+			       size_t rec_len)
+{
+	db->log_tail_len = rec_len;
+	sha256_Raw(rec, rec_len, (uint8_t *) &db->log_tail);
+}
+
+/* hash the rec_len bytes of fd ending at end_ofs */
+static bool blkdb_hash_rec(int fd, uint64_t end_ofs, uint32_t rec_len,
+			   bu256_t *hash)
+{
+	if (!rec_len || (rec_len > end_ofs))
+		return false;
+
+	void *rec = malloc(rec_len);
+	if (!rec)
+		return false;
+
+	bool rc = (pread(fd, rec, rec_len, (off_t)(end_ofs - rec_len)) ==
+		   (ssize_t) rec_len);
+	if (rc)
+		sha256_Raw(rec, rec_len, (uint8_t *) hash);
+
+	free(rec);
+	return rc;
+}
+
+static bool blkdb_read_log(struct blkdb *db, const char *idx_fn,
+			   uint64_t start_ofs)
 {
 	bool rc = true;
 	int fd = file_seq_open(idx_fn);
 	if (fd < 0)
 		return false;
 
+	/* the record just before start_ofs must be the one the caller
+	 * (a checkpoint) expects, or this is not the same log
+	 */
+	if (start_ofs) {
+		struct stat st;
+		bu256_t tail;
+
+		if ((fstat(fd, &st) < 0) || (st.st_size < start_ofs) ||
+		    !blkdb_hash_rec(fd, start_ofs, db->log_tail_len, &tail) ||
+		    !bu256_equal(&tail, &db->log_tail) ||
+		    (lseek(fd, (off_t) start_ofs, SEEK_SET) != (off_t) start_ofs)) {
+			close(fd);
+			return false;
+		}
+	}
+
 	struct p2p_message msg;
 	memset(&msg, 0, sizeof(msg));
 	bool read_ok = true;
+	off_t rec_ofs = (off_t) start_ofs, last_ofs = -1;
 
 	while (fread_message(fd, &msg, &read_ok)) {
 		rc = blkdb_read_rec(db, &msg);
 		if (!rc)
 			break;
+
+		last_ofs = rec_ofs;
+		rec_ofs += P2P_HDR_SZ + msg.hdr.data_len;
+	}
+
+	/* remember the last record read, for the next checkpoint */
+	if (rc && read_ok && (last_ofs >= 0)) {
+		uint32_t rec_len = rec_ofs - last_ofs;
+
+		if (blkdb_hash_rec(fd, rec_ofs, rec_len, &db->log_tail))
+			db->log_tail_len = rec_len;
+		else
+			db->log_tail_len = 0;
 	}
 
 	close(fd);
@@ -240,6 +449,11 @@ bool blkdb_read(struct blkdb *db, const char *idx_fn)
 	return read_ok && rc;
 }
 
+bool blkdb_read(struct blkdb *db, const char *idx_fn)
+{
+	return blkdb_read_log(db, idx_fn, 0);
+}
+
 bool blkdb_add(struct blkdb *db, struct blkinfo *bi,
 	       struct blkdb_reorg *reorg_info)
 {
@@ -252,6 +466,9 @@ bool blkdb_add(struct blkdb *db, struct blkinfo *bi,
 		size_t data_len = data->len;
 		ssize_t wrc = write(db->fd, data->str, data_len);
 
+		if (wrc == data_len)
+			blkdb_set_log_tail(db, data->str, data_len);
+
 		cstr_free(data, true);
 
 		if (wrc != data_len)
@@ -265,12 +482,42 @@ bool blkdb_add(struct blkdb *db, struct blkinfo *bi,
 	return blkdb_connect(db, bi, reorg_info);
 }
 
+/*
+ * A block failed validation: record that in the log, mark it and its
+ * descendants invalid, and move the best chain back to the valid block
+ * with the most work.  reorg_info describes that move.
+ */
+bool blkdb_invalidate(struct blkdb *db, struct blkinfo *bi,
+		      struct blkdb_reorg *reorg_info)
+{
+	if (!bi->prev)
+		return false;		/* genesis */
+
+	if (db->fd >= 0) {
+		cstring *data = message_str(db->netmagic, "bad",
+					    &bi->hash, sizeof(bi->hash));
+		ssize_t wrc = write(db->fd, data->str, data->len);
+		bool ok = (wrc == data->len);
+
+		if (ok)
+			blkdb_set_log_tail(db, data->str, data->len);
+
+		cstr_free(data, true);
+
+		if (!ok || (db->datasync_fd && (fdatasync(db->fd) < 0)))
+			return false;
+	}
+
+	return blkdb_mark_invalid(db, bi, reorg_info);
+}
+
 void blkdb_free(struct blkdb *db)
 {
 	if (db->close_fd && (db->fd >= 0))
 		close(db->fd);
 
 	bp_hashtab_unref(db->blocks);
+	parr_free(db->chain, true);
 }
 
 void blkdb_locator(struct blkdb *db, struct blkinfo *bi,
@@ -280,12 +527,12 @@ void blkdb_locator(struct blkdb *db, struct blkinfo *bi,
 		bi = db->best_chain;
 
 	int step = 1;
-	while (bi) {
+	int height = bi ? bi->height : -1;
+	while (height >= 0) {
+		bi = blkdb_ancestor(db, bi, height);
 		bp_locator_push(locator, &bi->hash);
 
-		unsigned int i;
-		for (i = 0; bi && i < step; i++)
-			bi = bi->prev;
+		height -= step;
 		if (locator->vHave->len > 10)
 			step *= 2;
 	}
@@ -293,3 +540,278 @@ void blkdb_locator(struct blkdb *db, struct blkinfo *bi,
 	bp_locator_push(locator, &db->block0);
 }
 
+static const char blkdb_ckpt_magic[8] = "ccblkidx";
+
+static int blkinfo_height_cmp(const void *a_, const void *b_)
+{
+	const struct blkinfo *a = *(const struct blkinfo **) a_;
+	const struct blkinfo *b = *(const struct blkinfo **) b_;
+
+	if (a->height < b->height)
+		return -1;
+	if (a->height > b->height)
+		return 1;
+	return 0;
+}
+
+/* invalid blocks are left out; a checkpoint reloads as if they had
+ * never been received
+ */
+static void blkdb_collect(void *key, void *value, void *user_private)
+{
+	struct blkinfo *bi = value;
+
+	if (!bi->invalid)
+		parr_add((parr *) user_private, bi);
+}
+
+static void ser_ckpt_rec(cstring *s, const struct blkinfo *bi,
+			 int32_t prev_idx)
+{
+	ser_u256(s, &bi->hash);
+	ser_u32(s, bi->hdr.nVersion);
+	ser_u256(s, &bi->hdr.hashMerkleRoot);
+	ser_u32(s, bi->hdr.nTime);
+	ser_u32(s, bi->hdr.nBits);
+	ser_u32(s, bi->hdr.nNonce);
+	ser_s32(s, bi->height);
+	ser_s32(s, prev_idx);
+	ser_s32(s, bi->n_file);
+	ser_s64(s, bi->n_pos);
+	ser_u256(s, &bi->work);
+}
+
+bool blkdb_ckpt_write(struct blkdb *db, const char *ckpt_fn,
+		      uint64_t log_ofs)
+{
+	unsigned int n_recs = bp_hashtab_size(db->blocks);
+	if (!n_recs || !db->best_chain)
+		return false;
+
+	parr *recs = parr_new(n_recs, NULL);
+	struct bp_hashtab *rec_idx = bp_hashtab_new(bu256_hash, bu256_equal_);
+	cstring *s = cstr_new_sz(BLKDB_CKPT_HDR_SZ +
+				 (n_recs * BLKDB_CKPT_REC_SZ) +
+				 SHA256_DIGEST_LENGTH);
+
+	/* parents always have lower height than their children, so height
+	 * order guarantees each record's prev index is already known
+	 */
+	bp_hashtab_iter(db->blocks, blkdb_collect, recs);
+	qsort(recs->data, recs->len, sizeof(void *), blkinfo_height_cmp);
+
+	unsigned int i;
+	for (i = 0; i < recs->len; i++) {
+		struct blkinfo *bi = parr_idx(recs, i);
+		bp_hashtab_put(rec_idx, &bi->hash, (void *)(uintptr_t)(i + 1));
+	}
+
+	uintptr_t best_idx = (uintptr_t) bp_hashtab_get(rec_idx,
+						&db->best_chain->hash);
+
+	ser_bytes(s, blkdb_ckpt_magic, sizeof(blkdb_ckpt_magic));
+	ser_u32(s, BLKDB_CKPT_VERSION);
+	ser_bytes(s, db->netmagic, sizeof(db->netmagic));
+	ser_u256(s, &db->block0);
+	ser_u64(s, log_ofs);
+	ser_u32(s, db->log_tail_len);
+	ser_u256(s, &db->log_tail);
+	ser_u32(s, recs->len);
+	ser_s32(s, (int32_t) best_idx - 1);
+
+	for (i = 0; i < recs->len; i++) {
+		struct blkinfo *bi = parr_idx(recs, i);
+		int32_t prev_idx = -1;
+
+		if (bi->prev)
+			prev_idx = (int32_t)(uintptr_t)
+				bp_hashtab_get(rec_idx, &bi->prev->hash) - 1;
+
+		ser_ckpt_rec(s, bi, prev_idx);
+	}
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	sha256_Raw(s->str, s->len, md);
+	ser_bytes(s, md, sizeof(md));
+
+	bool rc = bu_write_file(ckpt_fn, s->str, s->len);
+
+	cstr_free(s, true);
+	bp_hashtab_unref(rec_idx);
+	parr_free(recs, true);
+	return rc;
+}
+
+static bool deser_ckpt_rec(struct blkinfo *bi, int32_t *prev_idx,
+			   struct const_buffer *buf)
+{
+	uint32_t v32;
+
+	if (!deser_u256(&bi->hash, buf)) return false;
+	if (!deser_u32(&bi->hdr.nVersion, buf)) return false;
+	if (!deser_u256(&bi->hdr.hashMerkleRoot, buf)) return false;
+	if (!deser_u32(&bi->hdr.nTime, buf)) return false;
+	if (!deser_u32(&bi->hdr.nBits, buf)) return false;
+	if (!deser_u32(&bi->hdr.nNonce, buf)) return false;
+	if (!deser_u32(&v32, buf)) return false;
+	bi->height = (int32_t) v32;
+	if (!deser_u32(&v32, buf)) return false;
+	*prev_idx = (int32_t) v32;
+	if (!deser_u32(&v32, buf)) return false;
+	bi->n_file = (int32_t) v32;
+	if (!deser_s64(&bi->n_pos, buf)) return false;
+	if (!deser_u256(&bi->work, buf)) return false;
+
+	/* record hash was verified when the checkpoint was written */
+	bu256_copy(&bi->hdr.sha256, &bi->hash);
+	bi->hdr.sha256_valid = true;
+
+	return true;
+}
+
+static bool blkdb_ckpt_load(struct blkdb *db, struct const_buffer *buf,
+			    uint64_t *log_ofs)
+{
+	char magic[sizeof(blkdb_ckpt_magic)];
+	unsigned char netmagic[4];
+	uint32_t version, n_recs, v32;
+	int32_t best_idx;
+	bu256_t block0;
+
+	if (!deser_bytes(magic, buf, sizeof(magic)) ||
+	    memcmp(magic, blkdb_ckpt_magic, sizeof(magic)))
+		return false;
+	if (!deser_u32(&version, buf) || version != BLKDB_CKPT_VERSION)
+		return false;
+	if (!deser_bytes(netmagic, buf, sizeof(netmagic)) ||
+	    memcmp(netmagic, db->netmagic, sizeof(netmagic)))
+		return false;
+	if (!deser_u256(&block0, buf) || !bu256_equal(&block0, &db->block0))
+		return false;
+	if (!deser_u64(log_ofs, buf))
+		return false;
+	if (!deser_u32(&db->log_tail_len, buf) ||
+	    !deser_u256(&db->log_tail, buf))
+		return false;
+	if (!deser_u32(&n_recs, buf) || !deser_u32(&v32, buf))
+		return false;
+	best_idx = (int32_t) v32;
+
+	if (!n_recs || (best_idx < 0) || (best_idx >= n_recs) ||
+	    (buf->len != ((size_t) n_recs * BLKDB_CKPT_REC_SZ)))
+		return false;
+
+	struct blkinfo **bis = calloc(n_recs, sizeof(struct blkinfo *));
+	if (!bis)
+		return false;
+
+	bool rc = false;
+	unsigned int i;
+	for (i = 0; i < n_recs; i++) {
+		int32_t prev_idx;
+		struct blkinfo *bi = bi_new();
+
+		if (!deser_ckpt_rec(bi, &prev_idx, buf)) {
+			bi_free(bi);
+			goto out;
+		}
+
+		if (prev_idx < 0) {
+			if (i != 0 || bi->height != 0 ||
+			    !bu256_equal(&bi->hash, &db->block0)) {
+				bi_free(bi);
+				goto out;
+			}
+		} else {
+			if (prev_idx >= i ||
+			    bi->height != (bis[prev_idx]->height + 1)) {
+				bi_free(bi);
+				goto out;
+			}
+
+			bi->prev = bis[prev_idx];
+			bi->skip = blkinfo_ancestor(bi->prev,
+					blkinfo_skip_height(bi->height));
+			bu256_copy(&bi->hdr.hashPrevBlock, &bi->prev->hash);
+		}
+
+		if (!bp_hashtab_put(db->blocks, &bi->hash, bi)) {
+			bi_free(bi);
+			goto out;
+		}
+		bis[i] = bi;
+	}
+
+	db->best_chain = bis[best_idx];
+	blkdb_set_tip(db, db->best_chain);
+	rc = true;
+
+out:
+	free(bis);
+	return rc;
+}
+
+bool blkdb_ckpt_read(struct blkdb *db, const char *ckpt_fn,
+		     uint64_t *log_ofs)
+{
+	if (bp_hashtab_size(db->blocks) != 0)
+		return false;
+
+	int fd = file_seq_open(ckpt_fn);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < (BLKDB_CKPT_HDR_SZ + SHA256_DIGEST_LENGTH))) {
+		close(fd);
+		return false;
+	}
+
+	size_t map_len = st.st_size;
+	void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	bool rc = false;
+	size_t data_len = map_len - SHA256_DIGEST_LENGTH;
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	/* verify trailing checksum, before trusting any record */
+	sha256_Raw(map, data_len, md);
+	if (memcmp(md, (unsigned char *) map + data_len, sizeof(md)))
+		goto out;
+
+	struct const_buffer buf = { map, data_len };
+	rc = blkdb_ckpt_load(db, &buf, log_ofs);
+	if (!rc)
+		blkdb_reset(db);
+
+out:
+	munmap(map, map_len);
+	return rc;
+}
+
+bool blkdb_read_ckpt(struct blkdb *db, const char *idx_fn,
+		     const char *ckpt_fn, bool *ckpt_stale)
+{
+	uint64_t log_ofs = 0;
+
+	*ckpt_stale = true;
+
+	if (ckpt_fn && blkdb_ckpt_read(db, ckpt_fn, &log_ofs)) {
+		unsigned int n_ckpt = bp_hashtab_size(db->blocks);
+
+		/* replay only the log records appended since checkpoint */
+		if (blkdb_read_log(db, idx_fn, log_ofs)) {
+			*ckpt_stale = (bp_hashtab_size(db->blocks) != n_ckpt);
+			return true;
+		}
+
+		/* checkpoint does not match log; fall back to full replay */
+		blkdb_reset(db);
+	}
+
+	return blkdb_read_log(db, idx_fn, 0);
+}
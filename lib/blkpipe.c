@@ -0,0 +1,741 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ccoin/blkpipe.h>
+#include <ccoin/endian.h>
+#include <ccoin/mbr.h>
+#include <ccoin/queue.h>
+#include <ccoin/util.h>
+
+#ifdef __APPLE__
+#  define off64_t off_t
+#  define lseek64 lseek
+#  define pread64 pread
+#endif
+
+enum {
+	BLKPIPE_DEF_QUEUE_LEN	= 16,
+	BLKPIPE_MAX_RECORD	= 100 * 1024 * 1024,	/* as fread_*() */
+};
+
+struct blkpipe_item {
+	uint64_t		seq;
+	int64_t			fpos;
+	struct p2p_message	msg;
+	struct bp_block		block;
+	const char		*err;
+};
+
+struct blkpipe;
+
+struct blkpipe_worker {
+	struct blkpipe		*pl;
+	enum blkpipe_stage	stage;
+	pthread_t		thread;
+};
+
+struct blkpipe {
+	int			fd;
+	struct blkpipe_opts	opts;
+
+	/* input queue of each stage after BLKPIPE_READ */
+	struct bp_queue		q[BLKPIPE_N_STAGES];
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		window_cond;
+	uint64_t		n_done;		/* items consumed, in order */
+	size_t			window;		/* max items in flight */
+	bool			abort;
+	unsigned int		live[BLKPIPE_N_STAGES];
+
+	bool			read_ok;
+	int64_t			read_fpos;
+	uint64_t		n_items[BLKPIPE_N_STAGES];
+	double			busy[BLKPIPE_N_STAGES];
+	uint64_t		n_bytes;
+};
+
+static double blkpipe_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void blkpipe_item_free(struct blkpipe_item *item)
+{
+	bp_block_free(&item->block);
+	free(item->msg.data);
+	free(item);
+}
+
+static void blkpipe_account(struct blkpipe *pl, enum blkpipe_stage stage,
+			    uint64_t n_items, double busy)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->n_items[stage] += n_items;
+	pl->busy[stage] += busy;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static bool blkpipe_aborted(struct blkpipe *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	bool abort = pl->abort;
+	pthread_mutex_unlock(&pl->lock);
+
+	return abort;
+}
+
+static enum blkpipe_stage blkpipe_next(const struct blkpipe *pl,
+				       enum blkpipe_stage stage)
+{
+	if ((stage == BLKPIPE_DESER) && !pl->opts.validate)
+		return BLKPIPE_PROCESS;
+	return stage + 1;
+}
+
+static void *blkpipe_reader(void *arg)
+{
+	struct blkpipe *pl = arg;
+	uint64_t seq = 0;
+	double busy = 0.0;
+
+	while (1) {
+		pthread_mutex_lock(&pl->lock);
+		while (!pl->abort && (seq - pl->n_done >= pl->window))
+			pthread_cond_wait(&pl->window_cond, &pl->lock);
+		bool stop = pl->abort;
+		pthread_mutex_unlock(&pl->lock);
+		if (stop)
+			break;
+
+		double t0 = blkpipe_now();
+
+		struct blkpipe_item *item = calloc(1, sizeof(*item));
+		bp_block_init(&item->block);
+		item->seq = seq;
+		item->fpos = lseek64(pl->fd, 0, SEEK_CUR);
+
+		bool read_ok = false;
+		bool have_rec = (item->fpos >= 0) &&
+				pl->opts.read_f(pl->fd, &item->msg, &read_ok);
+
+		busy += blkpipe_now() - t0;
+
+		if (!have_rec) {
+			pl->read_ok = read_ok;
+			pl->read_fpos = item->fpos;
+			blkpipe_item_free(item);
+			break;
+		}
+
+		pl->n_bytes += item->msg.hdr.data_len;
+
+		if (!bp_queue_push(&pl->q[BLKPIPE_DESER], item)) {
+			blkpipe_item_free(item);
+			break;
+		}
+		seq++;
+	}
+
+	bp_queue_close(&pl->q[BLKPIPE_DESER]);
+	blkpipe_account(pl, BLKPIPE_READ, seq, busy);
+	return NULL;
+}
+
+/* deserialize; hash block header and transactions; check merkle root */
+static void blkpipe_deser(struct blkpipe_item *item)
+{
+	if (strncmp(item->msg.hdr.command, "block",
+		    sizeof(item->msg.hdr.command))) {
+		item->err = "unknown record";
+		return;
+	}
+
+	struct const_buffer buf = { item->msg.data, item->msg.hdr.data_len };
+	if (!deser_bp_block(&item->block, &buf)) {
+		item->err = "block deser fail";
+		return;
+	}
+
+	bp_block_calc_sha256(&item->block);
+
+	bu256_t merkle;
+	bp_block_merkle(&merkle, &item->block);
+	if (!bu256_equal(&merkle, &item->block.hashMerkleRoot))
+		item->err = "merkle root mismatch";
+
+	/* the block owns everything from here on */
+	free(item->msg.data);
+	item->msg.data = NULL;
+}
+
+/* the merkle root was checked by blkpipe_deser */
+static void blkpipe_valid(struct blkpipe_item *item)
+{
+	if (!bp_block_valid_hashed(&item->block))
+		item->err = "block not valid";
+}
+
+static void *blkpipe_work(void *arg)
+{
+	struct blkpipe_worker *w = arg;
+	struct blkpipe *pl = w->pl;
+	struct bp_queue *in = &pl->q[w->stage];
+	struct bp_queue *out = &pl->q[blkpipe_next(pl, w->stage)];
+	uint64_t n_items = 0;
+	double busy = 0.0;
+	void *p;
+
+	while (bp_queue_pop(in, &p)) {
+		struct blkpipe_item *item = p;
+
+		/* failed items travel on, so the consumer stops in order */
+		if (!item->err && !blkpipe_aborted(pl)) {
+			double t0 = blkpipe_now();
+			if (w->stage == BLKPIPE_DESER)
+				blkpipe_deser(item);
+			else
+				blkpipe_valid(item);
+			busy += blkpipe_now() - t0;
+			n_items++;
+		}
+
+		if (!bp_queue_push(out, item))
+			blkpipe_item_free(item);
+	}
+
+	pthread_mutex_lock(&pl->lock);
+	pl->n_items[w->stage] += n_items;
+	pl->busy[w->stage] += busy;
+	if (--pl->live[w->stage] == 0)
+		bp_queue_close(out);
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void blkpipe_fill_stats(struct blkpipe *pl, struct blkpipe_stats *st,
+			       double wall_secs)
+{
+	memset(st, 0, sizeof(*st));
+
+	st->n_blocks = pl->n_items[BLKPIPE_PROCESS];
+	st->n_bytes = pl->n_bytes;
+	st->wall_secs = wall_secs;
+	st->n_threads = pl->opts.n_threads;
+
+	unsigned int i;
+	for (i = 0; i < BLKPIPE_N_STAGES; i++) {
+		struct blkpipe_stage_stats *ss = &st->stage[i];
+		struct bp_queue *q = &pl->q[i];
+
+		ss->n_items = pl->n_items[i];
+		ss->busy_secs = pl->busy[i];
+		if (q->n_push)
+			ss->avg_depth = (double) q->depth_sum / q->n_push;
+		ss->max_depth = q->depth_max;
+	}
+}
+
+bool blkpipe_run(int fd, const struct blkpipe_opts *opts,
+		 blkpipe_block_fn block_f, void *priv,
+		 struct blkpipe_stats *stats, struct blkpipe_result *result)
+{
+	struct blkpipe pl;
+	memset(&pl, 0, sizeof(pl));
+
+	pl.fd = fd;
+	pl.opts = *opts;
+	if (!pl.opts.n_threads)
+		pl.opts.n_threads = bp_num_cpus();
+	if (!pl.opts.queue_len)
+		pl.opts.queue_len = BLKPIPE_DEF_QUEUE_LEN;
+	pl.window = 2 * (pl.opts.queue_len + pl.opts.n_threads);
+	pl.read_ok = true;
+	pl.read_fpos = -1;
+
+	result->read_ok = true;
+	result->fail_fpos = -1;
+	result->fail_reason = NULL;
+
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.window_cond, NULL);
+
+	unsigned int i;
+	bool started = true;
+	for (i = BLKPIPE_DESER; i < BLKPIPE_N_STAGES; i++)
+		if (!bp_queue_init(&pl.q[i], pl.opts.queue_len))
+			started = false;
+
+	double t_start = blkpipe_now();
+
+	/* start stages, downstream first */
+	unsigned int n_stages = pl.opts.validate ? 2 : 1;
+	unsigned int n_workers = n_stages * pl.opts.n_threads;
+	unsigned int n_started = 0;
+	struct blkpipe_worker *workers = calloc(n_workers,
+						sizeof(struct blkpipe_worker));
+	struct blkpipe_item **ring = calloc(pl.window, sizeof(*ring));
+	if (!workers || !ring)
+		started = false;
+
+	for (i = 0; started && (i < n_workers); i++) {
+		struct blkpipe_worker *w = &workers[i];
+		w->pl = &pl;
+		w->stage = (i < pl.opts.n_threads) ? BLKPIPE_DESER
+						   : BLKPIPE_VALID;
+		pl.live[w->stage]++;
+	}
+	for (i = 0; started && (i < n_workers); i++) {
+		if (pthread_create(&workers[i].thread, NULL, blkpipe_work,
+				   &workers[i]) != 0)
+			started = false;
+		else
+			n_started++;
+	}
+
+	pthread_t reader;
+	if (started &&
+	    (pthread_create(&reader, NULL, blkpipe_reader, &pl) != 0))
+		started = false;
+
+	/* a stage is missing; the rest would wait on it forever */
+	if (!started) {
+		pthread_mutex_lock(&pl.lock);
+		pl.abort = true;
+		pthread_mutex_unlock(&pl.lock);
+		for (i = BLKPIPE_DESER; n_started && (i < BLKPIPE_N_STAGES);
+		     i++)
+			bp_queue_close(&pl.q[i]);
+		result->fail_reason = "pipeline start failed";
+	}
+
+	/* in-order consumer: reassemble by sequence number */
+	uint64_t next = 0;
+	double busy = 0.0;
+	bool ok = started;
+	void *p;
+
+	while (started && bp_queue_pop(&pl.q[BLKPIPE_PROCESS], &p)) {
+		struct blkpipe_item *item = p;
+		ring[item->seq % pl.window] = item;
+
+		while ((item = ring[next % pl.window]) != NULL) {
+			ring[next % pl.window] = NULL;
+
+			if (ok && item->err) {
+				ok = false;
+				result->fail_fpos = item->fpos;
+				result->fail_reason = item->err;
+			} else if (ok) {
+				double t0 = blkpipe_now();
+				ok = block_f(&item->block, &item->msg.hdr,
+					     item->fpos, priv);
+				busy += blkpipe_now() - t0;
+				pl.n_items[BLKPIPE_PROCESS]++;
+				if (!ok) {
+					result->fail_fpos = item->fpos;
+					result->fail_reason = "block processing failed";
+				}
+			}
+
+			blkpipe_item_free(item);
+			next++;
+
+			pthread_mutex_lock(&pl.lock);
+			pl.n_done = next;
+			if (!ok)
+				pl.abort = true;
+			pthread_cond_broadcast(&pl.window_cond);
+			pthread_mutex_unlock(&pl.lock);
+		}
+	}
+
+	if (started)
+		pthread_join(reader, NULL);
+	for (i = 0; i < n_started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	pl.busy[BLKPIPE_PROCESS] = busy;
+	if (!pl.read_ok) {
+		ok = false;
+		result->read_ok = false;
+		if (result->fail_fpos < 0) {
+			result->fail_fpos = pl.read_fpos;
+			result->fail_reason = "read failed";
+		}
+	}
+
+	if (stats)
+		blkpipe_fill_stats(&pl, stats, blkpipe_now() - t_start);
+
+	free(ring);
+	free(workers);
+	for (i = BLKPIPE_DESER; i < BLKPIPE_N_STAGES; i++)
+		bp_queue_free(&pl.q[i]);
+	pthread_cond_destroy(&pl.window_cond);
+	pthread_mutex_destroy(&pl.lock);
+
+	return ok;
+}
+
+cstring *blkpipe_stats_str(const struct blkpipe_stats *st)
+{
+	static const char *stage_names[BLKPIPE_N_STAGES] = {
+		"read", "deser", "valid", "process",
+	};
+	char line[256];
+
+	cstring *s = cstr_new_sz(512);
+
+	snprintf(line, sizeof(line),
+		 "blkpipe: %llu blocks, %.1f MB in %.2fs, %u threads/stage",
+		 (unsigned long long) st->n_blocks, st->n_bytes / 1e6,
+		 st->wall_secs, st->n_threads);
+	cstr_append_buf(s, line, strlen(line));
+
+	unsigned int i;
+	for (i = 0; i < BLKPIPE_N_STAGES; i++) {
+		const struct blkpipe_stage_stats *ss = &st->stage[i];
+		if (!ss->n_items)
+			continue;
+
+		double rate = ss->busy_secs > 0.0 ?
+			      ss->n_items / ss->busy_secs : 0.0;
+		snprintf(line, sizeof(line),
+			 "\n  %-7s %llu blocks, %.2fs busy, %.0f blocks/s/thread",
+			 stage_names[i], (unsigned long long) ss->n_items,
+			 ss->busy_secs, rate);
+		cstr_append_buf(s, line, strlen(line));
+
+		/* no queues between the stages of a shard */
+		if ((i != BLKPIPE_READ) && ss->max_depth) {
+			snprintf(line, sizeof(line),
+				 ", queue avg %.1f max %zu",
+				 ss->avg_depth, ss->max_depth);
+			cstr_append_buf(s, line, strlen(line));
+		}
+	}
+
+	return s;
+}
+
+/* record header size, and offset of its LE32 data length, of read_f */
+static bool blkpipe_framing(blkpipe_read_fn read_f, unsigned int *hdr_len,
+			    unsigned int *len_ofs)
+{
+	if (read_f == fread_block) {
+		*hdr_len = sizeof(struct p2p_blockfile_hdr);
+		*len_ofs = 4;
+		return true;
+	}
+	if (read_f == fread_message) {
+		*hdr_len = P2P_HDR_SZ;
+		*len_ofs = 4 + 12;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Find the records from start to the end of the file by their headers
+ * alone, and cut them into at most max_shards runs of about equal byte
+ * size.  Checksums and contents are left to the shards' readers.
+ */
+bool blkpipe_split(int fd, blkpipe_read_fn read_f, int64_t start,
+		   unsigned int max_shards, struct blkpipe_shard *shards,
+		   unsigned int *n_shards, struct blkpipe_result *result)
+{
+	unsigned int hdr_len, len_ofs;
+	struct stat st;
+
+	*n_shards = 0;
+	result->read_ok = true;
+	result->fail_fpos = -1;
+	result->fail_reason = NULL;
+
+	if (!max_shards || !blkpipe_framing(read_f, &hdr_len, &len_ofs) ||
+	    (fstat(fd, &st) < 0)) {
+		result->read_ok = false;
+		result->fail_reason = "read failed";
+		return false;
+	}
+
+	size_t n_recs = 0, alloc = 1024;
+	int64_t *recs = malloc(alloc * sizeof(*recs));
+	int64_t pos = start;
+	bool rc = false;
+
+	while (pos < st.st_size) {
+		unsigned char hdr[P2P_HDR_SZ];
+		uint32_t data_len;
+
+		if ((pread64(fd, hdr, hdr_len, pos) != hdr_len))
+			goto err_out;
+		memcpy(&data_len, &hdr[len_ofs], sizeof(data_len));
+		data_len = le32toh(data_len);
+		if ((data_len > BLKPIPE_MAX_RECORD) ||
+		    (pos + hdr_len + data_len > st.st_size))
+			goto err_out;
+
+		if (n_recs == alloc) {
+			alloc *= 2;
+			recs = realloc(recs, alloc * sizeof(*recs));
+		}
+		recs[n_recs++] = pos;
+		pos += hdr_len + data_len;
+	}
+
+	/* shard k starts at the first record at or past k/n of the bytes */
+	unsigned int n = MIN(max_shards, n_recs);
+	size_t rec = 0;
+	unsigned int k;
+	for (k = 0; k < n; k++) {
+		int64_t end_want = start + ((pos - start) * (k + 1)) / n;
+		size_t first = rec;
+
+		rec++;
+		while ((rec < n_recs) && (recs[rec] < end_want) &&
+		       (n_recs - rec > n - k - 1))
+			rec++;
+
+		struct blkpipe_shard *sh = &shards[k];
+		sh->start = recs[first];
+		sh->end = (rec < n_recs) ? recs[rec] : pos;
+		sh->first_seq = first;
+		sh->n_blocks = rec - first;
+	}
+
+	*n_shards = n;
+	rc = true;
+	goto out;
+
+err_out:
+	result->read_ok = false;
+	result->fail_fpos = pos;
+	result->fail_reason = "read failed";
+out:
+	free(recs);
+	return rc;
+}
+
+struct blkpipe_shards {
+	pthread_mutex_t		lock;
+	unsigned int		fail_shard;	/* first failed, or n_shards */
+};
+
+struct blkpipe_shard_worker {
+	struct blkpipe_shards	*ctl;
+	unsigned int		idx;
+	const char		*fn;
+	const struct blkpipe_opts *opts;
+	const struct blkpipe_shard *shard;
+	blkpipe_block_fn	block_f;
+	void			*priv;
+	pthread_t		thread;
+
+	uint64_t		n_items[BLKPIPE_N_STAGES];
+	double			busy[BLKPIPE_N_STAGES];
+	uint64_t		n_bytes;
+	bool			read_ok;
+	int64_t			fail_fpos;
+	const char		*fail_reason;
+};
+
+/* a later shard's failure does not stop this one */
+static bool blkpipe_shard_stopped(struct blkpipe_shard_worker *w)
+{
+	pthread_mutex_lock(&w->ctl->lock);
+	bool stop = (w->ctl->fail_shard < w->idx);
+	pthread_mutex_unlock(&w->ctl->lock);
+
+	return stop;
+}
+
+static void blkpipe_shard_fail(struct blkpipe_shard_worker *w, int64_t fpos,
+			       const char *reason)
+{
+	w->fail_fpos = fpos;
+	w->fail_reason = reason;
+
+	pthread_mutex_lock(&w->ctl->lock);
+	w->ctl->fail_shard = MIN(w->ctl->fail_shard, w->idx);
+	pthread_mutex_unlock(&w->ctl->lock);
+}
+
+static void *blkpipe_shard_work(void *arg)
+{
+	struct blkpipe_shard_worker *w = arg;
+	int64_t fpos = w->shard->start;
+
+	int fd = open(w->fn, O_RDONLY | O_LARGEFILE);
+	if ((fd < 0) || (lseek64(fd, fpos, SEEK_SET) != fpos)) {
+		w->read_ok = false;
+		blkpipe_shard_fail(w, fpos, "read failed");
+		goto out;
+	}
+
+	while ((fpos < w->shard->end) && !blkpipe_shard_stopped(w)) {
+		struct blkpipe_item *item = calloc(1, sizeof(*item));
+		bp_block_init(&item->block);
+		item->fpos = fpos;
+
+		double t0 = blkpipe_now();
+		bool read_ok = false;
+		bool have_rec = w->opts->read_f(fd, &item->msg, &read_ok);
+		double t1 = blkpipe_now();
+		w->busy[BLKPIPE_READ] += t1 - t0;
+
+		if (!have_rec) {
+			w->read_ok = false;
+			blkpipe_shard_fail(w, fpos, "read failed");
+			blkpipe_item_free(item);
+			break;
+		}
+		w->n_items[BLKPIPE_READ]++;
+		w->n_bytes += item->msg.hdr.data_len;
+		fpos = lseek64(fd, 0, SEEK_CUR);
+
+		blkpipe_deser(item);
+		double t2 = blkpipe_now();
+		w->busy[BLKPIPE_DESER] += t2 - t1;
+		w->n_items[BLKPIPE_DESER]++;
+
+		if (!item->err && w->opts->validate) {
+			blkpipe_valid(item);
+			w->busy[BLKPIPE_VALID] += blkpipe_now() - t2;
+			w->n_items[BLKPIPE_VALID]++;
+		}
+
+		const char *err = item->err;
+		int64_t rec_fpos = item->fpos;
+		if (!err) {
+			t0 = blkpipe_now();
+			if (!w->block_f(&item->block, &item->msg.hdr,
+					item->fpos, w->priv))
+				err = "block processing failed";
+			w->busy[BLKPIPE_PROCESS] += blkpipe_now() - t0;
+			w->n_items[BLKPIPE_PROCESS]++;
+		}
+
+		blkpipe_item_free(item);
+		if (err) {
+			blkpipe_shard_fail(w, rec_fpos, err);
+			break;
+		}
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * Run each shard on its own thread.  On failure, shards after the
+ * failed one stop early, and those before it run to their end, so the
+ * failure reported is always the first in file order.
+ */
+bool blkpipe_run_shards(const char *fn, const struct blkpipe_opts *opts,
+			const struct blkpipe_shard *shards,
+			unsigned int n_shards, blkpipe_block_fn block_f,
+			void **shard_priv, struct blkpipe_stats *stats,
+			struct blkpipe_result *result)
+{
+	struct blkpipe_shards ctl;
+	pthread_mutex_init(&ctl.lock, NULL);
+	ctl.fail_shard = n_shards;
+
+	result->read_ok = true;
+	result->fail_fpos = -1;
+	result->fail_reason = NULL;
+
+	double t_start = blkpipe_now();
+
+	struct blkpipe_shard_worker *workers = calloc(n_shards,
+						      sizeof(*workers));
+	unsigned int i, j, n_started = 0;
+	if (!workers && n_shards) {
+		if (stats)
+			memset(stats, 0, sizeof(*stats));
+		ctl.fail_shard = 0;
+		result->fail_reason = "pipeline start failed";
+		goto out;
+	}
+
+	for (i = 0; i < n_shards; i++) {
+		struct blkpipe_shard_worker *w = &workers[i];
+		w->ctl = &ctl;
+		w->idx = i;
+		w->fn = fn;
+		w->opts = opts;
+		w->shard = &shards[i];
+		w->block_f = block_f;
+		w->priv = shard_priv ? shard_priv[i] : NULL;
+		w->read_ok = true;
+		w->fail_fpos = -1;
+		if (pthread_create(&w->thread, NULL, blkpipe_shard_work, w))
+			break;
+		n_started++;
+	}
+
+	/* a shard that did not start fails, stopping the ones after it */
+	if (n_started < n_shards) {
+		pthread_mutex_lock(&ctl.lock);
+		if (n_started < ctl.fail_shard)
+			ctl.fail_shard = n_started;
+		pthread_mutex_unlock(&ctl.lock);
+		workers[n_started].fail_fpos = shards[n_started].start;
+		workers[n_started].fail_reason = "pipeline start failed";
+	}
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->wall_secs = blkpipe_now() - t_start;
+		stats->n_threads = n_shards;
+	}
+
+	for (i = 0; i < n_shards; i++) {
+		struct blkpipe_shard_worker *w = &workers[i];
+
+		if ((i == ctl.fail_shard) && w->fail_reason) {
+			result->read_ok = w->read_ok;
+			result->fail_fpos = w->fail_fpos;
+			result->fail_reason = w->fail_reason;
+		}
+
+		if (!stats)
+			continue;
+
+		stats->n_blocks += w->n_items[BLKPIPE_PROCESS];
+		stats->n_bytes += w->n_bytes;
+		for (j = 0; j < BLKPIPE_N_STAGES; j++) {
+			stats->stage[j].n_items += w->n_items[j];
+			stats->stage[j].busy_secs += w->busy[j];
+		}
+	}
+
+out:
+	free(workers);
+	pthread_mutex_destroy(&ctl.lock);
+
+	return (ctl.fail_shard == n_shards);
+}
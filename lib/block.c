@@ -4,35 +4,72 @@
  */
 #include "picocoin-config.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <ccoin/core.h>
+#include <ccoin/parallel.h>
 #include <ccoin/util.h>
 #include <ccoin/parr.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/serialize.h>
 
+enum {
+	DUP_INPUTS_PAIRWISE_MAX	= 8,	/* below this, skip the sort */
+	BLOCK_PARALLEL_MIN_TX	= 64,	/* below this, check txs serially */
+};
+
+static int bp_outpt_ptr_cmp(const void *a_, const void *b_)
+{
+	const struct bp_outpt *a = *(const struct bp_outpt * const *) a_;
+	const struct bp_outpt *b = *(const struct bp_outpt * const *) b_;
+
+	int cmp = memcmp(&a->hash, &b->hash, sizeof(bu256_t));
+	if (cmp)
+		return cmp;
+
+	return (a->n > b->n) - (a->n < b->n);
+}
+
 static bool bp_has_dup_inputs(const struct bp_tx *tx)
 {
 	if (!tx->vin || !tx->vin->len || tx->vin->len == 1)
 		return false;
 
-	struct bp_txin *txin, *txin_tmp;
+	unsigned int n_in = tx->vin->len;
 	unsigned int i, j;
-	for (i = 0; i < tx->vin->len; i++) {
-		txin = parr_idx(tx->vin, i);
-		for (j = 0; j < tx->vin->len; j++) {
-			if (i == j)
-				continue;
-			txin_tmp = parr_idx(tx->vin, j);
 
-			if (bp_outpt_equal(&txin->prevout,
-					   &txin_tmp->prevout))
-				return true;
+	if (n_in <= DUP_INPUTS_PAIRWISE_MAX) {
+		for (i = 0; i < n_in; i++) {
+			struct bp_txin *txin = parr_idx(tx->vin, i);
+
+			for (j = i + 1; j < n_in; j++) {
+				struct bp_txin *txin_tmp = parr_idx(tx->vin, j);
+
+				if (bp_outpt_equal(&txin->prevout,
+						   &txin_tmp->prevout))
+					return true;
+			}
 		}
+
+		return false;
 	}
 
-	return false;
+	/* sort outpoints; duplicates become neighbors */
+	const struct bp_outpt **outpts = malloc(n_in * sizeof(*outpts));
+	for (i = 0; i < n_in; i++) {
+		struct bp_txin *txin = parr_idx(tx->vin, i);
+		outpts[i] = &txin->prevout;
+	}
+
+	qsort(outpts, n_in, sizeof(*outpts), bp_outpt_ptr_cmp);
+
+	bool dup = false;
+	for (i = 1; i < n_in && !dup; i++)
+		dup = bp_outpt_equal(outpts[i - 1], outpts[i]);
+
+	free(outpts);
+	return dup;
 }
 
 bool bp_tx_valid(const struct bp_tx *tx)
@@ -181,19 +218,13 @@ void bp_check_merkle_branch(bu256_t *hash, const bu256_t *txhash_in,
 
 static bool bp_block_valid_target(struct bp_block *block)
 {
-	mpz_t target, sha256;
-	mpz_init(target);
-	mpz_init(sha256);
-
-	u256_from_compact(target, block->nBits);
-	bu256_bn(sha256, &block->sha256);
-
-	int cmp = mpz_cmp(sha256, target);
+	bu256_t target;
 
-	mpz_clear(target);
-	mpz_clear(sha256);
+	if (!u256_from_compact(&target, block->nBits) ||
+	    bu256_is_zero(&target))
+		return false;
 
-	if (cmp > 0)			/* sha256 > target */
+	if (bu256_cmp(&block->sha256, &target) > 0)	/* sha256 > target */
 		return false;
 
 	return true;
@@ -208,39 +239,155 @@ static bool bp_block_valid_merkle(struct bp_block *block)
 	return bu256_equal(&merkle, &block->hashMerkleRoot);
 }
 
-bool bp_block_valid(struct bp_block *block)
+static bool block_tx_hash(void *ctx, unsigned int idx)
 {
-	bp_block_calc_sha256(block);
+	parr *vtx = ctx;
+	bp_tx_calc_sha256(parr_idx(vtx, idx));
+	return true;
+}
 
-	if (!block->vtx || !block->vtx->len)
+static bool block_tx_valid(void *ctx, unsigned int idx)
+{
+	parr *vtx = ctx;
+	struct bp_tx *tx = parr_idx(vtx, idx);
+
+	if (!bp_tx_valid(tx))
 		return false;
 
-	if (bp_block_ser_size(block) > MAX_BLOCK_SIZE)
+	bool is_coinbase_idx = (idx == 0);
+	bool is_coinbase = bp_tx_coinbase(tx);
+
+	return (is_coinbase == is_coinbase_idx);
+}
+
+static bool block_for_each_tx(const struct bp_block *block,
+			      bp_parallel_fn fn)
+{
+	unsigned int n_tx = block->vtx->len;
+	unsigned int i;
+
+	if (n_tx >= BLOCK_PARALLEL_MIN_TX)
+		return bp_parallel_for(n_tx, fn, block->vtx);
+
+	for (i = 0; i < n_tx; i++)
+		if (!fn(block->vtx, i))
+			return false;
+
+	return true;
+}
+
+/*
+ * Does any outpoint appear twice among the block's inputs, within a tx
+ * or across txs?  Uses an open-addressed set of outpoint pointers, sized
+ * up front to at least twice the input count so it never grows.
+ */
+bool bp_block_has_dup_spends(const struct bp_block *block)
+{
+	unsigned int n_in = 0;
+	unsigned int i, j;
+
+	if (!block->vtx)
+		return false;
+
+	for (i = 1; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		if (tx->vin)
+			n_in += tx->vin->len;
+	}
+	if (n_in < 2)
+		return false;
+
+	unsigned long n_slots = 1;
+	while (n_slots < (2UL * n_in))
+		n_slots <<= 1;
+	unsigned long mask = n_slots - 1;
+
+	const struct bp_outpt **slots = calloc(n_slots, sizeof(*slots));
+	if (!slots)
+		return true;		/* fail safe */
+
+	bool dup = false;
+	for (i = 1; i < block->vtx->len && !dup; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		if (!tx->vin)
+			continue;
+
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			const struct bp_outpt *outpt = &txin->prevout;
+			unsigned long slot = bp_outpt_hash(outpt) & mask;
+
+			while (slots[slot] &&
+			       !bp_outpt_equal(slots[slot], outpt))
+				slot = (slot + 1) & mask;
+
+			if (slots[slot]) {
+				dup = true;
+				break;
+			}
+			slots[slot] = outpt;
+		}
+	}
+
+	free(slots);
+	return dup;
+}
+
+/* per-tx context-free checks, spread over threads for large blocks */
+bool bp_block_valid_txs(const struct bp_block *block)
+{
+	if (!block->vtx || !block->vtx->len)
 		return false;
 
+	return block_for_each_tx(block, block_tx_valid);
+}
+
+/* the checks a header alone allows: proof of work, and timestamp */
+bool bp_block_valid_hdr(struct bp_block *block)
+{
+	bp_block_calc_sha256(block);
+
 	if (!bp_block_valid_target(block)) return false;
 
 	time_t now = time(NULL);
 	if (block->nTime > (now + (2 * 60 * 60)))
 		return false;
 
-	if (!bp_block_valid_merkle(block)) return false;
+	return true;
+}
 
-	unsigned int i;
-	for (i = 0; i < block->vtx->len; i++) {
-		struct bp_tx *tx;
+static bool block_valid(struct bp_block *block, bool check_merkle)
+{
+	if (!block->vtx || !block->vtx->len)
+		return false;
 
-		tx = parr_idx(block->vtx, i);
-		if (!bp_tx_valid(tx))
-			return false;
+	if (bp_block_ser_size(block) > MAX_BLOCK_SIZE)
+		return false;
 
-		bool is_coinbase_idx = (i == 0);
-		bool is_coinbase = bp_tx_coinbase(tx);
+	if (!bp_block_valid_hdr(block)) return false;
 
-		if (is_coinbase != is_coinbase_idx)
-			return false;
+	if (check_merkle) {
+		/* txids, hashed in parallel ahead of the merkle tree */
+		block_for_each_tx(block, block_tx_hash);
+
+		if (!bp_block_valid_merkle(block)) return false;
 	}
 
-	return true;
+	if (!bp_block_valid_txs(block)) return false;
+
+	/* double spends within the block, before any UTXO or script work */
+	return !bp_block_has_dup_spends(block);
+}
+
+bool bp_block_valid(struct bp_block *block)
+{
+	return block_valid(block, true);
 }
 
+/* as bp_block_valid, for a block whose txids the caller has computed
+ * and checked against the merkle root already
+ */
+bool bp_block_valid_hashed(struct bp_block *block)
+{
+	return block_valid(block, false);
+}
@@ -0,0 +1,372 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/blockfilter.h>
+#include <ccoin/crypto/siphash.h>
+#include <ccoin/parallel.h>
+#include <ccoin/script.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* filters matched per parallel task; query items are hashed per filter */
+#define FILTER_CHUNK 32
+
+/* high 64 bits of a * b, mapping a uniform hash onto [0, b) */
+static inline uint64_t mul_hi64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t) (((unsigned __int128) a * b) >> 64);
+#else
+	uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo;
+	uint64_t hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi;
+	uint64_t hi_hi = a_hi * b_hi;
+	uint64_t mid = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+
+	return hi_hi + (hi_lo >> 32) + (mid >> 32);
+#endif
+}
+
+static int cmp_u64(const void *a_, const void *b_)
+{
+	const uint64_t *a = a_;
+	const uint64_t *b = b_;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static int cmp_item(const void *a_, const void *b_)
+{
+	const struct const_buffer *a = a_;
+	const struct const_buffer *b = b_;
+
+	if (a->len != b->len)
+		return (a->len > b->len) - (a->len < b->len);
+	return a->len ? memcmp(a->p, b->p, a->len) : 0;
+}
+
+/* hash items onto [0, f), sorted */
+static void gcs_hash_items(uint64_t *out, const unsigned char key[16],
+			   const struct const_buffer *items,
+			   unsigned int n_items, uint64_t f)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_items; i++)
+		out[i] = mul_hi64(siphash24(key, items[i].p, items[i].len), f);
+	qsort(out, n_items, sizeof(uint64_t), cmp_u64);
+}
+
+/*
+ * Bit stream writer and reader, most significant bit first
+ */
+
+struct bit_writer {
+	cstring		*s;
+	uint64_t	acc;
+	unsigned int	n_bits;		/* bits pending in acc, < 8 */
+};
+
+static void bw_write(struct bit_writer *bw, uint64_t v, unsigned int n_bits)
+{
+	while (n_bits) {
+		unsigned int n = n_bits > 32 ? 32 : n_bits;
+
+		n_bits -= n;
+		bw->acc = (bw->acc << n) | ((v >> n_bits) & ((1ULL << n) - 1));
+		bw->n_bits += n;
+		while (bw->n_bits >= 8) {
+			bw->n_bits -= 8;
+			cstr_append_c(bw->s, (char) (bw->acc >> bw->n_bits));
+		}
+	}
+}
+
+static void bw_flush(struct bit_writer *bw)
+{
+	if (bw->n_bits)
+		cstr_append_c(bw->s, (char) (bw->acc << (8 - bw->n_bits)));
+	bw->acc = 0;
+	bw->n_bits = 0;
+}
+
+/* up to 64 unread bits, most significant first, refilled by byte */
+struct bit_reader {
+	const unsigned char	*p;
+	const unsigned char	*end;
+	uint64_t		acc;
+	unsigned int		n_bits;
+};
+
+static inline void br_refill(struct bit_reader *br)
+{
+	while ((br->n_bits <= 56) && (br->p < br->end)) {
+		br->acc |= ((uint64_t) *br->p++) << (56 - br->n_bits);
+		br->n_bits += 8;
+	}
+}
+
+static inline void br_skip(struct bit_reader *br, unsigned int n)
+{
+	br->acc = (n < 64) ? (br->acc << n) : 0;
+	br->n_bits -= n;
+}
+
+static void golomb_encode(struct bit_writer *bw, uint64_t x, unsigned int p)
+{
+	uint64_t q = x >> p;
+
+	while (q >= 32) {
+		bw_write(bw, 0xffffffffULL, 32);
+		q -= 32;
+	}
+	bw_write(bw, ((1ULL << q) - 1) << 1, q + 1);
+	bw_write(bw, x, p);
+}
+
+static bool golomb_decode(struct bit_reader *br, uint64_t *x, unsigned int p)
+{
+	uint64_t q = 0;
+
+	/* the unary quotient: count leading ones a word at a time */
+	while (1) {
+		br_refill(br);
+		if (!br->n_bits)
+			return false;
+
+		unsigned int ones = ~br->acc ? __builtin_clzll(~br->acc) : 64;
+		if (ones < br->n_bits) {
+			q += ones;
+			br_skip(br, ones + 1);
+			break;
+		}
+		q += br->n_bits;
+		br_skip(br, br->n_bits);
+	}
+
+	br_refill(br);
+	if (br->n_bits < p)
+		return false;
+
+	*x = (q << p) + (br->acc >> (64 - p));
+	br_skip(br, p);
+	return true;
+}
+
+/*
+ * Golomb-coded sets
+ */
+
+cstring *bp_gcs_build(const unsigned char key[16],
+		      const struct const_buffer *items, unsigned int n_items)
+{
+	struct const_buffer *uniq = NULL;
+	uint64_t *hashes = NULL;
+	unsigned int i, n = 0;
+
+	if (n_items) {
+		uniq = malloc(n_items * sizeof(*uniq));
+		memcpy(uniq, items, n_items * sizeof(*uniq));
+		qsort(uniq, n_items, sizeof(*uniq), cmp_item);
+		for (i = 0; i < n_items; i++)
+			if (!n || cmp_item(&uniq[n - 1], &uniq[i]))
+				uniq[n++] = uniq[i];
+
+		hashes = malloc(n * sizeof(uint64_t));
+		gcs_hash_items(hashes, key, uniq, n,
+			       (uint64_t) n * BP_BASIC_FILTER_M);
+	}
+
+	cstring *s = cstr_new_sz(ser_varlen_size(n) +
+				 (n * (BP_BASIC_FILTER_P + 2) + 7) / 8);
+	ser_varlen(s, n);
+
+	struct bit_writer bw = { s, 0, 0 };
+	uint64_t last = 0;
+	for (i = 0; i < n; i++) {
+		golomb_encode(&bw, hashes[i] - last, BP_BASIC_FILTER_P);
+		last = hashes[i];
+	}
+	bw_flush(&bw);
+
+	free(hashes);
+	free(uniq);
+	return s;
+}
+
+/*
+ * true if any of items is in the filter.  scratch, if given, holds
+ * n_items values, letting callers matching many filters allocate once.
+ */
+bool bp_gcs_match_any(const void *filter, size_t filter_len,
+		      const unsigned char key[16],
+		      const struct const_buffer *items, unsigned int n_items,
+		      uint64_t *scratch)
+{
+	struct const_buffer buf = { filter, filter_len };
+	uint32_t n;
+	bool rc = false;
+
+	if (!n_items || !deser_varlen(&n, &buf) || !n)
+		return false;
+
+	uint64_t *query = scratch ? scratch : malloc(n_items * sizeof(uint64_t));
+	gcs_hash_items(query, key, items, n_items,
+		       (uint64_t) n * BP_BASIC_FILTER_M);
+
+	/* merge the sorted query against the filter, in one pass */
+	struct bit_reader br = { buf.p, (const unsigned char *) buf.p + buf.len,
+				 0, 0 };
+	uint64_t value = 0, delta;
+	unsigned int i, j = 0;
+	for (i = 0; i < n; i++) {
+		if (!golomb_decode(&br, &delta, BP_BASIC_FILTER_P))
+			break;
+		value += delta;
+
+		while (query[j] < value)
+			if (++j == n_items)
+				goto out;
+		if (query[j] == value) {
+			rc = true;
+			break;
+		}
+	}
+
+out:
+	if (!scratch)
+		free(query);
+	return rc;
+}
+
+/*
+ * Basic block filters
+ */
+
+static void filter_key(unsigned char key[16], const struct bp_block *block)
+{
+	memcpy(key, &block->sha256, 16);
+}
+
+static bool filter_script(const cstring *script)
+{
+	return script && script->len &&
+	       ((unsigned char) script->str[0] != OP_RETURN);
+}
+
+/*
+ * block->sha256 must be valid.  undo is the block's spent outputs, as
+ * recorded when it was connected; NULL gives a filter of outputs only.
+ */
+cstring *bp_block_filter_basic(const struct bp_block *block, const parr *undo)
+{
+	unsigned int i, j, n_items = 0, max_items = 0;
+
+	for (i = 0; block->vtx && i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		max_items += tx->vout ? tx->vout->len : 0;
+	}
+	max_items += undo ? undo->len : 0;
+
+	struct const_buffer *items = malloc((max_items + 1) * sizeof(*items));
+
+	for (i = 0; block->vtx && i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		for (j = 0; tx->vout && j < tx->vout->len; j++) {
+			struct bp_txout *txout = parr_idx(tx->vout, j);
+			if (!filter_script(txout->scriptPubKey))
+				continue;
+			items[n_items].p = txout->scriptPubKey->str;
+			items[n_items].len = txout->scriptPubKey->len;
+			n_items++;
+		}
+	}
+
+	for (i = 0; undo && i < undo->len; i++) {
+		struct bp_utxo_undo *u = parr_idx(undo, i);
+		cstring *script = u->txout.scriptPubKey;
+		if (!script || !script->len)
+			continue;
+		items[n_items].p = script->str;
+		items[n_items].len = script->len;
+		n_items++;
+	}
+
+	unsigned char key[16];
+	filter_key(key, block);
+	cstring *s = bp_gcs_build(key, items, n_items);
+
+	free(items);
+	return s;
+}
+
+void bp_block_filter_header(bu256_t *header, const cstring *filter,
+			    const bu256_t *prev_header)
+{
+	unsigned char buf[64];
+
+	bu_Hash(buf, filter->str, filter->len);
+	memcpy(buf + 32, prev_header, 32);
+	bu_Hash((unsigned char *) header, buf, sizeof(buf));
+}
+
+struct match_batch {
+	const struct bp_block_filter_ref	*refs;
+	unsigned int				n_refs;
+	const struct const_buffer		*items;
+	unsigned int				n_items;
+	bool					*match;
+};
+
+static bool match_chunk(void *ctx, unsigned int idx)
+{
+	struct match_batch *mb = ctx;
+	unsigned int i = idx * FILTER_CHUNK;
+	unsigned int end = i + FILTER_CHUNK;
+
+	if (end > mb->n_refs)
+		end = mb->n_refs;
+
+	uint64_t *scratch = malloc(mb->n_items * sizeof(uint64_t));
+	if (!scratch)
+		return false;
+
+	for (; i < end; i++) {
+		const struct bp_block_filter_ref *ref = &mb->refs[i];
+		unsigned char key[16];
+
+		memcpy(key, ref->block_hash, 16);
+		mb->match[i] = bp_gcs_match_any(ref->filter, ref->filter_len,
+						key, mb->items, mb->n_items,
+						scratch);
+	}
+
+	free(scratch);
+	return true;
+}
+
+/* match[i] is set if any of items is in refs[i]'s filter */
+bool bp_block_filter_match_batch(const struct bp_block_filter_ref *refs,
+				 unsigned int n_refs,
+				 const struct const_buffer *items,
+				 unsigned int n_items, bool *match)
+{
+	struct match_batch mb = { refs, n_refs, items, n_items, match };
+
+	if (!n_items) {
+		memset(match, 0, n_refs * sizeof(bool));
+		return true;
+	}
+
+	return bp_parallel_for((n_refs + FILTER_CHUNK - 1) / FILTER_CHUNK,
+			       match_chunk, &mb);
+}
@@ -7,6 +7,9 @@
 #include <string.h>
 #include <ccoin/buffer.h>
 #include <ccoin/bloom.h>
+#include <ccoin/core.h>
+#include <ccoin/endian.h>
+#include <ccoin/script.h>
 #include <ccoin/serialize.h>
 #include <ccoin/cstr.h>
 #include <ccoin/util.h>
@@ -14,6 +17,14 @@
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455L
 #define LN2 0.6931471805599453094172321214581765680755001343602552L
 
+enum {
+	BLOOM_LANES		= 8,	/* hashes per MurmurHash3 pass */
+	BLOOM_LINE_WORDS	= 8,	/* uint64_t per 64-byte cache line */
+	BLOOM_BATCH		= 16,	/* items hashed ahead of probing */
+};
+
+#define BLOOM_SEED_STEP	0xFBA4C795U
+
 static const unsigned char bit_mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
 
 static inline uint32_t ROTL32 ( uint32_t x, int8_t r )
@@ -21,98 +32,249 @@ static inline uint32_t ROTL32 ( uint32_t x, int8_t r )
   return (x << r) | (x >> (32 - r));
 }
 
-static unsigned int bloom_hash(struct bloom *bf, unsigned int nHashNum,
-				   struct const_buffer *vDataToHash_)
+// The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+static const uint32_t c1 = 0xcc9e2d51;
+static const uint32_t c2 = 0x1b873593;
+
+static inline uint32_t murmur3_k(uint32_t k1)
 {
-	// The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
-	uint32_t h1 = nHashNum * (0xffffffffU / (bf->nHashFuncs-1));
-	const uint32_t c1 = 0xcc9e2d51;
-	const uint32_t c2 = 0x1b873593;
-	const unsigned char *vDataToHash = vDataToHash_->p;
+	k1 *= c1;
+	k1 = ROTL32(k1,15);
+	k1 *= c2;
+	return k1;
+}
 
-	const int nblocks = vDataToHash_->len / 4;
+static inline uint32_t murmur3_block(const unsigned char *p)
+{
+	uint32_t k1;
+	memcpy(&k1, p, 4);
+	return murmur3_k(le32toh(k1));
+}
 
-	//----------
-	// body
-	const uint32_t * blocks = (const uint32_t *)(&vDataToHash[0] + nblocks*4);
+static inline uint32_t murmur3_tail(const unsigned char *tail, size_t len)
+{
+	uint32_t k1 = 0;
 
-	int i;
-	for(i = -nblocks; i; i++)
+	switch(len & 3)
 	{
-		uint32_t k1 = blocks[i];
+	case 3: k1 ^= tail[2] << 16;	/* fall through */
+	case 2: k1 ^= tail[1] << 8;	/* fall through */
+	case 1: k1 ^= tail[0];
+			return murmur3_k(k1);
+	};
+	return 0;
+}
 
-		k1 *= c1;
-		k1 = ROTL32(k1,15);
-		k1 *= c2;
+/*
+ * MurmurHash3 of one item under BLOOM_LANES seeds at once.  The data
+ * words are mixed once, the same for every seed; only the running
+ * hashes differ, and those are kept in vector lanes.
+ */
+#ifdef __GNUC__
+typedef uint32_t bloom_lanes_t __attribute__((vector_size(BLOOM_LANES * 4)));
 
-		h1 ^= k1;
-		h1 = ROTL32(h1,13);
+static void murmur3_lanes(const uint32_t *seeds,
+			  const unsigned char *data, size_t len,
+			  uint32_t *out)
+{
+	bloom_lanes_t h1;
+	size_t i, nblocks = len / 4;
+
+	memcpy(&h1, seeds, sizeof(h1));
+
+	for (i = 0; i < nblocks; i++) {
+		h1 ^= murmur3_block(data + (i * 4));
+		h1 = (h1 << 13) | (h1 >> 19);
 		h1 = h1*5+0xe6546b64;
 	}
 
-	//----------
-	// tail
-	const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
+	h1 ^= murmur3_tail(data + (nblocks * 4), len);
 
-	uint32_t k1 = 0;
+	h1 ^= (uint32_t) len;
+	h1 ^= h1 >> 16;
+	h1 *= 0x85ebca6b;
+	h1 ^= h1 >> 13;
+	h1 *= 0xc2b2ae35;
+	h1 ^= h1 >> 16;
 
-	switch(vDataToHash_->len & 3)
-	{
-	case 3: k1 ^= tail[2] << 16;
-	case 2: k1 ^= tail[1] << 8;
-	case 1: k1 ^= tail[0];
-			k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
-	};
+	memcpy(out, &h1, sizeof(h1));
+}
+#else
+static uint32_t murmur3(uint32_t h1, const unsigned char *data, size_t len)
+{
+	size_t i, nblocks = len / 4;
+
+	for (i = 0; i < nblocks; i++) {
+		h1 ^= murmur3_block(data + (i * 4));
+		h1 = ROTL32(h1,13);
+		h1 = h1*5+0xe6546b64;
+	}
+
+	h1 ^= murmur3_tail(data + (nblocks * 4), len);
 
-	//----------
-	// finalization
-	h1 ^= vDataToHash_->len;
+	h1 ^= (uint32_t) len;
 	h1 ^= h1 >> 16;
 	h1 *= 0x85ebca6b;
 	h1 ^= h1 >> 13;
 	h1 *= 0xc2b2ae35;
 	h1 ^= h1 >> 16;
 
-	return h1 % (bf->vData->len * 8);
+	return h1;
 }
 
-static void string_resize(cstring *s, unsigned int new_index)
+static void murmur3_lanes(const uint32_t *seeds,
+			  const unsigned char *data, size_t len,
+			  uint32_t *out)
 {
-	unsigned int new_size = new_index + 1;
-	unsigned int cur_size = s->len;
-	if (cur_size >= new_size)
+	unsigned int l;
+	for (l = 0; l < BLOOM_LANES; l++)
+		out[l] = murmur3(seeds[l], data, len);
+}
+#endif
+
+/*
+ * BIP 37 filters: hash function nHashNum is MurmurHash3 seeded with
+ * nHashNum * 0xFBA4C795 + nTweak, modulo the filter size in bits.  Up
+ * to BLOOM_LANES of them are computed per pass.
+ */
+void bloom_insert(struct bloom *bf, const void *data, size_t data_len)
+{
+	const uint32_t n_bits = bf->vData->len * 8;
+	uint32_t seeds[BLOOM_LANES], h[BLOOM_LANES];
+	unsigned int i, l;
+
+	if (!n_bits)
 		return;
 
-	cstr_resize(s, new_size);
+	for (i = 0; i < bf->nHashFuncs; i += BLOOM_LANES) {
+		unsigned int n = MIN(BLOOM_LANES, bf->nHashFuncs - i);
+
+		for (l = 0; l < BLOOM_LANES; l++)
+			seeds[l] = ((i + l) * BLOOM_SEED_STEP) + bf->nTweak;
+		murmur3_lanes(seeds, data, data_len, h);
 
-	unsigned int pad = new_size - cur_size;
-	memset(s->str + cur_size, 0, pad);
+		for (l = 0; l < n; l++) {
+			uint32_t nIndex = h[l] % n_bits;
+			bf->vData->str[nIndex >> 3] |= bit_mask[7 & nIndex];
+		}
+	}
 }
 
-void bloom_insert(struct bloom *bf, const void *data, size_t data_len)
+bool bloom_contains(struct bloom *bf, const void *data, size_t data_len)
 {
-	struct const_buffer vKey = { data, data_len };
-	unsigned int i;
-	for (i = 0; i < bf->nHashFuncs; i++)
-	{
-		unsigned int nIndex = bloom_hash(bf, i, &vKey);
-		string_resize(bf->vData, nIndex >> 3);
-		bf->vData->str[nIndex >> 3] |= bit_mask[7 & nIndex];
+	const uint32_t n_bits = bf->vData->len * 8;
+	uint32_t seeds[BLOOM_LANES], h[BLOOM_LANES];
+	unsigned int i, l;
+
+	if (!n_bits)
+		return false;
+
+	for (i = 0; i < bf->nHashFuncs; i += BLOOM_LANES) {
+		unsigned int n = MIN(BLOOM_LANES, bf->nHashFuncs - i);
+
+		for (l = 0; l < BLOOM_LANES; l++)
+			seeds[l] = ((i + l) * BLOOM_SEED_STEP) + bf->nTweak;
+		murmur3_lanes(seeds, data, data_len, h);
+
+		for (l = 0; l < n; l++) {
+			uint32_t nIndex = h[l] % n_bits;
+			if (!(bf->vData->str[nIndex >> 3] & bit_mask[7 & nIndex]))
+				return false;
+		}
 	}
+	return true;
 }
 
-bool bloom_contains(struct bloom *bf, const void *data, size_t data_len)
+/* an outpoint as BIP 37 hashes it: txid, then output index */
+static void bloom_outpt_buf(unsigned char *p, const struct bp_outpt *outpt)
 {
-	struct const_buffer vKey = { data, data_len };
-	unsigned int i;
-	for (i = 0; i < bf->nHashFuncs; i++)
-	{
-		unsigned int nIndex = bloom_hash(bf, i, &vKey);
-		string_resize(bf->vData, nIndex >> 3);
-		if (!(bf->vData->str[nIndex >> 3] & bit_mask[7 & nIndex]))
+	uint32_t n = htole32(outpt->n);
+
+	memcpy(p, &outpt->hash, sizeof(outpt->hash));
+	memcpy(p + sizeof(outpt->hash), &n, sizeof(n));
+}
+
+void bloom_insert_outpt(struct bloom *bf, const struct bp_outpt *outpt)
+{
+	unsigned char outpt_buf[36];
+
+	bloom_outpt_buf(outpt_buf, outpt);
+	bloom_insert(bf, outpt_buf, sizeof(outpt_buf));
+}
+
+static bool bloom_script_match(struct bloom *bf, const cstring *script)
+{
+	struct const_buffer buf = { script->str, script->len };
+	struct bscript_parser bp;
+	struct bscript_op op;
+
+	bsp_start(&bp, &buf);
+	while (bsp_getop(&op, &bp))
+		if (op.data.len &&
+		    bloom_contains(bf, op.data.p, op.data.len))
+			return true;
+
+	return false;
+}
+
+static bool bloom_update_outpt(const struct bloom *bf, const cstring *script)
+{
+	switch (bf->nFlags & BLOOM_UPDATE_MASK) {
+	case BLOOM_UPDATE_ALL:
+		return true;
+	case BLOOM_UPDATE_P2PUBKEY_ONLY: {
+		parr *ops = bsp_parse_all(script->str, script->len);
+		if (!ops)
 			return false;
+		enum txnouttype txtype = bsp_classify(ops);
+		parr_free(ops, true);
+		return (txtype == TX_PUBKEY) || (txtype == TX_MULTISIG);
 	}
-	return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * BIP 37 transaction match: the txid, a data push in any output
+ * script, or any spent outpoint or data push in an input script.
+ * Matched outputs are added to the filter as nFlags says, so that
+ * spends of them match too.  tx->sha256 must be valid.
+ */
+bool bloom_tx_match(struct bloom *bf, const struct bp_tx *tx)
+{
+	unsigned char outpt_buf[36];
+	bool found = bloom_contains(bf, &tx->sha256, sizeof(tx->sha256));
+	unsigned int i;
+
+	for (i = 0; tx->vout && (i < tx->vout->len); i++) {
+		struct bp_txout *txout = parr_idx(tx->vout, i);
+		if (!txout->scriptPubKey ||
+		    !bloom_script_match(bf, txout->scriptPubKey))
+			continue;
+
+		found = true;
+		if (bloom_update_outpt(bf, txout->scriptPubKey)) {
+			struct bp_outpt outpt;
+			bu256_copy(&outpt.hash, &tx->sha256);
+			outpt.n = i;
+			bloom_insert_outpt(bf, &outpt);
+		}
+	}
+	if (found)
+		return true;
+
+	for (i = 0; tx->vin && (i < tx->vin->len); i++) {
+		struct bp_txin *txin = parr_idx(tx->vin, i);
+
+		bloom_outpt_buf(outpt_buf, &txin->prevout);
+		if (bloom_contains(bf, outpt_buf, sizeof(outpt_buf)) ||
+		    (txin->scriptSig &&
+		     bloom_script_match(bf, txin->scriptSig)))
+			return true;
+	}
+
+	return false;
 }
 
 bool bloom_size_ok(const struct bloom *bf)
@@ -125,6 +287,9 @@ bool deser_bloom(struct bloom *bf, struct const_buffer *buf)
 {
 	if (!deser_varstr(&bf->vData, buf)) return false;
 	if (!deser_u32(&bf->nHashFuncs, buf)) return false;
+	if (!deser_u32(&bf->nTweak, buf)) return false;
+
+	if (!deser_bytes(&bf->nFlags, buf, 1)) return false;
 	return true;
 }
 
@@ -132,6 +297,8 @@ void ser_bloom(cstring *s, const struct bloom *bf)
 {
 	ser_varstr(s, bf->vData);
 	ser_u32(s, bf->nHashFuncs);
+	ser_u32(s, bf->nTweak);
+	ser_bytes(s, &bf->nFlags, 1);
 }
 
 bool bloom_init(struct bloom *bf, unsigned int nElements, double nFPRate)
@@ -142,7 +309,8 @@ bool bloom_init(struct bloom *bf, unsigned int nElements, double nFPRate)
 	MIN((unsigned int)(-1 / LN2SQUARED * nElements * log(nFPRate)), MAX_BLOOM_FILTER_SIZE * 8) / 8;
 
 	bf->vData = cstr_new_sz(filter_size);
-	string_resize(bf->vData, filter_size - 1);
+	cstr_resize(bf->vData, filter_size);
+	memset(bf->vData->str, 0, filter_size);
 
 	bf->nHashFuncs =
 	MIN((unsigned int)(bf->vData->len * 8 / nElements * LN2), MAX_HASH_FUNCS);
@@ -163,3 +331,195 @@ void bloom_free(struct bloom *bf)
 	}
 }
 
+
+/*
+ * Local filters.  Every probe index comes from the lanes of a single
+ * MurmurHash3 pass.  In flat mode two lanes seed a double-hashing
+ * sequence (Kirsch-Mitzenmacher).  In blocked mode one lane picks the
+ * 64-byte line that all of an item's probes fall in, and the others
+ * are cut into 9-bit bit indexes within it: within a line this small,
+ * double hashing gives noticeably more false positives than
+ * independent indexes.
+ */
+enum {
+	BLOOM_LINE_BITS		= BLOOM_LINE_WORDS * 64,
+	BLOOM_BLOCKED_MAX_K	= (BLOOM_LANES - 1) * 3,  /* 9-bit fields */
+};
+
+static const uint32_t bloom_local_seeds[BLOOM_LANES] = {
+	0, 1, 2, 3, 4, 5, 6, 7,
+};
+
+struct bloom_probe {
+	uint64_t	*words;		/* line, or the whole filter */
+	uint32_t	h[BLOOM_LANES];
+};
+
+static void bloom_local_probe(const struct bloom_local *bf,
+			      const void *data, size_t data_len,
+			      struct bloom_probe *pr)
+{
+	murmur3_lanes(bloom_local_seeds, data, data_len, pr->h);
+
+	if (bf->blocked) {
+		uint32_t line = ((uint64_t) pr->h[0] * bf->n_lines) >> 32;
+		pr->words = bf->bits + (line * BLOOM_LINE_WORDS);
+	} else
+		pr->words = bf->bits;
+}
+
+static inline uint32_t bloom_local_bit(const struct bloom_local *bf,
+				       const struct bloom_probe *pr,
+				       unsigned int i)
+{
+	if (bf->blocked)
+		return (pr->h[1 + (i / 3)] >> (9 * (i % 3))) &
+		       (BLOOM_LINE_BITS - 1);
+
+	uint32_t a = pr->h[1] + (i * (pr->h[2] | 1));
+	return ((uint64_t) a * bf->n_bits) >> 32;
+}
+
+static void bloom_local_set(struct bloom_local *bf,
+			    const struct bloom_probe *pr)
+{
+	unsigned int i;
+
+	for (i = 0; i < bf->nHashFuncs; i++) {
+		uint32_t bit = bloom_local_bit(bf, pr, i);
+		pr->words[bit >> 6] |= (1ULL << (bit & 63));
+	}
+}
+
+static bool bloom_local_test(const struct bloom_local *bf,
+			     const struct bloom_probe *pr)
+{
+	unsigned int i;
+
+	for (i = 0; i < bf->nHashFuncs; i++) {
+		uint32_t bit = bloom_local_bit(bf, pr, i);
+		if (!(pr->words[bit >> 6] & (1ULL << (bit & 63))))
+			return false;
+	}
+	return true;
+}
+
+bool bloom_local_init(struct bloom_local *bf, unsigned int nElements,
+		      double nFPRate, bool blocked)
+{
+	memset(bf, 0, sizeof(*bf));
+
+	if (!nElements || (nFPRate <= 0.0) || (nFPRate >= 1.0))
+		return false;
+
+	double bits = -1 / LN2SQUARED * nElements * log(nFPRate);
+	if (blocked)
+		bits *= 1.1;	/* lines fill unevenly; make up the FP rate */
+	if (bits > (double) 0xffffffffU - 511)
+		return false;
+
+	uint32_t n_lines = ((uint32_t) bits + BLOOM_LINE_BITS - 1) /
+			   BLOOM_LINE_BITS;
+	n_lines = MAX(n_lines, 1);
+
+	void *p;
+	size_t sz = (size_t) n_lines * BLOOM_LINE_BITS / 8;
+	if (posix_memalign(&p, 64, sz))
+		return false;
+	memset(p, 0, sz);
+
+	bf->bits = p;
+	bf->n_lines = n_lines;
+	bf->n_bits = n_lines * BLOOM_LINE_BITS;
+	bf->blocked = blocked;
+
+	unsigned int k = (unsigned int)
+		((double) bf->n_bits / nElements * LN2 + 0.5);
+	bf->nHashFuncs = MIN(MAX(k, 1),
+			     blocked ? BLOOM_BLOCKED_MAX_K : MAX_HASH_FUNCS);
+
+	return true;
+}
+
+void bloom_local_free(struct bloom_local *bf)
+{
+	free(bf->bits);
+	memset(bf, 0, sizeof(*bf));
+}
+
+void bloom_local_insert(struct bloom_local *bf,
+			const void *data, size_t data_len)
+{
+	struct bloom_probe pr;
+
+	bloom_local_probe(bf, data, data_len, &pr);
+	bloom_local_set(bf, &pr);
+}
+
+bool bloom_local_contains(const struct bloom_local *bf,
+			  const void *data, size_t data_len)
+{
+	struct bloom_probe pr;
+
+	bloom_local_probe(bf, data, data_len, &pr);
+	return bloom_local_test(bf, &pr);
+}
+
+/*
+ * Batches hash BLOOM_BATCH items, and prefetch the line each will
+ * probe first, before touching the filter, so the cache misses of a
+ * batch overlap instead of queueing one behind another.
+ */
+static void bloom_local_probe_batch(const struct bloom_local *bf,
+				    const struct const_buffer *items,
+				    unsigned int n, struct bloom_probe *pr)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		bloom_local_probe(bf, items[i].p, items[i].len, &pr[i]);
+
+		uint32_t bit = bloom_local_bit(bf, &pr[i], 0);
+		bp_prefetch(&pr[i].words[bit >> 6]);
+	}
+}
+
+void bloom_local_insert_batch(struct bloom_local *bf,
+			      const struct const_buffer *items,
+			      unsigned int n)
+{
+	struct bloom_probe pr[BLOOM_BATCH];
+	unsigned int i, j;
+
+	for (i = 0; i < n; i += BLOOM_BATCH) {
+		unsigned int batch = MIN(BLOOM_BATCH, n - i);
+
+		bloom_local_probe_batch(bf, items + i, batch, pr);
+		for (j = 0; j < batch; j++)
+			bloom_local_set(bf, &pr[j]);
+	}
+}
+
+/* match[i] for each item (match may be NULL); returns the match count */
+unsigned int bloom_local_contains_batch(const struct bloom_local *bf,
+					const struct const_buffer *items,
+					unsigned int n, bool *match)
+{
+	struct bloom_probe pr[BLOOM_BATCH];
+	unsigned int i, j, n_match = 0;
+
+	for (i = 0; i < n; i += BLOOM_BATCH) {
+		unsigned int batch = MIN(BLOOM_BATCH, n - i);
+
+		bloom_local_probe_batch(bf, items + i, batch, pr);
+		for (j = 0; j < batch; j++) {
+			bool rc = bloom_local_test(bf, &pr[j]);
+			if (match)
+				match[i + j] = rc;
+			if (rc)
+				n_match++;
+		}
+	}
+
+	return n_match;
+}
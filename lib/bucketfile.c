@@ -0,0 +1,385 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/bucketfile.h>
+#include <ccoin/endian.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#ifdef __APPLE__
+#  define off64_t off_t
+#  define pread64 pread
+#  define lseek64 lseek
+#endif
+
+void bp_bucketfile_init(struct bp_bucketfile *bf, const char *magic,
+			uint32_t version, size_t hdr_sz, size_t ent_sz)
+{
+	memset(bf, 0, sizeof(*bf));
+	bf->magic = magic;
+	bf->version = version;
+	bf->hdr_sz = hdr_sz;
+	bf->ent_sz = ent_sz;
+	bf->log_fd = -1;
+}
+
+static uint64_t bucketfile_bucket_start(const struct bp_bucketfile *bf,
+					unsigned int bucket)
+{
+	uint64_t v;
+	memcpy(&v, bf->buckets + (bucket * 8), 8);
+	return le64toh(v);
+}
+
+static void bucketfile_unmap(struct bp_bucketfile *bf)
+{
+	if (bf->map)
+		munmap(bf->map, bf->map_len);
+	bf->map = NULL;
+	bf->map_len = 0;
+	bf->n_base = 0;
+	bf->buckets = NULL;
+	bf->ents = NULL;
+}
+
+/* map FILE, if present, and check its layout */
+static bool bucketfile_map(struct bp_bucketfile *bf)
+{
+	int fd = open(bf->fn, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return (errno == ENOENT);
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < bf->hdr_sz + BP_BUCKETFILE_TAB_SZ)) {
+		close(fd);
+		return false;
+	}
+
+	bf->map_len = st.st_size;
+	bf->map = mmap(NULL, bf->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (bf->map == MAP_FAILED) {
+		bf->map = NULL;
+		return false;
+	}
+
+	struct const_buffer buf = { bf->map, bf->map_len };
+	char magic[8];
+	uint32_t version, reserved;
+
+	if (!deser_bytes(magic, &buf, sizeof(magic)) ||
+	    memcmp(magic, bf->magic, sizeof(magic)))
+		goto err_out;
+	if (!deser_u32(&version, &buf) || version != bf->version)
+		goto err_out;
+	if (!deser_u32(&reserved, &buf) || !deser_u64(&bf->n_base, &buf))
+		goto err_out;
+
+	/* the index's own header fields are read by bp_bucketfile_hdr */
+	buf.p = (const unsigned char *) bf->map + bf->hdr_sz;
+	buf.len = bf->map_len - bf->hdr_sz - BP_BUCKETFILE_TAB_SZ;
+
+	if (buf.len / bf->ent_sz != bf->n_base || buf.len % bf->ent_sz)
+		goto err_out;
+
+	bf->buckets = (const unsigned char *) buf.p;
+	bf->ents = bf->buckets + BP_BUCKETFILE_TAB_SZ;
+
+	/* bucket starts must rise from 0 to n_base */
+	uint64_t prev = 0;
+	unsigned int i;
+	for (i = 0; i <= BP_BUCKETFILE_BUCKETS; i++) {
+		uint64_t start = bucketfile_bucket_start(bf, i);
+		if ((start < prev) || (start > bf->n_base))
+			goto err_out;
+		prev = start;
+	}
+	if ((bucketfile_bucket_start(bf, 0) != 0) || (prev != bf->n_base))
+		goto err_out;
+
+	return true;
+
+err_out:
+	bucketfile_unmap(bf);
+	return false;
+}
+
+static bool bucketfile_log_truncate(struct bp_bucketfile *bf, off64_t len)
+{
+	return (ftruncate(bf->log_fd, len) == 0);
+}
+
+/*
+ * Map fn and open fn.log.  A read-only file never writes the log, so
+ * it may be opened while another process appends to it; a missing
+ * log is then no error.
+ */
+bool bp_bucketfile_open(struct bp_bucketfile *bf, const char *fn,
+			bool read_only)
+{
+	bf->read_only = read_only;
+
+	if (!fn)
+		return true;
+
+	bf->fn = strdup(fn);
+	if (!bucketfile_map(bf))
+		return false;
+
+	size_t log_fn_sz = strlen(fn) + 8;
+	char *log_fn = malloc(log_fn_sz);
+	snprintf(log_fn, log_fn_sz, "%s.log", fn);
+
+	if (read_only)
+		bf->log_fd = open(log_fn, O_RDONLY | O_LARGEFILE);
+	else
+		bf->log_fd = open(log_fn,
+				  O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE,
+				  0666);
+	free(log_fn);
+
+	return (bf->log_fd >= 0) || (read_only && (errno == ENOENT));
+}
+
+void bp_bucketfile_close(struct bp_bucketfile *bf)
+{
+	if (bf->log_fd >= 0)
+		close(bf->log_fd);
+	bf->log_fd = -1;
+	bucketfile_unmap(bf);
+	free(bf->fn);
+	bf->fn = NULL;
+}
+
+/* the index's part of the FILE header; false if there is no FILE */
+bool bp_bucketfile_hdr(const struct bp_bucketfile *bf,
+		       struct const_buffer *buf)
+{
+	if (!bf->map)
+		return false;
+
+	buf->p = (const unsigned char *) bf->map + BP_BUCKETFILE_HDR_SZ;
+	buf->len = bf->hdr_sz - BP_BUCKETFILE_HDR_SZ;
+	return true;
+}
+
+/* first FILE record whose leading key_len bytes are not below key */
+uint64_t bp_bucketfile_lower_bound(const struct bp_bucketfile *bf,
+				   const void *key, size_t key_len)
+{
+	if (!bf->n_base)
+		return 0;
+
+	unsigned int bucket = bp_bucketfile_bucket(key);
+	uint64_t lo = bucketfile_bucket_start(bf, bucket);
+	uint64_t hi = bucketfile_bucket_start(bf, bucket + 1);
+
+	while (lo < hi) {
+		uint64_t mid = lo + ((hi - lo) / 2);
+		if (memcmp(bp_bucketfile_ent(bf, mid), key, key_len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Feed FILE.log to rec_fn.  Records after the last commit belong to a
+ * block whose write was cut short; unless read-only, cut them from the
+ * log.  The caller drops them from its pending block.
+ */
+bool bp_bucketfile_replay_log(struct bp_bucketfile *bf,
+			      bp_bucketfile_rec_fn rec_fn, void *priv)
+{
+	if (bf->log_fd < 0)
+		return true;
+
+	struct stat st;
+	if (fstat(bf->log_fd, &st) < 0)
+		return false;
+
+	const size_t chunk_sz = bf->ent_sz * 4096;
+	unsigned char *chunk = malloc(chunk_sz);
+	off64_t pos = 0, commit_end = 0;
+	bool rc = false;
+
+	while (pos + bf->ent_sz <= st.st_size) {
+		size_t want = MIN(chunk_sz, st.st_size - pos);
+		want -= want % bf->ent_sz;
+
+		ssize_t rrc = pread64(bf->log_fd, chunk, want, pos);
+		if (rrc != want)
+			goto out;
+
+		size_t ofs;
+		for (ofs = 0; ofs < want; ofs += bf->ent_sz) {
+			int kind = rec_fn(priv, chunk + ofs);
+			if (kind < 0)
+				goto truncate;
+
+			pos += bf->ent_sz;
+			if (kind > 0)
+				commit_end = pos;
+		}
+	}
+
+truncate:
+	if ((commit_end < st.st_size) && !bf->read_only &&
+	    !bucketfile_log_truncate(bf, commit_end))
+		goto out;
+
+	rc = true;
+
+out:
+	free(chunk);
+	return rc;
+}
+
+/* append one block's records, commit record included, in one write */
+bool bp_bucketfile_log_append(struct bp_bucketfile *bf,
+			      const void *data, size_t data_len)
+{
+	if (bf->log_fd < 0)
+		return true;
+
+	ssize_t wrc = write(bf->log_fd, data, data_len);
+	if (wrc == data_len)
+		return true;
+
+	/* replay drops a torn block, but cut it off now so that later
+	 * blocks stay readable
+	 */
+	off64_t end = lseek64(bf->log_fd, 0, SEEK_END);
+	if ((wrc > 0) && (end >= wrc))
+		bucketfile_log_truncate(bf, end - wrc);
+	return false;
+}
+
+static void bucketfile_flush(struct bp_bucketfile_writer *w)
+{
+	if (w->buf->len && !w->failed &&
+	    (write(w->fd, w->buf->str, w->buf->len) != w->buf->len))
+		w->failed = true;
+
+	cstr_resize(w->buf, 0);
+}
+
+/*
+ * Start a new FILE beside the current one.  Records are then put in
+ * key order, and bp_bucketfile_write_end moves the result into place.
+ */
+bool bp_bucketfile_write_begin(struct bp_bucketfile *bf,
+			       struct bp_bucketfile_writer *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->bf = bf;
+
+	size_t tmpfn_sz = strlen(bf->fn) + 16;
+	w->tmpfn = malloc(tmpfn_sz);
+	snprintf(w->tmpfn, tmpfn_sz, "%s.XXXXXX", bf->fn);
+
+	w->fd = mkstemp(w->tmpfn);
+	if (w->fd < 0)
+		goto err_out;
+
+	/* header and bucket table are written last */
+	if (lseek(w->fd, bf->hdr_sz + BP_BUCKETFILE_TAB_SZ, SEEK_SET) < 0) {
+		close(w->fd);
+		unlink(w->tmpfn);
+		goto err_out;
+	}
+
+	w->buf = cstr_new_sz(1024 * 1024 + bf->ent_sz);
+	w->counts = calloc(BP_BUCKETFILE_BUCKETS, sizeof(uint64_t));
+	return true;
+
+err_out:
+	free(w->tmpfn);
+	w->tmpfn = NULL;
+	return false;
+}
+
+void bp_bucketfile_write_put(struct bp_bucketfile_writer *w, const void *rec)
+{
+	ser_bytes(w->buf, rec, w->bf->ent_sz);
+	w->counts[bp_bucketfile_bucket(rec)]++;
+	w->n++;
+
+	if (w->buf->len >= (1024 * 1024))
+		bucketfile_flush(w);
+}
+
+/*
+ * Write the header, hdr being the index's part of it, and rename the
+ * new FILE over the old one.  The writer is released either way.
+ */
+bool bp_bucketfile_write_end(struct bp_bucketfile_writer *w,
+			     const cstring *hdr)
+{
+	struct bp_bucketfile *bf = w->bf;
+	bool rc = false;
+
+	bucketfile_flush(w);
+
+	cstring *s = cstr_new_sz(bf->hdr_sz + BP_BUCKETFILE_TAB_SZ);
+	ser_bytes(s, bf->magic, 8);
+	ser_u32(s, bf->version);
+	ser_u32(s, 0);
+	ser_u64(s, w->n);
+	ser_bytes(s, hdr->str, hdr->len);
+
+	uint64_t start = 0;
+	unsigned int b;
+	for (b = 0; b < BP_BUCKETFILE_BUCKETS; b++) {
+		ser_u64(s, start);
+		start += w->counts[b];
+	}
+	ser_u64(s, start);
+
+	bool hdr_ok = (hdr->len == (bf->hdr_sz - BP_BUCKETFILE_HDR_SZ)) &&
+		      (pwrite(w->fd, s->str, s->len, 0) == s->len);
+	cstr_free(s, true);
+
+	if (close(w->fd) < 0)
+		w->failed = true;
+
+	if (hdr_ok && !w->failed && (rename(w->tmpfn, bf->fn) == 0))
+		rc = true;
+	else
+		unlink(w->tmpfn);
+
+	free(w->counts);
+	cstr_free(w->buf, true);
+	free(w->tmpfn);
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+	return rc;
+}
+
+/*
+ * After a new FILE is in place: map it, and empty the log, whose
+ * records it now holds.  Replaying them again after a failed truncate
+ * would be harmless.
+ */
+bool bp_bucketfile_reload(struct bp_bucketfile *bf)
+{
+	bucketfile_unmap(bf);
+	bool trunc_ok = (bf->log_fd < 0) || bucketfile_log_truncate(bf, 0);
+
+	return bucketfile_map(bf) && trunc_ok;
+}
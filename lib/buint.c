@@ -120,3 +120,200 @@ void bu256_freep(void *bu256_v)
 	free(v);
 }
 
+
+/*
+ * Fixed-width arithmetic.  Values are unpacked into host-order words,
+ * least significant first, so the loops below are endian-neutral.
+ */
+
+static void bu256_unpack(uint32_t *w, const bu256_t *v)
+{
+	unsigned int i;
+	for (i = 0; i < BU256_WORDS; i++)
+		w[i] = le32toh(v->dword[i]);
+}
+
+static void bu256_pack(bu256_t *v, const uint32_t *w)
+{
+	unsigned int i;
+	for (i = 0; i < BU256_WORDS; i++)
+		v->dword[i] = htole32(w[i]);
+}
+
+static int words_cmp(const uint32_t *a, const uint32_t *b)
+{
+	int i;
+	for (i = BU256_WORDS - 1; i >= 0; i--) {
+		if (a[i] < b[i])
+			return -1;
+		if (a[i] > b[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+static unsigned int words_bits(const uint32_t *w)
+{
+	int i;
+	for (i = BU256_WORDS - 1; i >= 0; i--) {
+		if (w[i])
+			return (i * 32) + 32 - __builtin_clz(w[i]);
+	}
+
+	return 0;
+}
+
+static void words_shl(uint32_t *w, unsigned int shift)
+{
+	unsigned int k = shift / 32, b = shift % 32;
+	int i;
+
+	for (i = BU256_WORDS - 1; i >= 0; i--) {
+		uint32_t v = 0;
+		if (i >= k) {
+			v = w[i - k] << b;
+			if (b && (i > k))
+				v |= w[i - k - 1] >> (32 - b);
+		}
+		w[i] = v;
+	}
+}
+
+static void words_shr1(uint32_t *w)
+{
+	unsigned int i;
+	for (i = 0; i < BU256_WORDS; i++) {
+		w[i] >>= 1;
+		if (i + 1 < BU256_WORDS)
+			w[i] |= w[i + 1] << 31;
+	}
+}
+
+static void words_sub(uint32_t *a, const uint32_t *b)
+{
+	uint64_t borrow = 0;
+	unsigned int i;
+	for (i = 0; i < BU256_WORDS; i++) {
+		uint64_t n = (uint64_t) a[i] - b[i] - borrow;
+		a[i] = (uint32_t) n;
+		borrow = (n >> 32) & 1;
+	}
+}
+
+static void words_add(uint32_t *vo, const uint32_t *a, const uint32_t *b)
+{
+	uint64_t carry = 0;
+	unsigned int i;
+	for (i = 0; i < BU256_WORDS; i++) {
+		uint64_t n = carry + a[i] + b[i];
+		vo[i] = (uint32_t) n;
+		carry = n >> 32;
+	}
+}
+
+void bu256_add(bu256_t *vo, const bu256_t *a, const bu256_t *b)
+{
+	uint32_t wa[BU256_WORDS], wb[BU256_WORDS];
+
+	bu256_unpack(wa, a);
+	bu256_unpack(wb, b);
+	words_add(wa, wa, wb);
+	bu256_pack(vo, wa);
+}
+
+void bu256_sub(bu256_t *vo, const bu256_t *a, const bu256_t *b)
+{
+	uint32_t wa[BU256_WORDS], wb[BU256_WORDS];
+
+	bu256_unpack(wa, a);
+	bu256_unpack(wb, b);
+	words_sub(wa, wb);
+	bu256_pack(vo, wa);
+}
+
+int bu256_cmp(const bu256_t *a, const bu256_t *b)
+{
+	uint32_t wa[BU256_WORDS], wb[BU256_WORDS];
+
+	bu256_unpack(wa, a);
+	bu256_unpack(wb, b);
+	return words_cmp(wa, wb);
+}
+
+/* expand compact nBits encoding into a 256-bit target.  returns false
+ * for negative or overflowing encodings, which are never valid targets.
+ */
+bool bu256_set_compact(bu256_t *vo, uint32_t compact)
+{
+	uint32_t w[BU256_WORDS];
+	unsigned int nbytes = compact >> 24;
+	uint32_t mantissa = compact & 0x007fffff;
+
+	memset(w, 0, sizeof(w));
+
+	if (nbytes <= 3) {
+		w[0] = mantissa >> (8 * (3 - nbytes));
+	} else {
+		if (mantissa &&
+		    ((nbytes > 34) ||
+		     ((mantissa > 0xff) && (nbytes > 33)) ||
+		     ((mantissa > 0xffff) && (nbytes > 32)))) {
+			bu256_zero(vo);
+			return false;
+		}
+
+		w[0] = mantissa;
+		words_shl(w, 8 * (nbytes - 3));
+	}
+
+	bu256_pack(vo, w);
+
+	if (mantissa && (compact & 0x00800000))
+		return false;
+
+	return true;
+}
+
+/* proof-of-work represented by target: 2**256 / (target + 1), computed
+ * as (~target / (target + 1)) + 1 so that it fits in 256 bits.
+ */
+void bu256_target_work(bu256_t *work, const bu256_t *target)
+{
+	uint32_t num[BU256_WORDS], div[BU256_WORDS], q[BU256_WORDS];
+	uint32_t one[BU256_WORDS] = { 1 };
+	unsigned int i;
+
+	memset(q, 0, sizeof(q));
+
+	bu256_unpack(div, target);
+	if (!words_bits(div)) {
+		bu256_zero(work);
+		return;
+	}
+
+	for (i = 0; i < BU256_WORDS; i++)
+		num[i] = ~div[i];
+	words_add(div, div, one);
+
+	unsigned int num_bits = words_bits(num);
+	unsigned int div_bits = words_bits(div);
+
+	/* div == 0 only if target was 2**256-1; quotient is then 0 */
+	if (div_bits && (div_bits <= num_bits)) {
+		int shift = num_bits - div_bits;
+		words_shl(div, shift);
+
+		while (shift >= 0) {
+			if (words_cmp(num, div) >= 0) {
+				words_sub(num, div);
+				q[shift / 32] |= (1U << (shift % 32));
+			}
+			words_shr1(div);
+			shift--;
+		}
+	}
+
+	words_add(q, q, one);
+	bu256_pack(work, q);
+}
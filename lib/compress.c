@@ -0,0 +1,239 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ccoin/compress.h>
+#include <ccoin/key.h>
+#include <ccoin/script.h>
+#include <ccoin/serialize.h>
+
+uint64_t bp_amount_compress(uint64_t n)
+{
+	if (n == 0)
+		return 0;
+
+	unsigned int e = 0;
+	while (((n % 10) == 0) && (e < 9)) {
+		n /= 10;
+		e++;
+	}
+
+	if (e < 9) {
+		unsigned int d = n % 10;
+		n /= 10;
+		return 1 + (n * 9 + d - 1) * 10 + e;
+	}
+
+	return 1 + (n - 1) * 10 + 9;
+}
+
+uint64_t bp_amount_decompress(uint64_t x)
+{
+	if (x == 0)
+		return 0;
+
+	x--;
+	unsigned int e = x % 10;
+	x /= 10;
+
+	uint64_t n;
+	if (e < 9) {
+		unsigned int d = (x % 9) + 1;
+		x /= 9;
+		n = x * 10 + d;
+	} else
+		n = x + 1;
+
+	while (e) {
+		n *= 10;
+		e--;
+	}
+
+	return n;
+}
+
+/* template tag of script, filling payload; -1 if not special */
+static int script_special(const cstring *script, unsigned char *payload)
+{
+	const unsigned char *vch = (const unsigned char *) script->str;
+	size_t len = script->len;
+
+	if (len == 25 && vch[0] == OP_DUP && vch[1] == OP_HASH160 &&
+	    vch[2] == 0x14 && vch[23] == OP_EQUALVERIFY &&
+	    vch[24] == OP_CHECKSIG) {
+		memcpy(payload, &vch[3], 20);
+		return 0x00;
+	}
+
+	if (len == 23 && vch[0] == OP_HASH160 && vch[1] == 0x14 &&
+	    vch[22] == OP_EQUAL) {
+		memcpy(payload, &vch[2], 20);
+		return 0x01;
+	}
+
+	if (len == 35 && vch[0] == 33 && vch[34] == OP_CHECKSIG &&
+	    (vch[1] == 0x02 || vch[1] == 0x03)) {
+		memcpy(payload, &vch[2], 32);
+		return vch[1];
+	}
+
+	/* only points on the curve can be rebuilt from x and parity */
+	if (len == 67 && vch[0] == 65 && vch[66] == OP_CHECKSIG &&
+	    vch[1] == 0x04) {
+		struct bp_key key;
+		bp_key_init(&key);
+		bool valid = bp_pubkey_set(&key, &vch[1], 65);
+		bp_key_free(&key);
+		if (!valid)
+			return -1;
+
+		memcpy(payload, &vch[2], 32);
+		return 0x04 | (vch[65] & 0x01);
+	}
+
+	return -1;
+}
+
+static unsigned int script_special_size(unsigned int tag)
+{
+	return (tag < 2) ? 20 : 32;
+}
+
+void bp_script_compress(cstring *s, const cstring *script)
+{
+	unsigned char payload[32];
+	int tag = script ? script_special(script, payload) : -1;
+
+	if (tag >= 0) {
+		unsigned char c = tag;
+		ser_bytes(s, &c, 1);
+		ser_bytes(s, payload, script_special_size(tag));
+		return;
+	}
+
+	size_t len = script ? script->len : 0;
+	ser_varint(s, len + BP_SCRIPT_N_SPECIAL);
+	if (len)
+		ser_bytes(s, script->str, len);
+}
+
+static bool script_expand(cstring *s, unsigned int tag,
+			  const unsigned char *payload)
+{
+	unsigned char vch[67];
+
+	switch (tag) {
+	case 0x00:
+		vch[0] = OP_DUP;
+		vch[1] = OP_HASH160;
+		vch[2] = 0x14;
+		memcpy(&vch[3], payload, 20);
+		vch[23] = OP_EQUALVERIFY;
+		vch[24] = OP_CHECKSIG;
+		cstr_append_buf(s, vch, 25);
+		return true;
+
+	case 0x01:
+		vch[0] = OP_HASH160;
+		vch[1] = 0x14;
+		memcpy(&vch[2], payload, 20);
+		vch[22] = OP_EQUAL;
+		cstr_append_buf(s, vch, 23);
+		return true;
+
+	case 0x02:
+	case 0x03:
+		vch[0] = 33;
+		vch[1] = tag;
+		memcpy(&vch[2], payload, 32);
+		vch[34] = OP_CHECKSIG;
+		cstr_append_buf(s, vch, 35);
+		return true;
+	}
+
+	/* 0x04, 0x05: recover y from the compressed form */
+	unsigned char pub33[33];
+	pub33[0] = tag - 2;
+	memcpy(&pub33[1], payload, 32);
+
+	struct bp_key key;
+	void *pub65 = NULL;
+	size_t pub_len = 0;
+	bool rc = false;
+
+	bp_key_init(&key);
+	if (!bp_pubkey_set(&key, pub33, sizeof(pub33)) ||
+	    !bp_pubkey_get_uncompressed(&key, &pub65, &pub_len) ||
+	    (pub_len != 65))
+		goto out;
+
+	vch[0] = 65;
+	memcpy(&vch[1], pub65, 65);
+	vch[66] = OP_CHECKSIG;
+	cstr_append_buf(s, vch, 67);
+	rc = true;
+
+out:
+	free(pub65);
+	bp_key_free(&key);
+	return rc;
+}
+
+bool bp_script_decompress(cstring **so, struct const_buffer *buf)
+{
+	if (*so) {
+		cstr_free(*so, true);
+		*so = NULL;
+	}
+
+	uint64_t v;
+	if (!deser_varint(&v, buf)) return false;
+
+	cstring *s;
+	if (v < BP_SCRIPT_N_SPECIAL) {
+		unsigned char payload[32];
+		if (!deser_bytes(payload, buf, script_special_size(v)))
+			return false;
+
+		s = cstr_new_sz(67);
+		if (!script_expand(s, v, payload)) {
+			cstr_free(s, true);
+			return false;
+		}
+	} else {
+		uint64_t len = v - BP_SCRIPT_N_SPECIAL;
+		if (buf->len < len)
+			return false;
+
+		s = cstr_new_sz(len);
+		cstr_append_buf(s, buf->p, len);
+		buf->p += len;
+		buf->len -= len;
+	}
+
+	*so = s;
+	return true;
+}
+
+void ser_bp_txout_compressed(cstring *s, const struct bp_txout *txout)
+{
+	ser_varint(s, bp_amount_compress(txout->nValue));
+	bp_script_compress(s, txout->scriptPubKey);
+}
+
+bool deser_bp_txout_compressed(struct bp_txout *txout,
+			       struct const_buffer *buf)
+{
+	bp_txout_free(txout);
+
+	uint64_t v;
+	if (!deser_varint(&v, buf)) return false;
+	txout->nValue = bp_amount_decompress(v);
+
+	if (!bp_script_decompress(&txout->scriptPubKey, buf)) return false;
+	return true;
+}
@@ -402,16 +402,23 @@ void bp_tx_calc_sha256(struct bp_tx *tx)
 
 unsigned int bp_tx_ser_size(const struct bp_tx *tx)
 {
-	unsigned int tx_ser_size;
+	/* count, rather than build, the ser_bp_tx() encoding */
+	unsigned int tx_ser_size = 4 + 4;	/* nVersion, nLockTime */
+	unsigned int i;
 
-	/* TODO: introduce a counting-only serialization mode */
+	tx_ser_size += ser_varlen_size(tx->vin ? tx->vin->len : 0);
+	for (i = 0; tx->vin && i < tx->vin->len; i++) {
+		struct bp_txin *txin = parr_idx(tx->vin, i);
 
-	cstring *s = cstr_new_sz(512);
-	ser_bp_tx(s, tx);
+		tx_ser_size += 32 + 4 + 4 + ser_varstr_size(txin->scriptSig);
+	}
 
-	tx_ser_size = s->len;
+	tx_ser_size += ser_varlen_size(tx->vout ? tx->vout->len : 0);
+	for (i = 0; tx->vout && i < tx->vout->len; i++) {
+		struct bp_txout *txout = parr_idx(tx->vout, i);
 
-	cstr_free(s, true);
+		tx_ser_size += 8 + ser_varstr_size(txout->scriptPubKey);
+	}
 
 	return tx_ser_size;
 }
@@ -589,16 +596,15 @@ void bp_block_calc_sha256(struct bp_block *block)
 
 unsigned int bp_block_ser_size(const struct bp_block *block)
 {
-	unsigned int block_ser_size;
+	unsigned int block_ser_size = 80;	/* header */
 
-	/* TODO: introduce a counting-only serialization mode */
-
-	cstring *s = cstr_new_sz(200 * 1024);
-	ser_bp_block(s, block);
-
-	block_ser_size = s->len;
+	if (block->vtx) {
+		unsigned int i;
 
-	cstr_free(s, true);
+		block_ser_size += ser_varlen_size(block->vtx->len);
+		for (i = 0; i < block->vtx->len; i++)
+			block_ser_size += bp_tx_ser_size(parr_idx(block->vtx, i));
+	}
 
 	return block_ser_size;
 }
@@ -0,0 +1,380 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/crypto/aes_recfile.h>
+#include <ccoin/crypto/aes_util.h>      // for BytesToKeySHA512AES
+#include <ccoin/crypto/ctaes.h>         // for AES256_ctx, AES256_encrypt
+#include <ccoin/crypto/hmac.h>          // for hmac_sha256
+#include <ccoin/crypto/prng.h>          // for prng_get_random_bytes
+#include <ccoin/compat.h>               // for fdatasync
+#include <ccoin/endian.h>               // for htole32, htole64
+#include <ccoin/util.h>                 // for bu_write_file
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>                      // for open
+#include <stdlib.h>                     // for malloc, free
+#include <string.h>                     // for memcmp, memcpy
+#include <unistd.h>                     // for pread, pwrite, ftruncate
+
+static const char aes_recfile_magic[8] = "ccaesrec";
+
+/* record: length, IV, ciphertext, MAC */
+#define AES_RECFILE_REC_OVERHEAD	(4 + AES_RECFILE_IV_SZ + AES_RECFILE_MAC_SZ)
+
+/* refuse KDF costs no writer would have chosen */
+#define AES_RECFILE_MAX_ROUNDS		(1U << 24)
+
+static bool aes_recfile_derive(struct aes_recfile *rf,
+			       const void *key_data, size_t key_data_len)
+{
+	unsigned char master[AES256_KEY_LENGTH], iv[AES256_BLOCK_LENGTH];
+
+	if (BytesToKeySHA512AES(rf->salt, (unsigned char *) key_data,
+				key_data_len, rf->rounds, master, iv) !=
+	    AES256_KEY_LENGTH)
+		return false;
+
+	hmac_sha256(master, sizeof(master), "ccaesrec enc", 12, rf->enc_key);
+	hmac_sha256(master, sizeof(master), "ccaesrec mac", 12, rf->mac_key);
+
+	MEMSET_BZERO(master, sizeof(master));
+	MEMSET_BZERO(iv, sizeof(iv));
+	return true;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return le32toh(v);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return le64toh(v);
+}
+
+static bool mac_equal(const unsigned char *a, const unsigned char *b)
+{
+	unsigned char diff = 0;
+	unsigned int i;
+
+	for (i = 0; i < AES_RECFILE_MAC_SZ; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+/* AES-256-CTR, counter starting at iv (big-endian); in place */
+static void aes_recfile_ctr(const struct aes_recfile *rf,
+			    const unsigned char *iv, unsigned char *data,
+			    size_t len)
+{
+	unsigned char ctr[AES256_BLOCK_LENGTH * 16];
+	unsigned char ks[sizeof(ctr)];
+	unsigned char cur[AES256_BLOCK_LENGTH];
+	AES256_ctx ctx;
+	size_t pos = 0;
+	int j;
+
+	AES256_init(&ctx, rf->enc_key);
+	memcpy(cur, iv, sizeof(cur));
+
+	while (pos < len) {
+		size_t n = len - pos;
+		if (n > sizeof(ks))
+			n = sizeof(ks);
+		unsigned int blocks = (n + AES256_BLOCK_LENGTH - 1) /
+				      AES256_BLOCK_LENGTH;
+		unsigned int b;
+
+		for (b = 0; b < blocks; b++) {
+			memcpy(ctr + (b * AES256_BLOCK_LENGTH), cur,
+			       AES256_BLOCK_LENGTH);
+			for (j = AES256_BLOCK_LENGTH - 1; j >= 0; j--)
+				if (++cur[j])
+					break;
+		}
+
+		AES256_encrypt(&ctx, blocks, ks, ctr);
+
+		size_t i;
+		for (i = 0; i < n; i++)
+			data[pos + i] ^= ks[i];
+		pos += n;
+	}
+
+	MEMSET_BZERO(ks, sizeof(ks));
+	MEMSET_BZERO(&ctx, sizeof(ctx));
+}
+
+static void aes_recfile_rec_mac(const struct aes_recfile *rf, uint64_t seq,
+				const unsigned char *rec, size_t rec_len,
+				unsigned char *mac)
+{
+	unsigned char *buf = malloc(8 + rec_len);
+	uint64_t seq_le = htole64(seq);
+
+	memcpy(buf, &seq_le, 8);
+	memcpy(buf + 8, rec, rec_len);
+	hmac_sha256(rf->mac_key, sizeof(rf->mac_key), buf, 8 + rec_len, mac);
+	free(buf);
+}
+
+static void aes_recfile_hdr(const struct aes_recfile *rf, uint64_t n_recs,
+			    unsigned char *hdr)
+{
+	uint32_t v;
+	uint64_t n_le = htole64(n_recs);
+
+	memcpy(hdr, aes_recfile_magic, 8);
+	v = htole32(AES_RECFILE_VERSION);
+	memcpy(hdr + 8, &v, 4);
+	v = htole32(rf->rounds);
+	memcpy(hdr + 12, &v, 4);
+	memcpy(hdr + 16, rf->salt, AES_RECFILE_SALT_SZ);
+	memcpy(hdr + 16 + AES_RECFILE_SALT_SZ, &n_le, 8);
+
+	hmac_sha256(rf->mac_key, sizeof(rf->mac_key), hdr,
+		    AES_RECFILE_HDR_SZ - AES_RECFILE_MAC_SZ,
+		    hdr + AES_RECFILE_HDR_SZ - AES_RECFILE_MAC_SZ);
+}
+
+/* record seq, encrypted and authenticated, appended to s */
+static bool aes_recfile_seal(const struct aes_recfile *rf, uint64_t seq,
+			     cstring *s, const void *data, size_t data_len)
+{
+	if (data_len > 0xffffffffU - AES_RECFILE_REC_OVERHEAD)
+		return false;
+
+	size_t start = s->len;
+	uint32_t len_le = htole32(data_len);
+	unsigned char iv[AES_RECFILE_IV_SZ];
+
+	if (prng_get_random_bytes(iv, sizeof(iv)) < 0)
+		return false;
+
+	cstr_append_buf(s, &len_le, 4);
+	cstr_append_buf(s, iv, sizeof(iv));
+	cstr_append_buf(s, data, data_len);
+	aes_recfile_ctr(rf, iv, (unsigned char *) s->str + start + 4 +
+			sizeof(iv), data_len);
+
+	unsigned char mac[AES_RECFILE_MAC_SZ];
+	aes_recfile_rec_mac(rf, seq, (unsigned char *) s->str + start,
+			    s->len - start, mac);
+	cstr_append_buf(s, mac, sizeof(mac));
+	return true;
+}
+
+/* Does filename start like a record file?  Says nothing of the rest. */
+bool aes_recfile_is(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	char magic[sizeof(aes_recfile_magic)];
+	bool rc = (read(fd, magic, sizeof(magic)) == sizeof(magic)) &&
+		  !memcmp(magic, aes_recfile_magic, sizeof(magic));
+
+	close(fd);
+	return rc;
+}
+
+/* Keys for a new file, with a fresh salt; aes_recfile_write() creates it. */
+bool aes_recfile_new(struct aes_recfile *rf,
+		     const void *key_data, size_t key_data_len)
+{
+	memset(rf, 0, sizeof(*rf));
+	rf->fd = -1;
+	rf->rounds = AES_RECFILE_KDF_ROUNDS;
+
+	if (prng_get_random_bytes(rf->salt, sizeof(rf->salt)) < 0)
+		return false;
+
+	return aes_recfile_derive(rf, key_data, key_data_len);
+}
+
+static bool read_fd_all(int fd, unsigned char **data, size_t *data_len)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return false;
+
+	size_t len = st.st_size;
+	unsigned char *buf = malloc(len ? len : 1);
+	size_t pos = 0;
+
+	while (pos < len) {
+		ssize_t rrc = pread(fd, buf + pos, len - pos, pos);
+		if (rrc <= 0) {
+			free(buf);
+			return false;
+		}
+		pos += rrc;
+	}
+
+	*data = buf;
+	*data_len = len;
+	return true;
+}
+
+/*
+ * Open filename, and return the concatenated plaintext of its records
+ * in *contents.  Fails on a wrong passphrase or any damaged record
+ * other than a torn last one.
+ */
+bool aes_recfile_open(struct aes_recfile *rf, const char *filename,
+		      const void *key_data, size_t key_data_len,
+		      cstring **contents)
+{
+	unsigned char *data = NULL;
+	size_t data_len = 0;
+	cstring *out = NULL;
+
+	memset(rf, 0, sizeof(*rf));
+	rf->fd = open(filename, O_RDWR);
+	if (rf->fd < 0)
+		rf->fd = open(filename, O_RDONLY);
+	if ((rf->fd < 0) || !read_fd_all(rf->fd, &data, &data_len))
+		goto err_out;
+
+	if ((data_len < AES_RECFILE_HDR_SZ) ||
+	    memcmp(data, aes_recfile_magic, sizeof(aes_recfile_magic)) ||
+	    (get_le32(data + 8) != AES_RECFILE_VERSION))
+		goto err_out;
+
+	rf->rounds = get_le32(data + 12);
+	memcpy(rf->salt, data + 16, sizeof(rf->salt));
+	if (!rf->rounds || (rf->rounds > AES_RECFILE_MAX_ROUNDS) ||
+	    !aes_recfile_derive(rf, key_data, key_data_len))
+		goto err_out;
+
+	uint64_t hdr_recs = get_le64(data + 16 + AES_RECFILE_SALT_SZ);
+	unsigned char hdr[AES_RECFILE_HDR_SZ];
+	aes_recfile_hdr(rf, hdr_recs, hdr);
+	if (!mac_equal(hdr + AES_RECFILE_HDR_SZ - AES_RECFILE_MAC_SZ,
+		       data + AES_RECFILE_HDR_SZ - AES_RECFILE_MAC_SZ))
+		goto err_out;
+
+	out = cstr_new_sz(data_len);
+	size_t pos = AES_RECFILE_HDR_SZ;
+
+	while ((data_len - pos) >= AES_RECFILE_REC_OVERHEAD) {
+		uint32_t len = get_le32(data + pos);
+		size_t rec_len = 4 + AES_RECFILE_IV_SZ + (size_t) len;
+
+		if ((data_len - pos) < (rec_len + AES_RECFILE_MAC_SZ))
+			break;		/* torn */
+
+		unsigned char mac[AES_RECFILE_MAC_SZ];
+		aes_recfile_rec_mac(rf, rf->n_recs, data + pos, rec_len, mac);
+		if (!mac_equal(mac, data + pos + rec_len))
+			goto err_out;
+
+		unsigned char *pt = data + pos + 4 + AES_RECFILE_IV_SZ;
+		aes_recfile_ctr(rf, data + pos + 4, pt, len);
+		cstr_append_buf(out, pt, len);
+		MEMSET_BZERO(pt, len);
+
+		pos += rec_len + AES_RECFILE_MAC_SZ;
+		rf->n_recs++;
+	}
+
+	/* records dropped from the end; one more is an unfinished append */
+	if ((rf->n_recs != hdr_recs) && (rf->n_recs != hdr_recs + 1))
+		goto err_out;
+
+	rf->end = pos;
+	free(data);
+
+	*contents = out;
+	return true;
+
+err_out:
+	if (out) {
+		MEMSET_BZERO(out->str, out->len);
+		cstr_free(out, true);
+	}
+	free(data);
+	aes_recfile_close(rf);
+	return false;
+}
+
+/*
+ * Replace filename atomically with a file holding data as its only
+ * record, keeping the salt and keys; later appends go to the new file.
+ */
+bool aes_recfile_write(struct aes_recfile *rf, const char *filename,
+		       const void *data, size_t data_len)
+{
+	cstring *s = cstr_new_sz(AES_RECFILE_HDR_SZ + AES_RECFILE_REC_OVERHEAD +
+				 data_len);
+	unsigned char hdr[AES_RECFILE_HDR_SZ];
+	bool rc = false;
+
+	aes_recfile_hdr(rf, 1, hdr);
+	cstr_append_buf(s, hdr, sizeof(hdr));
+
+	if (!aes_recfile_seal(rf, 0, s, data, data_len) ||
+	    !bu_write_file(filename, s->str, s->len))
+		goto out;
+
+	if (rf->fd >= 0)
+		close(rf->fd);
+	rf->fd = open(filename, O_RDWR);
+	rf->n_recs = 1;
+	rf->end = s->len;
+	rc = (rf->fd >= 0);
+
+out:
+	cstr_free(s, true);
+	return rc;
+}
+
+/*
+ * Add one record to the end of the file, then count it in the header.
+ * The record is synced first: a header counting a record that never
+ * reached the disk would look like one dropped.
+ */
+bool aes_recfile_append(struct aes_recfile *rf,
+			const void *data, size_t data_len)
+{
+	if (rf->fd < 0)
+		return false;
+
+	cstring *s = cstr_new_sz(AES_RECFILE_REC_OVERHEAD + data_len);
+	bool rc = aes_recfile_seal(rf, rf->n_recs, s, data, data_len) &&
+		  /* drop a torn record left by an earlier append */
+		  (ftruncate(rf->fd, rf->end) == 0) &&
+		  (pwrite(rf->fd, s->str, s->len, rf->end) == (ssize_t) s->len) &&
+		  (fdatasync(rf->fd) == 0);
+
+	if (rc) {
+		rf->end += s->len;
+		rf->n_recs++;
+
+		unsigned char hdr[AES_RECFILE_HDR_SZ];
+		aes_recfile_hdr(rf, rf->n_recs, hdr);
+		rc = (pwrite(rf->fd, hdr, sizeof(hdr), 0) ==
+		      (ssize_t) sizeof(hdr));
+	}
+
+	cstr_free(s, true);
+	return rc;
+}
+
+void aes_recfile_close(struct aes_recfile *rf)
+{
+	if (rf->fd >= 0)
+		close(rf->fd);
+
+	MEMSET_BZERO(rf, sizeof(*rf));
+	rf->fd = -1;
+}
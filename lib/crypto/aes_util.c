@@ -176,7 +176,7 @@ bool write_aes_file(const char *filename_, void *key_data, size_t key_data_len,
 		    const void *plaintext, size_t pt_len)
 {
     char *filename = malloc(strlen(filename_) + 1);
-    size_t ct_len = pt_len;
+    size_t ct_len = pt_len + AES256_BLOCK_LENGTH;	// room for padding
     unsigned char ciphertext[ct_len];
     bool pad = true;
     bool rc = false;
@@ -0,0 +1,75 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <string.h>
+#include <ccoin/crypto/siphash.h>
+#include <ccoin/endian.h>
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do {							\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+} while (0)
+
+uint64_t siphash24_k(uint64_t k0, uint64_t k1, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t m;
+	size_t left = len;
+
+	for (; left >= 8; p += 8, left -= 8) {
+		memcpy(&m, p, 8);
+		m = le64toh(m);
+
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	/* last word: the remaining bytes, and the length in the top byte */
+	m = ((uint64_t) len) << 56;
+	switch (left) {
+	case 7: m |= ((uint64_t) p[6]) << 48;	/* fall through */
+	case 6: m |= ((uint64_t) p[5]) << 40;	/* fall through */
+	case 5: m |= ((uint64_t) p[4]) << 32;	/* fall through */
+	case 4: m |= ((uint64_t) p[3]) << 24;	/* fall through */
+	case 3: m |= ((uint64_t) p[2]) << 16;	/* fall through */
+	case 2: m |= ((uint64_t) p[1]) << 8;	/* fall through */
+	case 1: m |= ((uint64_t) p[0]);		/* fall through */
+	case 0: break;
+	}
+
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t siphash24(const uint8_t key[16], const void *data, size_t len)
+{
+	uint64_t k0, k1;
+
+	memcpy(&k0, key, 8);
+	memcpy(&k1, key + 8, 8);
+
+	return siphash24_k(le64toh(k0), le64toh(k1), data, len);
+}
@@ -0,0 +1,402 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/blockfilter.h>
+#include <ccoin/filterindex.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#ifdef __APPLE__
+#  define off64_t off_t
+#  define pread64 pread
+#  define lseek64 lseek
+#endif
+
+static const char filterindex_magic[8] = "ccfltidx";
+
+/* block hash, filter header, and the longest varlen */
+#define FILTERINDEX_REC_HEAD	(32 + 32 + 5)
+#define FILTERINDEX_CKSUM_SZ	4
+
+static void filterindex_ent_freep(void *p)
+{
+	struct bp_filterindex_ent *ent = p;
+
+	if (!ent)
+		return;
+	if (ent->filter)
+		cstr_free(ent->filter, true);
+	free(ent);
+}
+
+static uint64_t filterindex_filter_pos(const struct bp_filterindex_ent *ent)
+{
+	return ent->pos + 64 + ser_varlen_size(ent->filter_len);
+}
+
+static uint64_t filterindex_rec_len(const struct bp_filterindex_ent *ent)
+{
+	return 64 + ser_varlen_size(ent->filter_len) + ent->filter_len +
+	       FILTERINDEX_CKSUM_SZ;
+}
+
+static void filterindex_cksum(unsigned char *cksum, const void *p, size_t len)
+{
+	unsigned char md[32];
+
+	bu_Hash(md, p, len);
+	memcpy(cksum, md, FILTERINDEX_CKSUM_SZ);
+}
+
+static void filterindex_set_best(struct bp_filterindex *idx)
+{
+	idx->best_height = (int) idx->ents->len - 1;
+	if (idx->ents->len) {
+		struct bp_filterindex_ent *ent =
+			parr_idx(idx->ents, idx->ents->len - 1);
+		bu256_copy(&idx->best_hash, &ent->block_hash);
+	} else
+		bu256_zero(&idx->best_hash);
+}
+
+/* the whole of the record at ent, checksum included */
+static bool filterindex_rec_valid(const struct bp_filterindex *idx,
+				  const struct bp_filterindex_ent *ent)
+{
+	uint64_t rec_len = filterindex_rec_len(ent);
+	unsigned char *rec = malloc(rec_len);
+	unsigned char cksum[FILTERINDEX_CKSUM_SZ];
+	bool rc = false;
+
+	if (pread64(idx->fd, rec, rec_len, ent->pos) != rec_len)
+		goto out;
+
+	filterindex_cksum(cksum, rec, rec_len - FILTERINDEX_CKSUM_SZ);
+	rc = !memcmp(cksum, rec + rec_len - FILTERINDEX_CKSUM_SZ,
+		     FILTERINDEX_CKSUM_SZ);
+
+out:
+	free(rec);
+	return rc;
+}
+
+/*
+ * Walk FILE's records into memory.  Only the last can be torn, as each
+ * is one write, so only its checksum is checked; a short or damaged
+ * last record is cut off.
+ */
+static bool filterindex_read(struct bp_filterindex *idx)
+{
+	struct stat st;
+	if (fstat(idx->fd, &st) < 0)
+		return false;
+
+	if (st.st_size == 0) {
+		cstring *s = cstr_new_sz(BP_FILTERINDEX_HDR_SZ);
+		ser_bytes(s, filterindex_magic, sizeof(filterindex_magic));
+		ser_u32(s, BP_FILTERINDEX_VERSION);
+		ssize_t wrc = write(idx->fd, s->str, s->len);
+		cstr_free(s, true);
+		if (wrc != BP_FILTERINDEX_HDR_SZ)
+			return false;
+		idx->file_end = BP_FILTERINDEX_HDR_SZ;
+		return true;
+	}
+
+	unsigned char head[FILTERINDEX_REC_HEAD];
+	struct const_buffer buf = { head, BP_FILTERINDEX_HDR_SZ };
+	char magic[sizeof(filterindex_magic)];
+	uint32_t version;
+
+	if (pread64(idx->fd, head, BP_FILTERINDEX_HDR_SZ, 0) !=
+	    BP_FILTERINDEX_HDR_SZ)
+		return false;
+	if (!deser_bytes(magic, &buf, sizeof(magic)) ||
+	    memcmp(magic, filterindex_magic, sizeof(magic)))
+		return false;
+	if (!deser_u32(&version, &buf) || version != BP_FILTERINDEX_VERSION)
+		return false;
+
+	uint64_t pos = BP_FILTERINDEX_HDR_SZ;
+	while (pos < st.st_size) {
+		size_t want = MIN(sizeof(head), st.st_size - pos);
+		if (pread64(idx->fd, head, want, pos) != want)
+			return false;
+
+		struct bp_filterindex_ent *ent = calloc(1, sizeof(*ent));
+		buf.p = head;
+		buf.len = want;
+		if (!deser_u256(&ent->block_hash, &buf) ||
+		    !deser_u256(&ent->header, &buf) ||
+		    !deser_varlen(&ent->filter_len, &buf)) {
+			free(ent);
+			break;
+		}
+		ent->pos = pos;
+
+		if (pos + filterindex_rec_len(ent) > st.st_size) {
+			free(ent);
+			break;
+		}
+		pos += filterindex_rec_len(ent);
+		parr_add(idx->ents, ent);
+	}
+
+	if (idx->ents->len) {
+		struct bp_filterindex_ent *last =
+			parr_idx(idx->ents, idx->ents->len - 1);
+		if (!filterindex_rec_valid(idx, last)) {
+			pos = last->pos;
+			parr_remove_idx(idx->ents, idx->ents->len - 1);
+		}
+	}
+
+	if ((pos < st.st_size) && (ftruncate(idx->fd, pos) < 0))
+		return false;
+
+	idx->file_end = pos;
+	return true;
+}
+
+bool bp_filterindex_open(struct bp_filterindex *idx, const char *fn)
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->fd = -1;
+	idx->ents = parr_new(0, filterindex_ent_freep);
+	idx->best_height = -1;
+
+	if (!fn)
+		return true;
+
+	idx->fn = strdup(fn);
+	idx->fd = open(fn, O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE, 0666);
+	if (idx->fd < 0)
+		goto err_out;
+
+	if (!filterindex_read(idx))
+		goto err_out;
+
+	filterindex_set_best(idx);
+	return true;
+
+err_out:
+	bp_filterindex_close(idx);
+	return false;
+}
+
+void bp_filterindex_close(struct bp_filterindex *idx)
+{
+	if (idx->fd >= 0)
+		close(idx->fd);
+	if (idx->ents)
+		parr_free(idx->ents, true);
+	free(idx->fn);
+
+	memset(idx, 0, sizeof(*idx));
+	idx->fd = -1;
+	idx->best_height = -1;
+}
+
+/*
+ * Filter a block connected at height on top of the indexed best block.
+ * undo lists the outputs its inputs spent, as from bp_utxo_view_flush.
+ */
+bool bp_filterindex_connect(struct bp_filterindex *idx,
+			    const struct bp_block *block,
+			    unsigned int height, const parr *undo)
+{
+	if (idx->best_height < 0 ? (height != 0) :
+	    ((height != idx->best_height + 1) ||
+	     !bu256_equal(&block->hashPrevBlock, &idx->best_hash)))
+		return false;
+
+	struct bp_block hdr;
+	bp_block_init(&hdr);
+	bp_block_copy_hdr(&hdr, block);
+	bp_block_calc_sha256(&hdr);
+
+	/* the filter is keyed on the block hash, which hdr holds */
+	struct bp_block keyed = *block;
+	bu256_copy(&keyed.sha256, &hdr.sha256);
+	keyed.sha256_valid = true;
+	cstring *filter = bp_block_filter_basic(&keyed, undo);
+
+	bu256_t prev_header;
+	bu256_zero(&prev_header);
+	if (idx->ents->len) {
+		struct bp_filterindex_ent *prev =
+			parr_idx(idx->ents, idx->ents->len - 1);
+		bu256_copy(&prev_header, &prev->header);
+	}
+
+	struct bp_filterindex_ent *ent = calloc(1, sizeof(*ent));
+	bu256_copy(&ent->block_hash, &hdr.sha256);
+	bp_block_filter_header(&ent->header, filter, &prev_header);
+	ent->pos = idx->file_end;
+	ent->filter_len = filter->len;
+
+	bool rc = false;
+	if (idx->fd >= 0) {
+		cstring *s = cstr_new_sz(filterindex_rec_len(ent));
+		ser_u256(s, &ent->block_hash);
+		ser_u256(s, &ent->header);
+		ser_varstr(s, filter);
+
+		unsigned char cksum[FILTERINDEX_CKSUM_SZ];
+		filterindex_cksum(cksum, s->str, s->len);
+		ser_bytes(s, cksum, sizeof(cksum));
+
+		/* one write per block; cut off a torn one now, so that
+		 * later blocks stay readable
+		 */
+		ssize_t wrc = write(idx->fd, s->str, s->len);
+		bool ok = (wrc == s->len);
+		if (!ok && (wrc > 0))
+			ftruncate(idx->fd, idx->file_end);
+		cstr_free(s, true);
+		if (!ok) {
+			filterindex_ent_freep(ent);
+			goto out;
+		}
+		idx->file_end += filterindex_rec_len(ent);
+	} else {
+		ent->filter = filter;
+		filter = NULL;
+	}
+
+	parr_add(idx->ents, ent);
+	filterindex_set_best(idx);
+	rc = true;
+
+out:
+	if (filter)
+		cstr_free(filter, true);
+	bp_block_free(&hdr);
+	return rc;
+}
+
+/* Remove the indexed best block. */
+bool bp_filterindex_disconnect(struct bp_filterindex *idx,
+			       const struct bp_block *block)
+{
+	if (idx->best_height < 0)
+		return false;
+
+	struct bp_block hdr;
+	bp_block_init(&hdr);
+	bp_block_copy_hdr(&hdr, block);
+	bp_block_calc_sha256(&hdr);
+	bool match = bu256_equal(&hdr.sha256, &idx->best_hash);
+	bp_block_free(&hdr);
+	if (!match)
+		return false;
+
+	struct bp_filterindex_ent *ent =
+		parr_idx(idx->ents, idx->ents->len - 1);
+	if (idx->fd >= 0) {
+		if (ftruncate(idx->fd, ent->pos) < 0)
+			return false;
+		idx->file_end = ent->pos;
+	}
+
+	parr_remove_idx(idx->ents, idx->ents->len - 1);
+	filterindex_set_best(idx);
+	return true;
+}
+
+/* The entry at height; if filter is non-NULL, the filter too. */
+bool bp_filterindex_get(const struct bp_filterindex *idx, unsigned int height,
+			struct bp_filterindex_ent *ent, cstring **filter)
+{
+	if (height >= idx->ents->len)
+		return false;
+
+	const struct bp_filterindex_ent *e = parr_idx(idx->ents, height);
+	if (ent) {
+		*ent = *e;
+		ent->filter = NULL;
+	}
+	if (!filter)
+		return true;
+
+	if (e->filter) {
+		*filter = cstr_new_buf(e->filter->str, e->filter->len);
+		return true;
+	}
+
+	cstring *s = cstr_new_sz(e->filter_len);
+	if (pread64(idx->fd, s->str, e->filter_len,
+		    filterindex_filter_pos(e)) != e->filter_len) {
+		cstr_free(s, true);
+		return false;
+	}
+	cstr_resize(s, e->filter_len);
+	*filter = s;
+	return true;
+}
+
+/*
+ * match[i] is set if any of items is in the filter of block first + i.
+ * The records of the range are read at once, then matched in parallel.
+ */
+bool bp_filterindex_match(const struct bp_filterindex *idx,
+			  unsigned int first, unsigned int n,
+			  const struct const_buffer *items,
+			  unsigned int n_items, bool *match)
+{
+	if ((first > idx->ents->len) || (n > idx->ents->len - first))
+		return false;
+	if (!n)
+		return true;
+
+	struct bp_block_filter_ref *refs = malloc(n * sizeof(*refs));
+	unsigned char *span = NULL;
+	uint64_t span_start = 0;
+	bool rc = false;
+	unsigned int i;
+
+	if (idx->fd >= 0) {
+		const struct bp_filterindex_ent *e = parr_idx(idx->ents, first);
+		uint64_t span_end = (first + n < idx->ents->len) ?
+			((struct bp_filterindex_ent *)
+			 parr_idx(idx->ents, first + n))->pos :
+			idx->file_end;
+		size_t span_len = span_end - e->pos;
+
+		span_start = e->pos;
+		span = malloc(span_len);
+		if (!span || (pread64(idx->fd, span, span_len, span_start) !=
+			      span_len))
+			goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct bp_filterindex_ent *e = parr_idx(idx->ents,
+							      first + i);
+		refs[i].block_hash = &e->block_hash;
+		refs[i].filter_len = e->filter_len;
+		if (e->filter)
+			refs[i].filter = e->filter->str;
+		else
+			refs[i].filter = span +
+				(filterindex_filter_pos(e) - span_start);
+	}
+
+	rc = bp_block_filter_match_batch(refs, n, items, n_items, match);
+
+out:
+	free(span);
+	free(refs);
+	return rc;
+}
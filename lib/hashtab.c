@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ccoin/hashtab.h>
+#include <ccoin/util.h>
 
 struct bp_hashtab *bp_hashtab_new_ext(
 	unsigned long (*hash_f)(const void *p),
@@ -203,16 +204,10 @@ bool bp_hashtab_get_ext(struct bp_hashtab *ht, const void *lookup_key,
 	return match;
 }
 
-static bool bp_hashtab_grow(struct bp_hashtab *ht)
+static bool bp_hashtab_resize(struct bp_hashtab *ht,
+			      unsigned int new_tab_size)
 {
 	struct bp_ht_ent **new_tab = NULL;
-	unsigned int new_tab_size;
-
-	// if table small, grow by larger factor
-	if (ht->tab_size < 1024)
-		new_tab_size = (ht->tab_size * 10) - 1;
-	else
-		new_tab_size = (ht->tab_size * 2) - 1;
 
 	// alloc new table; our main failure point
 	new_tab = calloc(new_tab_size, sizeof(struct bp_ht_ent *));
@@ -249,6 +244,28 @@ static bool bp_hashtab_grow(struct bp_hashtab *ht)
 	return true;
 }
 
+static bool bp_hashtab_grow(struct bp_hashtab *ht)
+{
+	unsigned int new_tab_size;
+
+	// if table small, grow by larger factor
+	if (ht->tab_size < 1024)
+		new_tab_size = (ht->tab_size * 10) - 1;
+	else
+		new_tab_size = (ht->tab_size * 2) - 1;
+
+	return bp_hashtab_resize(ht, new_tab_size);
+}
+
+// size the table for n entries up front, ahead of a bulk load
+bool bp_hashtab_reserve(struct bp_hashtab *ht, unsigned int n)
+{
+	if (n <= ht->tab_size)
+		return true;
+
+	return bp_hashtab_resize(ht, n | 1);
+}
+
 bool bp_hashtab_put(struct bp_hashtab *ht, void *key, void *val)
 {
 	// lookup key and bucket
@@ -312,3 +329,26 @@ void bp_hashtab_iter(struct bp_hashtab *ht, bp_kvu_func cb, void *priv)
 	}
 }
 
+void bp_hashtab_prefetch_bucket(const struct bp_hashtab *ht, const void *key)
+{
+	unsigned int bucket = ht->hash_f(key) % ht->tab_size;
+	bp_prefetch(&ht->tab[bucket]);
+}
+
+void bp_hashtab_prefetch_ent(const struct bp_hashtab *ht, const void *key)
+{
+	unsigned int bucket = ht->hash_f(key) % ht->tab_size;
+	const struct bp_ht_ent *ent = ht->tab[bucket];
+	if (ent)
+		bp_prefetch(ent);
+}
+
+void bp_hashtab_prefetch_key(const struct bp_hashtab *ht, const void *key)
+{
+	unsigned int bucket = ht->hash_f(key) % ht->tab_size;
+	const struct bp_ht_ent *ent = ht->tab[bucket];
+	if (ent) {
+		bp_prefetch(ent->key);
+		bp_prefetch(ent->value);
+	}
+}
@@ -5,7 +5,9 @@
  */
 
 #include <ccoin/hdkeys.h>
+#include <ccoin/base58.h>
 #include <ccoin/buffer.h>
+#include <ccoin/parallel.h>
 #include <ccoin/serialize.h>
 #include <ccoin/util.h>
 #include <ccoin/crypto/ripemd160.h>
@@ -16,6 +18,15 @@
 #define TEST_PUBLIC 0x043587CF
 #define TEST_PRIVATE 0x04358394
 
+static uint32_t hd_version_public(uint32_t version)
+{
+	if (MAIN_PRIVATE == version)
+		return MAIN_PUBLIC;
+	if (TEST_PRIVATE == version)
+		return TEST_PUBLIC;
+	return version;
+}
+
 void hd_extended_key_init(struct hd_extended_key *ek)
 {
 	memset(ek, 0, sizeof(*ek));
@@ -59,6 +70,19 @@ bool hd_extended_key_deser(struct hd_extended_key *ek, const void *_data,
 	return false;
 }
 
+bool hd_extended_key_deser_base58(struct hd_extended_key *ek, const char *s)
+{
+	cstring *data = base58_decode_check(NULL, s);
+	if (!data)
+		return false;
+
+	bool rc = (78 == data->len) &&
+		  hd_extended_key_deser(ek, data->str, data->len);
+
+	cstr_free(data, true);
+	return rc;
+}
+
 static void hd_extended_key_ser_base(const struct hd_extended_key *ek,
 				     cstring *s, uint32_t version)
 {
@@ -115,15 +139,41 @@ bool hd_extended_key_generate_master(struct hd_extended_key *ek,
 	return false;
 }
 
+/* I = HMAC-SHA512(chaincode, data || index), data holding 33 bytes */
+static void hd_child_hmac(const struct hd_extended_key *parent,
+			  uint8_t *data, uint32_t index, uint8_t *I)
+{
+	const uint32_t indexBE = htobe32(index);
+	memcpy(&data[BP_PUBKEY_SZ], &indexBE, sizeof(uint32_t));
+
+	hmac_sha512(parent->chaincode.data, (int)sizeof(parent->chaincode.data),
+		    data, BP_PUBKEY_SZ + sizeof(uint32_t), I);
+}
+
+static void hd_child_set_meta(struct hd_extended_key *out_child,
+			      const struct hd_extended_key *parent,
+			      const uint8_t *parent_pub, uint32_t index,
+			      const uint8_t *I, uint32_t version)
+{
+	uint8_t md160[RIPEMD160_DIGEST_LENGTH];
+	bu_Hash160(md160, parent_pub, BP_PUBKEY_SZ);
+
+	memcpy(out_child->chaincode.data, &I[32], 32);
+	out_child->index = index;
+	out_child->version = version;
+	memcpy(out_child->parent_fingerprint, md160, 4);
+	out_child->depth = parent->depth + 1;
+}
+
 bool hd_extended_key_generate_child(const struct hd_extended_key *parent,
 				    uint32_t index,
 				    struct hd_extended_key *out_child)
 {
-	bool result = false;
-	void *parent_pub = NULL;
-	size_t parent_pub_len = 0;
+	uint8_t parent_pub[BP_PUBKEY_SZ];
+	if (!bp_pubkey_get_buf(&parent->key, parent_pub))
+		return false;
 
-	uint8_t data[33 + sizeof(uint32_t)];
+	uint8_t data[BP_PUBKEY_SZ + sizeof(uint32_t)];
 	if (0 != (0x80000000 & index)) {
 
 		if (!bp_key_secret_get(&data[1], 32, &parent->key)) {
@@ -131,48 +181,98 @@ bool hd_extended_key_generate_child(const struct hd_extended_key *parent,
 		}
 		data[0] = 0;
 
-		if (!bp_pubkey_get(&parent->key, &parent_pub, &parent_pub_len)) {
-			return false;
-		}
-
 	} else {
 
-		if (!bp_pubkey_get(&parent->key, &parent_pub, &parent_pub_len)) {
-			return false;
-		}
-		memcpy(&data[0], parent_pub, parent_pub_len);
+		memcpy(&data[0], parent_pub, BP_PUBKEY_SZ);
 
 	}
 
-	if (33 != parent_pub_len) {
-		goto free_parent_pub;
-	}
+	uint8_t I[64];
+	hd_child_hmac(parent, data, index, I);
+	memset(data, 0, sizeof(data));
 
-	const uint32_t indexBE = htobe32(index);
-	memcpy(&data[33], &indexBE, sizeof(uint32_t));
+	if (!bp_key_add_secret(&out_child->key, &parent->key, I))
+		return false;
+
+	hd_child_set_meta(out_child, parent, parent_pub, index, I,
+			  parent->version);
+	return true;
+}
+
+void hd_extended_key_neuter(struct hd_extended_key *ek)
+{
+	memset(ek->key.secret, 0, sizeof(ek->key.secret));
+	ek->version = hd_version_public(ek->version);
+}
+
+bool hd_extended_key_generate_child_pub(const struct hd_extended_key *parent,
+					uint32_t index,
+					struct hd_extended_key *out_child)
+{
+	if (0 != (0x80000000 & index))
+		return false;
+
+	uint8_t data[BP_PUBKEY_SZ + sizeof(uint32_t)];
+	if (!bp_pubkey_get_buf(&parent->key, data))
+		return false;
 
 	uint8_t I[64];
-	hmac_sha512(parent->chaincode.data, (int)sizeof(parent->chaincode.data),
-		    data, (int)sizeof(data), I);
+	hd_child_hmac(parent, data, index, I);
 
-	if (!bp_key_add_secret(&out_child->key, &parent->key, I)) {
-		goto free_parent_pub;
-	}
+	if (!bp_pubkey_add_tweak(&out_child->key, &parent->key, I))
+		return false;
 
-	uint8_t md160[RIPEMD160_DIGEST_LENGTH];
-	bu_Hash160(md160, parent_pub, parent_pub_len);
+	hd_child_set_meta(out_child, parent, data, index, I,
+			  hd_version_public(parent->version));
+	return true;
+}
 
-	memcpy(out_child->chaincode.data, &I[32], 32);
-	out_child->index = index;
-	out_child->version = parent->version;
-	memcpy(out_child->parent_fingerprint, md160, 4);
-	out_child->depth = parent->depth + 1;
-	result = true;
+struct hd_pub_batch {
+	const struct hd_extended_key	*parent;
+	uint8_t				parent_pub[BP_PUBKEY_SZ];
+	uint32_t			first;
+	struct hd_pub_child		*out;
+};
+
+static bool hd_pub_batch_child(void *ctx, unsigned int idx)
+{
+	const struct hd_pub_batch *batch = ctx;
+	struct hd_pub_child *child = &batch->out[idx];
+
+	uint8_t data[BP_PUBKEY_SZ + sizeof(uint32_t)];
+	memcpy(data, batch->parent_pub, BP_PUBKEY_SZ);
+
+	uint8_t I[64];
+	hd_child_hmac(batch->parent, data, batch->first + idx, I);
+
+	struct bp_key key;
+	if (!bp_pubkey_add_tweak(&key, &batch->parent->key, I) ||
+	    !bp_pubkey_get_buf(&key, child->pubkey))
+		return false;
+
+	bu_Hash160(child->pubkey_hash, child->pubkey, BP_PUBKEY_SZ);
+	return true;
+}
+
+bool hd_derive_pub_batch(const struct hd_extended_key *parent,
+			 uint32_t first, unsigned int n,
+			 struct hd_pub_child *out)
+{
+	// non-hardened indexes only
+	if ((0 != (0x80000000 & first)) || (n > 0x80000000 - first))
+		return false;
+
+	struct hd_pub_batch batch = {
+		.parent		= parent,
+		.first		= first,
+		.out		= out,
+	};
 
-free_parent_pub:
-	free(parent_pub);
+	// also sets up the shared secp256k1 context before the pool runs
+	if (!bp_pubkey_get_buf(&parent->key, batch.parent_pub))
+		return false;
 
-	return result;
+	return bp_parallel_for(n, hd_pub_batch_child, &batch);
 }
 
 bool hd_derive(struct hd_extended_key *out_child,
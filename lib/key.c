@@ -39,6 +39,11 @@ secp256k1_context *get_secp256k1_context()
 	return s_context;
 }
 
+bool bp_key_static_init()
+{
+	return get_secp256k1_context() != NULL;
+}
+
 void bp_key_static_shutdown()
 {
 	if (s_context) {
@@ -166,6 +171,45 @@ bool bp_pubkey_get(const struct bp_key *key, void **pubkey, size_t *pk_len)
 	return false;
 }
 
+bool bp_pubkey_get_buf(const struct bp_key *key, uint8_t *pubkey)
+{
+	secp256k1_context *ctx = get_secp256k1_context();
+	if (!ctx) {
+		return false;
+	}
+
+	size_t pk_len = BP_PUBKEY_SZ;
+	return secp256k1_ec_pubkey_serialize(ctx, pubkey, &pk_len,
+					     &key->pubkey,
+					     SECP256K1_EC_COMPRESSED) &&
+	       (pk_len == BP_PUBKEY_SZ);
+}
+
+bool bp_pubkey_get_uncompressed(const struct bp_key *key, void **pubkey,
+				size_t *pk_len)
+{
+	*pubkey = NULL;
+	*pk_len = 0;
+
+	secp256k1_context *ctx = get_secp256k1_context();
+	if (!ctx) {
+		return false;
+	}
+
+	void *pk = malloc(65);
+	if (pk) {
+		*pk_len = 65;
+		if (secp256k1_ec_pubkey_serialize(ctx, pk, pk_len,
+						  &key->pubkey,
+						  SECP256K1_EC_UNCOMPRESSED)) {
+			*pubkey = pk;
+			return true;
+		}
+		free(pk);
+	}
+	return false;
+}
+
 bool bp_key_secret_get(void *p, size_t len, const struct bp_key *key)
 {
 	if (!p || sizeof(key->secret) > len) {
@@ -290,6 +334,18 @@ bool bp_key_add_secret(struct bp_key *out,
 		return false;
 	}
 
+	return bp_pubkey_add_tweak(out, key, tweak32);
+}
+
+bool bp_pubkey_add_tweak(struct bp_key *out,
+			 const struct bp_key *key,
+			 const uint8_t *tweak32)
+{
+	secp256k1_context *ctx = get_secp256k1_context();
+	if (!ctx) {
+		return false;
+	}
+
 	memset(out->secret, 0, sizeof(out->secret));
 	memcpy(&out->pubkey, &key->pubkey, sizeof(secp256k1_pubkey));
 	return secp256k1_ec_pubkey_tweak_add(ctx, &out->pubkey, tweak32);
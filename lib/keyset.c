@@ -9,6 +9,7 @@
 #include <ccoin/crypto/ripemd160.h>
 #include <ccoin/key.h>
 #include <ccoin/buffer.h>
+#include <ccoin/script.h>
 #include <ccoin/util.h>
 
 void bpks_init(struct bp_keyset *ks)
@@ -19,6 +20,36 @@ void bpks_init(struct bp_keyset *ks)
 				     buffer_freep, NULL);
 	ks->pubhash = bp_hashtab_new_ext(buffer_hash, buffer_equal,
 					 buffer_freep, NULL);
+	ks->scripts = bp_hashtab_new_ext(buffer_hash, buffer_equal,
+					 free, NULL);
+}
+
+/* one allocation: the struct buffer, then the script bytes */
+static bool bpks_add_script(struct bp_keyset *ks, const void *script,
+			    size_t script_len)
+{
+	struct buffer *buf = malloc(sizeof(*buf) + script_len);
+	if (!buf)
+		return false;
+
+	buf->p = buf + 1;
+	buf->len = script_len;
+	memcpy(buf->p, script, script_len);
+
+	bp_hashtab_put(ks->scripts, buf, buf);
+	return true;
+}
+
+static bool bpks_add_pubhash_script(struct bp_keyset *ks, const void *md160)
+{
+	unsigned char script[25] = {
+		OP_DUP, OP_HASH160, RIPEMD160_DIGEST_LENGTH,
+	};
+
+	memcpy(script + 3, md160, RIPEMD160_DIGEST_LENGTH);
+	script[23] = OP_EQUALVERIFY;
+	script[24] = OP_CHECKSIG;
+	return bpks_add_script(ks, script, sizeof(script));
 }
 
 bool bpks_add(struct bp_keyset *ks, struct bp_key *key)
@@ -41,7 +72,40 @@ bool bpks_add(struct bp_keyset *ks, struct bp_key *key)
 	bp_hashtab_put(ks->pub, buf_pk, buf_pk);
 	bp_hashtab_put(ks->pubhash, buf_pkhash, buf_pkhash);
 
-	return true;
+	/* a direct push: pubkeys are at most 65 bytes */
+	unsigned char script[1 + 65 + 1];
+	if (pk_len <= 65) {
+		script[0] = pk_len;
+		memcpy(script + 1, pubkey, pk_len);
+		script[1 + pk_len] = OP_CHECKSIG;
+		if (!bpks_add_script(ks, script, pk_len + 2))
+			return false;
+	}
+
+	return bpks_add_pubhash_script(ks, md160);
+}
+
+/* a key known only by its hash, as from a P2PKH address */
+bool bpks_add_pubhash(struct bp_keyset *ks, const void *md160)
+{
+	struct buffer *buf = buffer_copy(md160, RIPEMD160_DIGEST_LENGTH);
+	if (!buf)
+		return false;
+
+	bp_hashtab_put(ks->pubhash, buf, buf);
+	return bpks_add_pubhash_script(ks, md160);
+}
+
+/* a script hash, as from a P2SH address; matched by script only */
+bool bpks_add_scripthash(struct bp_keyset *ks, const void *md160)
+{
+	unsigned char script[23] = {
+		OP_HASH160, RIPEMD160_DIGEST_LENGTH,
+	};
+
+	memcpy(script + 2, md160, RIPEMD160_DIGEST_LENGTH);
+	script[22] = OP_EQUAL;
+	return bpks_add_script(ks, script, sizeof(script));
 }
 
 bool bpks_lookup(const struct bp_keyset *ks, const void *data, size_t data_len,
@@ -58,9 +122,19 @@ bool bpks_lookup(const struct bp_keyset *ks, const void *data, size_t data_len,
 	return bp_hashtab_get_ext(ht, &buf, NULL, NULL);
 }
 
+/* true if script pays a watched key or script hash */
+bool bpks_lookup_script(const struct bp_keyset *ks,
+			const void *script, size_t script_len)
+{
+	struct const_buffer buf = { script, script_len };
+
+	return bp_hashtab_get_ext(ks->scripts, &buf, NULL, NULL);
+}
+
 void bpks_free(struct bp_keyset *ks)
 {
 	bp_hashtab_unref(ks->pub);
 	bp_hashtab_unref(ks->pubhash);
+	bp_hashtab_unref(ks->scripts);
 }
 
@@ -0,0 +1,275 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/merkleblock.h>
+#include <ccoin/bloom.h>
+#include <ccoin/coredefs.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+void bp_merkle_block_init(struct bp_merkle_block *mb)
+{
+	memset(mb, 0, sizeof(*mb));
+	bp_block_init(&mb->hdr);
+}
+
+void bp_merkle_block_free(struct bp_merkle_block *mb)
+{
+	if (!mb)
+		return;
+
+	if (mb->vHash) {
+		parr_free(mb->vHash, true);
+		mb->vHash = NULL;
+	}
+	if (mb->vBits) {
+		cstr_free(mb->vBits, true);
+		mb->vBits = NULL;
+	}
+}
+
+bool deser_bp_merkle_block(struct bp_merkle_block *mb,
+			   struct const_buffer *buf)
+{
+	bp_merkle_block_free(mb);
+	bp_merkle_block_init(mb);
+
+	struct bp_block *hdr = &mb->hdr;
+	if (!deser_u32(&hdr->nVersion, buf)) return false;
+	if (!deser_u256(&hdr->hashPrevBlock, buf)) return false;
+	if (!deser_u256(&hdr->hashMerkleRoot, buf)) return false;
+	if (!deser_u32(&hdr->nTime, buf)) return false;
+	if (!deser_u32(&hdr->nBits, buf)) return false;
+	if (!deser_u32(&hdr->nNonce, buf)) return false;
+
+	if (!deser_u32(&mb->nTransactions, buf)) return false;
+	if (!deser_u256_array(&mb->vHash, buf)) return false;
+	if (!deser_varstr(&mb->vBits, buf)) return false;
+
+	return true;
+}
+
+void ser_bp_merkle_block(cstring *s, const struct bp_merkle_block *mb)
+{
+	struct bp_block hdr;
+	bp_block_copy_hdr(&hdr, &mb->hdr);
+	ser_bp_block(s, &hdr);
+
+	ser_u32(s, mb->nTransactions);
+	ser_u256_array(s, mb->vHash);
+	ser_varstr(s, mb->vBits);
+}
+
+/* nodes at height, where the transactions are at height 0 */
+static unsigned int mb_width(uint32_t n_tx, unsigned int height)
+{
+	return (n_tx + (1U << height) - 1) >> height;
+}
+
+static unsigned int mb_height(uint32_t n_tx)
+{
+	unsigned int height = 0;
+
+	while (mb_width(n_tx, height) > 1)
+		height++;
+	return height;
+}
+
+struct mb_build {
+	struct bp_merkle_block	*mb;
+	parr			*tree;		/* bp_block_merkle_tree() */
+	bool			*parent;	/* per tree node: above a match */
+	unsigned int		ofs[33];	/* per height, into tree */
+	unsigned int		n_bits;
+};
+
+static void mb_push_bit(struct mb_build *b, bool bit)
+{
+	cstring *bits = b->mb->vBits;
+
+	if ((b->n_bits & 7) == 0)
+		cstr_append_c(bits, 0);
+	if (bit)
+		bits->str[b->n_bits >> 3] |= 1 << (b->n_bits & 7);
+	b->n_bits++;
+}
+
+static void mb_build_node(struct mb_build *b, unsigned int height,
+			  unsigned int pos)
+{
+	unsigned int node = b->ofs[height] + pos;
+	bool parent = b->parent[node];
+
+	mb_push_bit(b, parent);
+
+	if ((height == 0) || !parent) {
+		parr_add(b->mb->vHash, bu256_new(parr_idx(b->tree, node)));
+		return;
+	}
+
+	mb_build_node(b, height - 1, pos * 2);
+	if ((pos * 2) + 1 < mb_width(b->mb->nTransactions, height - 1))
+		mb_build_node(b, height - 1, (pos * 2) + 1);
+}
+
+/*
+ * Filtered block of block, proving the transactions for which match[]
+ * is set.  Transaction hashes are computed if need be.
+ */
+bool bp_merkle_block_build(struct bp_merkle_block *mb,
+			   const struct bp_block *block,
+			   const bool *match)
+{
+	bp_merkle_block_free(mb);
+	bp_merkle_block_init(mb);
+
+	struct mb_build b = { .mb = mb };
+	b.tree = bp_block_merkle_tree(block);
+	if (!b.tree)
+		return false;
+
+	uint32_t n_tx = block->vtx->len;
+	unsigned int height, top = mb_height(n_tx);
+	unsigned int pos;
+
+	bp_block_copy_hdr(&mb->hdr, block);
+	mb->nTransactions = n_tx;
+	mb->vHash = parr_new(0, bu256_freep);
+	mb->vBits = cstr_new_sz(16);
+
+	/* mark every node above a matched transaction */
+	b.parent = malloc(b.tree->len * sizeof(bool));
+	memcpy(b.parent, match, n_tx * sizeof(bool));
+
+	for (height = 0; height < top; height++) {
+		unsigned int width = mb_width(n_tx, height);
+		const bool *below = b.parent + b.ofs[height];
+
+		b.ofs[height + 1] = b.ofs[height] + width;
+		for (pos = 0; pos < mb_width(n_tx, height + 1); pos++)
+			b.parent[b.ofs[height + 1] + pos] =
+				below[pos * 2] ||
+				(((pos * 2) + 1 < width) && below[(pos * 2) + 1]);
+	}
+
+	mb_build_node(&b, top, 0);
+
+	free(b.parent);
+	parr_free(b.tree, true);
+	return true;
+}
+
+/*
+ * Filtered block of block for BIP 37 filter bf, which is updated as
+ * its nFlags say.  match[] receives the transactions matched.
+ */
+bool bp_merkle_block_filter(struct bp_merkle_block *mb,
+			    const struct bp_block *block,
+			    struct bloom *bf, bool *match)
+{
+	if (!block->vtx || !block->vtx->len)
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		bp_tx_calc_sha256(tx);
+		match[i] = bloom_tx_match(bf, tx);
+	}
+
+	return bp_merkle_block_build(mb, block, match);
+}
+
+struct mb_extract {
+	const struct bp_merkle_block	*mb;
+	unsigned int			bits_used;
+	unsigned int			hashes_used;
+	parr				*txids;
+	bool				bad;
+};
+
+static void mb_extract_node(struct mb_extract *x, unsigned int height,
+			    unsigned int pos, bu256_t *hash)
+{
+	const struct bp_merkle_block *mb = x->mb;
+
+	if (x->bits_used >= (mb->vBits->len * 8)) {
+		x->bad = true;
+		return;
+	}
+
+	unsigned int bit = x->bits_used++;
+	bool parent = mb->vBits->str[bit >> 3] & (1 << (bit & 7));
+
+	if ((height == 0) || !parent) {
+		if (x->hashes_used >= mb->vHash->len) {
+			x->bad = true;
+			return;
+		}
+
+		bu256_copy(hash, parr_idx(mb->vHash, x->hashes_used++));
+		if (height == 0 && parent)
+			parr_add(x->txids, bu256_new(hash));
+		return;
+	}
+
+	bu256_t left, right;
+
+	mb_extract_node(x, height - 1, pos * 2, &left);
+	if (x->bad)
+		return;
+
+	if ((pos * 2) + 1 < mb_width(mb->nTransactions, height - 1)) {
+		mb_extract_node(x, height - 1, (pos * 2) + 1, &right);
+		if (x->bad)
+			return;
+
+		/* two identical children: CVE-2012-2459 */
+		if (bu256_equal(&left, &right)) {
+			x->bad = true;
+			return;
+		}
+	} else
+		bu256_copy(&right, &left);
+
+	bu_Hash_((unsigned char *) hash, &left, sizeof(left),
+		 &right, sizeof(right));
+}
+
+/*
+ * Append the matched transaction ids of mb to txids (of bu256_t), in
+ * block order.  Fails, adding nothing, unless the partial tree is
+ * well formed, used up exactly, and hashes to the header's merkle root.
+ */
+bool bp_merkle_block_extract(const struct bp_merkle_block *mb, parr *txids)
+{
+	if ((mb->nTransactions == 0) ||
+	    (mb->nTransactions > (MAX_BLOCK_SIZE / 60)) ||
+	    !mb->vHash || !mb->vBits ||
+	    (mb->vHash->len > mb->nTransactions) ||
+	    ((mb->vBits->len * 8) < mb->vHash->len))
+		return false;
+
+	struct mb_extract x = { .mb = mb, .txids = txids };
+	unsigned int start = txids->len;
+	bu256_t root;
+
+	mb_extract_node(&x, mb_height(mb->nTransactions), 0, &root);
+
+	if (x.bad ||
+	    (((x.bits_used + 7) / 8) != mb->vBits->len) ||
+	    (x.hashes_used != mb->vHash->len) ||
+	    !bu256_equal(&root, &mb->hdr.hashMerkleRoot)) {
+		parr_remove_range(txids, start, txids->len - start);
+		return false;
+	}
+
+	return true;
+}
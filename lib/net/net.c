@@ -7,13 +7,17 @@
 #include "ccoin/net/net.h"              // for nc_conn, net_child_info, etc
 #include <ccoin/net/netbase.h>          // for bn_address_str, etc
 #include <ccoin/blkdb.h>                // for blkdb, blkdb_locator, etc
+#include <ccoin/bloom.h>                // for bloom, deser_bloom, etc
 #include <ccoin/buffer.h>               // for buffer, const_buffer
 #include <ccoin/core.h>                 // for bp_address, bp_inv, etc
 #include <ccoin/coredefs.h>             // for ::CADDR_TIME_VERSION, etc
 #include <ccoin/cstr.h>                 // for cstring, cstr_free
 #include <ccoin/hashtab.h>              // for bp_hashtab_size
 #include <ccoin/log.h>                  // for log_info, log_debug, etc
+#include <ccoin/merkleblock.h>          // for bp_merkle_block, etc
 #include <ccoin/parr.h>                 // for parr, parr_idx, parr_add, etc
+#include <ccoin/script.h>               // for MAX_SCRIPT_ELEMENT_SIZE
+#include <ccoin/serialize.h>            // for deser_varstr
 #include <ccoin/util.h>                 // for MIN
 
 #include <assert.h>                     // for assert
@@ -42,6 +46,8 @@ static bool nc_conn_read_enable(struct nc_conn *conn);
 static bool nc_conn_read_disable(struct nc_conn *conn);
 static bool nc_conn_write_enable(struct nc_conn *conn);
 static bool nc_conn_write_disable(struct nc_conn *conn);
+static cstring *nc_version_build(struct nc_conn *conn);
+static bool nc_conn_serve(struct nc_conn *conn);
 
 void net_set(struct net_settings *_net_settings)
 {
@@ -81,6 +87,8 @@ static void nc_conn_build_iov(clist *write_q, unsigned int partial,
 
 static void nc_conn_written(struct nc_conn *conn, size_t bytes)
 {
+	conn->write_q_bytes -= bytes;
+
 	while (bytes > 0) {
 		clist *tmp;
 		struct buffer *buf;
@@ -131,10 +139,12 @@ static void nc_conn_write_evt(int fd, short events, void *priv)
 	/* handle partially and fully completed buffers */
 	nc_conn_written(conn, wrc);
 
-	/* thaw read, if write fully drained */
+	/* thaw read, and serve more blocks, if write fully drained */
 	if (!conn->write_q) {
 		nc_conn_write_disable(conn);
 		nc_conn_read_enable(conn);
+		if (!nc_conn_serve(conn))
+			goto err_out;
 	}
 
 	return;
@@ -161,6 +171,7 @@ static bool nc_conn_send(struct nc_conn *conn, const char *command,
 	/* if write q exists, write_evt will handle output */
 	if (conn->write_q) {
 		conn->write_q = clist_append(conn->write_q, buf);
+		conn->write_q_bytes += buf->len;
 		return true;
 	}
 
@@ -175,6 +186,7 @@ static bool nc_conn_send(struct nc_conn *conn, const char *command,
 		}
 
 		conn->write_q = clist_append(conn->write_q, buf);
+		conn->write_q_bytes += buf->len;
 		goto out_wrstart;
 	}
 
@@ -188,6 +200,7 @@ static bool nc_conn_send(struct nc_conn *conn, const char *command,
 	/* message partially sent; pause read; poll for writable */
 	conn->write_q = clist_append(conn->write_q, buf);
 	conn->write_partial = wrc;
+	conn->write_q_bytes += buf->len - wrc;
 
 out_wrstart:
 	nc_conn_read_disable(conn);
@@ -195,6 +208,42 @@ out_wrstart:
 	return true;
 }
 
+static bool nc_conn_send_version(struct nc_conn *conn)
+{
+	cstring *msg_data = nc_version_build(conn);
+	bool rc = nc_conn_send(conn, "version", msg_data->str, msg_data->len);
+	cstr_free(msg_data, true);
+
+	return rc;
+}
+
+static bool nc_conn_send_filter(struct nc_conn *conn)
+{
+	cstring *s = cstr_new_sz(1024);
+	ser_bloom(s, conn->nci->filter);
+
+	bool rc = nc_conn_send(conn, "filterload", s->str, s->len);
+
+	cstr_free(s, true);
+	return rc;
+}
+
+static bool nc_conn_getblocks(struct nc_conn *conn)
+{
+	struct msg_getblocks gb;
+	msg_getblocks_init(&gb);
+	blkdb_locator(conn->nci->db, conn->nci->getblocks_tip, &gb.locator);
+	cstring *s = ser_msg_getblocks(&gb);
+
+	bool rc = nc_conn_send(conn, "getblocks", s->str, s->len);
+
+	cstr_free(s, true);
+	msg_getblocks_free(&gb);
+
+	conn->nci->last_getblocks = time(NULL);
+	return rc;
+}
+
 static bool nc_msg_version(struct nc_conn *conn)
 {
 	if (conn->seen_version)
@@ -225,13 +274,27 @@ static bool nc_msg_version(struct nc_conn *conn)
 			mv.nStartingHeight);
 	}
 
-	if (!(mv.nServices & NODE_NETWORK))	/* require NODE_NETWORK */
-		goto out;
+	conn->services = mv.nServices;
+
+	/* outgoing: full nodes only, and in SPV mode, filtering ones */
+	if (!conn->inbound) {
+		if (!(mv.nServices & NODE_NETWORK))
+			goto out;
+		if (conn->nci->filter &&
+		    ((mv.nVersion < BIP0037_VERSION) ||
+		     ((mv.nVersion >= NO_BLOOM_VERSION) &&
+		      !(mv.nServices & NODE_BLOOM))))
+			goto out;
+	}
 	if (mv.nonce == *conn->nci->instance_nonce)		/* connected to ourselves? */
 		goto out;
 
 	conn->protover = MIN(mv.nVersion, PROTO_VERSION);
 
+	/* incoming: introduce ourselves in turn */
+	if (conn->inbound && !nc_conn_send_version(conn))
+		goto out;
+
 	/* acknowledge version receipt */
 	if (!nc_conn_send(conn, "verack", NULL, 0))
 		goto out;
@@ -294,16 +357,28 @@ static bool nc_msg_verack(struct nc_conn *conn)
 
 	log_debug("net: %s verack", conn->addr_str);
 
+	if (conn->handshake_ev) {
+		event_free(conn->handshake_ev);
+		conn->handshake_ev = NULL;
+	}
+
 	/*
 	 * When a connection attempt is made, the peer is deleted
 	 * from the peer list.  When we successfully connect,
 	 * the peer is re-added.  Thus, peers are immediately
-	 * forgotten if they fail, on the first try.
+	 * forgotten if they fail, on the first try.  Incoming
+	 * peers' ports are not ones to connect to.
 	 */
-	conn->peer.last_ok = time(NULL);
-	conn->peer.n_ok++;
-	conn->peer.addr.nTime = (uint32_t) conn->peer.last_ok;
-	peerman_add(conn->nci->peers, &conn->peer, true);
+	if (!conn->inbound) {
+		conn->peer.last_ok = time(NULL);
+		conn->peer.n_ok++;
+		conn->peer.addr.nTime = (uint32_t) conn->peer.last_ok;
+		peerman_add(conn->nci->peers, &conn->peer, true);
+	}
+
+	/* SPV mode: filter before anything else is asked for */
+	if (conn->nci->filter && !nc_conn_send_filter(conn))
+		return false;
 
 	/* request peer addresses */
 	if ((conn->protover >= CADDR_TIME_VERSION) &&
@@ -311,24 +386,12 @@ static bool nc_msg_verack(struct nc_conn *conn)
 		return false;
 
 	/* request blocks */
-	bool rc = true;
-	time_t now = time(NULL);
-	time_t cutoff = now - (24 * 60 * 60);
-	if (conn->nci->last_getblocks < cutoff) {
-		struct msg_getblocks gb;
-		msg_getblocks_init(&gb);
-		blkdb_locator(conn->nci->db, NULL, &gb.locator);
-		cstring *s = ser_msg_getblocks(&gb);
-
-		rc = nc_conn_send(conn, "getblocks", s->str, s->len);
+	time_t cutoff = time(NULL) - (24 * 60 * 60);
+	if ((conn->services & NODE_NETWORK) &&
+	    (conn->nci->last_getblocks < cutoff))
+		return nc_conn_getblocks(conn);
 
-		cstr_free(s, true);
-		msg_getblocks_free(&gb);
-
-		conn->nci->last_getblocks = now;
-	}
-
-	return rc;
+	return true;
 }
 
 static bool nc_msg_inv(struct nc_conn *conn)
@@ -373,7 +436,9 @@ static bool nc_msg_inv(struct nc_conn *conn)
 		switch (inv->type) {
 		case MSG_BLOCK:
 			if (conn->nci->inv_block_process(&inv->hash))
-				msg_vinv_push(&mv_out, MSG_BLOCK, &inv->hash);
+				msg_vinv_push(&mv_out, conn->nci->filter ?
+					      MSG_FILTERED_BLOCK : MSG_BLOCK,
+					      &inv->hash);
 			break;
 
 		case MSG_TX:
@@ -403,12 +468,14 @@ out:
 static bool nc_msg_block(struct nc_conn *conn)
 {
 	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct const_buffer deser_buf = buf;
 	struct bp_block block;
 	bp_block_init(&block);
 
 	bool rc = false;
 
-	if (!deser_bp_block(&block, &buf))
+	/* buf still spans the whole serialized block, for storage */
+	if (!deser_bp_block(&block, &deser_buf))
 		goto out;
 	bp_block_calc_sha256(&block);
 	char hexstr[BU256_STRSZ];
@@ -433,6 +500,416 @@ out:
 	return rc;
 }
 
+static void nc_conn_mblock_free(struct nc_conn *conn)
+{
+	if (conn->mblock) {
+		bp_block_free(conn->mblock);
+		free(conn->mblock);
+		conn->mblock = NULL;
+	}
+	if (conn->mblock_txids) {
+		parr_free(conn->mblock_txids, true);
+		conn->mblock_txids = NULL;
+	}
+}
+
+/*
+ * A filtered block is complete once the matched txs that follow its
+ * merkleblock have come.  A peer that does not send them all would
+ * have us miss payments, and is dropped.  A block whose parent is
+ * unknown is dropped too, and the blocks between asked for.
+ */
+static bool nc_conn_mblock_done(struct nc_conn *conn)
+{
+	struct net_child_info *nci = conn->nci;
+	struct bp_block *block = conn->mblock;
+	bool rc = false;
+
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &block->sha256);
+
+	if (block->vtx->len < conn->mblock_txids->len) {
+		log_info("net: %s merkleblock %s: %zu of %zu txs sent",
+			conn->addr_str, hexstr,
+			block->vtx->len, conn->mblock_txids->len);
+		goto out;
+	}
+
+	if (!blkdb_lookup(nci->db, &block->hashPrevBlock) &&
+	    !blkdb_lookup(nci->db, &block->sha256)) {
+		log_debug("net: %s merkleblock %s: parent unknown",
+			conn->addr_str, hexstr);
+		rc = nc_conn_getblocks(conn);
+		goto out;
+	}
+
+	rc = nci->merkle_block_process(block);
+
+	/* blocks were missed between the scan and this one: ask again,
+	 * from where the scan is, at most once a second
+	 */
+	if (rc && nci->getblocks_tip &&
+	    !bu256_equal(&nci->getblocks_tip->hash, &block->sha256) &&
+	    (nci->last_getblocks != time(NULL)))
+		rc = nc_conn_getblocks(conn);
+
+out:
+	nc_conn_mblock_free(conn);
+	return rc;
+}
+
+static bool nc_msg_merkleblock(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct bp_merkle_block mb;
+	parr *txids = parr_new(0, bu256_freep);
+	bool rc = false;
+
+	bp_merkle_block_init(&mb);
+
+	if (!deser_bp_merkle_block(&mb, &buf))
+		goto out;
+
+	/* not asked for */
+	if (!conn->nci->filter || !conn->nci->merkle_block_process)
+		goto out_ok;
+
+	bp_block_calc_sha256(&mb.hdr);
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &mb.hdr.sha256);
+
+	if (!bp_block_valid_hdr(&mb.hdr) ||
+	    !bp_merkle_block_extract(&mb, txids)) {
+		log_info("net: %s invalid merkleblock %s",
+			conn->addr_str, hexstr);
+		goto out;
+	}
+
+	log_debug("net: %s merkleblock %s (%zu of %u txs)",
+		conn->addr_str, hexstr, txids->len, mb.nTransactions);
+
+	struct bp_block *block = malloc(sizeof(*block));
+	bp_block_copy_hdr(block, &mb.hdr);
+	block->vtx = parr_new(txids->len, bp_tx_freep);
+
+	conn->mblock = block;
+	conn->mblock_txids = txids;
+	txids = NULL;
+
+	/* nothing matched: no txs follow */
+	rc = (conn->mblock_txids->len > 0) || nc_conn_mblock_done(conn);
+	goto out;
+
+out_ok:
+	rc = true;
+
+out:
+	if (txids)
+		parr_free(txids, true);
+	bp_merkle_block_free(&mb);
+	return rc;
+}
+
+/* the txs of a filtered block; loose txs are not wanted */
+static bool nc_msg_tx(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+
+	if (!conn->mblock)
+		return true;
+
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+
+	if (!deser_bp_tx(tx, &buf)) {
+		bp_tx_freep(tx);
+		return false;
+	}
+
+	parr *vtx = conn->mblock->vtx;
+	bp_tx_calc_sha256(tx);
+	if (!bu256_equal(&tx->sha256, parr_idx(conn->mblock_txids, vtx->len))) {
+		bp_tx_freep(tx);
+		return true;
+	}
+
+	parr_add(vtx, tx);
+	if (vtx->len == conn->mblock_txids->len)
+		return nc_conn_mblock_done(conn);
+
+	return true;
+}
+
+static void nc_conn_filter_free(struct nc_conn *conn)
+{
+	if (conn->filter) {
+		bloom_free(conn->filter);
+		free(conn->filter);
+		conn->filter = NULL;
+	}
+}
+
+/*
+ * BIP 37 filters are taken when we serve blocks, as our version
+ * message says (NODE_BLOOM); otherwise they are ignored.
+ */
+static bool nc_msg_filterload(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+
+	if (!conn->nci->block_read)
+		return true;
+
+	struct bloom *bf = malloc(sizeof(*bf));
+	__bloom_init(bf);
+
+	if (!deser_bloom(bf, &buf) || !bloom_size_ok(bf)) {
+		bloom_free(bf);
+		free(bf);
+		return false;
+	}
+
+	log_debug("net: %s filterload(%zu bytes, %u hash funcs)",
+		conn->addr_str, bf->vData->len, bf->nHashFuncs);
+
+	nc_conn_filter_free(conn);
+	conn->filter = bf;
+	return true;
+}
+
+static bool nc_msg_filteradd(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	cstring *data = NULL;
+
+	if (!conn->nci->block_read)
+		return true;
+
+	bool rc = deser_varstr(&data, &buf) &&
+		  (data->len <= MAX_SCRIPT_ELEMENT_SIZE) && conn->filter;
+	if (rc)
+		bloom_insert(conn->filter, data->str, data->len);
+
+	if (data)
+		cstr_free(data, true);
+	return rc;
+}
+
+/* a filtered block: merkleblock, then each matched tx */
+static bool nc_conn_send_filtered(struct nc_conn *conn, struct bp_block *block)
+{
+	struct bp_merkle_block mb;
+	bool *match = calloc(block->vtx->len, sizeof(bool));
+	bool rc = false;
+
+	bp_merkle_block_init(&mb);
+
+	if (!match ||
+	    !bp_merkle_block_filter(&mb, block, conn->filter, match))
+		goto out;
+
+	cstring *s = cstr_new_sz(1024);
+	ser_bp_merkle_block(s, &mb);
+	rc = nc_conn_send(conn, "merkleblock", s->str, s->len);
+
+	unsigned int i;
+	for (i = 0; rc && (i < block->vtx->len); i++) {
+		if (!match[i])
+			continue;
+
+		cstr_resize(s, 0);
+		ser_bp_tx(s, parr_idx(block->vtx, i));
+		rc = nc_conn_send(conn, "tx", s->str, s->len);
+	}
+
+	cstr_free(s, true);
+
+out:
+	free(match);
+	bp_merkle_block_free(&mb);
+	return rc;
+}
+
+/*
+ * Serving blocks: the best chain past the peer's locator, as "inv",
+ * NC_MAX_GETBLOCKS at a time.  When the peer asks for the last of
+ * them, it is sent our best block too, so it asks for more.
+ */
+static bool nc_msg_getblocks(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct net_child_info *nci = conn->nci;
+	struct msg_getblocks gb;
+	struct msg_vinv mv;
+	bool rc = false;
+
+	msg_getblocks_init(&gb);
+	msg_vinv_init(&mv);
+
+	if (!deser_msg_getblocks(&gb, &buf))
+		goto out;
+
+	if (!nci->block_read || !nci->db->best_chain)
+		goto out_ok;
+
+	/* fork point: the first locator block on our best chain */
+	int height = 0;
+	unsigned int i;
+	for (i = 0; gb.locator.vHave && (i < gb.locator.vHave->len); i++) {
+		struct blkinfo *bi = blkdb_lookup(nci->db,
+					parr_idx(gb.locator.vHave, i));
+		if (bi && (blkdb_at_height(nci->db, bi->height) == bi)) {
+			height = bi->height;
+			break;
+		}
+	}
+
+	struct blkinfo *bi = NULL;
+	for (i = 0; i < NC_MAX_GETBLOCKS; i++) {
+		bi = blkdb_at_height(nci->db, ++height);
+		if (!bi)
+			break;
+		msg_vinv_push(&mv, MSG_BLOCK, &bi->hash);
+		if (bu256_equal(&bi->hash, &gb.hash_stop))
+			break;
+	}
+
+	if (!mv.invs)
+		goto out_ok;
+	if (i == NC_MAX_GETBLOCKS)
+		bu256_copy(&conn->hash_continue, &bi->hash);
+
+	cstring *s = ser_msg_vinv(&mv);
+	rc = nc_conn_send(conn, "inv", s->str, s->len);
+	cstr_free(s, true);
+	goto out;
+
+out_ok:
+	rc = true;
+
+out:
+	msg_vinv_free(&mv);
+	msg_getblocks_free(&gb);
+	return rc;
+}
+
+/* the peer reached the end of a "getblocks" reply: offer our best */
+static bool nc_conn_send_continue(struct nc_conn *conn)
+{
+	struct msg_vinv mv;
+
+	bu256_zero(&conn->hash_continue);
+
+	msg_vinv_init(&mv);
+	msg_vinv_push(&mv, MSG_BLOCK, &conn->nci->db->best_chain->hash);
+	cstring *s = ser_msg_vinv(&mv);
+	bool rc = nc_conn_send(conn, "inv", s->str, s->len);
+	cstr_free(s, true);
+	msg_vinv_free(&mv);
+
+	return rc;
+}
+
+/*
+ * Send the blocks a peer asked for, a few at a time: stop while the
+ * write queue holds NC_MAX_SEND_Q bytes, and go on once it drains.
+ */
+static bool nc_conn_serve(struct nc_conn *conn)
+{
+	struct net_child_info *nci = conn->nci;
+
+	while (conn->getdata_q && (conn->write_q_bytes < NC_MAX_SEND_Q)) {
+		if (conn->getdata_pos == conn->getdata_q->len) {
+			parr_free(conn->getdata_q, true);
+			conn->getdata_q = NULL;
+			conn->getdata_pos = 0;
+			break;
+		}
+
+		struct bp_inv *inv = parr_idx(conn->getdata_q,
+					      conn->getdata_pos++);
+		struct bp_block block;
+		bool ok = true;
+
+		/* filtered blocks need the peer's filter */
+		if ((inv->type == MSG_FILTERED_BLOCK) && !conn->filter)
+			continue;
+
+		bp_block_init(&block);
+		if (!nci->block_read(&inv->hash, &block))
+			goto next;
+
+		if (inv->type == MSG_FILTERED_BLOCK) {
+			ok = nc_conn_send_filtered(conn, &block);
+		} else {
+			cstring *s = cstr_new_sz(bp_block_ser_size(&block));
+			ser_bp_block(s, &block);
+			ok = nc_conn_send(conn, "block", s->str, s->len);
+			cstr_free(s, true);
+		}
+
+		if (ok && bu256_equal(&inv->hash, &conn->hash_continue))
+			ok = nc_conn_send_continue(conn);
+
+next:
+		bp_block_free(&block);
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+static bool nc_msg_getdata(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_vinv mv;
+	bool rc = false;
+
+	msg_vinv_init(&mv);
+
+	if (!deser_msg_vinv(&mv, &buf))
+		goto out;
+
+	if (!conn->nci->block_read || !mv.invs)
+		goto out_ok;
+
+	/* queue the blocks; drop the ones already served */
+	if (!conn->getdata_q)
+		conn->getdata_q = parr_new(mv.invs->len, free);
+	parr_remove_range(conn->getdata_q, 0, conn->getdata_pos);
+	conn->getdata_pos = 0;
+
+	unsigned int i;
+	for (i = 0; i < mv.invs->len; i++) {
+		struct bp_inv *inv = parr_idx(mv.invs, i);
+
+		if ((inv->type != MSG_BLOCK) &&
+		    (inv->type != MSG_FILTERED_BLOCK))
+			continue;
+
+		if (conn->getdata_q->len >= NC_MAX_GETDATA) {
+			log_info("net: %s getdata, too many blocks",
+				conn->addr_str);
+			goto out;
+		}
+
+		struct bp_inv *copy = malloc(sizeof(*copy));
+		*copy = *inv;
+		parr_add(conn->getdata_q, copy);
+	}
+
+	rc = nc_conn_serve(conn);
+	goto out;
+
+out_ok:
+	rc = true;
+
+out:
+	msg_vinv_free(&mv);
+	return rc;
+}
+
 static bool nc_conn_message(struct nc_conn *conn)
 {
 	char *command = conn->msg.hdr.command;
@@ -466,6 +943,11 @@ static bool nc_conn_message(struct nc_conn *conn)
 		return false;
 	}
 
+	/* a filtered block's txs follow it; anything else ends them */
+	if (conn->mblock && strncmp(command, "tx", 12) &&
+	    !nc_conn_mblock_done(conn))
+		return false;
+
 	/* incoming message: addr */
 	if (!strncmp(command, "addr", 12))
 		return nc_msg_addr(conn);
@@ -478,6 +960,28 @@ static bool nc_conn_message(struct nc_conn *conn)
 	else if (!strncmp(command, "block", 12))
 		return nc_msg_block(conn);
 
+	/* incoming message: merkleblock, and its tx's */
+	else if (!strncmp(command, "merkleblock", 12))
+		return nc_msg_merkleblock(conn);
+	else if (!strncmp(command, "tx", 12))
+		return nc_msg_tx(conn);
+
+	/* incoming messages: getblocks, getdata */
+	else if (!strncmp(command, "getblocks", 12))
+		return nc_msg_getblocks(conn);
+	else if (!strncmp(command, "getdata", 12))
+		return nc_msg_getdata(conn);
+
+	/* incoming messages: BIP 37 filter */
+	else if (!strncmp(command, "filterload", 12))
+		return nc_msg_filterload(conn);
+	else if (!strncmp(command, "filteradd", 12))
+		return nc_msg_filteradd(conn);
+	else if (!strncmp(command, "filterclear", 12)) {
+		nc_conn_filter_free(conn);
+		return true;
+	}
+
 	log_debug("net: %s unknown message %s",
 		conn->addr_str,
 		command);
@@ -574,16 +1078,29 @@ static void nc_conn_free(struct nc_conn *conn)
 		event_del(conn->write_ev);
 		event_free(conn->write_ev);
 	}
+	if (conn->handshake_ev)
+		event_free(conn->handshake_ev);
 
 	if (conn->fd >= 0)
 		close(conn->fd);
 
 	free(conn->msg.data);
+	nc_conn_filter_free(conn);
+	nc_conn_mblock_free(conn);
+	if (conn->getdata_q)
+		parr_free(conn->getdata_q, true);
 
 	memset(conn, 0, sizeof(*conn));
 	free(conn);
 }
 
+static bool nc_fd_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	return (flags >= 0) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0);
+}
+
 static bool nc_conn_start(struct nc_conn *conn)
 {
 	/* create socket */
@@ -598,9 +1115,7 @@ static bool nc_conn_start(struct nc_conn *conn)
 	}
 
 	/* set non-blocking */
-	int flags = fcntl(conn->fd, F_GETFL, 0);
-	if ((flags < 0) ||
-	    (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+	if (!nc_fd_nonblock(conn->fd)) {
 		log_error("net: socket fcntl %s: %s",
 			conn->addr_str,
 			strerror(errno));
@@ -735,6 +1250,8 @@ static cstring *nc_version_build(struct nc_conn *conn)
 	msg_version_init(&mv);
 
 	mv.nVersion = PROTO_VERSION;
+	if (conn->nci->block_read)
+		mv.nServices = NODE_NETWORK | NODE_BLOOM;
 	mv.nTime = (int64_t) time(NULL);
 	mv.nonce = *conn->nci->instance_nonce;
 	sprintf(mv.strSubVer, "/picocoin:%s/", VERSION);
@@ -742,6 +1259,9 @@ static cstring *nc_version_build(struct nc_conn *conn)
 		conn->nci->db->best_chain ?
 			conn->nci->db->best_chain->height : 0;
 
+	/* SPV mode: no tx relay until our filter is loaded (BIP 37) */
+	mv.bRelay = !conn->nci->filter;
+
 	cstring *rs = ser_msg_version(&mv);
 
 	msg_version_free(&mv);
@@ -814,6 +1334,36 @@ static bool nc_conn_write_disable(struct nc_conn *conn)
 	return true;
 }
 
+static void nc_conn_handshake_evt(int fd, short events, void *priv)
+{
+	struct nc_conn *conn = priv;
+
+	if (conn->dead || conn->seen_verack)
+		return;
+
+	log_info("net: %s handshake timeout", conn->addr_str);
+	nc_conn_kill(conn);
+}
+
+/* a peer that connects must get through version/verack in time */
+static bool nc_conn_handshake_start(struct nc_conn *conn)
+{
+	struct timeval timeout = { NC_HANDSHAKE_TIMEOUT, };
+
+	conn->handshake_ev = evtimer_new(conn->nci->eb,
+					 nc_conn_handshake_evt, conn);
+	if (!conn->handshake_ev)
+		return false;
+
+	if (evtimer_add(conn->handshake_ev, &timeout) != 0) {
+		event_free(conn->handshake_ev);
+		conn->handshake_ev = NULL;
+		return false;
+	}
+
+	return true;
+}
+
 static void nc_conn_evt_connected(int fd, short events, void *priv)
 {
 	struct nc_conn *conn = priv;
@@ -843,11 +1393,7 @@ static void nc_conn_evt_connected(int fd, short events, void *priv)
 	conn->ev = NULL;
 
 	/* build and send "version" message */
-	cstring *msg_data = nc_version_build(conn);
-	bool rc = nc_conn_send(conn, "version", msg_data->str, msg_data->len);
-	cstr_free(msg_data, true);
-
-	if (!rc) {
+	if (!nc_conn_send_version(conn)) {
 		log_info("net: %s !conn_send", conn->addr_str);
 		goto err_out;
 	}
@@ -862,6 +1408,9 @@ static void nc_conn_evt_connected(int fd, short events, void *priv)
 		goto err_out;
 	}
 
+	if (!nc_conn_handshake_start(conn))
+		goto err_out;
+
 	return;
 
 err_out:
@@ -897,14 +1446,28 @@ void nc_conns_gc(struct net_child_info *nci, bool free_all)
 	log_debug("net: gc'd %u connections", n_gc);
 }
 
+static unsigned int nc_conns_inbound(struct net_child_info *nci)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = parr_idx(nci->conns, i);
+		if (conn->inbound)
+			n++;
+	}
+
+	return n;
+}
+
 static void nc_conns_open(struct net_child_info *nci)
 {
-	log_debug("net: open connections (have %zu, want %zu more)",
-		nci->conns->len,
-		NC_MAX_CONN - nci->conns->len);
+	unsigned int n_out = nci->conns->len - nc_conns_inbound(nci);
+
+	log_debug("net: open connections (have %u, want %u more)",
+		n_out, NC_MAX_CONN - MIN(n_out, NC_MAX_CONN));
 
 	while ((bp_hashtab_size(nci->peers->map_addr) > 0) &&
-	       (nci->conns->len < NC_MAX_CONN)) {
+	       (n_out < NC_MAX_CONN)) {
 
 		/* delete peer from front of address list.  it will be
 		 * re-added before writing peer file, if successful
@@ -958,6 +1521,7 @@ static void nc_conns_open(struct net_child_info *nci)
 
 		/* add to our list of active connections */
 		parr_add(nci->conns, conn);
+		n_out++;
 
 		continue;
 
@@ -966,6 +1530,135 @@ err_loop:
 	}
 }
 
+static void nc_listen_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	struct sockaddr_storage saddr;
+	socklen_t saddr_len = sizeof(saddr);
+
+	int conn_fd = accept(fd, (struct sockaddr *) &saddr, &saddr_len);
+	if (conn_fd < 0)
+		return;
+
+	struct peer peer;
+	peer_init(&peer);
+
+	if (saddr.ss_family == AF_INET) {
+		struct sockaddr_in *saddr4 = (struct sockaddr_in *) &saddr;
+		peer.addr.ip[10] = 0xff;
+		peer.addr.ip[11] = 0xff;
+		memcpy(&peer.addr.ip[12], &saddr4->sin_addr.s_addr, 4);
+		peer.addr.port = ntohs(saddr4->sin_port);
+	} else {
+		struct sockaddr_in6 *saddr6 = (struct sockaddr_in6 *) &saddr;
+		memcpy(peer.addr.ip, &saddr6->sin6_addr.s6_addr, 16);
+		peer.addr.port = ntohs(saddr6->sin6_port);
+	}
+
+	struct nc_conn *conn = nc_conn_new(&peer);
+	peer_free(&peer);
+	conn->nci = nci;
+	conn->fd = conn_fd;
+	conn->ipv4 = is_ipv4_mapped(conn->peer.addr.ip);
+	conn->inbound = true;
+	conn->connected = true;
+
+	if (nc_conns_inbound(nci) >= NC_MAX_INBOUND) {
+		log_info("net: %s refused, too many connections",
+			conn->addr_str);
+		goto err_out;
+	}
+
+	/* switch to read-header state; they speak first */
+	conn->msg_p = conn->hdrbuf;
+	conn->expected = P2P_HDR_SZ;
+	conn->reading_hdr = true;
+
+	if (!nc_fd_nonblock(conn->fd) || !nc_conn_read_enable(conn) ||
+	    !nc_conn_handshake_start(conn))
+		goto err_out;
+
+	log_debug("net: connection from %s", conn->addr_str);
+
+	parr_add(nci->conns, conn);
+	return;
+
+err_out:
+	nc_conn_free(conn);
+}
+
+/* accept connections on port, IPv6 and IPv4 alike */
+bool nc_listen(struct net_child_info *nci, unsigned short port)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0) {
+		log_error("net: listen socket: %s", strerror(errno));
+		return false;
+	}
+
+	int on = 1, off = 0;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+	struct sockaddr_in6 saddr6;
+	memset(&saddr6, 0, sizeof(saddr6));
+	saddr6.sin6_family = AF_INET6;
+	saddr6.sin6_addr = in6addr_any;
+	saddr6.sin6_port = htons(port);
+
+	if ((bind(fd, (struct sockaddr *) &saddr6, sizeof(saddr6)) < 0) ||
+	    (listen(fd, 16) < 0) || !nc_fd_nonblock(fd)) {
+		log_error("net: listen on port %u: %s", port, strerror(errno));
+		goto err_out;
+	}
+
+	nci->listen_ev = event_new(nci->eb, fd, EV_READ | EV_PERSIST,
+				   nc_listen_evt, nci);
+	if (!nci->listen_ev)
+		goto err_out;
+	if (event_add(nci->listen_ev, NULL) != 0) {
+		event_free(nci->listen_ev);
+		nci->listen_ev = NULL;
+		goto err_out;
+	}
+
+	log_info("net: listening on port %u", port);
+	return true;
+
+err_out:
+	close(fd);
+	return false;
+}
+
+void nc_listen_stop(struct net_child_info *nci)
+{
+	if (!nci->listen_ev)
+		return;
+
+	int fd = event_get_fd(nci->listen_ev);
+	event_del(nci->listen_ev);
+	event_free(nci->listen_ev);
+	nci->listen_ev = NULL;
+	close(fd);
+}
+
+/*
+ * SPV mode: load filter into every peer, those connected now and
+ * those to come.  The caller keeps filter, for as long as it is set.
+ */
+void nc_filter_load(struct net_child_info *nci, struct bloom *filter)
+{
+	nci->filter = filter;
+
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = parr_idx(nci->conns, i);
+		if (!conn->dead && conn->seen_verack &&
+		    !nc_conn_send_filter(conn))
+			nc_conn_kill(conn);
+	}
+}
+
 void nc_conns_process(struct net_child_info *nci)
 {
 	nc_conns_gc(nci, false);
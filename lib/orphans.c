@@ -0,0 +1,178 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ccoin/orphans.h>
+
+void bp_orphan_freep(void *p)
+{
+	struct bp_orphan *orphan = p;
+	if (!orphan)
+		return;
+
+	buffer_freep(orphan->data);
+
+	memset(orphan, 0, sizeof(*orphan));
+	free(orphan);
+}
+
+static void orphan_list_freep(void *p)
+{
+	parr_free(p, true);
+}
+
+/*
+ * Decode a held block, ready to connect: the block hash, checked
+ * against the one it was held under, and every tx hash.
+ */
+bool bp_orphan_block(const struct bp_orphan *orphan, struct bp_block *block)
+{
+	struct const_buffer buf = { orphan->data->p, orphan->data->len };
+
+	if (!deser_bp_block(block, &buf))
+		return false;
+
+	bp_block_calc_sha256(block);
+	if (!bu256_equal(&block->sha256, &orphan->hash))
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++)
+		bp_tx_calc_sha256(parr_idx(block->vtx, i));
+
+	return true;
+}
+
+void bp_orphan_pool_init(struct bp_orphan_pool *pool, size_t max_bytes)
+{
+	memset(pool, 0, sizeof(*pool));
+
+	pool->by_hash = bp_hashtab_new(bu256_hash, bu256_equal_);
+	pool->by_prev = bp_hashtab_new_ext(bu256_hash, bu256_equal_,
+					   bu256_freep, orphan_list_freep);
+	pool->max_bytes = max_bytes;
+}
+
+void bp_orphan_pool_free(struct bp_orphan_pool *pool)
+{
+	if (!pool)
+		return;
+
+	struct bp_orphan *orphan = pool->oldest;
+	while (orphan) {
+		struct bp_orphan *newer = orphan->newer;
+		bp_orphan_freep(orphan);
+		orphan = newer;
+	}
+
+	if (pool->by_hash)
+		bp_hashtab_unref(pool->by_hash);
+	if (pool->by_prev)
+		bp_hashtab_unref(pool->by_prev);
+
+	memset(pool, 0, sizeof(*pool));
+}
+
+/* unlink from both indices and the age list; caller owns orphan */
+static void orphan_unlink(struct bp_orphan_pool *pool,
+			  struct bp_orphan *orphan)
+{
+	bp_hashtab_del(pool->by_hash, &orphan->hash);
+
+	parr *siblings = bp_hashtab_get(pool->by_prev, &orphan->prev_hash);
+	if (siblings) {
+		parr_remove(siblings, orphan);
+		if (siblings->len == 0)
+			bp_hashtab_del(pool->by_prev, &orphan->prev_hash);
+	}
+
+	if (orphan->older)
+		orphan->older->newer = orphan->newer;
+	else
+		pool->oldest = orphan->newer;
+	if (orphan->newer)
+		orphan->newer->older = orphan->older;
+	else
+		pool->newest = orphan->older;
+	orphan->older = orphan->newer = NULL;
+
+	pool->bytes -= orphan->data->len;
+}
+
+bool bp_orphan_add(struct bp_orphan_pool *pool, const bu256_t *hash,
+		   const bu256_t *prev_hash, const void *data, size_t data_len)
+{
+	if (bp_orphan_have(pool, hash) || (data_len > pool->max_bytes))
+		return false;
+
+	/* make room, oldest first */
+	while (pool->oldest && (pool->bytes + data_len > pool->max_bytes)) {
+		struct bp_orphan *victim = pool->oldest;
+		orphan_unlink(pool, victim);
+		bp_orphan_freep(victim);
+		pool->n_evicted++;
+	}
+
+	struct bp_orphan *orphan = calloc(1, sizeof(*orphan));
+	if (!orphan)
+		return false;
+	orphan->data = buffer_copy(data, data_len);
+	if (!orphan->data) {
+		free(orphan);
+		return false;
+	}
+	bu256_copy(&orphan->hash, hash);
+	bu256_copy(&orphan->prev_hash, prev_hash);
+
+	parr *siblings = bp_hashtab_get(pool->by_prev, prev_hash);
+	if (!siblings) {
+		siblings = parr_new(1, NULL);
+		bp_hashtab_put(pool->by_prev, bu256_new(prev_hash), siblings);
+	}
+	parr_add(siblings, orphan);
+	bp_hashtab_put(pool->by_hash, &orphan->hash, orphan);
+
+	orphan->older = pool->newest;
+	if (pool->newest)
+		pool->newest->newer = orphan;
+	else
+		pool->oldest = orphan;
+	pool->newest = orphan;
+
+	pool->bytes += data_len;
+	pool->n_added++;
+
+	return true;
+}
+
+/*
+ * Remove all orphans whose parent is prev_hash, appending them to out
+ * in arrival order.  The caller takes ownership (bp_orphan_freep).
+ */
+unsigned int bp_orphan_take_children(struct bp_orphan_pool *pool,
+				     const bu256_t *prev_hash, parr *out)
+{
+	parr *siblings = bp_hashtab_get(pool->by_prev, prev_hash);
+	if (!siblings)
+		return 0;
+
+	unsigned int n = 0;
+	while (siblings->len > 0) {
+		struct bp_orphan *orphan = parr_idx(siblings, 0);
+		bool last = (siblings->len == 1);
+
+		/* the last unlink frees siblings */
+		orphan_unlink(pool, orphan);
+		parr_add(out, orphan);
+		n++;
+
+		if (last)
+			break;
+	}
+
+	return n;
+}
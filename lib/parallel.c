@@ -0,0 +1,185 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <ccoin/parallel.h>
+#include <ccoin/queue.h>
+#include <ccoin/util.h>
+
+struct par_job {
+	bp_parallel_fn	fn;
+	void		*ctx;
+
+	unsigned int	n;
+	unsigned int	next;		/* first index not yet handed out */
+	unsigned int	chunk;
+	unsigned int	running;	/* threads inside a chunk */
+	unsigned int	limit;		/* max running */
+	bool		failed;
+
+	struct par_job	*next_job;
+};
+
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_done = PTHREAD_COND_INITIALIZER;
+static struct par_job *par_jobs;	/* active loops */
+static pthread_t *par_threads;
+static unsigned int par_n_threads;
+static unsigned int par_limit;		/* 0 = # cpus */
+static bool par_stop;
+
+static bool par_job_available(const struct par_job *job)
+{
+	return !job->failed && (job->next < job->n) &&
+	       (job->running < job->limit);
+}
+
+/* run the next chunk of job; called and returns with par_lock held */
+static void par_run_chunk(struct par_job *job)
+{
+	unsigned int start = job->next;
+	unsigned int end = MIN(start + job->chunk, job->n);
+
+	job->next = end;
+	job->running++;
+	pthread_mutex_unlock(&par_lock);
+
+	bool ok = true;
+	unsigned int i;
+	for (i = start; ok && (i < end); i++)
+		ok = job->fn(job->ctx, i);
+
+	pthread_mutex_lock(&par_lock);
+	if (!ok)
+		job->failed = true;
+	job->running--;
+	if (job->running == 0)
+		pthread_cond_broadcast(&par_done);
+}
+
+static void *par_worker(void *arg)
+{
+	pthread_mutex_lock(&par_lock);
+
+	while (!par_stop) {
+		struct par_job *job;
+		for (job = par_jobs; job; job = job->next_job)
+			if (par_job_available(job))
+				break;
+
+		if (job)
+			par_run_chunk(job);
+		else
+			pthread_cond_wait(&par_work, &par_lock);
+	}
+
+	pthread_mutex_unlock(&par_lock);
+	return NULL;
+}
+
+/* grow the pool to n_threads; par_lock held */
+static void par_start(unsigned int n_threads)
+{
+	if (n_threads <= par_n_threads)
+		return;
+
+	pthread_t *threads = realloc(par_threads,
+				     n_threads * sizeof(pthread_t));
+	if (!threads)
+		return;
+	par_threads = threads;
+
+	while (par_n_threads < n_threads) {
+		if (pthread_create(&par_threads[par_n_threads], NULL,
+				   par_worker, NULL))
+			break;
+		par_n_threads++;
+	}
+}
+
+unsigned int bp_parallel_threads(void)
+{
+	pthread_mutex_lock(&par_lock);
+	unsigned int n = par_limit;
+	pthread_mutex_unlock(&par_lock);
+
+	return n ? n : bp_num_cpus();
+}
+
+void bp_parallel_set_threads(unsigned int n_threads)
+{
+	pthread_mutex_lock(&par_lock);
+	par_limit = n_threads;
+	pthread_mutex_unlock(&par_lock);
+}
+
+bool bp_parallel_for(unsigned int n, bp_parallel_fn fn, void *ctx)
+{
+	unsigned int limit = bp_parallel_threads();
+	unsigned int i;
+
+	if ((limit < 2) || (n < 2)) {
+		for (i = 0; i < n; i++)
+			if (!fn(ctx, i))
+				return false;
+		return true;
+	}
+
+	struct par_job job = {
+		.fn	= fn,
+		.ctx	= ctx,
+		.n	= n,
+		.chunk	= MAX(1, n / (limit * 4)),
+		.limit	= limit,
+	};
+
+	pthread_mutex_lock(&par_lock);
+
+	par_start(limit - 1);
+	job.next_job = par_jobs;
+	par_jobs = &job;
+	pthread_cond_broadcast(&par_work);
+
+	while (1) {
+		if (par_job_available(&job))
+			par_run_chunk(&job);
+		else if ((job.failed || (job.next >= job.n)) &&
+			 (job.running == 0))
+			break;
+		else
+			pthread_cond_wait(&par_done, &par_lock);
+	}
+
+	struct par_job **p = &par_jobs;
+	while (*p != &job)
+		p = &(*p)->next_job;
+	*p = job.next_job;
+
+	pthread_mutex_unlock(&par_lock);
+
+	return !job.failed;
+}
+
+void bp_parallel_shutdown(void)
+{
+	pthread_mutex_lock(&par_lock);
+	par_stop = true;
+	pthread_cond_broadcast(&par_work);
+	pthread_mutex_unlock(&par_lock);
+
+	unsigned int i;
+	for (i = 0; i < par_n_threads; i++)
+		pthread_join(par_threads[i], NULL);
+
+	pthread_mutex_lock(&par_lock);
+	free(par_threads);
+	par_threads = NULL;
+	par_n_threads = 0;
+	par_stop = false;
+	pthread_mutex_unlock(&par_lock);
+}
@@ -0,0 +1,108 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/queue.h>
+
+bool bp_queue_init(struct bp_queue *q, size_t cap)
+{
+	memset(q, 0, sizeof(*q));
+
+	if (!cap)
+		return false;
+
+	q->ring = calloc(cap, sizeof(void *));
+	if (!q->ring)
+		return false;
+	q->cap = cap;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+
+	return true;
+}
+
+void bp_queue_free(struct bp_queue *q)
+{
+	if (!q || !q->ring)
+		return;
+
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+
+	free(q->ring);
+	memset(q, 0, sizeof(*q));
+}
+
+bool bp_queue_push(struct bp_queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while ((q->len == q->cap) && !q->closed)
+		pthread_cond_wait(&q->not_full, &q->lock);
+
+	if (q->closed) {
+		pthread_mutex_unlock(&q->lock);
+		return false;
+	}
+
+	q->ring[(q->head + q->len) % q->cap] = item;
+	q->len++;
+
+	q->n_push++;
+	q->depth_sum += q->len;
+	if (q->len > q->depth_max)
+		q->depth_max = q->len;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return true;
+}
+
+bool bp_queue_pop(struct bp_queue *q, void **item)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while ((q->len == 0) && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+
+	if (q->len == 0) {
+		pthread_mutex_unlock(&q->lock);
+		return false;
+	}
+
+	*item = q->ring[q->head];
+	q->ring[q->head] = NULL;
+	q->head = (q->head + 1) % q->cap;
+	q->len--;
+
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	return true;
+}
+
+void bp_queue_close(struct bp_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+unsigned int bp_num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (unsigned int) n : 1;
+}
@@ -39,6 +39,37 @@ static void string_find_del(cstring *s, const struct buffer *buf)
 	cstr_free(script, true);
 }
 
+/* Serialize scriptCode, skipping OP_CODESEPARATORs */
+static void ser_script_code(cstring *s, const cstring *scriptCode)
+{
+	struct const_buffer it = { scriptCode->str, scriptCode->len };
+	struct const_buffer itBegin = it;
+	struct bscript_op op;
+	unsigned int nCodeSeparators = 0;
+
+	struct bscript_parser bp;
+	bsp_start(&bp, &it);
+
+	while (bsp_getop(&op, &bp)) {
+		if (op.op == OP_CODESEPARATOR)
+		    nCodeSeparators++;
+	}
+	ser_varlen(s, scriptCode->len - nCodeSeparators);
+
+	it = itBegin;
+	bsp_start(&bp, &it);
+
+	while (bsp_getop(&op, &bp)) {
+	    if (op.op == OP_CODESEPARATOR) {
+			ser_bytes(s, itBegin.p, it.p - itBegin.p - 1);
+			itBegin  = it;
+	    }
+	}
+
+	if (itBegin.p != scriptCode->str + scriptCode->len)
+	    ser_bytes(s, itBegin.p, it.p - itBegin.p);
+}
+
 void bp_tx_sigserializer(cstring *s, const cstring *scriptCode,
 			const struct bp_tx *txTo, unsigned int nIn,
 			int nHashType)
@@ -73,35 +104,8 @@ void bp_tx_sigserializer(cstring *s, const cstring *scriptCode,
 			ser_varlen(s, (int)0);
 		else if (scriptCode == NULL)
 		    cstr_append_c(s, 0);
-		else {
-			/** Serialize the passed scriptCode, skipping OP_CODESEPARATORs */
-			struct const_buffer it = { scriptCode->str, scriptCode->len };
-			struct const_buffer itBegin = it;
-			struct bscript_op op;
-			unsigned int nCodeSeparators = 0;
-
-			struct bscript_parser bp;
-			bsp_start(&bp, &it);
-
-			while (bsp_getop(&op, &bp)) {
-				if (op.op == OP_CODESEPARATOR)
-				    nCodeSeparators++;
-			}
-			ser_varlen(s, scriptCode->len - nCodeSeparators);
-
-			it = itBegin;
-			bsp_start(&bp, &it);
-
-			while (bsp_getop(&op, &bp)) {
-			    if (op.op == OP_CODESEPARATOR) {
-					ser_bytes(s, itBegin.p, it.p - itBegin.p - 1);
-					itBegin  = it;
-			    }
-			}
-
-			if (itBegin.p != scriptCode->str + scriptCode->len)
-			    ser_bytes(s, itBegin.p, it.p - itBegin.p);
-		}
+		else
+			ser_script_code(s, scriptCode);
 
 		// Serialize the nSequence
 		if ((nInput != nIn) && (fHashSingle || fHashNone))
@@ -158,6 +162,109 @@ void bp_tx_sighash(bu256_t *hash, const cstring *scriptCode,
 	cstr_free(s, true);
 }
 
+/*
+ * SIGHASH_ALL signature hashes for many inputs of one transaction.
+ *
+ * Every input's SIGHASH_ALL preimage is the same serialization, with
+ * all input scripts empty but the one being signed.  That blank
+ * serialization is built once, and hashed once up to each input's
+ * script; an input's hash then resumes from that SHA-256 state and
+ * hashes only its own script and what follows.  The sighasher is
+ * read-only once built, so inputs may be hashed from several threads.
+ */
+bool bp_tx_sighasher_init(struct bp_tx_sighasher *sh,
+			  const struct bp_tx *txTo)
+{
+	memset(sh, 0, sizeof(*sh));
+
+	if (!txTo->vin || !txTo->vout)
+		return false;
+
+	unsigned int n_in = txTo->vin->len;
+	cstring *s = cstr_new_sz(64 + (n_in * 41) + (txTo->vout->len * 34));
+
+	sh->tx = txTo;
+	sh->blank = s;
+	sh->script_ofs = calloc(MAX(n_in, 1), sizeof(size_t));
+	sh->midstate = calloc(MAX(n_in, 1), sizeof(SHA256_CTX));
+	if (!sh->script_ofs || !sh->midstate) {
+		bp_tx_sighasher_free(sh);
+		return false;
+	}
+
+	ser_u32(s, txTo->nVersion);
+	ser_varlen(s, n_in);
+
+	unsigned int i;
+	for (i = 0; i < n_in; i++) {
+		struct bp_txin *txin = parr_idx(txTo->vin, i);
+
+		ser_bp_outpt(s, &txin->prevout);
+		sh->script_ofs[i] = s->len;
+		ser_varlen(s, 0);
+		ser_u32(s, txin->nSequence);
+	}
+
+	ser_varlen(s, txTo->vout->len);
+	for (i = 0; i < txTo->vout->len; i++)
+		ser_bp_txout(s, parr_idx(txTo->vout, i));
+
+	ser_u32(s, txTo->nLockTime);
+	ser_s32(s, SIGHASH_ALL);
+
+	SHA256_CTX ctx;
+	size_t pos = 0;
+
+	sha256_Init(&ctx);
+	for (i = 0; i < n_in; i++) {
+		sha256_Update(&ctx, s->str + pos, sh->script_ofs[i] - pos);
+		pos = sh->script_ofs[i];
+		sh->midstate[i] = ctx;
+	}
+
+	return true;
+}
+
+void bp_tx_sighasher_free(struct bp_tx_sighasher *sh)
+{
+	if (!sh)
+		return;
+
+	cstr_free(sh->blank, true);
+	free(sh->script_ofs);
+	free(sh->midstate);
+	memset(sh, 0, sizeof(*sh));
+}
+
+/* same result as bp_tx_sighash(hash, scriptCode, tx, nIn, SIGHASH_ALL) */
+void bp_tx_sighasher_hash(const struct bp_tx_sighasher *sh, bu256_t *hash,
+			  const cstring *scriptCode, unsigned int nIn)
+{
+	if (nIn >= sh->tx->vin->len) {
+		//  nIn out of range
+		bu256_set_u64(hash, 1);
+		return;
+	}
+
+	SHA256_CTX ctx = sh->midstate[nIn];
+	cstring *code = cstr_new_sz(scriptCode ? scriptCode->len + 9 : 1);
+
+	if (scriptCode)
+		ser_script_code(code, scriptCode);
+	else
+		cstr_append_c(code, 0);
+	sha256_Update(&ctx, code->str, code->len);
+	cstr_free(code, true);
+
+	/* skip the blank script's length byte */
+	size_t tail = sh->script_ofs[nIn] + 1;
+	sha256_Update(&ctx, sh->blank->str + tail, sh->blank->len - tail);
+
+	uint8_t md1[SHA256_DIGEST_LENGTH];
+	sha256_Final(md1, &ctx);
+	sha256_Raw(md1, sizeof(md1), (uint8_t *) hash);
+}
+
 static const unsigned char disabled_op[256] = {
 	[OP_CAT] = 1,
 	[OP_SUBSTR] = 1,
@@ -6,27 +6,18 @@
 #include <ccoin/core.h>
 #include <ccoin/buint.h>
 #include <ccoin/key.h>
+#include <ccoin/parallel.h>
 #include <ccoin/util.h>
 
-static bool sign1(const bu160_t *key_id, struct bp_keystore *ks,
-		  const bu256_t *hash, int nHashType,
-		  cstring *scriptSig)
+static bool sign_hash(const struct bp_key *key, const bu256_t *hash,
+		      int nHashType, cstring *scriptSig)
 {
-	struct bp_key key;
-	bool rc = false;
-
-	bp_key_init(&key);
-
-	/* find private key in keystore */
-	if (!bkeys_key_get(ks, key_id, &key))
-		goto out;
-
 	void *sig = NULL;
 	size_t siglen = 0;
 
 	/* sign hash with private key */
-	if (!bp_sign(&key, hash, sizeof(*hash), &sig, &siglen))
-		goto out;
+	if (!bp_sign(key, hash, sizeof(*hash), &sig, &siglen))
+		return false;
 
 	/* append nHashType to signature */
 	unsigned char ch = (unsigned char) nHashType;
@@ -38,6 +29,25 @@ static bool sign1(const bu160_t *key_id, struct bp_keystore *ks,
 	bsp_push_data(scriptSig, sig, siglen);
 	free(sig);
 
+	return true;
+}
+
+static bool sign1(const bu160_t *key_id, struct bp_keystore *ks,
+		  const bu256_t *hash, int nHashType,
+		  cstring *scriptSig)
+{
+	struct bp_key key;
+	bool rc = false;
+
+	bp_key_init(&key);
+
+	/* find private key in keystore */
+	if (!bkeys_key_get(ks, key_id, &key))
+		goto out;
+
+	if (!sign_hash(&key, hash, nHashType, scriptSig))
+		goto out;
+
 	rc = true;
 
 out:
@@ -129,3 +139,184 @@ bool bp_sign_sig(struct bp_keystore *ks, const struct bp_utxo *txFrom,
 	return bp_script_sign(ks, txout->scriptPubKey, txTo, nIn, nHashType);
 }
 
+
+/*
+ * Signing every input of a transaction at once.
+ *
+ * The templates are matched, keys looked up and (for hash types other
+ * than SIGHASH_ALL) signature hashes computed in the caller's thread.
+ * SIGHASH_ALL hashes come from one bp_tx_sighasher, shared by all
+ * inputs.  Hashing and signing then run on the bp_parallel_for() pool,
+ * and the scriptSigs are stored once every input is done.
+ */
+struct tx_sign_input {
+	const cstring		*scriptCode;
+	enum txnouttype		txtype;
+	struct bp_key		key;
+	bool			have_hash;
+	bu256_t			hash;
+	cstring			*scriptSig;
+	enum bp_sign_result	result;
+};
+
+struct tx_sign_ctx {
+	const struct bp_tx_sighasher *sh;
+	struct tx_sign_input	*in;
+	int			nHashType;
+};
+
+static enum bp_sign_result tx_sign_prepare(struct bp_keystore *ks,
+					   const struct bp_tx *txTo,
+					   unsigned int nIn, int nHashType,
+					   struct tx_sign_input *in)
+{
+	struct bscript_addr addrs;
+	enum bp_sign_result res = BP_SIGN_NONSTANDARD;
+	struct buffer *kbuf;
+	bu160_t key_id;
+
+	if (!in->scriptCode)
+		return BP_SIGN_SKIPPED;
+
+	if (!bsp_addr_parse(&addrs, in->scriptCode->str,
+			    in->scriptCode->len))
+		return BP_SIGN_NONSTANDARD;
+
+	in->txtype = addrs.txtype;
+	switch (addrs.txtype) {
+	case TX_PUBKEY:
+		kbuf = addrs.pub->data;
+		bu_Hash160((unsigned char *)&key_id, kbuf->p, kbuf->len);
+		break;
+
+	case TX_PUBKEYHASH:
+		kbuf = addrs.pubhash->data;
+		memcpy(&key_id, kbuf->p, kbuf->len);
+		break;
+
+	default:			/* as bp_script_sign() */
+		goto out;
+	}
+
+	res = BP_SIGN_NO_KEY;
+	if (!bkeys_key_get(ks, &key_id, &in->key))
+		goto out;
+
+	if (nHashType != SIGHASH_ALL) {
+		bp_tx_sighash(&in->hash, in->scriptCode, txTo, nIn, nHashType);
+		in->have_hash = true;
+	}
+
+	res = BP_SIGN_OK;
+
+out:
+	bsp_addr_free(&addrs);
+	return res;
+}
+
+static bool tx_sign_input(void *ctx_, unsigned int idx)
+{
+	struct tx_sign_ctx *ctx = ctx_;
+	struct tx_sign_input *in = &ctx->in[idx];
+
+	if (in->result != BP_SIGN_OK)
+		return true;
+
+	if (!in->have_hash)
+		bp_tx_sighasher_hash(ctx->sh, &in->hash, in->scriptCode, idx);
+
+	cstring *scriptSig = cstr_new_sz(128);
+
+	if (!sign_hash(&in->key, &in->hash, ctx->nHashType, scriptSig))
+		goto err_out;
+
+	if (in->txtype == TX_PUBKEYHASH) {
+		uint8_t pubkey[BP_PUBKEY_SZ];
+
+		if (!bp_pubkey_get_buf(&in->key, pubkey))
+			goto err_out;
+		bsp_push_data(scriptSig, pubkey, sizeof(pubkey));
+	}
+
+	in->scriptSig = scriptSig;
+	return true;
+
+err_out:
+	cstr_free(scriptSig, true);
+	in->result = BP_SIGN_FAILED;
+	return true;		/* carry on with the other inputs */
+}
+
+/*
+ * Sign each input nIn of txTo spending fromPubKeys[nIn] (NULL to leave
+ * that input alone), as bp_script_sign() would.  Each input's outcome
+ * goes to results[nIn], if results is not NULL.  Returns the number of
+ * inputs signed.
+ */
+unsigned int bp_tx_sign(struct bp_keystore *ks, struct bp_tx *txTo,
+			const cstring * const *fromPubKeys, int nHashType,
+			enum bp_sign_result *results)
+{
+	if (!ks || !txTo || !txTo->vin || !txTo->vout || !fromPubKeys)
+		return 0;
+
+	/* the workers below share one secp256k1 context; create it here,
+	 * not lazily from several threads at once
+	 */
+	if (!bp_key_static_init())
+		return 0;
+
+	unsigned int n_in = txTo->vin->len;
+	unsigned int i, n_signed = 0;
+	struct bp_tx_sighasher sh;
+	bool have_sh = false;
+
+	struct tx_sign_input *in = calloc(MAX(n_in, 1), sizeof(*in));
+	if (!in)
+		return 0;
+
+	for (i = 0; i < n_in; i++) {
+		in[i].scriptCode = fromPubKeys[i];
+		in[i].result = tx_sign_prepare(ks, txTo, i, nHashType, &in[i]);
+	}
+
+	if (nHashType == SIGHASH_ALL) {
+		have_sh = bp_tx_sighasher_init(&sh, txTo);
+
+		/* fall back to hashing input by input */
+		for (i = 0; !have_sh && (i < n_in); i++) {
+			if (in[i].result != BP_SIGN_OK)
+				continue;
+			bp_tx_sighash(&in[i].hash, in[i].scriptCode, txTo, i,
+				      nHashType);
+			in[i].have_hash = true;
+		}
+	}
+
+	struct tx_sign_ctx ctx = {
+		.sh		= have_sh ? &sh : NULL,
+		.in		= in,
+		.nHashType	= nHashType,
+	};
+	bp_parallel_for(n_in, tx_sign_input, &ctx);
+
+	for (i = 0; i < n_in; i++) {
+		if (in[i].result == BP_SIGN_OK) {
+			struct bp_txin *txin = parr_idx(txTo->vin, i);
+
+			if (txin->scriptSig)
+				cstr_free(txin->scriptSig, true);
+			txin->scriptSig = in[i].scriptSig;
+			n_signed++;
+		}
+		if (results)
+			results[i] = in[i].result;
+	}
+
+	if (have_sh)
+		bp_tx_sighasher_free(&sh);
+	memset(in, 0, MAX(n_in, 1) * sizeof(*in));
+	free(in);
+
+	return n_signed;
+}
@@ -82,6 +82,28 @@ void ser_varstr(cstring *s, cstring *s_in)
 	ser_bytes(s, s_in->str, s_in->len);
 }
 
+/* MSB-first base-128 varint, as used in the reference client's
+ * UTXO database: one byte below 128, and each continuation byte is
+ * biased by one so every value has exactly one encoding.
+ */
+void ser_varint(cstring *s, uint64_t v)
+{
+	unsigned char tmp[10];
+	unsigned int len = 0;
+
+	while (1) {
+		tmp[len] = (v & 0x7f) | (len ? 0x80 : 0x00);
+		if (v <= 0x7f)
+			break;
+		v = (v >> 7) - 1;
+		len++;
+	}
+
+	do {
+		ser_bytes(s, &tmp[len], 1);
+	} while (len--);
+}
+
 void ser_u256_array(cstring *s, parr *arr)
 {
 	unsigned int arr_len = arr ? arr->len : 0;
@@ -193,6 +215,28 @@ bool deser_varlen(uint32_t *lo, struct const_buffer *buf)
 	return true;
 }
 
+bool deser_varint(uint64_t *vo, struct const_buffer *buf)
+{
+	uint64_t v = 0;
+
+	while (1) {
+		unsigned char c;
+		if (!deser_bytes(&c, buf, 1)) return false;
+
+		if (v > (UINT64_MAX >> 7))
+			return false;
+		v = (v << 7) | (c & 0x7f);
+		if (!(c & 0x80))
+			break;
+		if (v == UINT64_MAX)
+			return false;
+		v++;
+	}
+
+	*vo = v;
+	return true;
+}
+
 bool deser_str(char *so, struct const_buffer *buf, size_t maxlen)
 {
 	uint32_t len;
@@ -280,12 +324,7 @@ err_out:
 	return false;
 }
 
-void u256_from_compact(mpz_t vo, uint32_t c)
+bool u256_from_compact(bu256_t *vo, uint32_t c)
 {
-	uint32_t nbytes = (c >> 24) & 0xFF;
-	uint32_t cv = c & 0xFFFFFF;
-
-	mpz_set_ui(vo, cv);
-	mpz_mul_2exp(vo, vo, (8 * (nbytes - 3)));
+	return bu256_set_compact(vo, c);
 }
-
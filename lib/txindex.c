@@ -0,0 +1,299 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/txindex.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#ifdef __APPLE__
+#  define off64_t off_t
+#  define pread64 pread
+#endif
+
+static const char txindex_magic[8] = "cctxidx\0";
+
+static void ser_txindex_ent(cstring *s, const struct bp_txindex_ent *ent)
+{
+	ser_u256(s, &ent->txid);
+	ser_u64(s, ent->blk_pos);
+	ser_u32(s, ent->tx_ofs);
+	ser_u32(s, ent->tx_len);
+}
+
+static bool deser_txindex_ent(struct bp_txindex_ent *ent,
+			      struct const_buffer *buf)
+{
+	if (!deser_u256(&ent->txid, buf)) return false;
+	if (!deser_u64(&ent->blk_pos, buf)) return false;
+	if (!deser_u32(&ent->tx_ofs, buf)) return false;
+	if (!deser_u32(&ent->tx_len, buf)) return false;
+	return true;
+}
+
+static bool txindex_is_commit(const struct bp_txindex_ent *ent)
+{
+	static const bu256_t zero;
+	return bu256_equal(&ent->txid, &zero);
+}
+
+static bool txindex_read_hdr(struct bp_txindex *idx)
+{
+	struct const_buffer buf;
+	uint64_t blocks_end;
+
+	if (!bp_bucketfile_hdr(&idx->bf, &buf))
+		return true;
+	if (!deser_u64(&blocks_end, &buf))
+		return false;
+
+	idx->blocks_end = MAX(idx->blocks_end, blocks_end);
+	return true;
+}
+
+/* move a block's entries, committed, into the in-memory map */
+static void txindex_publish(struct bp_txindex *idx, parr *pending)
+{
+	unsigned int i;
+	for (i = 0; i < pending->len; i++) {
+		struct bp_txindex_ent *ent = parr_idx(pending, i);
+		bp_hashtab_put(idx->recent, &ent->txid, ent);
+	}
+
+	pending->len = 0;
+}
+
+struct txindex_replay {
+	struct bp_txindex	*idx;
+	parr			*pending;
+};
+
+/* the commit record of a block carries its tx count, in tx_len */
+static int txindex_replay_rec(void *priv, const unsigned char *rec)
+{
+	struct txindex_replay *r = priv;
+	struct const_buffer buf = { rec, BP_TXINDEX_ENT_SZ };
+	struct bp_txindex_ent *ent = malloc(sizeof(*ent));
+	deser_txindex_ent(ent, &buf);
+
+	if (!txindex_is_commit(ent)) {
+		parr_add(r->pending, ent);
+		return 0;
+	}
+
+	bool valid = (ent->tx_len == r->pending->len);
+	uint64_t end = ent->blk_pos + ent->tx_ofs;
+	free(ent);
+	if (!valid)
+		return -1;
+
+	txindex_publish(r->idx, r->pending);
+	r->idx->blocks_end = MAX(r->idx->blocks_end, end);
+	return 1;
+}
+
+bool bp_txindex_open(struct bp_txindex *idx, const char *fn)
+{
+	memset(idx, 0, sizeof(*idx));
+	bp_bucketfile_init(&idx->bf, txindex_magic, BP_TXINDEX_VERSION,
+			   BP_TXINDEX_HDR_SZ, BP_TXINDEX_ENT_SZ);
+	idx->recent = bp_hashtab_new_ext(bu256_hash, bu256_equal_, NULL, free);
+
+	struct txindex_replay r = { idx, parr_new(0, free) };
+	bool rc = bp_bucketfile_open(&idx->bf, fn, false) &&
+		  txindex_read_hdr(idx) &&
+		  bp_bucketfile_replay_log(&idx->bf, txindex_replay_rec, &r);
+
+	parr_free(r.pending, true);
+	if (!rc)
+		bp_txindex_close(idx);
+	return rc;
+}
+
+void bp_txindex_close(struct bp_txindex *idx)
+{
+	bp_bucketfile_close(&idx->bf);
+	bp_hashtab_unref(idx->recent);
+
+	memset(idx, 0, sizeof(*idx));
+	idx->bf.log_fd = -1;
+}
+
+/*
+ * Index the transactions of a block stored at blk_pos, whose record
+ * header (P2P or bootstrap.dat framing) is hdr_len bytes.
+ */
+bool bp_txindex_add_block(struct bp_txindex *idx,
+			  const struct bp_block *block,
+			  uint64_t blk_pos, unsigned int hdr_len)
+{
+	unsigned int n_tx = block->vtx ? block->vtx->len : 0;
+	uint64_t ofs = hdr_len + 80 + ser_varlen_size(n_tx);
+	parr *pending = parr_new(n_tx, free);
+	cstring *s = cstr_new_sz((n_tx + 1) * BP_TXINDEX_ENT_SZ);
+	bool rc = false;
+	unsigned int i;
+
+	for (i = 0; i < n_tx; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		bp_tx_calc_sha256(tx);
+
+		struct bp_txindex_ent *ent = malloc(sizeof(*ent));
+		bu256_copy(&ent->txid, &tx->sha256);
+		ent->blk_pos = blk_pos;
+		ent->tx_ofs = ofs;
+		ent->tx_len = bp_tx_ser_size(tx);
+		parr_add(pending, ent);
+
+		ser_txindex_ent(s, ent);
+		ofs += ent->tx_len;
+	}
+
+	if (ofs > UINT32_MAX)
+		goto out;
+
+	struct bp_txindex_ent commit = {
+		.blk_pos	= blk_pos,
+		.tx_ofs		= ofs,
+		.tx_len		= n_tx,
+	};
+	ser_txindex_ent(s, &commit);
+
+	if (!bp_bucketfile_log_append(&idx->bf, s->str, s->len))
+		goto out;
+
+	txindex_publish(idx, pending);
+	idx->blocks_end = MAX(idx->blocks_end, blk_pos + ofs);
+	rc = true;
+
+out:
+	parr_free(pending, true);
+	cstr_free(s, true);
+	return rc;
+}
+
+bool bp_txindex_lookup(const struct bp_txindex *idx, const bu256_t *txid,
+		       struct bp_txindex_ent *ent)
+{
+	struct bp_txindex_ent *recent = bp_hashtab_get(idx->recent, txid);
+	if (recent) {
+		*ent = *recent;
+		return true;
+	}
+
+	const struct bp_bucketfile *bf = &idx->bf;
+	uint64_t n = bp_bucketfile_lower_bound(bf, txid, sizeof(bu256_t));
+	if (n >= bf->n_base)
+		return false;
+
+	const unsigned char *p = bp_bucketfile_ent(bf, n);
+	if (memcmp(p, txid, sizeof(bu256_t)))
+		return false;
+
+	struct const_buffer buf = { p, BP_TXINDEX_ENT_SZ };
+	return deser_txindex_ent(ent, &buf);
+}
+
+static void txindex_collect(void *key, void *value, void *priv)
+{
+	parr_add(priv, value);
+}
+
+static int txindex_ent_cmp(const void *a_, const void *b_)
+{
+	const struct bp_txindex_ent *a = *(const struct bp_txindex_ent * const *) a_;
+	const struct bp_txindex_ent *b = *(const struct bp_txindex_ent * const *) b_;
+
+	return memcmp(&a->txid, &b->txid, sizeof(bu256_t));
+}
+
+/*
+ * Merge the log into a new FILE: one pass over the sorted base and
+ * the sorted log entries, the log winning on equal txids.
+ */
+bool bp_txindex_compact(struct bp_txindex *idx)
+{
+	struct bp_bucketfile *bf = &idx->bf;
+	struct bp_bucketfile_writer w;
+
+	if (!bf->fn || !bp_hashtab_size(idx->recent))
+		return true;
+	if (!bp_bucketfile_write_begin(bf, &w))
+		return false;
+
+	parr *recent = parr_new(bp_hashtab_size(idx->recent), NULL);
+	bp_hashtab_iter(idx->recent, txindex_collect, recent);
+	qsort(recent->data, recent->len, sizeof(void *), txindex_ent_cmp);
+
+	cstring *rec = cstr_new_sz(BP_TXINDEX_ENT_SZ);
+	uint64_t i = 0;
+	unsigned int j = 0;
+
+	while ((i < bf->n_base) || (j < recent->len)) {
+		const unsigned char *base = (i < bf->n_base) ?
+					    bp_bucketfile_ent(bf, i) : NULL;
+		const struct bp_txindex_ent *ent = (j < recent->len) ?
+						   parr_idx(recent, j) : NULL;
+		int cmp = !base ? 1 : !ent ? -1 :
+			  memcmp(base, &ent->txid, sizeof(bu256_t));
+
+		if (cmp < 0) {
+			bp_bucketfile_write_put(&w, base);
+			i++;
+			continue;
+		}
+
+		cstr_resize(rec, 0);
+		ser_txindex_ent(rec, ent);
+		bp_bucketfile_write_put(&w, rec->str);
+		j++;
+		if (cmp == 0)
+			i++;
+	}
+	cstr_free(rec, true);
+	parr_free(recent, true);
+
+	cstring *hdr = cstr_new_sz(8);
+	ser_u64(hdr, idx->blocks_end);
+	bool rc = bp_bucketfile_write_end(&w, hdr);
+	cstr_free(hdr, true);
+	if (!rc)
+		return false;
+
+	/* FILE now holds the log entries */
+	bp_hashtab_clear(idx->recent);
+	return bp_bucketfile_reload(bf);
+}
+
+/* read and decode only the tx's bytes from the blocks file */
+bool bp_txindex_read_tx(int fd, const struct bp_txindex_ent *ent,
+			struct bp_tx *tx)
+{
+	void *data = malloc(ent->tx_len);
+	bool rc = false;
+
+	if (!data)
+		return false;
+
+	ssize_t rrc = pread64(fd, data, ent->tx_len,
+			      (off64_t) (ent->blk_pos + ent->tx_ofs));
+	if (rrc != ent->tx_len)
+		goto out;
+
+	struct const_buffer buf = { data, ent->tx_len };
+	if (!deser_bp_tx(tx, &buf) || buf.len)
+		goto out;
+
+	bp_tx_calc_sha256(tx);
+	rc = bu256_equal(&tx->sha256, &ent->txid);
+
+out:
+	free(data);
+	return rc;
+}
@@ -6,6 +6,8 @@
 
 #include <string.h>
 #include <ccoin/core.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
 #include <ccoin/compat.h>
 
 void bp_utxo_init(struct bp_utxo *coin)
@@ -129,6 +131,107 @@ static bool bp_utxo_null(const struct bp_utxo *coin)
 }
 
 bool bp_utxo_spend(struct bp_utxo_set *uset, const struct bp_outpt *outpt)
+{
+	return bp_utxo_spend_undo(uset, outpt, NULL);
+}
+
+void bp_utxo_undo_init(struct bp_utxo_undo *undo)
+{
+	memset(undo, 0, sizeof(*undo));
+}
+
+void bp_utxo_undo_free(struct bp_utxo_undo *undo)
+{
+	if (!undo)
+		return;
+
+	bp_txout_free(&undo->txout);
+}
+
+void bp_utxo_undo_freep(void *p)
+{
+	struct bp_utxo_undo *undo = p;
+	if (!undo)
+		return;
+
+	bp_utxo_undo_free(undo);
+
+	memset(undo, 0, sizeof(*undo));
+	free(undo);
+}
+
+bool deser_bp_utxo_undo(struct bp_utxo_undo *undo, struct const_buffer *buf)
+{
+	bp_utxo_undo_free(undo);
+
+	uint32_t flags;
+	if (!deser_bp_outpt(&undo->prevout, buf)) return false;
+	if (!deser_u32(&flags, buf)) return false;
+	if (!deser_u32(&undo->height, buf)) return false;
+	if (!deser_u32(&undo->version, buf)) return false;
+	if (!deser_bp_txout(&undo->txout, buf)) return false;
+
+	undo->is_coinbase = (flags & 1);
+	return true;
+}
+
+void ser_bp_utxo_undo(cstring *s, const struct bp_utxo_undo *undo)
+{
+	ser_bp_outpt(s, &undo->prevout);
+	ser_u32(s, undo->is_coinbase ? 1 : 0);
+	ser_u32(s, undo->height);
+	ser_u32(s, undo->version);
+	ser_bp_txout(s, &undo->txout);
+}
+
+bool deser_bp_block_undo(parr **undo_out, struct const_buffer *buf)
+{
+	parr *arr = *undo_out;
+	if (arr) {
+		parr_free(arr, true);
+		*undo_out = NULL;
+	}
+
+	uint32_t vlen;
+	if (!deser_varlen(&vlen, buf)) return false;
+
+	arr = parr_new(vlen, bp_utxo_undo_freep);
+
+	unsigned int i;
+	for (i = 0; i < vlen; i++) {
+		struct bp_utxo_undo *undo;
+
+		undo = calloc(1, sizeof(*undo));
+		bp_utxo_undo_init(undo);
+		if (!deser_bp_utxo_undo(undo, buf)) {
+			bp_utxo_undo_freep(undo);
+			parr_free(arr, true);
+			return false;
+		}
+
+		parr_add(arr, undo);
+	}
+
+	*undo_out = arr;
+	return true;
+}
+
+void ser_bp_block_undo(cstring *s, const parr *undo)
+{
+	ser_varlen(s, undo ? undo->len : 0);
+
+	unsigned int i;
+	for (i = 0; undo && i < undo->len; i++)
+		ser_bp_utxo_undo(s, parr_idx(undo, i));
+}
+
+/*
+ * Spend an output.  If undo is non-NULL, ownership of the spent txout
+ * moves into a new undo record appended to it, along with the coin
+ * metadata needed to recreate the coin later.
+ */
+bool bp_utxo_spend_undo(struct bp_utxo_set *uset,
+			const struct bp_outpt *outpt, parr *undo)
 {
 	struct bp_utxo *coin = bp_utxo_lookup(uset, &outpt->hash);
 	if (!coin || !coin->vout || !coin->vout->len ||
@@ -140,9 +243,20 @@ bool bp_utxo_spend(struct bp_utxo_set *uset, const struct bp_outpt *outpt)
 	if (!txout)
 		return false;
 
-	/* free txout, replace with NULL marker indicating spent-ness */
+	/* replace with NULL marker indicating spent-ness */
 	coin->vout->data[outpt->n] = NULL;
-	bp_txout_free(txout);
+
+	if (undo) {
+		struct bp_utxo_undo *ent = calloc(1, sizeof(*ent));
+		bp_utxo_undo_init(ent);
+		bp_outpt_copy(&ent->prevout, outpt);
+		ent->is_coinbase = coin->is_coinbase;
+		ent->height = coin->height;
+		ent->version = coin->version;
+		ent->txout = *txout;		/* take ownership */
+		parr_add(undo, ent);
+	} else
+		bp_txout_free(txout);
 	free(txout);
 
 	/* if coin entirely spent, free it */
@@ -152,3 +266,394 @@ bool bp_utxo_spend(struct bp_utxo_set *uset, const struct bp_outpt *outpt)
 	return true;
 }
 
+
+/* Recreate a spent output, and its coin if it was fully spent. */
+bool bp_utxo_unspend(struct bp_utxo_set *uset,
+		     const struct bp_utxo_undo *undo)
+{
+	uint32_t n = undo->prevout.n;
+
+	struct bp_utxo *coin = bp_utxo_lookup(uset, &undo->prevout.hash);
+	if (!coin) {
+		coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+
+		bu256_copy(&coin->hash, &undo->prevout.hash);
+		coin->is_coinbase = undo->is_coinbase;
+		coin->height = undo->height;
+		coin->version = undo->version;
+		coin->vout = parr_new(n + 1, bp_txout_freep);
+
+		bp_utxo_set_add(uset, coin);
+	}
+
+	if (n >= coin->vout->len)
+		parr_resize(coin->vout, n + 1);
+	else if (parr_idx(coin->vout, n))
+		return false;			/* output is not spent */
+
+	struct bp_txout *txout = malloc(sizeof(*txout));
+	bp_txout_copy(txout, &undo->txout);
+	coin->vout->data[n] = txout;
+
+	return true;
+}
+
+/*
+ * Undo the UTXO changes made by connecting block: remove the coins it
+ * created and restore the outputs it spent, both in reverse order.
+ * undo must hold the records captured by bp_utxo_spend_undo() while the
+ * block was connected.  On failure the set is left partially unwound.
+ */
+bool bp_utxo_disconnect_block(struct bp_utxo_set *uset,
+			      const struct bp_block *block, const parr *undo)
+{
+	if (!block->vtx || !undo)
+		return false;
+
+	unsigned int undo_idx = undo->len;
+	unsigned int i = block->vtx->len;
+
+	while (i-- > 0) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		if (!tx->sha256_valid)
+			bp_tx_calc_sha256(tx);
+
+		/* remove outputs created by this tx; later spends of
+		 * them have already been unwound
+		 */
+		if (!bp_hashtab_del(uset->map, &tx->sha256))
+			return false;
+
+		if (i == 0)
+			break;			/* coinbase */
+
+		unsigned int j = tx->vin->len;
+		while (j-- > 0) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			struct bp_utxo_undo *ent;
+
+			if (undo_idx == 0)
+				return false;
+			ent = parr_idx(undo, --undo_idx);
+
+			if (!bp_outpt_equal(&ent->prevout, &txin->prevout) ||
+			    !bp_utxo_unspend(uset, ent))
+				return false;
+		}
+	}
+
+	return (undo_idx == 0);
+}
+
+enum {
+	UTXO_PREFETCH_GROUP	= 16,	/* lookups with overlapping misses */
+};
+
+static struct bp_txout *utxo_peek_txout(const struct bp_utxo *coin,
+					const struct bp_outpt *outpt)
+{
+	if (!coin || !coin->vout || (outpt->n >= coin->vout->len))
+		return NULL;
+	return parr_idx(coin->vout, outpt->n);
+}
+
+/*
+ * Resolve a group of inputs.  Each pass follows one more pointer of
+ * every input's lookup chain (bucket, entry, coin, outputs, txout,
+ * script), so the group's cache misses overlap instead of serializing.
+ */
+static void utxo_view_resolve(struct bp_utxo_view *view,
+			      const struct bp_outpt **outpts, unsigned int n)
+{
+	struct bp_hashtab *map = view->uset->map;
+	struct bp_utxo *coins[UTXO_PREFETCH_GROUP];
+	struct bp_txout *txout;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		bp_hashtab_prefetch_bucket(map, &outpts[i]->hash);
+	for (i = 0; i < n; i++)
+		bp_hashtab_prefetch_ent(map, &outpts[i]->hash);
+	for (i = 0; i < n; i++)
+		bp_hashtab_prefetch_key(map, &outpts[i]->hash);
+
+	for (i = 0; i < n; i++) {
+		coins[i] = bp_utxo_lookup(view->uset, &outpts[i]->hash);
+		if (coins[i])
+			bp_prefetch(coins[i]->vout);
+	}
+	for (i = 0; i < n; i++)
+		if (coins[i] && coins[i]->vout &&
+		    (outpts[i]->n < coins[i]->vout->len))
+			bp_prefetch(&coins[i]->vout->data[outpts[i]->n]);
+	for (i = 0; i < n; i++)
+		if ((txout = utxo_peek_txout(coins[i], outpts[i])) != NULL)
+			bp_prefetch(txout);
+	for (i = 0; i < n; i++)
+		if ((txout = utxo_peek_txout(coins[i], outpts[i])) != NULL)
+			bp_prefetch(txout->scriptPubKey);
+	for (i = 0; i < n; i++)
+		if ((txout = utxo_peek_txout(coins[i], outpts[i])) &&
+		    txout->scriptPubKey)
+			bp_prefetch(txout->scriptPubKey->str);
+
+	for (i = 0; i < n; i++) {
+		if (coins[i])
+			view->n_resolved++;
+		parr_add(view->coins, coins[i]);
+	}
+}
+
+/*
+ * A staged change.  Spends are keyed by their outpoint; new coins by
+ * their txid and UTXO_VIEW_ADD, which no spendable output index uses.
+ */
+struct bp_utxo_view_op {
+	struct bp_outpt	key;
+	struct bp_utxo	*coin;		/* add: owned until flushed */
+};
+
+enum {
+	UTXO_VIEW_ADD		= 0xffffffffU,
+};
+
+static bool utxo_view_reserve(struct bp_utxo_view *view, unsigned int n)
+{
+	/* op log */
+	if ((view->n_ops + n) > view->ops_alloc) {
+		unsigned int alloc = MAX(view->ops_alloc * 2, view->n_ops + n);
+		struct bp_utxo_view_op *ops;
+		ops = realloc(view->ops, alloc * sizeof(*ops));
+		if (!ops)
+			return false;
+		view->ops = ops;
+		view->ops_alloc = alloc;
+	}
+
+	/* index over it, at most half full */
+	unsigned long want = 2UL * (view->n_ops + n);
+	if (want <= view->n_slots)
+		return true;
+
+	unsigned long n_slots = MAX(view->n_slots, 16);
+	while (n_slots < want)
+		n_slots <<= 1;
+
+	unsigned int *slots = calloc(n_slots, sizeof(*slots));
+	if (!slots)
+		return false;
+
+	unsigned long i, mask = n_slots - 1;
+	for (i = 0; i < view->n_slots; i++) {
+		unsigned int op_idx = view->slots[i];
+		if (!op_idx)
+			continue;
+
+		struct bp_utxo_view_op *op = &view->ops[op_idx - 1];
+		unsigned long slot = bp_outpt_hash(&op->key) & mask;
+		while (slots[slot])
+			slot = (slot + 1) & mask;
+		slots[slot] = op_idx;
+	}
+
+	free(view->slots);
+	view->slots = slots;
+	view->n_slots = n_slots;
+	return true;
+}
+
+/* index slot holding key, or the empty slot where it would go */
+static unsigned int *utxo_view_slot(const struct bp_utxo_view *view,
+				    const struct bp_outpt *key)
+{
+	unsigned long mask = view->n_slots - 1;
+	unsigned long slot = bp_outpt_hash(key) & mask;
+
+	while (view->slots[slot]) {
+		const struct bp_utxo_view_op *op;
+		op = &view->ops[view->slots[slot] - 1];
+		if (bp_outpt_equal(&op->key, key))
+			break;
+		slot = (slot + 1) & mask;
+	}
+
+	return &view->slots[slot];
+}
+
+static struct bp_utxo_view_op *utxo_view_find(const struct bp_utxo_view *view,
+					      const struct bp_outpt *key)
+{
+	if (!view->n_ops)
+		return NULL;
+
+	unsigned int op_idx = *utxo_view_slot(view, key);
+	return op_idx ? &view->ops[op_idx - 1] : NULL;
+}
+
+static bool utxo_view_stage(struct bp_utxo_view *view,
+			    const struct bp_outpt *key, struct bp_utxo *coin)
+{
+	if (!utxo_view_reserve(view, 1))
+		return false;
+
+	struct bp_utxo_view_op *op = &view->ops[view->n_ops++];
+	bp_outpt_copy(&op->key, key);
+	op->coin = coin;
+
+	/* a later coin with the same txid shadows an earlier one */
+	*utxo_view_slot(view, key) = view->n_ops;
+	return true;
+}
+
+static void utxo_view_reset(struct bp_utxo_view *view)
+{
+	unsigned int i;
+	for (i = 0; i < view->n_ops; i++) {
+		struct bp_utxo_view_op *op = &view->ops[i];
+		if (op->coin) {
+			bp_utxo_free(op->coin);
+			free(op->coin);
+		}
+	}
+
+	view->n_ops = 0;
+	if (view->slots)
+		memset(view->slots, 0, view->n_slots * sizeof(*view->slots));
+}
+
+/*
+ * Start a block's overlay on uset.  If block is non-NULL, every input's
+ * coin is looked up ahead of connection; inputs spending outputs
+ * created earlier in the same block are found in the overlay instead.
+ */
+void bp_utxo_view_init(struct bp_utxo_view *view, struct bp_utxo_set *uset,
+		       const struct bp_block *block)
+{
+	memset(view, 0, sizeof(*view));
+	view->uset = uset;
+
+	unsigned int n_in = 0;
+	unsigned int i, j;
+	for (i = 1; block && block->vtx && i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		n_in += tx->vin->len;
+	}
+
+	/* room for every spend and new coin, so staging never grows */
+	view->coins = parr_new(n_in, NULL);
+	utxo_view_reserve(view, n_in + (block && block->vtx ?
+					  block->vtx->len : 0));
+
+	const struct bp_outpt *group[UTXO_PREFETCH_GROUP];
+	unsigned int n_group = 0;
+
+	for (i = 1; block && block->vtx && i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+
+			group[n_group++] = &txin->prevout;
+			if (n_group == UTXO_PREFETCH_GROUP) {
+				utxo_view_resolve(view, group, n_group);
+				n_group = 0;
+			}
+		}
+	}
+
+	utxo_view_resolve(view, group, n_group);
+}
+
+/* Drop the view, discarding any changes not flushed. */
+void bp_utxo_view_free(struct bp_utxo_view *view)
+{
+	if (!view)
+		return;
+
+	utxo_view_reset(view);
+	free(view->ops);
+	free(view->slots);
+	if (view->coins)
+		parr_free(view->coins, true);
+	memset(view, 0, sizeof(*view));
+}
+
+/*
+ * The coin for the next input in block order, which spends outpt, as
+ * seen through the overlay: NULL if the output was already spent in
+ * this block.  The coin is read-only; spend through the view.
+ */
+struct bp_utxo *bp_utxo_view_next(struct bp_utxo_view *view,
+				  const struct bp_outpt *outpt)
+{
+	struct bp_utxo *coin = NULL;
+
+	if (view->next < view->coins->len)
+		coin = parr_idx(view->coins, view->next++);
+
+	if (utxo_view_find(view, outpt))
+		return NULL;			/* spent in this view */
+
+	struct bp_outpt add_key = { outpt->hash, UTXO_VIEW_ADD };
+	struct bp_utxo_view_op *added = utxo_view_find(view, &add_key);
+	if (added)
+		return added->coin;
+
+	if (coin && bu256_equal(&coin->hash, &outpt->hash))
+		return coin;
+
+	view->n_late++;
+	return bp_utxo_lookup(view->uset, &outpt->hash);
+}
+
+/* Stage the spend of outpt, from a coin returned by bp_utxo_view_next() */
+bool bp_utxo_view_spend(struct bp_utxo_view *view, struct bp_utxo *coin,
+			const struct bp_outpt *outpt)
+{
+	if (!utxo_peek_txout(coin, outpt) || (outpt->n == UTXO_VIEW_ADD) ||
+	    utxo_view_find(view, outpt))
+		return false;
+
+	return utxo_view_stage(view, outpt, NULL);
+}
+
+/* Stage a new coin; the view owns it from here on. */
+bool bp_utxo_view_add(struct bp_utxo_view *view, struct bp_utxo *coin)
+{
+	struct bp_outpt key = { coin->hash, UTXO_VIEW_ADD };
+
+	if (!utxo_view_stage(view, &key, coin)) {
+		bp_utxo_free(coin);
+		free(coin);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Apply the staged changes to the backing set in one pass, in the order
+ * they were made, appending undo records for the spends to undo (if
+ * non-NULL).  Every spend was checked when staged, so this fails only
+ * if the set changed underneath the view.
+ */
+bool bp_utxo_view_flush(struct bp_utxo_view *view, parr *undo)
+{
+	bool rc = true;
+	unsigned int i;
+
+	for (i = 0; rc && i < view->n_ops; i++) {
+		struct bp_utxo_view_op *op = &view->ops[i];
+
+		if (op->coin) {
+			bp_utxo_set_add(view->uset, op->coin);
+			op->coin = NULL;
+		} else
+			rc = bp_utxo_spend_undo(view->uset, &op->key, undo);
+	}
+
+	utxo_view_reset(view);
+	return rc;
+}
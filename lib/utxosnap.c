@@ -0,0 +1,384 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/utxosnap.h>
+#include <ccoin/compress.h>
+#include <ccoin/coredefs.h>
+#include <ccoin/endian.h>
+#include <ccoin/key.h>
+#include <ccoin/parallel.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+#include <ccoin/crypto/sha2.h>
+
+static const char utxosnap_magic[8] = "ccutxo\0\0";
+
+static void utxosnap_collect(void *key, void *value, void *priv)
+{
+	parr *coins = priv;
+	parr_add(coins, value);
+}
+
+static int utxosnap_coin_cmp(const void *a_, const void *b_)
+{
+	const struct bp_utxo *a = *(const struct bp_utxo * const *) a_;
+	const struct bp_utxo *b = *(const struct bp_utxo * const *) b_;
+
+	return memcmp(&a->hash, &b->hash, sizeof(bu256_t));
+}
+
+/* coin: txid, height, version, coinbase flag, output count, then the
+ * unspent outputs as (index, compressed txout) pairs.  The output count
+ * is one past the last unspent output, not the tx's: a coin recreated
+ * by bp_utxo_unspend() has lost its trailing spent outputs.
+ */
+static void ser_utxosnap_coin(cstring *s, const struct bp_utxo *coin)
+{
+	unsigned int i, n_vout = 0, n_unspent = 0;
+
+	for (i = 0; i < coin->vout->len; i++)
+		if (parr_idx(coin->vout, i)) {
+			n_unspent++;
+			n_vout = i + 1;
+		}
+
+	ser_u256(s, &coin->hash);
+	ser_u32(s, coin->height);
+	ser_u32(s, coin->version);
+	ser_bool(s, coin->is_coinbase);
+	ser_varlen(s, n_vout);
+	ser_varlen(s, n_unspent);
+
+	for (i = 0; i < coin->vout->len; i++) {
+		struct bp_txout *txout = parr_idx(coin->vout, i);
+		if (!txout)
+			continue;
+
+		ser_varlen(s, i);
+		ser_bp_txout_compressed(s, txout);
+	}
+}
+
+static bool deser_utxosnap_coin(struct bp_utxo *coin,
+				struct const_buffer *buf)
+{
+	uint32_t n_vout, n_unspent, idx;
+	unsigned int i;
+
+	if (!deser_u256(&coin->hash, buf)) return false;
+	if (!deser_u32(&coin->height, buf)) return false;
+	if (!deser_u32(&coin->version, buf)) return false;
+	if (!deser_bool(&coin->is_coinbase, buf)) return false;
+	if (!deser_varlen(&n_vout, buf)) return false;
+	if (!deser_varlen(&n_unspent, buf)) return false;
+
+	/* no tx has more outputs than fit in a block */
+	if (!n_unspent || (n_unspent > n_vout) ||
+	    (n_vout > (MAX_BLOCK_SIZE / 9)))
+		return false;
+
+	coin->vout = parr_new(n_vout, bp_txout_freep);
+	parr_resize(coin->vout, n_vout);
+
+	int64_t prev_idx = -1;
+	for (i = 0; i < n_unspent; i++) {
+		if (!deser_varlen(&idx, buf))
+			return false;
+		if ((idx >= n_vout) || ((int64_t) idx <= prev_idx))
+			return false;
+		prev_idx = idx;
+
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		coin->vout->data[idx] = txout;
+		if (!deser_bp_txout_compressed(txout, buf))
+			return false;
+	}
+
+	/* canonical: the last output is unspent */
+	return (prev_idx + 1 == n_vout);
+}
+
+bool bp_utxosnap_write(const char *fn, struct bp_utxo_set *uset,
+		       const unsigned char *netmagic,
+		       const bu256_t *best_hash, uint32_t height,
+		       struct bp_utxosnap_info *info)
+{
+	unsigned int n_coins = bp_hashtab_size(uset->map);
+	unsigned int n_chunks = (n_coins + BP_UTXOSNAP_CHUNK - 1) /
+				BP_UTXOSNAP_CHUNK;
+	unsigned int i;
+
+	parr *coins = parr_new(n_coins, NULL);
+	bp_hashtab_iter(uset->map, utxosnap_collect, coins);
+	qsort(coins->data, coins->len, sizeof(void *), utxosnap_coin_cmp);
+
+	cstring *s = cstr_new_sz(BP_UTXOSNAP_HDR_SZ + (n_chunks * 8) +
+				 (n_coins * 80));
+
+	ser_bytes(s, utxosnap_magic, sizeof(utxosnap_magic));
+	ser_u32(s, BP_UTXOSNAP_VERSION);
+	ser_bytes(s, netmagic, 4);
+	ser_u256(s, best_hash);
+	ser_u32(s, height);
+	ser_u64(s, n_coins);
+	ser_u32(s, BP_UTXOSNAP_CHUNK);
+	ser_u32(s, n_chunks);
+
+	/* chunk offset table, filled in below */
+	size_t ofs_pos = s->len;
+	for (i = 0; i < n_chunks; i++)
+		ser_u64(s, 0);
+	size_t data_pos = s->len;
+
+	for (i = 0; i < coins->len; i++) {
+		if ((i % BP_UTXOSNAP_CHUNK) == 0) {
+			uint64_t ofs = htole64(s->len - data_pos);
+			memcpy(s->str + ofs_pos +
+			       (i / BP_UTXOSNAP_CHUNK) * 8, &ofs, 8);
+		}
+
+		ser_utxosnap_coin(s, parr_idx(coins, i));
+	}
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	sha256_Raw((unsigned char *) s->str, s->len, md);
+	ser_bytes(s, md, sizeof(md));
+
+	bool rc = bu_write_file(fn, s->str, s->len);
+
+	if (rc && info) {
+		memcpy(info->netmagic, netmagic, 4);
+		bu256_copy(&info->best_hash, best_hash);
+		info->height = height;
+		info->n_coins = n_coins;
+		memcpy(&info->snap_hash, md, sizeof(md));
+	}
+
+	cstr_free(s, true);
+	parr_free(coins, true);
+	return rc;
+}
+
+struct utxosnap_file {
+	void		*map;
+	size_t		map_len;
+
+	struct bp_utxosnap_info info;
+	uint32_t	chunk_coins;
+	uint32_t	n_chunks;
+	const unsigned char *ofs_tab;
+	struct const_buffer data;	/* coin records */
+};
+
+static void utxosnap_close(struct utxosnap_file *sf)
+{
+	if (sf->map)
+		munmap(sf->map, sf->map_len);
+	memset(sf, 0, sizeof(*sf));
+}
+
+/* map fn, verify its checksum, and parse the header */
+static bool utxosnap_open(struct utxosnap_file *sf, const char *fn)
+{
+	memset(sf, 0, sizeof(*sf));
+
+	int fd = file_seq_open(fn);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < (BP_UTXOSNAP_HDR_SZ + SHA256_DIGEST_LENGTH))) {
+		close(fd);
+		return false;
+	}
+
+	sf->map_len = st.st_size;
+	sf->map = mmap(NULL, sf->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (sf->map == MAP_FAILED) {
+		sf->map = NULL;
+		return false;
+	}
+
+	size_t data_len = sf->map_len - SHA256_DIGEST_LENGTH;
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	/* verify trailing checksum, before trusting any record */
+	sha256_Raw(sf->map, data_len, md);
+	if (memcmp(md, (unsigned char *) sf->map + data_len, sizeof(md)))
+		goto err_out;
+	memcpy(&sf->info.snap_hash, md, sizeof(md));
+
+	struct const_buffer buf = { sf->map, data_len };
+	char magic[sizeof(utxosnap_magic)];
+	uint32_t version;
+
+	if (!deser_bytes(magic, &buf, sizeof(magic)) ||
+	    memcmp(magic, utxosnap_magic, sizeof(magic)))
+		goto err_out;
+	if (!deser_u32(&version, &buf) || version != BP_UTXOSNAP_VERSION)
+		goto err_out;
+	if (!deser_bytes(sf->info.netmagic, &buf, 4) ||
+	    !deser_u256(&sf->info.best_hash, &buf) ||
+	    !deser_u32(&sf->info.height, &buf) ||
+	    !deser_u64(&sf->info.n_coins, &buf) ||
+	    !deser_u32(&sf->chunk_coins, &buf) ||
+	    !deser_u32(&sf->n_chunks, &buf))
+		goto err_out;
+
+	if (!sf->chunk_coins ||
+	    (sf->n_chunks != (sf->info.n_coins + sf->chunk_coins - 1) /
+			     sf->chunk_coins) ||
+	    (buf.len / 8 < sf->n_chunks))
+		goto err_out;
+
+	sf->ofs_tab = buf.p;
+	sf->data.p = (const unsigned char *) buf.p + (sf->n_chunks * 8);
+	sf->data.len = buf.len - (sf->n_chunks * 8);
+	return true;
+
+err_out:
+	utxosnap_close(sf);
+	return false;
+}
+
+bool bp_utxosnap_read_info(const char *fn, struct bp_utxosnap_info *info)
+{
+	struct utxosnap_file sf;
+	if (!utxosnap_open(&sf, fn))
+		return false;
+
+	*info = sf.info;
+	utxosnap_close(&sf);
+	return true;
+}
+
+struct utxosnap_load {
+	const struct utxosnap_file *sf;
+	struct bp_utxo		**coins;	/* n_coins, in file order */
+};
+
+static bool utxosnap_chunk_range(const struct utxosnap_file *sf,
+				 unsigned int chunk, struct const_buffer *buf)
+{
+	uint64_t start, end;
+
+	memcpy(&start, sf->ofs_tab + (chunk * 8), 8);
+	start = le64toh(start);
+	if (chunk + 1 < sf->n_chunks) {
+		memcpy(&end, sf->ofs_tab + ((chunk + 1) * 8), 8);
+		end = le64toh(end);
+	} else
+		end = sf->data.len;
+
+	if ((start > end) || (end > sf->data.len))
+		return false;
+
+	buf->p = (const unsigned char *) sf->data.p + start;
+	buf->len = end - start;
+	return true;
+}
+
+/* decode one chunk; runs on pool threads */
+static bool utxosnap_load_chunk(void *ctx, unsigned int chunk)
+{
+	struct utxosnap_load *ld = ctx;
+	const struct utxosnap_file *sf = ld->sf;
+	struct const_buffer buf;
+
+	if (!utxosnap_chunk_range(sf, chunk, &buf))
+		return false;
+
+	uint64_t first = (uint64_t) chunk * sf->chunk_coins;
+	uint64_t last = MIN(first + sf->chunk_coins, sf->info.n_coins);
+	uint64_t i;
+
+	for (i = first; i < last; i++) {
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		ld->coins[i] = coin;
+
+		if (!deser_utxosnap_coin(coin, &buf))
+			return false;
+
+		/* sorted, and so unique */
+		if ((i > first) &&
+		    (utxosnap_coin_cmp(&ld->coins[i - 1], &coin) >= 0))
+			return false;
+	}
+
+	return (buf.len == 0);
+}
+
+/*
+ * Load a snapshot into an empty set: chunks are decoded in parallel,
+ * then inserted into a table sized for them up front.
+ */
+bool bp_utxosnap_load(const char *fn, struct bp_utxo_set *uset,
+		      struct bp_utxosnap_info *info)
+{
+	if (bp_hashtab_size(uset->map) != 0)
+		return false;
+
+	struct utxosnap_file sf;
+	if (!utxosnap_open(&sf, fn))
+		return false;
+
+	bool rc = false;
+	uint64_t i;
+
+	if (sf.info.n_coins > UINT32_MAX)
+		goto out;
+
+	struct utxosnap_load ld = { &sf, NULL };
+	ld.coins = calloc(sf.info.n_coins, sizeof(struct bp_utxo *));
+	if (!ld.coins && sf.info.n_coins)
+		goto out;
+
+	/* expanding uncompressed pubkey scripts needs the secp256k1
+	 * context; create it here, not lazily from several threads
+	 */
+	if (!bp_key_static_init())
+		goto out_coins;
+
+	if (!bp_parallel_for(sf.n_chunks, utxosnap_load_chunk, &ld))
+		goto out_coins;
+
+	/* chunk boundaries keep the global order too */
+	for (i = 1; i < sf.info.n_coins; i++)
+		if (((i % sf.chunk_coins) == 0) &&
+		    (utxosnap_coin_cmp(&ld.coins[i - 1], &ld.coins[i]) >= 0))
+			goto out_coins;
+
+	bp_hashtab_reserve(uset->map, sf.info.n_coins);
+	for (i = 0; i < sf.info.n_coins; i++) {
+		bp_utxo_set_add(uset, ld.coins[i]);
+		ld.coins[i] = NULL;
+	}
+
+	if (info)
+		*info = sf.info;
+	rc = true;
+
+out_coins:
+	for (i = 0; i < sf.info.n_coins; i++)
+		if (ld.coins[i]) {
+			bp_utxo_free(ld.coins[i]);
+			free(ld.coins[i]);
+		}
+	free(ld.coins);
+out:
+	utxosnap_close(&sf);
+	return rc;
+}
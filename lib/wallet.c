@@ -7,6 +7,7 @@
 #include "picocoin-config.h"
 
 #include <ccoin/address.h>
+#include <ccoin/base58.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/key.h>
 #include <ccoin/mbr.h>
@@ -63,6 +64,11 @@ static void wallet_free_hdkey(void *p)
 	free(hdkey);
 }
 
+static void wallet_free_addr(void *p)
+{
+	cstr_free(p, true);
+}
+
 static void wallet_free_account(void *p)
 {
 	struct wallet_account *acct = p;
@@ -109,45 +115,112 @@ struct wallet_account *account_byname(struct wallet *wlt, const char *name)
 	return NULL;
 }
 
-cstring *wallet_new_address(struct wallet *wlt)
+const struct hd_extended_key *
+wallet_account_chain_key(struct wallet *wlt, struct wallet_account *acct,
+			 enum wallet_chain chain)
 {
+	if (acct->chain_keys[chain])
+		return acct->chain_keys[chain];
+
 	struct hd_path_seg hdpath[] = {
 		{ 44, true },	// BIP 44
 		{ 0, true },	// chain: BTC
 		{ 0, true },	// acct#
 		{ 0, false },	// change?
-		{ 0, false },	// key index
 	};
 
-	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
-	if (!acct)
-		return NULL;
-
-	// patch HD path based on account settings
 	hdpath[2].index = acct->acct_idx;
-	hdpath[4].index = acct->next_key_idx;
+	hdpath[3].index = chain;
 
 	assert(wlt->hdmaster && (wlt->hdmaster->len > 0));
 	struct hd_extended_key *master = parr_idx(wlt->hdmaster, 0);
 	assert(master != NULL);
 
-	struct hd_extended_key child;
-	hd_extended_key_init(&child);
+	struct hd_extended_key *ek = calloc(1, sizeof(*ek));
+	if (!ek)
+		return NULL;
+	hd_extended_key_init(ek);
 
-	if (!hd_derive(&child, master, hdpath, ARRAY_SIZE(hdpath))) {
-		hd_extended_key_free(&child);
+	if (!hd_derive(ek, master, hdpath, ARRAY_SIZE(hdpath))) {
+		wallet_free_hdkey(ek);
 		return NULL;
 	}
 
-	acct->next_key_idx++;
+	// addresses are derived from the public half only
+	hd_extended_key_neuter(ek);
+
+	acct->chain_keys[chain] = ek;
+	return ek;
+}
 
-	cstring *rs = bp_pubkey_get_address(&child.key,wlt->chain->addr_pubkey);
+cstring *wallet_new_address(struct wallet *wlt)
+{
+	parr *addrs = wallet_new_addresses(wlt, 1);
+	if (!addrs)
+		return NULL;
 
-	hd_extended_key_free(&child);
+	cstring *rs = parr_idx(addrs, 0);
+	addrs->data[0] = NULL;		// steal ref
+	parr_free(addrs, true);
 
 	return rs;
 }
 
+/*
+ * The next n receiving addresses of the default account, in order.
+ * Each costs one public derivation step from the cached chain key,
+ * rather than the whole path from the master key, and the steps run
+ * on the bp_parallel_for() pool.
+ */
+parr *wallet_new_addresses(struct wallet *wlt, unsigned int n)
+{
+	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
+	if (!acct)
+		return NULL;
+
+	// non-hardened indexes only
+	if (n > (0x80000000U - acct->next_key_idx))
+		return NULL;
+
+	const struct hd_extended_key *parent =
+		wallet_account_chain_key(wlt, acct, WALLET_CHAIN_EXTERNAL);
+	if (!parent)
+		return NULL;
+
+	struct hd_pub_child *children = calloc(MAX(n, 1), sizeof(*children));
+	if (!children)
+		return NULL;
+
+	parr *addrs = NULL;
+	if (!hd_derive_pub_batch(parent, acct->next_key_idx, n, children))
+		goto out;
+
+	addrs = parr_new(n, wallet_free_addr);
+	if (!addrs)
+		goto out;
+
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		cstring *addr = base58_encode_check(wlt->chain->addr_pubkey,
+						    true,
+						    children[i].pubkey_hash,
+						    sizeof(children[i].pubkey_hash));
+		if (!addr) {
+			parr_free(addrs, true);
+			addrs = NULL;
+			goto out;
+		}
+
+		parr_add(addrs, addr);
+	}
+
+	acct->next_key_idx += n;
+
+out:
+	free(children);
+	return addrs;
+}
+
 static cstring *ser_wallet_root(const struct wallet *wlt)
 {
 	cstring *rs = cstr_new_sz(8);
@@ -177,6 +250,8 @@ static void account_free(struct wallet_account *acct)
 		return;
 
 	cstr_free(acct->name, true);
+	wallet_free_hdkey(acct->chain_keys[WALLET_CHAIN_EXTERNAL]);
+	wallet_free_hdkey(acct->chain_keys[WALLET_CHAIN_CHANGE]);
 
 	memset(acct, 0, sizeof(*acct));
 	free(acct);
@@ -195,6 +270,22 @@ static bool deser_wallet_account(struct wallet *wlt, struct const_buffer *buf)
 	    !deser_u32(&acct->next_key_idx, buf))
 		goto err_out;
 
+	/* a later record for the same account supersedes the earlier one */
+	unsigned int i;
+	for (i = 0; i < wlt->accounts->len; i++) {
+		struct wallet_account *old = parr_idx(wlt->accounts, i);
+		if (old->acct_idx != acct->acct_idx)
+			continue;
+
+		cstring *tmp = old->name;
+		old->name = acct->name;
+		acct->name = tmp;
+		old->next_key_idx = acct->next_key_idx;
+
+		account_free(acct);
+		return true;
+	}
+
 	parr_add(wlt->accounts, acct);
 
 	return true;
@@ -211,6 +302,31 @@ static void ser_account(cstring *s, const struct wallet_account *acct)
 	ser_u32(s, acct->next_key_idx);
 }
 
+cstring *ser_wallet_root_rec(const struct wallet *wlt)
+{
+	cstring *s_root = ser_wallet_root(wlt);
+	cstring *recdata = message_str(wlt->chain->netmagic,
+				       "root", s_root->str, s_root->len);
+	cstr_free(s_root, true);
+
+	return recdata;
+}
+
+cstring *ser_wallet_account_rec(const struct wallet *wlt,
+				const struct wallet_account *acct)
+{
+	cstring *acct_raw = cstr_new_sz(64);
+	ser_account(acct_raw, acct);
+
+	cstring *recdata = message_str(wlt->chain->netmagic,
+				       "account",
+				       acct_raw->str,
+				       acct_raw->len);
+	cstr_free(acct_raw, true);
+
+	return recdata;
+}
+
 cstring *ser_wallet(const struct wallet *wlt)
 {
 	struct bp_key *key;
@@ -221,12 +337,9 @@ cstring *ser_wallet(const struct wallet *wlt)
 	 * ser "root" record
 	 */
 	{
-	cstring *s_root = ser_wallet_root(wlt);
-	cstring *recdata = message_str(wlt->chain->netmagic,
-				       "root", s_root->str, s_root->len);
+	cstring *recdata = ser_wallet_root_rec(wlt);
 	cstr_append_buf(rs, recdata->str, recdata->len);
 	cstr_free(recdata, true);
-	cstr_free(s_root, true);
 	}
 
 	/* ser "privkey" records */
@@ -269,18 +382,11 @@ cstring *ser_wallet(const struct wallet *wlt)
 	for (i = 0; i < wlt->accounts->len; i++) {
 		struct wallet_account *acct = parr_idx(wlt->accounts, i);
 
-		cstring *acct_raw = cstr_new_sz(64);
-		ser_account(acct_raw, acct);
-
-		cstring *recdata = message_str(wlt->chain->netmagic,
-					       "account",
-					       acct_raw->str,
-					       acct_raw->len);
+		cstring *recdata = ser_wallet_account_rec(wlt, acct);
 		assert(recdata != NULL);
 
 		cstr_append_buf(rs, recdata->str, recdata->len);
 		cstr_free(recdata, true);
-		cstr_free(acct_raw, true);
 	}
 
 	return rs;
@@ -310,6 +416,7 @@ static bool deser_wallet_root(struct wallet *wlt, struct const_buffer *buf)
 			return false;
 
 		if (!strcmp(key->str, "def_acct")) {
+			cstr_free(wlt->def_acct, true);
 			wlt->def_acct = value;
 			value = NULL;	// steal ref
 		}
@@ -0,0 +1,860 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ccoin/bloom.h>
+#include <ccoin/crypto/sha2.h>
+#include <ccoin/key.h>
+#include <ccoin/script.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+#include <ccoin/wallet.h>
+#include <ccoin/wallettrack.h>
+
+static const char wallettrack_magic[8] = "ccwtrack";
+
+/* HD indexes at and above this are hardened; xpubs cannot derive them */
+#define WALLET_TRACK_MAX_INDEX	0x80000000U
+
+static unsigned long wallettrack_outpt_hash(const void *p)
+{
+	return bp_outpt_hash(p);
+}
+
+static bool wallettrack_outpt_equal(const void *a, const void *b)
+{
+	return bp_outpt_equal(a, b);
+}
+
+static void wallettrack_free_chain(void *p)
+{
+	struct wallet_track_chain *ch = p;
+
+	if (!ch)
+		return;
+
+	hd_extended_key_free(&ch->xpub);
+	free(ch);
+}
+
+static void wallettrack_free_block(void *p)
+{
+	struct wallet_track_block *jb = p;
+
+	if (!jb)
+		return;
+
+	parr_free(jb->added, true);
+	parr_free(jb->spent, true);
+	free(jb);
+}
+
+static struct wallet_track_block *wallettrack_block_new(void)
+{
+	struct wallet_track_block *jb = calloc(1, sizeof(*jb));
+	jb->added = parr_new(0, free);
+	jb->spent = parr_new(0, free);
+	return jb;
+}
+
+void wallet_track_init(struct wallet_tracker *wt, const unsigned char *netmagic)
+{
+	memset(wt, 0, sizeof(*wt));
+	memcpy(wt->netmagic, netmagic, sizeof(wt->netmagic));
+	wt->best_height = -1;
+
+	wt->chains = parr_new(0, wallettrack_free_chain);
+	wt->loose = parr_new(0, free);
+	wt->keys = bp_hashtab_new_ext(bu160_hash, bu160_equal_, NULL, free);
+	wt->coins = bp_hashtab_new_ext(wallettrack_outpt_hash,
+				       wallettrack_outpt_equal, NULL, free);
+	wt->journal = parr_new(0, wallettrack_free_block);
+}
+
+void wallet_track_free(struct wallet_tracker *wt)
+{
+	if (!wt->chains)
+		return;
+
+	parr_free(wt->chains, true);
+	parr_free(wt->loose, true);
+	bp_hashtab_unref(wt->keys);
+	bp_hashtab_unref(wt->coins);
+	parr_free(wt->journal, true);
+	memset(wt, 0, sizeof(*wt));
+}
+
+/* Forget every coin and the scan position; the keys remain watched. */
+void wallet_track_reset(struct wallet_tracker *wt)
+{
+	bp_hashtab_clear(wt->coins);
+	parr_resize(wt->journal, 0);
+	wt->balance = 0;
+	wt->best_height = -1;
+	bu256_zero(&wt->best_hash);
+}
+
+static bool wallettrack_put_key(struct wallet_tracker *wt,
+				const bu160_t *pkhash,
+				uint32_t chain_idx, uint32_t index)
+{
+	struct wallet_track_key *k = malloc(sizeof(*k));
+	if (!k)
+		return false;
+
+	memcpy(&k->pkhash, pkhash, sizeof(k->pkhash));
+	k->chain_idx = chain_idx;
+	k->index = index;
+
+	if (!bp_hashtab_put(wt->keys, &k->pkhash, k)) {
+		free(k);
+		return false;
+	}
+	return true;
+}
+
+/* watch keys up to WALLET_TRACK_GAP past the last issued or used one */
+static bool wallettrack_extend(struct wallet_tracker *wt, uint32_t chain_idx)
+{
+	struct wallet_track_chain *ch = parr_idx(wt->chains, chain_idx);
+	uint64_t want = ch->n_issued > ch->n_used ? ch->n_issued : ch->n_used;
+
+	want += WALLET_TRACK_GAP;
+	if (want > WALLET_TRACK_MAX_INDEX)
+		want = WALLET_TRACK_MAX_INDEX;
+	if (ch->n_watched >= want)
+		return true;
+
+	unsigned int n = want - ch->n_watched;
+	struct hd_pub_child *kids = malloc(n * sizeof(*kids));
+	if (!kids)
+		return false;
+
+	bool rc = hd_derive_pub_batch(&ch->xpub, ch->n_watched, n, kids);
+
+	unsigned int i;
+	for (i = 0; rc && (i < n); i++)
+		rc = wallettrack_put_key(wt, (bu160_t *) kids[i].pubkey_hash,
+					 chain_idx, ch->n_watched + i);
+
+	if (rc)
+		ch->n_watched = want;
+
+	free(kids);
+	return rc;
+}
+
+static struct wallet_track_chain *
+wallettrack_chain_find(struct wallet_tracker *wt, uint32_t acct_idx,
+		       uint32_t chain)
+{
+	unsigned int i;
+	for (i = 0; i < wt->chains->len; i++) {
+		struct wallet_track_chain *ch = parr_idx(wt->chains, i);
+		if ((ch->acct_idx == acct_idx) && (ch->chain == chain))
+			return ch;
+	}
+
+	return NULL;
+}
+
+static struct wallet_track_chain *
+wallettrack_chain_new(const struct hd_extended_key *xpub,
+		      uint32_t acct_idx, uint32_t chain)
+{
+	struct wallet_track_chain *ch = calloc(1, sizeof(*ch));
+	if (!ch)
+		return NULL;
+
+	/* keep the public half only, whatever was passed in */
+	cstring *s = cstr_new_sz(78);
+	hd_extended_key_init(&ch->xpub);
+	if (!hd_extended_key_ser_pub(xpub, s) ||
+	    !hd_extended_key_deser(&ch->xpub, s->str, s->len)) {
+		cstr_free(s, true);
+		wallettrack_free_chain(ch);
+		return NULL;
+	}
+	cstr_free(s, true);
+
+	ch->acct_idx = acct_idx;
+	ch->chain = chain;
+	return ch;
+}
+
+/*
+ * Watch HD chain xpub, of which n_issued addresses have been handed
+ * out, or note more issued addresses of a chain already watched.
+ * Issued addresses the tracker never watched may have been paid in
+ * blocks already scanned: the tracker is then reset, for a rescan.
+ */
+bool wallet_track_add_chain(struct wallet_tracker *wt,
+			    const struct hd_extended_key *xpub,
+			    uint32_t acct_idx, uint32_t chain,
+			    uint32_t n_issued)
+{
+	if (n_issued > WALLET_TRACK_MAX_INDEX)
+		return false;
+
+	struct wallet_track_chain *ch = wallettrack_chain_find(wt, acct_idx,
+							       chain);
+	bool missed;
+
+	if (ch) {
+		missed = (n_issued > ch->n_watched);
+		if (n_issued > ch->n_issued)
+			ch->n_issued = n_issued;
+	} else {
+		ch = wallettrack_chain_new(xpub, acct_idx, chain);
+		if (!ch)
+			return false;
+		ch->n_issued = n_issued;
+		parr_add(wt->chains, ch);
+		missed = (n_issued > 0);
+	}
+
+	if (!wallettrack_extend(wt, parr_find(wt->chains, ch)))
+		return false;
+
+	if (missed && (wt->best_height >= 0))
+		wallet_track_reset(wt);
+	return true;
+}
+
+static bool wallettrack_add_pkhash(struct wallet_tracker *wt,
+				   const bu160_t *pkhash)
+{
+	if (bp_hashtab_get(wt->keys, pkhash))
+		return true;
+
+	bu160_t *copy = malloc(sizeof(*copy));
+	if (!copy)
+		return false;
+	memcpy(copy, pkhash, sizeof(*copy));
+	parr_add(wt->loose, copy);
+
+	return wallettrack_put_key(wt, pkhash, WALLET_TRACK_LOOSE,
+				   wt->loose->len - 1);
+}
+
+/* Watch a non-HD key.  A key new to the tracker resets it, for a rescan. */
+bool wallet_track_add_key(struct wallet_tracker *wt, const struct bp_key *key)
+{
+	void *pub = NULL;
+	size_t pub_len = 0;
+
+	if (!bp_pubkey_get(key, &pub, &pub_len))
+		return false;
+
+	bu160_t pkhash;
+	bu_Hash160((unsigned char *) &pkhash, pub, pub_len);
+	free(pub);
+
+	if (bp_hashtab_get(wt->keys, &pkhash))
+		return true;
+
+	if (!wallettrack_add_pkhash(wt, &pkhash))
+		return false;
+
+	if (wt->best_height >= 0)
+		wallet_track_reset(wt);
+	return true;
+}
+
+/* Watch every account chain and key of wlt. */
+bool wallet_track_watch(struct wallet_tracker *wt, struct wallet *wlt)
+{
+	unsigned int i;
+
+	for (i = 0; wlt->accounts && (i < wlt->accounts->len); i++) {
+		struct wallet_account *acct = parr_idx(wlt->accounts, i);
+		enum wallet_chain chain;
+
+		for (chain = WALLET_CHAIN_EXTERNAL;
+		     chain <= WALLET_CHAIN_CHANGE; chain++) {
+			const struct hd_extended_key *xpub =
+				wallet_account_chain_key(wlt, acct, chain);
+			uint32_t n_issued = (chain == WALLET_CHAIN_EXTERNAL) ?
+					    acct->next_key_idx : 0;
+
+			if (!xpub ||
+			    !wallet_track_add_chain(wt, xpub, acct->acct_idx,
+						    chain, n_issued))
+				return false;
+		}
+	}
+
+	struct bp_key *key;
+	wallet_for_each_key(wlt, key)
+		if (!wallet_track_add_key(wt, key))
+			return false;
+
+	return true;
+}
+
+/* the watched key an output pays, by P2PKH or P2PK template */
+static struct wallet_track_key *
+wallettrack_match(struct wallet_tracker *wt, const cstring *script)
+{
+	const unsigned char *p = (const unsigned char *) script->str;
+	size_t len = script->len;
+	bu160_t pkhash;
+
+	if ((len == 25) && (p[0] == OP_DUP) && (p[1] == OP_HASH160) &&
+	    (p[2] == 20) && (p[23] == OP_EQUALVERIFY) &&
+	    (p[24] == OP_CHECKSIG))
+		memcpy(&pkhash, p + 3, sizeof(pkhash));
+	else if (((len == 35) || (len == 67)) && (p[0] == len - 2) &&
+		 (p[len - 1] == OP_CHECKSIG))
+		bu_Hash160((unsigned char *) &pkhash, p + 1, p[0]);
+	else
+		return NULL;
+
+	return bp_hashtab_get(wt->keys, &pkhash);
+}
+
+/* a watched HD key was paid: move the lookahead along */
+static bool wallettrack_used(struct wallet_tracker *wt,
+			     const struct wallet_track_key *k)
+{
+	if (k->chain_idx == WALLET_TRACK_LOOSE)
+		return true;
+
+	struct wallet_track_chain *ch = parr_idx(wt->chains, k->chain_idx);
+	if (k->index < ch->n_used)
+		return true;
+
+	ch->n_used = k->index + 1;
+	return wallettrack_extend(wt, k->chain_idx);
+}
+
+static bool wallettrack_put_coin(struct wallet_tracker *wt,
+				 const struct wallet_coin *coin)
+{
+	struct wallet_coin *copy = malloc(sizeof(*copy));
+	if (!copy)
+		return false;
+	*copy = *coin;
+
+	if (!bp_hashtab_put(wt->coins, &copy->outpt, copy)) {
+		free(copy);
+		return false;
+	}
+
+	wt->balance += copy->value;
+	return true;
+}
+
+/* reverse the effect of a journalled block on the coins */
+static void wallettrack_undo(struct wallet_tracker *wt,
+			     const struct wallet_track_block *jb)
+{
+	unsigned int i;
+
+	/* restore first: coins both added and spent by the block are
+	 * then removed again below
+	 */
+	for (i = 0; i < jb->spent->len; i++)
+		wallettrack_put_coin(wt, parr_idx(jb->spent, i));
+
+	for (i = 0; i < jb->added->len; i++) {
+		const struct bp_outpt *outpt = parr_idx(jb->added, i);
+		struct wallet_coin *coin = bp_hashtab_get(wt->coins, outpt);
+
+		if (coin) {
+			wt->balance -= coin->value;
+			bp_hashtab_del(wt->coins, outpt);
+		}
+	}
+}
+
+static bool wallettrack_spend(struct wallet_tracker *wt,
+			      struct wallet_track_block *jb,
+			      const struct bp_tx *tx)
+{
+	unsigned int i;
+
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bp_txin *txin = parr_idx(tx->vin, i);
+		struct wallet_coin *coin = bp_hashtab_get(wt->coins,
+							  &txin->prevout);
+		if (!coin)
+			continue;
+
+		struct wallet_coin *spent = malloc(sizeof(*spent));
+		if (!spent)
+			return false;
+		*spent = *coin;
+		parr_add(jb->spent, spent);
+
+		wt->balance -= coin->value;
+		bp_hashtab_del(wt->coins, &txin->prevout);
+	}
+
+	return true;
+}
+
+static bool wallettrack_receive(struct wallet_tracker *wt,
+				struct wallet_track_block *jb,
+				const struct bp_tx *tx, unsigned int height)
+{
+	unsigned int i;
+
+	for (i = 0; i < tx->vout->len; i++) {
+		struct bp_txout *txout = parr_idx(tx->vout, i);
+		struct wallet_track_key *k = wallettrack_match(wt,
+							txout->scriptPubKey);
+		if (!k)
+			continue;
+
+		struct wallet_coin coin = {
+			.value		= txout->nValue,
+			.height		= height,
+			.chain_idx	= k->chain_idx,
+			.index		= k->index,
+		};
+		bu256_copy(&coin.outpt.hash, &tx->sha256);
+		coin.outpt.n = i;
+		memcpy(&coin.pkhash, &k->pkhash, sizeof(coin.pkhash));
+
+		/* duplicate txid (BIP 30): the first coin stands */
+		if (bp_hashtab_get(wt->coins, &coin.outpt))
+			continue;
+
+		struct bp_outpt *outpt = malloc(sizeof(*outpt));
+		if (!outpt)
+			return false;
+		bp_outpt_copy(outpt, &coin.outpt);
+		parr_add(jb->added, outpt);
+
+		if (!wallettrack_put_coin(wt, &coin) ||
+		    !wallettrack_used(wt, k))
+			return false;
+	}
+
+	return true;
+}
+
+static struct wallet_track_block *
+wallettrack_scan(struct wallet_tracker *wt, const struct bp_block *block,
+		 unsigned int height)
+{
+	struct bp_block hdr;
+	bp_block_init(&hdr);
+	bp_block_copy_hdr(&hdr, block);
+	bp_block_calc_sha256(&hdr);
+
+	struct wallet_track_block *jb = wallettrack_block_new();
+	bu256_copy(&jb->hash, &hdr.sha256);
+	bu256_copy(&jb->prev_hash, &block->hashPrevBlock);
+	jb->height = height;
+	bp_block_free(&hdr);
+
+	unsigned int n_tx = block->vtx ? block->vtx->len : 0;
+	unsigned int i;
+	bool rc = true;
+
+	for (i = 0; rc && (i < n_tx); i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		bp_tx_calc_sha256(tx);
+
+		rc = ((i == 0) || wallettrack_spend(wt, jb, tx)) &&
+		     wallettrack_receive(wt, jb, tx, height);
+	}
+
+	if (!rc) {
+		wallettrack_undo(wt, jb);
+		wallettrack_free_block(jb);
+		return NULL;
+	}
+
+	return jb;
+}
+
+/*
+ * Take block at height on top of the best block.  Before anything has
+ * been scanned, a block at any height is taken, so a new wallet need
+ * not scan history older than itself.
+ */
+bool wallet_track_connect(struct wallet_tracker *wt,
+			  const struct bp_block *block, unsigned int height)
+{
+	if ((wt->best_height >= 0) &&
+	    ((height != wt->best_height + 1) ||
+	     !bu256_equal(&block->hashPrevBlock, &wt->best_hash)))
+		return false;
+
+	struct wallet_track_block *jb;
+	unsigned int n_keys;
+
+	/* a payment near the end of the lookahead watches more keys,
+	 * which earlier outputs of the block may pay too: scan it again
+	 * until the watched keys stay put
+	 */
+	while (1) {
+		n_keys = bp_hashtab_size(wt->keys);
+
+		jb = wallettrack_scan(wt, block, height);
+		if (!jb)
+			return false;
+		if (bp_hashtab_size(wt->keys) == n_keys)
+			break;
+
+		wallettrack_undo(wt, jb);
+		wallettrack_free_block(jb);
+	}
+
+	parr_add(wt->journal, jb);
+	if (wt->journal->len > WALLET_TRACK_DEPTH)
+		parr_remove_range(wt->journal, 0,
+				  wt->journal->len - WALLET_TRACK_DEPTH);
+
+	wt->best_height = height;
+	bu256_copy(&wt->best_hash, &jb->hash);
+	return true;
+}
+
+/*
+ * Remove the best block, named by hash.  Fails when the block is
+ * older than the journal reaches.
+ */
+bool wallet_track_disconnect(struct wallet_tracker *wt, const bu256_t *hash)
+{
+	if ((wt->best_height < 0) || (wt->journal->len == 0) ||
+	    !bu256_equal(hash, &wt->best_hash))
+		return false;
+
+	struct wallet_track_block *jb = parr_idx(wt->journal,
+						 wt->journal->len - 1);
+	wallettrack_undo(wt, jb);
+
+	wt->best_height = jb->height - 1;
+	bu256_copy(&wt->best_hash, &jb->prev_hash);
+
+	parr_remove_idx(wt->journal, wt->journal->len - 1);
+	return true;
+}
+
+static void wallettrack_collect(void *key, void *value, void *priv)
+{
+	parr_add(priv, value);
+}
+
+static int wallettrack_coin_cmp(const void *a_, const void *b_)
+{
+	const struct wallet_coin *a = *(const struct wallet_coin * const *) a_;
+	const struct wallet_coin *b = *(const struct wallet_coin * const *) b_;
+
+	if (a->height != b->height)
+		return a->height < b->height ? -1 : 1;
+
+	int cmp = memcmp(&a->outpt.hash, &b->outpt.hash, sizeof(bu256_t));
+	if (cmp)
+		return cmp;
+
+	return (a->outpt.n > b->outpt.n) - (a->outpt.n < b->outpt.n);
+}
+
+/* Point out at the unspent coins, oldest first.  out does not own them. */
+void wallet_track_unspent(const struct wallet_tracker *wt, parr *out)
+{
+	size_t start = out->len;
+
+	bp_hashtab_iter(wt->coins, wallettrack_collect, out);
+	qsort(&out->data[start], out->len - start, sizeof(void *),
+	      wallettrack_coin_cmp);
+}
+
+static void wallettrack_filter_coin(void *key, void *value, void *priv)
+{
+	const struct wallet_coin *coin = value;
+
+	bloom_insert_outpt(priv, &coin->outpt);
+}
+
+/*
+ * BIP 37 filter for an SPV peer, matching what the tracker matches:
+ * each watched HD key by public key (P2PK) and by its hash (P2PKH),
+ * non-HD keys by hash, and the unspent coins by outpoint, so that
+ * their spends are seen.  Payments found update the filter in the
+ * peer (BLOOM_UPDATE_ALL); new keys watched need a new filter.
+ */
+bool wallet_track_filter(const struct wallet_tracker *wt, struct bloom *bf,
+			 double fp_rate, uint32_t nTweak)
+{
+	unsigned int i, j, n_elem = wt->loose->len + wallet_track_n_coins(wt);
+
+	for (i = 0; i < wt->chains->len; i++) {
+		const struct wallet_track_chain *ch = parr_idx(wt->chains, i);
+		n_elem += 2 * ch->n_watched;
+	}
+
+	if (!bloom_init(bf, n_elem ? n_elem : 1, fp_rate))
+		return false;
+	bf->nTweak = nTweak;
+	bf->nFlags = BLOOM_UPDATE_ALL;
+
+	for (i = 0; i < wt->chains->len; i++) {
+		struct wallet_track_chain *ch = parr_idx(wt->chains, i);
+		struct hd_pub_child *kids;
+
+		if (!ch->n_watched)
+			continue;
+		kids = malloc(ch->n_watched * sizeof(*kids));
+		if (!kids ||
+		    !hd_derive_pub_batch(&ch->xpub, 0, ch->n_watched, kids)) {
+			free(kids);
+			bloom_free(bf);
+			return false;
+		}
+
+		for (j = 0; j < ch->n_watched; j++) {
+			bloom_insert(bf, kids[j].pubkey, BP_PUBKEY_SZ);
+			bloom_insert(bf, kids[j].pubkey_hash, 20);
+		}
+		free(kids);
+	}
+
+	for (i = 0; i < wt->loose->len; i++)
+		bloom_insert(bf, parr_idx(wt->loose, i), sizeof(bu160_t));
+
+	bp_hashtab_iter(wt->coins, wallettrack_filter_coin, bf);
+
+	return true;
+}
+
+static void ser_wallet_coin(cstring *s, const struct wallet_coin *coin)
+{
+	ser_bp_outpt(s, &coin->outpt);
+	ser_s64(s, coin->value);
+	ser_u32(s, coin->height);
+	ser_bytes(s, &coin->pkhash, sizeof(coin->pkhash));
+	ser_u32(s, coin->chain_idx);
+	ser_u32(s, coin->index);
+}
+
+static bool deser_wallet_coin(struct wallet_coin *coin,
+			      struct const_buffer *buf)
+{
+	if (!deser_bp_outpt(&coin->outpt, buf)) return false;
+	if (!deser_s64(&coin->value, buf)) return false;
+	if (!deser_u32(&coin->height, buf)) return false;
+	if (!deser_bytes(&coin->pkhash, buf, sizeof(coin->pkhash)))
+		return false;
+	if (!deser_u32(&coin->chain_idx, buf)) return false;
+	if (!deser_u32(&coin->index, buf)) return false;
+	return true;
+}
+
+static void ser_wallettrack_coins(void *key, void *value, void *priv)
+{
+	ser_wallet_coin(priv, value);
+}
+
+/*
+ * Store the tracker in fn, replacing it atomically.  The keys of each
+ * chain are not stored, but derived again on reading.
+ */
+bool wallet_track_write(const struct wallet_tracker *wt, const char *fn)
+{
+	unsigned int i, j;
+	cstring *s = cstr_new_sz(256 + (bp_hashtab_size(wt->coins) * 80));
+
+	ser_bytes(s, wallettrack_magic, sizeof(wallettrack_magic));
+	ser_u32(s, WALLET_TRACK_VERSION);
+	ser_bytes(s, wt->netmagic, 4);
+	ser_u32(s, (uint32_t) wt->best_height);
+	ser_u256(s, &wt->best_hash);
+
+	ser_varlen(s, wt->chains->len);
+	for (i = 0; i < wt->chains->len; i++) {
+		struct wallet_track_chain *ch = parr_idx(wt->chains, i);
+
+		ser_u32(s, ch->acct_idx);
+		ser_u32(s, ch->chain);
+		if (!hd_extended_key_ser_pub(&ch->xpub, s)) {
+			cstr_free(s, true);
+			return false;
+		}
+		ser_u32(s, ch->n_issued);
+		ser_u32(s, ch->n_used);
+	}
+
+	ser_varlen(s, wt->loose->len);
+	for (i = 0; i < wt->loose->len; i++)
+		ser_bytes(s, parr_idx(wt->loose, i), sizeof(bu160_t));
+
+	ser_varlen(s, bp_hashtab_size(wt->coins));
+	bp_hashtab_iter(wt->coins, ser_wallettrack_coins, s);
+
+	ser_varlen(s, wt->journal->len);
+	for (i = 0; i < wt->journal->len; i++) {
+		struct wallet_track_block *jb = parr_idx(wt->journal, i);
+
+		ser_u256(s, &jb->hash);
+		ser_u256(s, &jb->prev_hash);
+		ser_u32(s, jb->height);
+
+		ser_varlen(s, jb->added->len);
+		for (j = 0; j < jb->added->len; j++)
+			ser_bp_outpt(s, parr_idx(jb->added, j));
+
+		ser_varlen(s, jb->spent->len);
+		for (j = 0; j < jb->spent->len; j++)
+			ser_wallet_coin(s, parr_idx(jb->spent, j));
+	}
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	sha256_Raw((unsigned char *) s->str, s->len, md);
+	ser_bytes(s, md, sizeof(md));
+
+	bool rc = bu_write_file(fn, s->str, s->len);
+
+	cstr_free(s, true);
+	return rc;
+}
+
+static bool deser_wallettrack_chain(struct wallet_tracker *wt,
+				    struct const_buffer *buf)
+{
+	uint32_t acct_idx, chain, n_issued, n_used;
+	struct hd_extended_key xpub;
+	bool rc = false;
+
+	hd_extended_key_init(&xpub);
+
+	if (!deser_u32(&acct_idx, buf) || !deser_u32(&chain, buf) ||
+	    (buf->len < 78) || !hd_extended_key_deser(&xpub, buf->p, 78))
+		goto out;
+	buf->p += 78;
+	buf->len -= 78;
+
+	if (!deser_u32(&n_issued, buf) || !deser_u32(&n_used, buf) ||
+	    (n_used > WALLET_TRACK_MAX_INDEX) ||
+	    wallettrack_chain_find(wt, acct_idx, chain))
+		goto out;
+
+	struct wallet_track_chain *ch = wallettrack_chain_new(&xpub, acct_idx,
+							      chain);
+	if (!ch)
+		goto out;
+	ch->n_issued = n_issued;
+	ch->n_used = n_used;
+	parr_add(wt->chains, ch);
+
+	rc = wallettrack_extend(wt, wt->chains->len - 1);
+
+out:
+	hd_extended_key_free(&xpub);
+	return rc;
+}
+
+static bool deser_wallettrack_block(struct wallet_tracker *wt,
+				    struct const_buffer *buf)
+{
+	struct wallet_track_block *jb = wallettrack_block_new();
+	uint32_t n, i;
+
+	parr_add(wt->journal, jb);
+
+	if (!deser_u256(&jb->hash, buf)) return false;
+	if (!deser_u256(&jb->prev_hash, buf)) return false;
+	if (!deser_u32(&jb->height, buf)) return false;
+
+	if (!deser_varlen(&n, buf)) return false;
+	for (i = 0; i < n; i++) {
+		struct bp_outpt *outpt = malloc(sizeof(*outpt));
+		parr_add(jb->added, outpt);
+		if (!deser_bp_outpt(outpt, buf))
+			return false;
+	}
+
+	if (!deser_varlen(&n, buf)) return false;
+	for (i = 0; i < n; i++) {
+		struct wallet_coin *coin = malloc(sizeof(*coin));
+		parr_add(jb->spent, coin);
+		if (!deser_wallet_coin(coin, buf))
+			return false;
+	}
+
+	return true;
+}
+
+/* Load a tracker stored by wallet_track_write().  wt is initialized here. */
+bool wallet_track_read(struct wallet_tracker *wt, const char *fn)
+{
+	void *data = NULL;
+	size_t data_len = 0;
+	unsigned char zero_magic[4] = {};
+
+	wallet_track_init(wt, zero_magic);
+
+	if (!bu_read_file(fn, &data, &data_len, 1024 * 1024 * 1024))
+		return false;
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	char magic[sizeof(wallettrack_magic)];
+	uint32_t version, height, n, i;
+	bool rc = false;
+
+	if (data_len < (sizeof(magic) + sizeof(md)))
+		goto out;
+	data_len -= sizeof(md);
+	sha256_Raw(data, data_len, md);
+	if (memcmp(md, (unsigned char *) data + data_len, sizeof(md)))
+		goto out;
+
+	struct const_buffer buf = { data, data_len };
+
+	if (!deser_bytes(magic, &buf, sizeof(magic)) ||
+	    memcmp(magic, wallettrack_magic, sizeof(magic)) ||
+	    !deser_u32(&version, &buf) ||
+	    (version != WALLET_TRACK_VERSION) ||
+	    !deser_bytes(wt->netmagic, &buf, 4) ||
+	    !deser_u32(&height, &buf) ||
+	    !deser_u256(&wt->best_hash, &buf))
+		goto out;
+	wt->best_height = (int) height;
+
+	if (!deser_varlen(&n, &buf))
+		goto out;
+	for (i = 0; i < n; i++)
+		if (!deser_wallettrack_chain(wt, &buf))
+			goto out;
+
+	if (!deser_varlen(&n, &buf))
+		goto out;
+	for (i = 0; i < n; i++) {
+		bu160_t pkhash;
+		if (!deser_bytes(&pkhash, &buf, sizeof(pkhash)) ||
+		    !wallettrack_add_pkhash(wt, &pkhash))
+			goto out;
+	}
+
+	if (!deser_varlen(&n, &buf))
+		goto out;
+	for (i = 0; i < n; i++) {
+		struct wallet_coin coin;
+		if (!deser_wallet_coin(&coin, &buf) ||
+		    !wallettrack_put_coin(wt, &coin))
+			goto out;
+	}
+
+	if (!deser_varlen(&n, &buf))
+		goto out;
+	for (i = 0; i < n; i++)
+		if (!deser_wallettrack_block(wt, &buf))
+			goto out;
+
+	rc = (buf.len == 0);
+
+out:
+	free(data);
+	if (!rc)
+		wallet_track_free(wt);
+	return rc;
+}
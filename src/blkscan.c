@@ -4,7 +4,9 @@
  */
 #include "picocoin-config.h"
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,6 +15,7 @@
 #include <ccoin/crypto/ripemd160.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/base58.h>
+#include <ccoin/blkpipe.h>
 #include <ccoin/buffer.h>
 #include <ccoin/key.h>
 #include <ccoin/core.h>
@@ -22,6 +25,8 @@
 #include <ccoin/addr_match.h>
 #include <ccoin/message.h>
 #include <ccoin/hashtab.h>
+#include <ccoin/queue.h>
+#include <ccoin/txindex.h>
 
 const char *argp_program_version = PACKAGE_VERSION;
 
@@ -31,6 +36,12 @@ static struct argp_option options[] = {
 	{ "blocks", 'b', "FILE", 0,
 	  "Load blockchain data from mkbootstrap-produced FILE.  Default filename \"addresses.txt\"." },
 
+	{ "txindex", 'i', "FILE", 0,
+	  "Keep a persistent transaction index in FILE, adding blocks not yet indexed.  Default: in-memory index." },
+
+	{ "jobs", 'j', "N", 0,
+	  "Split the blocks file into N shards, scanned in parallel, after bringing the transaction index up to date.  0 = one per CPU.  Default: one pipelined scan." },
+
 	{ "no-decimal", 'N', NULL, 0,
 	  "Print values as integers (satoshis), not decimal numbers" },
 
@@ -45,11 +56,13 @@ static const char doc[] =
 
 static char *blocks_fn = "blocks.dat";
 static char *address_fn = "addresses.txt";
+static char *txindex_fn = NULL;
 static bool opt_quiet = false;
 static bool opt_decimal = true;
+static int opt_jobs = -1;
 
 static struct bp_keyset bpks;
-static struct bp_hashtab *tx_idx = NULL;
+static struct bp_txindex tx_idx;
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
 
@@ -65,6 +78,14 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 'b':
 		blocks_fn = arg;
 		break;
+	case 'i':
+		txindex_fn = arg;
+		break;
+	case 'j':
+		opt_jobs = atoi(arg);
+		if (opt_jobs < 0)
+			argp_usage(state);
+		break;
 	case 'N':
 		opt_decimal = false;
 		break;
@@ -84,7 +105,7 @@ static void load_address(unsigned int line_no, const char *line)
 	unsigned char addrtype;
 	cstring *s = base58_decode_check(&addrtype, line);
 
-	if (!s || addrtype != PUBKEY_ADDRESS) {
+	if (!s || (addrtype != PUBKEY_ADDRESS && addrtype != SCRIPT_ADDRESS)) {
 		fprintf(stderr, "Invalid address on line %d: %s\n", line_no, line);
 		exit(1);
 	}
@@ -95,8 +116,16 @@ static void load_address(unsigned int line_no, const char *line)
 		exit(1);
 	}
 
-	struct buffer *buf_pkhash = buffer_copy(s->str,RIPEMD160_DIGEST_LENGTH);
-	bp_hashtab_put(bpks.pubhash, buf_pkhash, buf_pkhash);
+	bool added;
+	if (addrtype == PUBKEY_ADDRESS)
+		added = bpks_add_pubhash(&bpks, s->str);
+	else
+		added = bpks_add_scripthash(&bpks, s->str);
+	if (!added) {
+		fprintf(stderr, "Cannot add address on line %d: %s\n",
+			line_no, line);
+		exit(1);
+	}
 
 	cstr_free(s, true);
 }
@@ -131,96 +160,42 @@ static void load_addresses(void)
 
 	if (!opt_quiet)
 		fprintf(stderr, "%d addresses loaded\n",
-			bp_hashtab_size(bpks.pubhash));
+			bp_hashtab_size(bpks.scripts));
 }
 
-/* file pos -> block lookup */
-static bool reload_block(int fd, uint64_t fpos, struct bp_block *block)
-{
-	off_t save_ofs = lseek(fd, 0, SEEK_CUR);
-	if (save_ofs == (off_t)-1) {
-		perror("lseek 1");
-		return false;
-	}
-
-	if (lseek(fd, (off_t) fpos, SEEK_SET) != (off_t) fpos) {
-		perror("lseek 2");
-		return false;
-	}
-
-	struct p2p_message msg = {};
-	bool read_ok = false;
-
-	if (!fread_block(fd, &msg, &read_ok)) {
-		fprintf(stderr, "reload_block fread_block fail\n");
-		goto err_out;
-	}
-
-	struct const_buffer buf = { msg.data, msg.hdr.data_len };
-
-	bool rc = deser_bp_block(block, &buf);
-	if (!rc) {
-		fprintf(stderr, "reload_block deser_block fail\n");
-		goto err_out;
-	}
-
-	if (lseek(fd, save_ofs, SEEK_SET) != save_ofs)
-		perror("lseek restore true");
-	free(msg.data);
-	return true;
-
-err_out:
-	if (lseek(fd, save_ofs, SEEK_SET) != save_ofs)
-		perror("lseek restore false");
-	free(msg.data);
-	return false;
-}
-
-/* search for tx_hash within given block; return full tx */
-static bool tx_from_block(struct bp_tx *dest, bu256_t *tx_hash,
-			  const struct bp_block *block)
-{
-	unsigned int n;
-	for (n = 0; n < block->vtx->len; n++) {
-		struct bp_tx *tx;
-
-		tx = parr_idx(block->vtx, n);
-
-		bp_tx_calc_sha256(tx);
+static int block_fd = -1;
 
-		if (bu256_equal(&tx->sha256, tx_hash)) {
-			bp_tx_copy(dest, tx);
-			return true;
-		}
-	}
+/* matches of one scan, or of one shard of a parallel scan */
+struct scan_state {
+	unsigned int	height;		/* of the next block */
+	unsigned int	tx_matches;
+	cstring		*out;		/* report text, not yet printed */
+};
 
-	return false;
-}
+static struct scan_state gbl_state;
 
-static bool tx_from_fpos(struct bp_tx *dest, bu256_t *tx_hash,
-			 int fd, uint64_t fpos)
+static void out_printf(cstring *out, const char *fmt, ...)
 {
-	struct bp_block block;
-	bool rc = false;
-
-	bp_block_init(&block);
-
-	if (!reload_block(fd, fpos, &block))
-		goto out;
-
-	if (!tx_from_block(dest, tx_hash, &block))
-		goto out;
-
-	rc = true;
-
-out:
-	bp_block_free(&block);
-	return rc;
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (len >= (int) sizeof(line)) {
+		size_t pos = out->len;
+		cstr_resize(out, pos + len);
+
+		va_start(ap, fmt);
+		vsnprintf(out->str + pos, len + 1, fmt, ap);
+		va_end(ap);
+	} else if (len > 0)
+		cstr_append_buf(out, line, len);
 }
 
-static int block_fd = -1;
-
-static void print_txout(bool show_from, unsigned int i, struct bp_txout *txout)
+static void print_txout(cstring *out, bool show_from, unsigned int i,
+			struct bp_txout *txout)
 {
 	char valstr[VALSTR_SZ];
 	if (opt_decimal)
@@ -229,19 +204,19 @@ static void print_txout(bool show_from, unsigned int i, struct bp_txout *txout)
 		snprintf(valstr, sizeof(valstr), "%lld",
 			 (long long) txout->nValue);
 
-	printf("\t%s %u: %s",
-		show_from ? "\tFrom" : "Output",
-		i, valstr);
+	out_printf(out, "\t%s %u: %s",
+		   show_from ? "\tFrom" : "Output",
+		   i, valstr);
 
 	struct bscript_addr addrs;
 	if (!bsp_addr_parse(&addrs, txout->scriptPubKey->str,
 			    txout->scriptPubKey->len)) {
-		printf(" UNPARSEABLE-ADDRESS!\n");
+		out_printf(out, " UNPARSEABLE-ADDRESS!\n");
 		return;
 	}
 
 	if (addrs.pub)
-		printf(" SOME-PUBKEYS!");
+		out_printf(out, " SOME-PUBKEYS!");
 
 	struct const_buffer *buf;
 	clist *tmp = addrs.pubhash;
@@ -255,26 +230,47 @@ static void print_txout(bool show_from, unsigned int i, struct bp_txout *txout)
 		cstring *addr = base58_encode_check(PUBKEY_ADDRESS, true,
 						    buf->p, buf->len);
 		if (!addr) {
-			printf(" ENCODE-FAILED!\n");
+			out_printf(out, " ENCODE-FAILED!\n");
+			goto out;
+		}
+
+		out_printf(out, " %s%s%s",
+			   is_mine ? "*" : "",
+			   addr->str,
+			   is_mine ? "*" : "");
+
+		cstr_free(addr, true);
+	}
+
+	/* bsp_addr_parse leaves script hashes to the caller */
+	if (addrs.txtype == TX_SCRIPTHASH) {
+		is_mine = bpks_lookup_script(&bpks, txout->scriptPubKey->str,
+					     txout->scriptPubKey->len);
+
+		cstring *addr = base58_encode_check(SCRIPT_ADDRESS, true,
+						    txout->scriptPubKey->str + 2,
+						    RIPEMD160_DIGEST_LENGTH);
+		if (!addr) {
+			out_printf(out, " ENCODE-FAILED!\n");
 			goto out;
 		}
 
-		printf(" %s%s%s",
-		       is_mine ? "*" : "",
-		       addr->str,
-		       is_mine ? "*" : "");
+		out_printf(out, " %s%s%s",
+			   is_mine ? "*" : "",
+			   addr->str,
+			   is_mine ? "*" : "");
 
 		cstr_free(addr, true);
 	}
 
-	printf("\n");
+	out_printf(out, "\n");
 
 out:
         clist_free_ext(addrs.pub, buffer_freep);
         clist_free_ext(addrs.pubhash, buffer_freep);
 }
 
-static void print_txouts(struct bp_tx *tx, int idx)
+static void print_txouts(cstring *out, struct bp_tx *tx, int idx)
 {
 	unsigned int i;
 	for (i = 0; i < tx->vout->len; i++) {
@@ -283,42 +279,42 @@ static void print_txouts(struct bp_tx *tx, int idx)
 		txout = parr_idx(tx->vout, i);
 
 		if (idx < 0)
-			print_txout(false, i, txout);
+			print_txout(out, false, i, txout);
 		else if (idx == i)
-			print_txout(true, i, txout);
+			print_txout(out, true, i, txout);
 	}
 }
 
-static void print_txin(unsigned int i, struct bp_txin *txin)
+static void print_txin(cstring *out, unsigned int i, struct bp_txin *txin)
 {
 	char hexstr[BU256_STRSZ];
 
 	bu256_hex(hexstr, &txin->prevout.hash);
 
-	printf("\tInput %u: %s %u\n",
-		i, hexstr, txin->prevout.n);
+	out_printf(out, "\tInput %u: %s %u\n",
+		   i, hexstr, txin->prevout.n);
 
-	uint64_t *fpos_p = bp_hashtab_get(tx_idx, &txin->prevout.hash);
-	if (!fpos_p) {
-		printf("\t\tINPUT NOT FOUND!\n");
+	struct bp_txindex_ent ent;
+	if (!bp_txindex_lookup(&tx_idx, &txin->prevout.hash, &ent)) {
+		out_printf(out, "\t\tINPUT NOT FOUND!\n");
 		return;
 	}
 
 	struct bp_tx tx;
 	bp_tx_init(&tx);
 
-	if (!tx_from_fpos(&tx, &txin->prevout.hash, block_fd, *fpos_p)) {
-		printf("\t\tINPUT NOT READ!\n");
+	if (!bp_txindex_read_tx(block_fd, &ent, &tx)) {
+		out_printf(out, "\t\tINPUT NOT READ!\n");
 		goto out;
 	}
 
-	print_txouts(&tx, txin->prevout.n);
+	print_txouts(out, &tx, txin->prevout.n);
 
 out:
 	bp_tx_free(&tx);
 }
 
-static void print_txins(struct bp_tx *tx)
+static void print_txins(cstring *out, struct bp_tx *tx)
 {
 	unsigned int i;
 	for (i = 0; i < tx->vin->len; i++) {
@@ -326,35 +322,28 @@ static void print_txins(struct bp_tx *tx)
 
 		txin = parr_idx(tx->vin, i);
 
-		print_txin(i, txin);
+		print_txin(out, i, txin);
 	}
 }
 
 static void index_block(unsigned int height, struct bp_block *block,
 			uint64_t fpos)
 {
-	unsigned int n;
-	for (n = 0; n < block->vtx->len; n++) {
-		struct bp_tx *tx;
-		uint64_t *fpos_copy;
-
-		tx = parr_idx(block->vtx, n);
-
-		bp_tx_calc_sha256(tx);
-
-		bu256_t *hash = bu256_new(&tx->sha256);
-
-		fpos_copy = malloc(sizeof(fpos));
-		if (fpos_copy)
-			*fpos_copy = fpos;
+	/* already in a persistent index from an earlier run */
+	if (fpos < tx_idx.blocks_end)
+		return;
 
-		bp_hashtab_put(tx_idx, hash, fpos_copy);
+	if (!bp_txindex_add_block(&tx_idx, block, fpos,
+				  sizeof(struct p2p_blockfile_hdr)) ||
+	    (bp_txindex_want_compact(&tx_idx) &&
+	     !bp_txindex_compact(&tx_idx))) {
+		fprintf(stderr, "tx index update failed at height %u\n",
+			height);
+		exit(1);
 	}
 }
 
-static unsigned int tx_matches = 0;
-
-static void scan_block(unsigned int height, struct bp_block *block)
+static void scan_block(struct scan_state *st, struct bp_block *block)
 {
 	unsigned int n;
 	for (n = 0; n < block->vtx->len; n++) {
@@ -367,80 +356,193 @@ static void scan_block(unsigned int height, struct bp_block *block)
 			bp_tx_calc_sha256(tx);
 			bu256_hex(hashstr, &tx->sha256);
 
-			printf("%u, %s\n",
-			       block->nTime,
-			       hashstr);
+			out_printf(st->out, "%u, %s\n",
+				   block->nTime,
+				   hashstr);
 
-			print_txins(tx);
-			print_txouts(tx, -1);
+			print_txins(st->out, tx);
+			print_txouts(st->out, tx, -1);
 
-			tx_matches++;
+			st->tx_matches++;
 		}
 	}
 }
 
-static void scan_decode_block(unsigned int height, struct p2p_message *msg,
-			      uint64_t *fpos)
+static void flush_output(struct scan_state *st)
 {
-	struct bp_block block;
-	bp_block_init(&block);
-
-	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+	fwrite(st->out->str, 1, st->out->len, stdout);
+	cstr_resize(st->out, 0);
+}
 
-	bool rc = deser_bp_block(&block, &buf);
-	if (!rc) {
-		fprintf(stderr, "block deser failed at height %u\n", height);
-		exit(1);
+static bool scan_decoded_block(struct bp_block *block,
+			       const struct p2p_message_hdr *hdr,
+			       int64_t fpos, void *priv)
+{
+	struct scan_state *st = priv;
+	unsigned int height = st->height++;
+
+	/* shards only read the index, brought up to date beforehand */
+	if (st == &gbl_state)
+		index_block(height, block, fpos);
+	scan_block(st, block);
+
+	if (st == &gbl_state) {
+		flush_output(st);
+
+		if ((st->height % 10000 == 0) && (!opt_quiet))
+			fprintf(stderr,
+				"Scanned %llu transactions at height %u\n",
+				(unsigned long long) bp_txindex_size(&tx_idx),
+				st->height);
 	}
 
-	index_block(height, &block, *fpos);
-	scan_block(height, &block);
+	return true;
+}
 
-	uint64_t pos_tmp = msg->hdr.data_len;
-	*fpos += (pos_tmp + 8);
+static bool index_decoded_block(struct bp_block *block,
+				const struct p2p_message_hdr *hdr,
+				int64_t fpos, void *priv)
+{
+	unsigned int *height = priv;
 
-	bp_block_free(&block);
+	index_block((*height)++, block, fpos);
+	return true;
 }
 
-static void scan_blocks(void)
+static void scan_fail(const struct blkpipe_result *res)
 {
-	int fd = file_seq_open(blocks_fn);
-	if (fd < 0) {
+	if (!res->read_ok)
+		fprintf(stderr, "block read %s failed\n", blocks_fn);
+	else
+		fprintf(stderr, "%s at offset %lld\n",
+			res->fail_reason, (long long) res->fail_fpos);
+	exit(1);
+}
+
+/*
+ * Input lookups need every earlier tx indexed, so index the blocks
+ * the index lacks first, in one pass, then scan shards of the file in
+ * parallel, with read-only lookups, and print their output in file
+ * order.
+ */
+static void scan_blocks_sharded(int fd)
+{
+	struct blkpipe_opts opts = {
+		.read_f		= fread_block,
+	};
+	struct blkpipe_stats stats;
+	struct blkpipe_result res;
+	unsigned int n_indexed = 0;
+
+	if (lseek(fd, tx_idx.blocks_end, SEEK_SET) < 0) {
 		perror(blocks_fn);
 		exit(1);
 	}
+	if (!blkpipe_run(fd, &opts, index_decoded_block, &n_indexed,
+			 &stats, &res))
+		scan_fail(&res);
+	if (!opt_quiet)
+		fprintf(stderr, "Indexed %u blocks, %llu transactions\n",
+			n_indexed,
+			(unsigned long long) bp_txindex_size(&tx_idx));
+
+	unsigned int max_shards = opt_jobs ? opt_jobs : bp_num_cpus();
+	struct blkpipe_shard *shards = calloc(max_shards, sizeof(*shards));
+	unsigned int n_shards, i;
+	if (!shards) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
 
-	struct p2p_message msg = {};
-	bool read_ok = false;
+	if (!blkpipe_split(fd, fread_block, 0, max_shards, shards,
+			   &n_shards, &res))
+		scan_fail(&res);
 
-	unsigned int height = 0;
-	uint64_t fpos = 0;
+	struct scan_state *states = calloc(n_shards, sizeof(*states));
+	void **privs = calloc(n_shards, sizeof(void *));
+	if (n_shards && (!states || !privs)) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
+	for (i = 0; i < n_shards; i++) {
+		states[i].height = shards[i].first_seq;
+		states[i].out = cstr_new_sz(0);
+		privs[i] = &states[i];
+	}
+
+	bool rc = blkpipe_run_shards(blocks_fn, &opts, shards, n_shards,
+				     scan_decoded_block, privs, &stats, &res);
 
-	block_fd = fd;
+	for (i = 0; i < n_shards; i++) {
+		flush_output(&states[i]);
+		gbl_state.tx_matches += states[i].tx_matches;
+		cstr_free(states[i].out, true);
+	}
+	if (n_shards)
+		gbl_state.height = states[n_shards - 1].height;
+	free(privs);
+	free(states);
+	free(shards);
 
-	while (fread_block(fd, &msg, &read_ok)) {
-		scan_decode_block(height, &msg, &fpos);
-		height++;
+	if (!rc)
+		scan_fail(&res);
 
-		if ((height % 10000 == 0) && (!opt_quiet))
-			fprintf(stderr, "Scanned %u transactions at height %u\n",
-				bp_hashtab_size(tx_idx),
-				height);
+	if (!opt_quiet) {
+		cstring *s = blkpipe_stats_str(&stats);
+		fprintf(stderr, "%s\n", s->str);
+		cstr_free(s, true);
 	}
+}
 
-	block_fd = -1;
+static void scan_blocks(void)
+{
+	int fd = file_seq_open(blocks_fn);
+	if (fd < 0) {
+		perror(blocks_fn);
+		exit(1);
+	}
 
-	if (!read_ok) {
-		fprintf(stderr, "block read %s failed\n", blocks_fn);
+	/* separate descriptor for reading indexed txs while scanning */
+	block_fd = file_seq_open(blocks_fn);
+	if (block_fd < 0) {
+		perror(blocks_fn);
 		exit(1);
 	}
 
+	if (opt_jobs >= 0)
+		scan_blocks_sharded(fd);
+	else {
+		struct blkpipe_opts opts = {
+			.read_f		= fread_block,
+		};
+		struct blkpipe_stats stats;
+		struct blkpipe_result res;
+
+		if (!blkpipe_run(fd, &opts, scan_decoded_block, &gbl_state,
+				 &stats, &res)) {
+			if (!res.read_ok)
+				fprintf(stderr, "block read %s failed\n",
+					blocks_fn);
+			else
+				fprintf(stderr, "%s at height %u\n",
+					res.fail_reason, gbl_state.height);
+			exit(1);
+		}
+
+		if (!opt_quiet) {
+			cstring *s = blkpipe_stats_str(&stats);
+			fprintf(stderr, "%s\n", s->str);
+			cstr_free(s, true);
+		}
+	}
+
+	close(block_fd);
+	block_fd = -1;
 	close(fd);
-	free(msg.data);
 
 	if (!opt_quiet) {
-		fprintf(stderr, "Scanned to height %u\n", height);
-		fprintf(stderr, "TX matches: %u\n", tx_matches);
+		fprintf(stderr, "Scanned to height %u\n", gbl_state.height);
+		fprintf(stderr, "TX matches: %u\n", gbl_state.tx_matches);
 	}
 }
 
@@ -456,12 +558,24 @@ int main (int argc, char *argv[])
 
 	bpks_init(&bpks);
 
-	tx_idx = bp_hashtab_new_ext(bu256_hash, bu256_equal_,
-				    bu256_freep, free);
+	if (!bp_txindex_open(&tx_idx, txindex_fn)) {
+		fprintf(stderr, "%s: cannot open tx index\n", txindex_fn);
+		return 1;
+	}
+
+	gbl_state.out = cstr_new_sz(0);
 
 	load_addresses();
 	scan_blocks();
 
+	cstr_free(gbl_state.out, true);
+
+	if (!bp_txindex_compact(&tx_idx)) {
+		fprintf(stderr, "%s: tx index write failed\n", txindex_fn);
+		return 1;
+	}
+	bp_txindex_close(&tx_idx);
+
 	return 0;
 }
 
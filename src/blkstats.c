@@ -5,18 +5,21 @@
 #include "picocoin-config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <argp.h>
 #include <ccoin/coredefs.h>
+#include <ccoin/blkpipe.h>
 #include <ccoin/buffer.h>
 #include <ccoin/core.h>
 #include <ccoin/util.h>
 #include <ccoin/mbr.h>
 #include <ccoin/script.h>
 #include <ccoin/message.h>
+#include <ccoin/queue.h>
 
 const char *argp_program_version = PACKAGE_VERSION;
 
@@ -24,6 +27,9 @@ static struct argp_option options[] = {
 	{ "blocks", 'b', "FILE", 0,
 	  "Load blockchain data from mkbootstrap-produced FILE.  Default filename \"blocks.dat\"." },
 
+	{ "jobs", 'j', "N", 0,
+	  "Split the blocks file into N shards, scanned in parallel.  0 = one per CPU.  Default: one pipelined scan." },
+
 	{ "quiet", 'q', NULL, 0,
 	  "Silence informational messages" },
 
@@ -35,6 +41,7 @@ static const char doc[] =
 
 static char *blocks_fn = "blocks.dat";
 static bool opt_quiet = false;
+static int opt_jobs = -1;
 
 enum stat_type {
 	STA_BLOCK,
@@ -64,16 +71,24 @@ static const char *stat_names[STA_LAST + 1] = {
 	"unknown",
 };
 
-static unsigned long gbl_stats[STA_LAST + 1];
+/* counters of one scan, or of one shard of a parallel scan */
+struct scan_state {
+	uint64_t	first_height;
+	unsigned long	stats[STA_LAST + 1];
+	cstring		*errs;		/* messages, printed after the scan */
+};
+
+static struct scan_state gbl_state;
 
-static inline void incstat(enum stat_type stype)
+static inline void incstat(struct scan_state *st, enum stat_type stype)
 {
-	gbl_stats[stype]++;
+	st->stats[stype]++;
 }
 
-static inline unsigned long getstat(enum stat_type stype)
+static inline unsigned long getstat(const struct scan_state *st,
+				    enum stat_type stype)
 {
-	return gbl_stats[stype];
+	return st->stats[stype];
 }
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
@@ -87,6 +102,11 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 'b':
 		blocks_fn = arg;
 		break;
+	case 'j':
+		opt_jobs = atoi(arg);
+		if (opt_jobs < 0)
+			argp_usage(state);
+		break;
 	case 'q':
 		opt_quiet = true;
 		break;
@@ -98,8 +118,6 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-static int block_fd = -1;
-
 static bool match_op_pos(parr *script, enum opcodetype opcode,
 			 unsigned int pos)
 {
@@ -110,14 +128,19 @@ static bool match_op_pos(parr *script, enum opcodetype opcode,
 	return (op->op == opcode);
 }
 
-static void scan_txout(struct bp_txout *txout)
+static void scan_txout(struct scan_state *st, struct bp_txout *txout)
 {
-	incstat(STA_TXOUT);
+	incstat(st, STA_TXOUT);
 
 	parr *script = bsp_parse_all(txout->scriptPubKey->str,
 					  txout->scriptPubKey->len);
 	if (!script) {
-		fprintf(stderr, "error at txout %lu\n", getstat(STA_TXOUT)-1);
+		/* heights, unlike txout counts, are known within a shard */
+		char line[128];
+		snprintf(line, sizeof(line), "error at txout in block %llu\n",
+			 (unsigned long long) (st->first_height +
+					       getstat(st, STA_BLOCK)));
+		cstr_append_buf(st->errs, line, strlen(line));
 		return;
 	}
 
@@ -125,24 +148,24 @@ static void scan_txout(struct bp_txout *txout)
 
 	switch (outtype) {
 	case TX_PUBKEY:
-		incstat(STA_PUBKEY);
+		incstat(st, STA_PUBKEY);
 		break;
 	case TX_PUBKEYHASH:
-		incstat(STA_PUBKEYHASH);
+		incstat(st, STA_PUBKEYHASH);
 		break;
 	case TX_SCRIPTHASH:
-		incstat(STA_SCRIPTHASH);
+		incstat(st, STA_SCRIPTHASH);
 		break;
 	case TX_MULTISIG:
-		incstat(STA_MULTISIG);
+		incstat(st, STA_MULTISIG);
 		break;
 	default: {
 		if (match_op_pos(script, OP_RETURN, 0))
-			incstat(STA_OP_RETURN);
+			incstat(st, STA_OP_RETURN);
 		else if (match_op_pos(script, OP_DROP, 1))
-			incstat(STA_OP_DROP);
+			incstat(st, STA_OP_DROP);
 		else
-			incstat(STA_UNKNOWN);
+			incstat(st, STA_UNKNOWN);
 		break;
 	 }
 	}
@@ -150,7 +173,7 @@ static void scan_txout(struct bp_txout *txout)
 	parr_free(script, true);
 }
 
-static void scan_tx(struct bp_tx *tx)
+static void scan_tx(struct scan_state *st, struct bp_tx *tx)
 {
 	unsigned int i;
 	for (i = 0; i < tx->vout->len; i++) {
@@ -158,13 +181,13 @@ static void scan_tx(struct bp_tx *tx)
 
 		txout = parr_idx(tx->vout, i);
 
-		scan_txout(txout);
+		scan_txout(st, txout);
 	}
 
-	incstat(STA_TX);
+	incstat(st, STA_TX);
 }
 
-static void scan_block(struct bp_block *block)
+static void scan_block(struct scan_state *st, struct bp_block *block)
 {
 	unsigned int n;
 	for (n = 0; n < block->vtx->len; n++) {
@@ -172,32 +195,85 @@ static void scan_block(struct bp_block *block)
 
 		tx = parr_idx(block->vtx, n);
 
-		scan_tx(tx);
+		scan_tx(st, tx);
 	}
 
-	incstat(STA_BLOCK);
+	incstat(st, STA_BLOCK);
 }
 
-static void scan_decode_block(struct p2p_message *msg, uint64_t *fpos)
+static bool scan_decoded_block(struct bp_block *block,
+			       const struct p2p_message_hdr *hdr,
+			       int64_t fpos, void *priv)
 {
-	struct bp_block block;
-	bp_block_init(&block);
+	struct scan_state *st = priv;
 
-	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+	scan_block(st, block);
 
-	bool rc = deser_bp_block(&block, &buf);
-	if (!rc) {
-		fprintf(stderr, "block deser failed at block %lu\n",
-			getstat(STA_BLOCK));
-		exit(1);
+	if ((st == &gbl_state) && (getstat(st, STA_BLOCK) % 10000 == 0) &&
+	    (!opt_quiet))
+		fprintf(stderr, "Scanned block %lu\n",
+			getstat(st, STA_BLOCK));
+
+	return true;
+}
+
+static void scan_fail(const struct blkpipe_result *res)
+{
+	if (!res->read_ok)
+		fprintf(stderr, "block read %s failed\n", blocks_fn);
+	else
+		fprintf(stderr, "%s at offset %lld\n",
+			res->fail_reason, (long long) res->fail_fpos);
+	exit(1);
+}
+
+/* scan shards of the file in parallel, then total them in file order */
+static void scan_blocks_sharded(int fd)
+{
+	unsigned int max_shards = opt_jobs ? opt_jobs : bp_num_cpus();
+	struct blkpipe_shard *shards = calloc(max_shards, sizeof(*shards));
+	unsigned int n_shards, i, j;
+	struct blkpipe_result res;
+
+	if (!blkpipe_split(fd, fread_block, 0, max_shards, shards,
+			   &n_shards, &res))
+		scan_fail(&res);
+
+	struct scan_state *states = calloc(n_shards, sizeof(*states));
+	void **privs = calloc(n_shards, sizeof(void *));
+	for (i = 0; i < n_shards; i++) {
+		states[i].first_height = shards[i].first_seq;
+		states[i].errs = cstr_new_sz(0);
+		privs[i] = &states[i];
 	}
 
-	scan_block(&block);
+	struct blkpipe_opts opts = {
+		.read_f		= fread_block,
+	};
+	struct blkpipe_stats stats;
 
-	uint64_t pos_tmp = msg->hdr.data_len;
-	*fpos += (pos_tmp + 8);
+	bool rc = blkpipe_run_shards(blocks_fn, &opts, shards, n_shards,
+				     scan_decoded_block, privs, &stats, &res);
+
+	for (i = 0; i < n_shards; i++) {
+		for (j = 0; j < ARRAY_SIZE(gbl_state.stats); j++)
+			gbl_state.stats[j] += states[i].stats[j];
+		cstr_append_buf(gbl_state.errs, states[i].errs->str,
+				states[i].errs->len);
+		cstr_free(states[i].errs, true);
+	}
+	free(privs);
+	free(states);
+	free(shards);
 
-	bp_block_free(&block);
+	if (!rc)
+		scan_fail(&res);
+
+	if (!opt_quiet) {
+		cstring *s = blkpipe_stats_str(&stats);
+		fprintf(stderr, "%s\n", s->str);
+		cstr_free(s, true);
+	}
 }
 
 static void scan_blocks(void)
@@ -208,38 +284,40 @@ static void scan_blocks(void)
 		exit(1);
 	}
 
-	struct p2p_message msg = {};
-	bool read_ok = false;
+	if (opt_jobs >= 0) {
+		scan_blocks_sharded(fd);
+		close(fd);
+		return;
+	}
 
-	uint64_t fpos = 0;
+	struct blkpipe_opts opts = {
+		.read_f		= fread_block,
+	};
+	struct blkpipe_stats stats;
+	struct blkpipe_result res;
 
-	block_fd = fd;
+	bool rc = blkpipe_run(fd, &opts, scan_decoded_block, &gbl_state,
+			      &stats, &res);
+	close(fd);
 
-	while (fread_block(fd, &msg, &read_ok)) {
-		scan_decode_block(&msg, &fpos);
+	if (!rc)
+		scan_fail(&res);
 
-		if ((getstat(STA_BLOCK) % 10000 == 0) && (!opt_quiet))
-			fprintf(stderr, "Scanned block %lu\n",
-				getstat(STA_BLOCK));
+	if (!opt_quiet) {
+		cstring *s = blkpipe_stats_str(&stats);
+		fprintf(stderr, "%s\n", s->str);
+		cstr_free(s, true);
 	}
-
-	block_fd = -1;
-
-	if (!read_ok) {
-		fprintf(stderr, "block read %s failed\n", blocks_fn);
-		exit(1);
-	}
-
-	close(fd);
-	free(msg.data);
 }
 
 static void show_report(void)
 {
+	fputs(gbl_state.errs->str, stderr);
+
 	unsigned int i;
-	for (i = 0; i < ARRAY_SIZE(gbl_stats); i++)
+	for (i = 0; i < ARRAY_SIZE(gbl_state.stats); i++)
 		printf("%lu %s\n",
-		       getstat(i),
+		       getstat(&gbl_state, i),
 		       stat_names[i]);
 }
 
@@ -253,9 +331,13 @@ int main (int argc, char *argv[])
 		return 1;
 	}
 
+	gbl_state.errs = cstr_new_sz(0);
+
 	scan_blocks();
 	show_report();
 
+	cstr_free(gbl_state.errs, true);
+
 	return 0;
 }
 
@@ -5,22 +5,30 @@
 #include "picocoin-config.h"           // for VERSION, _LARGE_FILES, etc
 
 #include "brd.h"
+#include <ccoin/addrindex.h>            // for bp_addrindex, etc
 #include <ccoin/blkdb.h>                // for blkinfo, blkdb, etc
-#include <ccoin/buffer.h>               // for const_buffer, buffer_copy, etc
+#include <ccoin/blkpipe.h>              // for blkpipe_run, etc
+#include <ccoin/buffer.h>               // for const_buffer
 #include <ccoin/clist.h>                // for clist_length
 #include <ccoin/core.h>                 // for bp_block, bp_utxo, bp_tx, etc
 #include <ccoin/coredefs.h>             // for chain_info, chain_find, etc
 #include <ccoin/crypto/prng.h>          // for prng_get_random_bytes
 #include <ccoin/cstr.h>                 // for cstring, cstr_free
+#include <ccoin/filterindex.h>          // for bp_filterindex, etc
 #include <ccoin/hexcode.h>              // for decode_hex
 #include <ccoin/log.h>                  // for log_info, logging, etc
 #include <ccoin/mbr.h>                  // for fread_message
 #include <ccoin/message.h>              // for p2p_message, etc
 #include <ccoin/net/net.h>              // for net_child_info, nc_conns_gc, etc
 #include <ccoin/net/peerman.h>          // for peer_manager, peerman_write, etc
+#include <ccoin/orphans.h>              // for bp_orphan_pool, bp_orphan_add, etc
 #include <ccoin/parr.h>                 // for parr, parr_idx, parr_free, etc
 #include <ccoin/script.h>               // for bp_verify_sig
+#include <ccoin/serialize.h>            // for ser_u256, deser_u256, etc
+#include <ccoin/txindex.h>              // for bp_txindex, etc
 #include <ccoin/util.h>                 // for ARRAY_SIZE, czstr_equal, etc
+#include <ccoin/utxosnap.h>             // for bp_utxosnap_load, etc
+#include <ccoin/wallettrack.h>          // for wallet_tracker, etc
 
 
 #include <assert.h>                     // for assert
@@ -34,7 +42,6 @@
 #include <stdio.h>                      // for fprintf, NULL, fclose, etc
 #include <stdlib.h>                     // for exit, free, calloc
 #include <string.h>                     // for strerror, strcmp, strlen, etc
-#include <sys/uio.h>                    // for iovec, writev
 #include <unistd.h>                     // for lseek64, access, lseek, etc
 
 #ifdef __APPLE__
@@ -43,11 +50,6 @@
 #endif
 
 
-#if defined(__GNUC__)
-/* For add_orphan */
-# pragma GCC diagnostic ignored "-Wunused-function"
-#endif
-
 const char *prog_name = "brd";
 struct bp_hashtab *settings;
 const struct chain_info *chain = NULL;
@@ -57,9 +59,19 @@ struct logging *log_state;
 bool debugging = false;
 
 static struct blkdb db;
-static struct bp_hashtab *orphans;
+static struct bp_orphan_pool orphans;
 static struct bp_utxo_set uset;
+static bool uset_valid = false;		/* uset is at db.best_chain */
 static int blocks_fd = -1;
+static int undo_fd = -1;
+static struct bp_txindex txindex;
+static bool have_txindex = false;
+static struct bp_addrindex addrindex;
+static bool have_addrindex = false;
+static struct bp_filterindex filterindex;
+static bool have_filterindex = false;
+static struct wallet_tracker wtrack;
+static bool have_wtrack = false;
 static bool script_verf = false;
 static unsigned int net_conn_timeout = 11;
 struct net_child_info global_nci;
@@ -70,12 +82,13 @@ static const char *const_settings[] = {
 	"peers=brd.peers",
 	/* "blkdb=brd.blkdb", */
 	"blocks=brd.blocks",
+	"undo=brd.undo",
+	"orphans.max_bytes=67108864",
 	"log=-", /* "log=brd.log", */
 };
 
 static bool block_process(const struct bp_block *block, int64_t fpos);
 static bool have_orphan(const bu256_t *v);
-static bool add_orphan(const bu256_t *hash_in, struct const_buffer *buf_in);
 
 static bool parse_kvstr(const char *s, char **key, char **value)
 {
@@ -210,6 +223,34 @@ static void init_log(void)
 
 }
 
+static char *blkdb_ckpt_fn(void)
+{
+	static char ckpt_fn[1024];
+
+	char *fn = setting("blkdb.ckpt");
+	if (fn)
+		return fn;
+
+	snprintf(ckpt_fn, sizeof(ckpt_fn), "%s.ckpt", setting("blkdb"));
+	return ckpt_fn;
+}
+
+static void write_blkdb_ckpt(void)
+{
+	if ((db.fd < 0) || !db.best_chain)
+		return;
+
+	off_t log_ofs = lseek(db.fd, 0, SEEK_END);
+	if ((log_ofs == (off_t)-1) ||
+	    !blkdb_ckpt_write(&db, blkdb_ckpt_fn(), log_ofs)) {
+		log_info("%s: blkdb checkpoint write failed", prog_name);
+		return;
+	}
+
+	log_debug("%s: blkdb checkpoint written, %u blocks",
+		  prog_name, bp_hashtab_size(db.blocks));
+}
+
 static void init_blkdb(void)
 {
 	if (!blkdb_init(&db, chain->netmagic, &chain_genesis)) {
@@ -221,8 +262,11 @@ static void init_blkdb(void)
 	if (!blkdb_fn)
 		return;
 
+	char *ckpt_fn = blkdb_ckpt_fn();
+	bool ckpt_stale = false;
+
 	if ((access(blkdb_fn, F_OK) == 0) &&
-	    !blkdb_read(&db, blkdb_fn)) {
+	    !blkdb_read_ckpt(&db, blkdb_fn, ckpt_fn, &ckpt_stale)) {
 		log_info("%s: blkdb read failed", prog_name);
 		exit(1);
 	}
@@ -234,6 +278,10 @@ static void init_blkdb(void)
 		exit(1);
 	}
 
+	/* upgrade path: checkpoint a log that was replayed in full */
+	if (ckpt_stale)
+		write_blkdb_ckpt();
+
     log_debug("%s: blkdb opened", prog_name);
 }
 
@@ -306,7 +354,469 @@ static void init_blocks(void)
 		init_block0();
 }
 
-static bool spend_tx(struct bp_utxo_set *uset, const struct bp_tx *tx,
+static void init_undo(void)
+{
+	char *undo_fn = setting("undo");
+	if (!undo_fn)
+		return;
+
+	/* kept across restarts: a UTXO set loaded from a snapshot needs
+	 * the undo data of the blocks before it.  reset_undo() clears it
+	 * when the set is rebuilt instead.
+	 */
+	undo_fd = open(undo_fn, O_RDWR | O_CREAT | O_LARGEFILE, 0666);
+	if (undo_fd < 0) {
+		log_info("%s: undo file open failed: %s", prog_name, strerror(errno));
+		exit(1);
+	}
+}
+
+/* the UTXO set is being rebuilt from genesis, and its undo data with it */
+static void reset_undo(void)
+{
+	if ((undo_fd >= 0) && (ftruncate(undo_fd, 0) < 0)) {
+		log_info("%s: undo file truncate failed: %s", prog_name,
+			 strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Point each block at its undo record, for a UTXO set loaded from a
+ * snapshot.  A block connected more than once (reorgs) has a record
+ * for each time; the last is current.  A torn tail is cut off.
+ */
+static void read_undo_index(void)
+{
+	if ((undo_fd < 0) || (lseek64(undo_fd, 0, SEEK_SET) == (off64_t)-1))
+		return;
+
+	struct p2p_message msg = {};
+	bool read_ok = true;
+	unsigned int n_recs = 0;
+	off64_t fpos64 = 0;
+
+	while (fread_message(undo_fd, &msg, &read_ok)) {
+		struct const_buffer buf = { msg.data, msg.hdr.data_len };
+		bu256_t hash;
+		int64_t n_pos;
+
+		if (strncmp(msg.hdr.command, "undo", sizeof(msg.hdr.command)) ||
+		    !deser_u256(&hash, &buf) || !deser_s64(&n_pos, &buf)) {
+			read_ok = false;
+			break;
+		}
+
+		struct blkinfo *bi = blkdb_lookup(&db, &hash);
+		if (bi && (bi->n_pos == n_pos)) {
+			bi->n_undo_pos = fpos64;
+			n_recs++;
+		}
+
+		fpos64 = lseek64(undo_fd, 0, SEEK_CUR);
+		if (fpos64 == (off64_t)-1) {
+			log_info("%s: undo file: seek failed: %s", prog_name,
+				 strerror(errno));
+			exit(1);
+		}
+	}
+	free(msg.data);
+
+	if (!read_ok) {
+		log_info("%s: undo file: damaged at offset %lld, truncated",
+			 prog_name, (long long) fpos64);
+		if (ftruncate(undo_fd, fpos64) < 0) {
+			log_info("%s: undo file truncate failed: %s",
+				 prog_name, strerror(errno));
+			exit(1);
+		}
+	}
+
+	log_debug("%s: undo file: %u records", prog_name, n_recs);
+}
+
+static void init_txindex(void)
+{
+	char *txindex_fn = setting("txindex");
+	if (!txindex_fn)
+		return;
+
+	if (!bp_txindex_open(&txindex, txindex_fn)) {
+		log_info("%s: txindex %s open failed", prog_name, txindex_fn);
+		exit(1);
+	}
+
+	have_txindex = true;
+}
+
+/* index a block stored at fpos, unless an earlier run did */
+static bool txindex_block(const struct bp_block *block, int64_t fpos)
+{
+	if (!have_txindex || (fpos < txindex.blocks_end))
+		return true;
+
+	if (bp_txindex_add_block(&txindex, block, fpos, P2P_HDR_SZ) &&
+	    (!bp_txindex_want_compact(&txindex) ||
+	     bp_txindex_compact(&txindex)))
+		return true;
+
+	/* stop here; the next startup catches up from this block */
+	log_info("%s: txindex update failed at offset %lld, disabled",
+		 prog_name, (long long) fpos);
+	bp_txindex_close(&txindex);
+	have_txindex = false;
+	return false;
+}
+
+static void init_addrindex(void)
+{
+	char *addrindex_fn = setting("addrindex");
+	if (!addrindex_fn)
+		return;
+
+	if (!bp_addrindex_open(&addrindex, addrindex_fn, false)) {
+		log_info("%s: addrindex %s open failed", prog_name, addrindex_fn);
+		exit(1);
+	}
+
+	have_addrindex = true;
+}
+
+static void addrindex_fail(const char *op, const struct blkinfo *bi)
+{
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &bi->hash);
+	log_info("%s: addrindex %s failed at height %d %s, disabled",
+		 prog_name, op, bi->height, hexstr);
+
+	bp_addrindex_close(&addrindex);
+	have_addrindex = false;
+}
+
+/*
+ * Blocks are connected again on every replay of the blocks file; the
+ * index skips those at or below its best block, and takes the rest
+ * only if they extend it.  A gap (the index enabled after blocks were
+ * stored, with a block index on disk) needs a replay: remove the
+ * block index and restart.
+ */
+static void addrindex_connect(const struct blkinfo *bi,
+			      const struct bp_block *block, const parr *undo)
+{
+	if (!have_addrindex || (bi->height < addrindex.best_height))
+		return;
+
+	if ((bi->height == addrindex.best_height) &&
+	    bu256_equal(&bi->hash, &addrindex.best_hash))
+		return;
+
+	if (bp_addrindex_connect(&addrindex, block, bi->height, undo) &&
+	    (!bp_addrindex_want_compact(&addrindex) ||
+	     bp_addrindex_compact(&addrindex)))
+		return;
+
+	addrindex_fail("connect", bi);
+}
+
+static void addrindex_disconnect(const struct blkinfo *bi,
+				 const struct bp_block *block, const parr *undo)
+{
+	/* not reached by the index, or below it on a replay */
+	if (!have_addrindex || (bi->height != addrindex.best_height))
+		return;
+
+	if (bp_addrindex_disconnect(&addrindex, block, undo))
+		return;
+
+	addrindex_fail("disconnect", bi);
+}
+
+static void init_filterindex(void)
+{
+	char *filterindex_fn = setting("filterindex");
+	if (!filterindex_fn)
+		return;
+
+	if (!bp_filterindex_open(&filterindex, filterindex_fn)) {
+		log_info("%s: filterindex %s open failed", prog_name,
+			 filterindex_fn);
+		exit(1);
+	}
+
+	have_filterindex = true;
+}
+
+static void filterindex_fail(const char *op, const struct blkinfo *bi)
+{
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &bi->hash);
+	log_info("%s: filterindex %s failed at height %d %s, disabled",
+		 prog_name, op, bi->height, hexstr);
+
+	bp_filterindex_close(&filterindex);
+	have_filterindex = false;
+}
+
+/* as addrindex_connect: replayed blocks are skipped, gaps refused */
+static void filterindex_connect(const struct blkinfo *bi,
+				const struct bp_block *block, const parr *undo)
+{
+	if (!have_filterindex || (bi->height < filterindex.best_height))
+		return;
+
+	if ((bi->height == filterindex.best_height) &&
+	    bu256_equal(&bi->hash, &filterindex.best_hash))
+		return;
+
+	if (bp_filterindex_connect(&filterindex, block, bi->height, undo))
+		return;
+
+	filterindex_fail("connect", bi);
+}
+
+static void filterindex_disconnect(const struct blkinfo *bi,
+				   const struct bp_block *block)
+{
+	if (!have_filterindex || (bi->height != filterindex.best_height))
+		return;
+
+	if (bp_filterindex_disconnect(&filterindex, block))
+		return;
+
+	filterindex_fail("disconnect", bi);
+}
+
+static void init_wallet_track(void)
+{
+	char *fn = setting("wallet.coins");
+	if (!fn)
+		return;
+
+	/* created, with the keys to watch, by "picocoin watch" */
+	if (!wallet_track_read(&wtrack, fn)) {
+		log_info("%s: wallet coins %s read failed", prog_name, fn);
+		exit(1);
+	}
+	if (memcmp(wtrack.netmagic, chain->netmagic, 4)) {
+		log_info("%s: wallet coins %s: wrong chain", prog_name, fn);
+		exit(1);
+	}
+
+	have_wtrack = true;
+}
+
+static void write_wallet_track(void)
+{
+	if (have_wtrack &&
+	    !wallet_track_write(&wtrack, setting("wallet.coins"))) {
+		log_info("%s: wallet coins write failed", prog_name);
+	}
+}
+
+static bool write_undo(struct blkinfo *bi, const parr *undo)
+{
+	if (undo_fd < 0)
+		return true;
+
+	cstring *data = cstr_new_sz(64 + (undo->len * 64));
+	ser_u256(data, &bi->hash);
+	ser_s64(data, bi->n_pos);
+	ser_bp_block_undo(data, undo);
+
+	cstring *msg = message_str(chain->netmagic, "undo",
+				   data->str, data->len);
+	cstr_free(data, true);
+
+	bool rc = false;
+	off64_t fpos64 = lseek64(undo_fd, 0, SEEK_END);
+	if (fpos64 == (off64_t)-1) {
+		log_info("undo: lseek64 failed %s", strerror(errno));
+		goto out;
+	}
+
+	errno = 0;
+	ssize_t bwritten = write(undo_fd, msg->str, msg->len);
+	if (bwritten != msg->len) {
+		log_info("undo: write failed %s", strerror(errno));
+		goto out;
+	}
+
+	bi->n_undo_pos = fpos64;
+	rc = true;
+
+out:
+	cstr_free(msg, true);
+	return rc;
+}
+
+static bool read_undo(const struct blkinfo *bi, parr **undo)
+{
+	if ((undo_fd < 0) || (bi->n_undo_pos < 0))
+		return false;
+
+	if (lseek64(undo_fd, bi->n_undo_pos, SEEK_SET) == (off64_t)-1)
+		return false;
+
+	struct p2p_message msg = {};
+	bool read_ok = true;
+	bool rc = false;
+
+	if (!fread_message(undo_fd, &msg, &read_ok) ||
+	    strncmp(msg.hdr.command, "undo", sizeof(msg.hdr.command)))
+		goto out;
+
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	bu256_t hash;
+	int64_t n_pos;
+
+	if (!deser_u256(&hash, &buf) || !deser_s64(&n_pos, &buf) ||
+	    !bu256_equal(&hash, &bi->hash) || (n_pos != bi->n_pos))
+		goto out;
+
+	rc = deser_bp_block_undo(undo, &buf);
+
+out:
+	free(msg.data);
+	return rc;
+}
+
+/* reload a stored block, leaving the blocks file position untouched */
+static bool read_block_at(const struct blkinfo *bi, struct bp_block *block)
+{
+	off64_t save_pos = lseek64(blocks_fd, 0, SEEK_CUR);
+	if ((save_pos == (off64_t)-1) ||
+	    (lseek64(blocks_fd, bi->n_pos, SEEK_SET) == (off64_t)-1))
+		return false;
+
+	struct p2p_message msg = {};
+	bool read_ok = true;
+	bool rc = false;
+
+	if (!fread_message(blocks_fd, &msg, &read_ok) ||
+	    strncmp(msg.hdr.command, "block", sizeof(msg.hdr.command)))
+		goto out;
+
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	if (!deser_bp_block(block, &buf))
+		goto out;
+
+	bp_block_calc_sha256(block);
+	if (!bu256_equal(&block->sha256, &bi->hash))
+		goto out;
+
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++)
+		bp_tx_calc_sha256(parr_idx(block->vtx, i));
+
+	rc = true;
+
+out:
+	free(msg.data);
+	if (lseek64(blocks_fd, save_pos, SEEK_SET) == (off64_t)-1)
+		rc = false;
+	return rc;
+}
+
+static void wtrack_fail(const struct blkinfo *bi)
+{
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &bi->hash);
+	log_info("%s: wallet coins scan failed at height %d %s, disabled",
+		 prog_name, bi->height, hexstr);
+
+	wallet_track_free(&wtrack);
+	have_wtrack = false;
+}
+
+/*
+ * Bring the wallet tracker to tip, on the best chain: take back its
+ * blocks that left the best chain, then scan those it has not seen,
+ * reading them from the blocks file.  A reorg past the tracker's
+ * journal means a rescan from the genesis block.
+ */
+static bool wtrack_sync(const struct blkinfo *tip)
+{
+	while (wtrack.best_height >= 0) {
+		struct blkinfo *bi = blkdb_at_height(&db, wtrack.best_height);
+		if (bi && bu256_equal(&bi->hash, &wtrack.best_hash))
+			break;
+
+		if (!wallet_track_disconnect(&wtrack, &wtrack.best_hash)) {
+			log_info("%s: wallet coins: reorg too deep, rescanning",
+				 prog_name);
+			wallet_track_reset(&wtrack);
+		}
+	}
+
+	int height;
+	for (height = wtrack.best_height + 1; height <= tip->height; height++) {
+		struct blkinfo *bi = blkdb_at_height(&db, height);
+		struct bp_block block;
+		bp_block_init(&block);
+
+		bool ok = bi && read_block_at(bi, &block) &&
+			  wallet_track_connect(&wtrack, &block, height);
+
+		bp_block_free(&block);
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Like the indexes, the tracker skips blocks it has on a replay of the
+ * blocks file.  A block that does not extend it (the tracker is new,
+ * was reset, or followed another branch) is found by wtrack_sync().
+ */
+static void wtrack_connect(const struct blkinfo *bi,
+			   const struct bp_block *block)
+{
+	if (!have_wtrack || (bi->height <= wtrack.best_height))
+		return;
+
+	if (((wtrack.best_height >= 0) || (bi->height == 0)) &&
+	    wallet_track_connect(&wtrack, block, bi->height))
+		return;
+
+	if (!wtrack_sync(bi))
+		wtrack_fail(bi);
+}
+
+static void wtrack_disconnect(const struct blkinfo *bi)
+{
+	if (!have_wtrack || !bu256_equal(&bi->hash, &wtrack.best_hash))
+		return;
+
+	if (!wallet_track_disconnect(&wtrack, &bi->hash)) {
+		log_info("%s: wallet coins: reorg too deep, rescanning",
+			 prog_name);
+		wallet_track_reset(&wtrack);
+	}
+}
+
+/* scan blocks stored while the tracker was not in use */
+static void wtrack_catch_up(void)
+{
+	if (!have_wtrack || !db.best_chain)
+		return;
+
+	int start = wtrack.best_height;
+	if (!wtrack_sync(db.best_chain)) {
+		wtrack_fail(db.best_chain);
+		return;
+	}
+
+	log_info("%s: wallet coins: scanned %d blocks, height %d, "
+		 "%u coins, balance %lld", prog_name,
+		 wtrack.best_height - start, wtrack.best_height,
+		 wallet_track_n_coins(&wtrack),
+		 (long long) wallet_track_balance(&wtrack));
+	write_wallet_track();
+}
+
+static bool spend_tx(struct bp_utxo_view *view, const struct bp_tx *tx,
 		     unsigned int tx_idx, unsigned int height)
 {
 	bool is_coinbase = (tx_idx == 0);
@@ -325,7 +835,7 @@ static bool spend_tx(struct bp_utxo_set *uset, const struct bp_tx *tx,
 
 			txin = parr_idx(tx->vin, i);
 
-			coin = bp_utxo_lookup(uset, &txin->prevout.hash);
+			coin = bp_utxo_view_next(view, &txin->prevout);
 			if (!coin || !coin->vout)
 				return false;
 
@@ -337,6 +847,8 @@ static bool spend_tx(struct bp_utxo_set *uset, const struct bp_tx *tx,
 			if (txin->prevout.n >= coin->vout->len)
 				return false;
 			txout = parr_idx(coin->vout, txin->prevout.n);
+			if (!txout)
+				return false;
 			total_in += txout->nValue;
 
 			if (script_verf &&
@@ -344,7 +856,7 @@ static bool spend_tx(struct bp_utxo_set *uset, const struct bp_tx *tx,
 						/* SCRIPT_VERIFY_P2SH */ 0, 0))
 				return false;
 
-			if (!bp_utxo_spend(uset, &txin->prevout))
+			if (!bp_utxo_view_spend(view, coin, &txin->prevout))
 				return false;
 		}
 	}
@@ -371,31 +883,230 @@ static bool spend_tx(struct bp_utxo_set *uset, const struct bp_tx *tx,
 	}
 
 	/* add unspent outputs to set */
-	bp_utxo_set_add(uset, coin);
-
-	return true;
+	return bp_utxo_view_add(view, coin);
 }
 
 static bool spend_block(struct bp_utxo_set *uset, const struct bp_block *block,
-			unsigned int height)
+			unsigned int height, parr *undo)
 {
+	struct bp_utxo_view view;
 	unsigned int i;
+	bool rc = true;
+
+	/* stage the block in an overlay, with input coins resolved up
+	 * front; uset changes only if every tx checks out
+	 */
+	bp_utxo_view_init(&view, uset, block);
 
 	for (i = 0; i < block->vtx->len; i++) {
 		struct bp_tx *tx;
 
 		tx = parr_idx(block->vtx, i);
-		if (!spend_tx(uset, tx, i, height)) {
+		if (!spend_tx(&view, tx, i, height)) {
 			char hexstr[BU256_STRSZ];
 			bu256_hex(hexstr, &tx->sha256);
 			log_info("%s: spent_block tx fail %s", prog_name, hexstr);
+			rc = false;
+			break;
+		}
+	}
+
+	if (rc)
+		rc = bp_utxo_view_flush(&view, undo);
+
+	bp_utxo_view_free(&view);
+	return rc;
+}
+
+/* *invalid is set if the block itself failed to check out */
+static bool chain_connect(struct blkinfo *bi, const struct bp_block *block,
+			  bool *invalid)
+{
+	parr *undo = parr_new(0, bp_utxo_undo_freep);
+	bool rc = spend_block(&uset, block, bi->height, undo);
+
+	*invalid = !rc;
+
+	/* the undo data exists only once the block is in uset; if it
+	 * cannot be stored, unwind the block with the copy in hand
+	 */
+	if (rc && !write_undo(bi, undo)) {
+		if (!bp_utxo_disconnect_block(&uset, block, undo)) {
+			log_info("%s: UTXO set unwind failed", prog_name);
+			exit(1);
+		}
+		rc = false;
+	}
+
+	if (rc) {
+		addrindex_connect(bi, block, undo);
+		filterindex_connect(bi, block, undo);
+		wtrack_connect(bi, block);
+	}
+	parr_free(undo, true);
+
+	if (!rc) {
+		char hexstr[BU256_STRSZ];
+		bu256_hex(hexstr, &bi->hash);
+		log_info("%s: block spend fail %u %s",
+			prog_name, bi->height, hexstr);
+	}
+
+	return rc;
+}
+
+static bool chain_disconnect(struct blkinfo *bi)
+{
+	struct bp_block block;
+	bp_block_init(&block);
+	parr *undo = NULL;
+
+	bool rc = read_block_at(bi, &block) &&
+		  read_undo(bi, &undo) &&
+		  bp_utxo_disconnect_block(&uset, &block, undo);
+	if (rc) {
+		addrindex_disconnect(bi, &block, undo);
+		filterindex_disconnect(bi, &block);
+		wtrack_disconnect(bi);
+	}
+
+	if (undo)
+		parr_free(undo, true);
+	bp_block_free(&block);
+
+	if (!rc) {
+		char hexstr[BU256_STRSZ];
+		bu256_hex(hexstr, &bi->hash);
+		log_info("%s: block disconnect fail %u %s",
+			prog_name, bi->height, hexstr);
+	}
+
+	return rc;
+}
+
+/* last block shared by the branches ending at a and b, or NULL */
+static struct blkinfo *chain_fork(struct blkinfo *a, struct blkinfo *b)
+{
+	if (!a || !b)
+		return NULL;
+
+	if (a->height > b->height)
+		a = blkdb_ancestor(&db, a, b->height);
+	else
+		b = blkdb_ancestor(&db, b, a->height);
+
+	while (a != b) {
+		a = a->prev;
+		b = b->prev;
+	}
+
+	return a;
+}
+
+/*
+ * Move the UTXO set from block "from" to block "to": unwind back to
+ * their fork point using undo data, then connect to's branch in height
+ * order.  to_block, if not NULL, is to's block, already in memory; the
+ * rest are reloaded from the blocks file.  On return *at is the block
+ * the set is at, and *bad the block that failed to connect, if any.
+ */
+static bool chain_move(struct blkinfo *from, struct blkinfo *to,
+		       const struct bp_block *to_block,
+		       struct blkinfo **at, struct blkinfo **bad)
+{
+	struct blkinfo *fork = chain_fork(from, to);
+
+	*at = from;
+	*bad = NULL;
+
+	while (*at != fork) {
+		if (!chain_disconnect(*at))
+			return false;
+		*at = (*at)->prev;
+	}
+
+	int height;
+	for (height = fork ? fork->height + 1 : 0; height <= to->height;
+	     height++) {
+		struct blkinfo *bi = blkdb_ancestor(&db, to, height);
+		bool invalid = false;
+		bool ok;
+
+		if ((bi == to) && to_block)
+			ok = chain_connect(bi, to_block, &invalid);
+		else {
+			struct bp_block block;
+			bp_block_init(&block);
+
+			ok = read_block_at(bi, &block) &&
+			     chain_connect(bi, &block, &invalid);
+
+			bp_block_free(&block);
+		}
+
+		if (!ok) {
+			if (invalid)
+				*bad = bi;
 			return false;
 		}
+		*at = bi;
 	}
 
 	return true;
 }
 
+/*
+ * Move the UTXO set from reorg->old_best to the new best chain ending
+ * at tip.  If a block on the way fails to connect, it is marked invalid
+ * in blkdb, and the set follows the best chain back to the valid block
+ * with the most work, normally reorg->old_best.
+ */
+static bool chain_reorg(const struct blkdb_reorg *reorg,
+			struct blkinfo *tip, const struct bp_block *tip_block)
+{
+	struct blkinfo *at, *bad;
+	unsigned int i;
+
+	/* blocks connected before a snapshot was taken elsewhere, or before
+	 * a lost undo file, cannot be unwound: a restart rebuilds the set
+	 */
+	for (i = 0, at = reorg->old_best; i < reorg->disconn; i++, at = at->prev)
+		if ((undo_fd < 0) || (at->n_undo_pos < 0)) {
+			log_info("%s: reorg of %u blocks, past the undo data "
+				 "at height %d", prog_name, reorg->disconn,
+				 at->height);
+			exit(1);
+		}
+
+	if (chain_move(reorg->old_best, tip, tip_block, &at, &bad)) {
+		if (reorg->disconn) {
+			log_info("%s: reorg to height %d, %u disconnected, "
+				 "%u connected", prog_name, tip->height,
+				 reorg->disconn, reorg->conn);
+		}
+		return true;
+	}
+
+	while (bad) {
+		char hexstr[BU256_STRSZ];
+		bu256_hex(hexstr, &bad->hash);
+		log_info("%s: block %s invalid, at height %d",
+			 prog_name, hexstr, bad->height);
+
+		struct blkdb_reorg back;
+		if (!blkdb_invalidate(&db, bad, &back))
+			break;
+
+		struct blkinfo *from = at;
+		if (chain_move(from, db.best_chain, NULL, &at, &bad))
+			return false;
+	}
+
+	/* neither branch can be restored: uset no longer follows blkdb */
+	log_info("%s: UTXO set rollback failed", prog_name);
+	exit(1);
+}
+
 static bool block_process(const struct bp_block *block, int64_t fpos)
 {
 	struct blkinfo *bi = bi_new();
@@ -408,91 +1119,70 @@ static bool block_process(const struct bp_block *block, int64_t fpos)
 
 	if (!blkdb_add(&db, bi, &reorg)) {
 		log_info("%s: blkdb add fail", prog_name);
-		goto err_out;
+		bi_free(bi);
+		return false;
 	}
 
-	/* FIXME: support reorg */
-	assert(reorg.conn == 1);
-	assert(reorg.disconn == 0);
-
-	/* if best chain, mark TX's as spent */
-	if (bu256_equal(&db.best_chain->hash, &bi->hdr.sha256)) {
-		if (!spend_block(&uset, block, bi->height)) {
-			char hexstr[BU256_STRSZ];
-			bu256_hex(hexstr, &bi->hdr.sha256);
-			log_info("%s: block spend fail %u %s",
-				prog_name,
-				bi->height, hexstr);
-			/* FIXME: bad record is now in blkdb */
+	txindex_block(block, fpos);
 
-			goto err_out;
-		}
-	}
-
-	return true;
+	/* side chain with less work: stored, not connected */
+	if (reorg.conn == 0)
+		return true;
 
-err_out:
-	bi_free(bi);
-	return false;
+	/* bi is owned by blkdb now; if it, or a block it builds on,
+	 * fails to connect, chain_reorg takes blkdb and the UTXO set
+	 * back to the best valid chain
+	 */
+	return chain_reorg(&reorg, bi, block);
 }
 
-static bool read_block_msg(struct p2p_message *msg, int64_t fpos)
+static bool read_block_rec(struct bp_block *block,
+			   const struct p2p_message_hdr *hdr,
+			   int64_t fpos, void *priv)
 {
-	/* unknown records are invalid */
-	if (strncmp(msg->hdr.command, "block",
-		    sizeof(msg->hdr.command)))
+	if (memcmp(hdr->netmagic, chain->netmagic, 4)) {
+		log_info("blocks file: invalid network magic");
 		return false;
-
-	bool rc = false;
-
-	struct bp_block block;
-	bp_block_init(&block);
-
-	struct const_buffer buf = { msg->data, msg->hdr.data_len };
-	if (!deser_bp_block(&block, &buf)) {
-		log_info("%s: block deser fail", prog_name);
-		goto out;
-	}
-	bp_block_calc_sha256(&block);
-
-	if (!bp_block_valid(&block)) {
-		log_info("%s: block not valid", prog_name);
-		goto out;
 	}
 
-	rc = block_process(&block, fpos);
-
-out:
-	bp_block_free(&block);
-	return rc;
+	return block_process(block, fpos);
 }
 
 static void read_blocks(void)
 {
-	int fd = blocks_fd;
+	/* the pipeline reads through its own descriptor; blocks_fd
+	 * remains free for reloading blocks during a reorg
+	 */
+	int fd = open(setting("blocks"), O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		log_info("blocks file: open failed: %s", strerror(errno));
+		exit(1);
+	}
 
-	struct p2p_message msg = {};
-	bool read_ok = true;
-	int64_t fpos = 0;
-	while (fread_message(fd, &msg, &read_ok)) {
-		if (memcmp(msg.hdr.netmagic, chain->netmagic, 4)) {
-			log_info("blocks file: invalid network magic");
-			exit(1);
-		}
+	struct blkpipe_opts opts = {
+		.read_f		= fread_message,
+		.validate	= true,
+	};
+	struct blkpipe_stats stats;
+	struct blkpipe_result res;
 
-		if (!read_block_msg(&msg, fpos))
-			exit(1);
+	bool rc = blkpipe_run(fd, &opts, read_block_rec, NULL, &stats, &res);
+	close(fd);
 
-		fpos += P2P_HDR_SZ;
-		fpos += msg.hdr.data_len;
-	}
+	cstring *s = blkpipe_stats_str(&stats);
+	log_info("%s", s->str);
+	cstr_free(s, true);
 
-	if (!read_ok) {
-		log_info("blocks file: read failed");
+	if (!rc) {
+		log_info("blocks file: %s at offset %lld",
+			 res.fail_reason, (long long) res.fail_fpos);
 		exit(1);
 	}
 
-	free(msg.data);
+	if (lseek64(blocks_fd, 0, SEEK_END) == (off64_t)-1) {
+		log_info("blocks file: seek failed: %s", strerror(errno));
+		exit(1);
+	}
 }
 
 static void readprep_blocks_file(void)
@@ -501,9 +1191,11 @@ static void readprep_blocks_file(void)
 	 * all block data (several gigabytes)
 	 */
 	if (blocks_fd >= 0) {
-		if (db.fd < 0)
+		if (db.fd < 0) {
+			reset_undo();
 			read_blocks();
-		else {
+			uset_valid = true;
+		} else {
 			/* TODO: verify that blocks file offsets are
 			 * present in blkdb */
 
@@ -516,40 +1208,193 @@ static void readprep_blocks_file(void)
 	}
 }
 
-static void init_orphans(void)
+static bool txindex_catch_up_rec(struct bp_block *block,
+				 const struct p2p_message_hdr *hdr,
+				 int64_t fpos, void *priv)
 {
-	orphans = bp_hashtab_new_ext(bu256_hash, bu256_equal_,
-				     bu256_freep, buffer_freep);
+	return txindex_block(block, fpos);
 }
 
-static bool have_orphan(const bu256_t *v)
+/* index blocks stored while the txindex was not in use */
+static void txindex_catch_up(void)
 {
-	return bp_hashtab_get(orphans, v);
+	if (!have_txindex || (blocks_fd < 0))
+		return;
+
+	off64_t flen = lseek64(blocks_fd, 0, SEEK_END);
+	if ((flen == (off64_t)-1) || (txindex.blocks_end == flen))
+		return;
+
+	if (txindex.blocks_end > flen) {
+		log_info("%s: txindex is ahead of the blocks file", prog_name);
+		exit(1);
+	}
+
+	int fd = open(setting("blocks"), O_RDONLY | O_LARGEFILE);
+	if ((fd < 0) ||
+	    (lseek64(fd, txindex.blocks_end, SEEK_SET) == (off64_t)-1)) {
+		log_info("%s: txindex: blocks file: %s", prog_name,
+			 strerror(errno));
+		exit(1);
+	}
+
+	struct blkpipe_opts opts = {
+		.read_f		= fread_message,
+	};
+	struct blkpipe_stats stats;
+	struct blkpipe_result res;
+
+	bool rc = blkpipe_run(fd, &opts, txindex_catch_up_rec, NULL,
+			      &stats, &res);
+	close(fd);
+
+	log_info("%s: txindex: %llu blocks added, %s", prog_name,
+		 (unsigned long long) stats.n_blocks,
+		 rc ? "up to date" : res.fail_reason);
 }
 
-static bool add_orphan(const bu256_t *hash_in, struct const_buffer *buf_in)
+static bool write_utxo_snapshot(const char *fn)
 {
-	if (have_orphan(hash_in))
-		return false;
+	struct bp_utxosnap_info info;
+	char hexstr[BU256_STRSZ];
 
-	bu256_t *hash = bu256_new(hash_in);
-	if (!hash) {
-		log_info("%s: OOM", prog_name);
+	/* an empty or partial set would be stamped as the best block's */
+	if (!uset_valid) {
+		log_info("%s: UTXO set not at the best block, "
+			 "no snapshot written", prog_name);
 		return false;
 	}
 
-	struct buffer *buf = buffer_copy(buf_in->p, buf_in->len);
-	if (!buf) {
-		bu256_freep(hash);
-		log_info("%s: OOM", prog_name);
+	if (!db.best_chain ||
+	    !bp_utxosnap_write(fn, &uset, chain->netmagic,
+			       &db.best_chain->hash, db.best_chain->height,
+			       &info)) {
+		log_info("%s: UTXO snapshot write failed: %s", prog_name, fn);
 		return false;
 	}
 
-	bp_hashtab_put(orphans, hash, buf);
-
+	bu256_hex(hexstr, &info.snap_hash);
+	log_info("%s: UTXO snapshot %s: %llu coins at height %u, hash %s",
+		 prog_name, fn, (unsigned long long) info.n_coins,
+		 info.height, hexstr);
 	return true;
 }
 
+/*
+ * With a block index already on disk, the blocks file is not replayed,
+ * so the UTXO set comes from the snapshot written at the last shutdown
+ * (or copied from another node).  It has to match the best chain
+ * exactly, and the configured hash if there is one.  Without one,
+ * replay_utxo_set() rebuilds the set.
+ */
+static void load_utxo_snapshot(void)
+{
+	char *fn = setting("utxo.snapshot");
+	if (!fn || uset_valid || !db.best_chain)
+		return;
+
+	if (access(fn, F_OK) != 0) {
+		log_info("%s: no UTXO snapshot %s", prog_name, fn);
+		return;
+	}
+
+	struct bp_utxosnap_info info;
+	char hexstr[BU256_STRSZ];
+
+	if (!bp_utxosnap_load(fn, &uset, &info)) {
+		log_info("%s: UTXO snapshot %s: invalid", prog_name, fn);
+		exit(1);
+	}
+	bu256_hex(hexstr, &info.snap_hash);
+
+	char *want_str = setting("utxo.snapshot.hash");
+	bu256_t want;
+	if (want_str &&
+	    (!hex_bu256(&want, want_str) ||
+	     !bu256_equal(&want, &info.snap_hash))) {
+		log_info("%s: UTXO snapshot %s: hash %s, expected %s",
+			 prog_name, fn, hexstr, want_str);
+		exit(1);
+	}
+
+	if (memcmp(info.netmagic, chain->netmagic, 4)) {
+		log_info("%s: UTXO snapshot %s: wrong chain", prog_name, fn);
+		exit(1);
+	}
+
+	/* stale: the last run did not shut down cleanly */
+	if (!bu256_equal(&info.best_hash, &db.best_chain->hash)) {
+		log_info("%s: UTXO snapshot %s: not at best block, height %u",
+			 prog_name, fn, info.height);
+		bp_utxo_set_free(&uset);
+		bp_utxo_set_init(&uset);
+		return;
+	}
+
+	log_info("%s: UTXO snapshot %s: %llu coins at height %u, hash %s",
+		 prog_name, fn, (unsigned long long) info.n_coins,
+		 info.height, hexstr);
+
+	read_undo_index();
+	uset_valid = true;
+}
+
+/*
+ * A block index on disk, and no snapshot to go with it: rebuild the
+ * UTXO set by connecting the best chain, block by block, from the
+ * blocks file.
+ */
+static void replay_utxo_set(void)
+{
+	if (uset_valid)
+		return;
+
+	if (db.best_chain) {
+		if (blocks_fd < 0) {
+			log_info("%s: no blocks file to rebuild the UTXO set",
+				 prog_name);
+			exit(1);
+		}
+
+		log_info("%s: rebuilding UTXO set, height %d", prog_name,
+			 db.best_chain->height);
+
+		struct blkinfo *at, *bad;
+		reset_undo();
+		if (!chain_move(NULL, db.best_chain, NULL, &at, &bad)) {
+			log_info("%s: UTXO set rebuild failed at height %d",
+				 prog_name, at ? at->height + 1 : 0);
+			exit(1);
+		}
+	}
+
+	uset_valid = true;
+}
+
+static void init_orphans(void)
+{
+	char *max_str = setting("orphans.max_bytes");
+	size_t max_bytes = max_str ? strtoull(max_str, NULL, 10) : 0;
+
+	bp_orphan_pool_init(&orphans, max_bytes);
+}
+
+static bool have_orphan(const bu256_t *v)
+{
+	return bp_orphan_have(&orphans, v);
+}
+
+static void log_orphans(const char *event, const bu256_t *hash)
+{
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, hash);
+
+	log_debug("%s: orphan %s %s, pool %u blocks, %zu bytes, %llu evicted",
+		  prog_name, event, hexstr,
+		  bp_orphan_count(&orphans), bp_orphan_bytes(&orphans),
+		  (unsigned long long) orphans.n_evicted);
+}
+
 static void init_peers(struct net_child_info *nci)
 {
 	/*
@@ -588,43 +1433,116 @@ static bool inv_block_process(bu256_t *hash)
 			    !have_orphan(hash));
 }
 
-static bool add_block(struct bp_block *block, struct p2p_message_hdr *hdr, struct const_buffer *buf)
+/* serve a stored block to peers: "getdata", filtered or not */
+static bool block_read(const bu256_t *hash, struct bp_block *block)
 {
-    /* check for duplicate block */
-    if (blkdb_lookup(&db, &block->sha256) ||
-        have_orphan(&block->sha256))
-        return true;
-
-    struct iovec iov[2];
-    iov[0].iov_base = &hdr;	// TODO: endian bug?
-    iov[0].iov_len = sizeof(hdr);
-    iov[1].iov_base = (void *) buf->p;	// cast away 'const'
-    iov[1].iov_len = buf->len;
-    size_t total_write = iov[0].iov_len + iov[1].iov_len;
-
-    /* store current file position */
-    off64_t fpos64 = lseek64(blocks_fd, 0, SEEK_CUR);
-    if (fpos64 == (off64_t)-1) {
+	struct blkinfo *bi = blkdb_lookup(&db, hash);
+
+	return bi && read_block_at(bi, block);
+}
+
+/* append a block to the blocks file, and index it */
+static bool store_block(const struct bp_block *block,
+			const struct const_buffer *buf)
+{
+	/* store current file position */
+	off64_t fpos64 = lseek64(blocks_fd, 0, SEEK_CUR);
+	if (fpos64 == (off64_t)-1) {
 		log_info("blocks: lseek64 failed %s", strerror(errno));
 		return false;
-    }
+	}
+
+	/* write new block to disk */
+	cstring *msg = message_str(chain->netmagic, "block", buf->p, buf->len);
 
-    /* write new block to disk */
-    errno = 0;
-    ssize_t bwritten = writev(blocks_fd, iov, ARRAY_SIZE(iov));
-    if (bwritten != total_write) {
+	errno = 0;
+	ssize_t bwritten = write(blocks_fd, msg->str, msg->len);
+	bool rc = (bwritten == msg->len);
+	cstr_free(msg, true);
+
+	if (!rc) {
 		log_info("blocks: write failed %s", strerror(errno));
-        return false;
-    }
+		return false;
+	}
+
+	/* process block */
+	if (!block_process(block, fpos64)) {
+		log_info("blocks: process-block failed");
+		return false;
+	}
+
+	return true;
+}
+
+/* descendants of a rejected block are invalid too */
+static void drop_orphans(const bu256_t *parent)
+{
+	parr *dropped = parr_new(0, bp_orphan_freep);
+	bp_orphan_take_children(&orphans, parent, dropped);
+
+	unsigned int i;
+	for (i = 0; i < dropped->len; i++) {
+		struct bp_orphan *orphan = parr_idx(dropped, i);
+		bp_orphan_take_children(&orphans, &orphan->hash, dropped);
+	}
+
+	parr_free(dropped, true);
+}
+
+/* connect orphans descended from a newly stored block, breadth first */
+static void process_orphans(const bu256_t *parent)
+{
+	parr *queue = parr_new(0, bp_orphan_freep);
+	bp_orphan_take_children(&orphans, parent, queue);
+
+	unsigned int i;
+	for (i = 0; i < queue->len; i++) {
+		struct bp_orphan *orphan = parr_idx(queue, i);
+		struct const_buffer buf = { orphan->data->p, orphan->data->len };
+		struct bp_block block;
+		bp_block_init(&block);
+
+		bool ok = bp_orphan_block(orphan, &block) &&
+			  store_block(&block, &buf);
+		bp_block_free(&block);
+
+		log_orphans(ok ? "connected" : "rejected", &orphan->hash);
+
+		if (ok)
+			bp_orphan_take_children(&orphans, &orphan->hash, queue);
+		else
+			drop_orphans(&orphan->hash);
+	}
 
-    /* process block */
-    if (!block_process(block, fpos64)) {
-        log_info("blocks: process-block failed");
-        return false;
-    }
+	parr_free(queue, true);
+}
 
-    return true;
+static bool add_block(struct bp_block *block, struct p2p_message_hdr *hdr, struct const_buffer *buf)
+{
+	/* check for duplicate block */
+	if (blkdb_lookup(&db, &block->sha256) ||
+	    have_orphan(&block->sha256))
+		return true;
+
+	/* parent unknown: hold until it arrives */
+	struct blkinfo *prev = blkdb_lookup(&db, &block->hashPrevBlock);
+	if (!prev) {
+		if (bp_orphan_add(&orphans, &block->sha256,
+				  &block->hashPrevBlock, buf->p, buf->len))
+			log_orphans("added", &block->sha256);
+		return true;
+	}
 
+	/* builds on a block that failed to connect */
+	if (prev->invalid)
+		return false;
+
+	if (!store_block(block, buf))
+		return false;
+
+	process_orphans(&block->sha256);
+
+	return true;
 }
 
 static void init_nci(struct net_child_info *nci)
@@ -638,10 +1556,16 @@ static void init_nci(struct net_child_info *nci)
 	nci->eb = event_base_new();
     nci->inv_block_process = inv_block_process;
 	nci->block_process = add_block;
+	nci->block_read = block_read;
 	nci->net_conn_timeout = net_conn_timeout;
     nci->chain = chain;
     nci->instance_nonce = &instance_nonce;
 	nci->running = true;
+
+	/* accept inbound peers, if asked */
+	char *port_str = setting("net.listen");
+	if (port_str && !nc_listen(nci, atoi(port_str)))
+		exit(1);
 }
 
 static void init_daemon(struct net_child_info *nci)
@@ -649,8 +1573,17 @@ static void init_daemon(struct net_child_info *nci)
 	init_blkdb();
 	bp_utxo_set_init(&uset);
 	init_blocks();
+	init_undo();
+	init_txindex();
+	init_addrindex();
+	init_filterindex();
+	init_wallet_track();
 	init_orphans();
 	readprep_blocks_file();
+	txindex_catch_up();
+	wtrack_catch_up();
+	load_utxo_snapshot();
+	replay_utxo_set();
 	init_nci(nci);
 }
 
@@ -665,6 +1598,7 @@ static void run_daemon(struct net_child_info *nci)
 
 static void shutdown_nci(struct net_child_info *nci)
 {
+	nc_listen_stop(nci);
 	peerman_free(nci->peers);
 	nc_conns_gc(nci, true);
 	assert(nci->conns->len == 0);
@@ -674,11 +1608,45 @@ static void shutdown_nci(struct net_child_info *nci)
 
 static void shutdown_daemon(struct net_child_info *nci)
 {
+	write_blkdb_ckpt();
+
+	char *snap_fn = setting("utxo.snapshot");
+	if (snap_fn)
+		write_utxo_snapshot(snap_fn);
+
+	if (have_txindex) {
+		if (bp_txindex_want_compact(&txindex) &&
+		    !bp_txindex_compact(&txindex)) {
+			log_info("%s: txindex compaction failed", prog_name);
+		}
+		bp_txindex_close(&txindex);
+	}
+
+	if (have_addrindex) {
+		if (bp_addrindex_want_compact(&addrindex) &&
+		    !bp_addrindex_compact(&addrindex)) {
+			log_info("%s: addrindex compaction failed", prog_name);
+		}
+		bp_addrindex_close(&addrindex);
+	}
+
+	if (have_filterindex)
+		bp_filterindex_close(&filterindex);
+
+	if (have_wtrack) {
+		write_wallet_track();
+		wallet_track_free(&wtrack);
+	}
+
 	bool rc = peerman_write(nci->peers, setting("peers"), chain);
 	log_info("blocks: %s %u/%zu peers",
 		rc ? "wrote" : "failed to write",
 		bp_hashtab_size(nci->peers->map_addr),
 		clist_length(nci->peers->addrlist));
+	log_info("blocks: %u orphans, %zu bytes, %llu added, %llu evicted",
+		bp_orphan_count(&orphans), bp_orphan_bytes(&orphans),
+		(unsigned long long) orphans.n_added,
+		(unsigned long long) orphans.n_evicted);
 
 	if (log_state->logtofile) {
 		fclose(log_state->stream);
@@ -688,7 +1656,7 @@ static void shutdown_daemon(struct net_child_info *nci)
 
 	if (setting("free")) {
 		shutdown_nci(nci);
-		bp_hashtab_unref(orphans);
+		bp_orphan_pool_free(&orphans);
 		bp_hashtab_unref(settings);
 		blkdb_free(&db);
 		bp_utxo_set_free(&uset);
@@ -733,6 +1701,12 @@ int main (int argc, char *argv[])
 	signal(SIGTERM, term_signal);
 
 	init_daemon(&global_nci);
+
+	/* one-shot: write the UTXO set as of the best block, and exit */
+	char *dump_fn = setting("utxo.dump");
+	if (dump_fn)
+		return write_utxo_snapshot(dump_fn) ? 0 : 1;
+
 	run_daemon(&global_nci);
 
 	log_info("%s: daemon exiting", prog_name);
@@ -5,18 +5,25 @@
 #include "picocoin-config.h"            // for VERSION
 
 #include "picocoin.h"                   // for network_sync, setting
+#include <ccoin/addrindex.h>            // for bp_addrindex_history, etc
+#include <ccoin/base58.h>               // for base58_decode_check
 #include <ccoin/blkdb.h>                // for blkinfo, blkdb, etc
+#include <ccoin/bloom.h>                // for bloom, bloom_free
 #include <ccoin/clist.h>                // for clist, clist_free_ext, etc
 #include <ccoin/compat.h>               // for strndup
 #include <ccoin/core.h>                 // for bp_address
 #include <ccoin/coredefs.h>             // for chain_find, chain_info
 #include <ccoin/crypto/prng.h>          // for prng_get_random_bytes
+#include <ccoin/hexcode.h>              // for hex2str
 #include <ccoin/log.h>                  // for log_info, log_debug, etc
 #include <ccoin/net/dns.h>              // for bu_dns_seed_addrs
 #include <ccoin/net/net.h>              // for net_child_info, nc_conns_gc, etc
 #include <ccoin/net/netbase.h>          // for bn_address_str, etc
 #include <ccoin/net/peerman.h>          // for peer_manager, peerman_write, etc
+#include <ccoin/script.h>               // for bsp_make_pubkeyhash, etc
 #include <ccoin/util.h>                 // for ARRAY_SIZE, czstr_equal, etc
+#include <ccoin/utxosnap.h>             // for bp_utxosnap_read_info, etc
+#include <ccoin/wallettrack.h>          // for wallet_tracker, etc
 
 #include "wallet.h"                     // for cur_wallet_addresses, etc
 
@@ -44,6 +51,10 @@ enum command_type {
 	CMD_WALLET_INFO,
 	CMD_ACCT_DEFAULT,
 	CMD_ACCT_CREATE,
+	CMD_UTXO_INFO,
+	CMD_ADDR_HISTORY,
+	CMD_WALLET_WATCH,
+	CMD_WALLET_BALANCE,
 };
 
 const char *prog_name = "picocoin";
@@ -68,6 +79,7 @@ static const char *const_settings[] = {
 	"chain=bitcoin",
 	"peers=picocoin.peers",
 	"blkdb=picocoin.blkdb",
+	"wallet.coins=picocoin.coins",
 };
 
 /* Command line arguments and processing */
@@ -100,6 +112,10 @@ static char global_doc[] =
 	"\taddressList - List all legacy addresses (non-HD) in the wallet.\n"
 	"\tdump - Dump entire wallet contents, including private keys.\n"
 	"\tinfo - Print informational summary of wallet data.\n"
+	"\tutxo-info - Verify a UTXO snapshot file and print its summary.\n"
+	"\taddr-history - List an address's history from brd's address index.\n"
+	"\twatch - Have brd track the wallet's coins.\n"
+	"\tbalance - Print the wallet's balance and coins, as tracked by brd.\n"
 	"\n"
 	"Run \"picocoin cmd --help\" for extended, per-command help.\n"
 	"\n"
@@ -167,7 +183,7 @@ static struct argp argp_cmd_settings = { cmd_no_options, parse_no_opt, NULL, cmd
 
 // ======================== command: netsync ==========================
 
-static char cmd_netsync_doc[] = "Sync with network\n";
+static char cmd_netsync_doc[] = "Sync with network.  With the coin tracker file named by setting wallet.coins, also scan for the wallet's coins, by BIP 37 filtered blocks\n";
 
 static struct argp argp_cmd_netsync = { cmd_no_options, parse_no_opt, NULL, cmd_netsync_doc };
 
@@ -214,6 +230,32 @@ static char cmd_addressList_doc[] = "Wallet addressList\n";
 
 static struct argp argp_cmd_addressList = { cmd_no_options, parse_no_opt, NULL, cmd_addressList_doc };
 
+// ======================== command: utxo-info ==========================
+
+static char cmd_utxo_info_doc[] = "Verify a UTXO snapshot and print its summary\n";
+static const char cmd_args_utxo_file_doc[] = "snapshot-file";
+
+static struct argp argp_cmd_utxo_info = { cmd_no_options, parse_arg1_opt, cmd_args_utxo_file_doc, cmd_utxo_info_doc };
+
+// ======================== command: addr-history ==========================
+
+static char cmd_addr_history_doc[] = "List the transactions touching an address (or hex scriptPubKey), and its balance, using the address index named by setting addrindex\n";
+static const char cmd_args_addr_doc[] = "address";
+
+static struct argp argp_cmd_addr_history = { cmd_no_options, parse_arg1_opt, cmd_args_addr_doc, cmd_addr_history_doc };
+
+// ======================== command: watch ==========================
+
+static char cmd_watch_doc[] = "Store the wallet's public keys in the coin tracker file named by setting wallet.coins, for brd (run with the same setting), or netsync, to find the wallet's coins.  Stop brd first.\n";
+
+static struct argp argp_cmd_watch = { cmd_no_options, parse_no_opt, NULL, cmd_watch_doc };
+
+// ======================== command: balance ==========================
+
+static char cmd_balance_doc[] = "Print the wallet's balance and unspent coins, from the coin tracker file named by setting wallet.coins\n";
+
+static struct argp argp_cmd_balance = { cmd_no_options, parse_no_opt, NULL, cmd_balance_doc };
+
 // ======================== top-level command processing ================
 
 static void parse_secondary_cmd(struct argp_state* state,
@@ -281,6 +323,18 @@ static error_t parse_global_opt (int key, char *arg, struct argp_state *state)
 		} else if (strcmp(arg, "info") == 0) {
 			opt_command = CMD_WALLET_INFO;
 			parse_secondary_cmd(state, &argp_cmd_info, "info");
+		} else if (strcmp(arg, "utxo-info") == 0) {
+			opt_command = CMD_UTXO_INFO;
+			parse_secondary_cmd(state, &argp_cmd_utxo_info, "utxo-info");
+		} else if (strcmp(arg, "addr-history") == 0) {
+			opt_command = CMD_ADDR_HISTORY;
+			parse_secondary_cmd(state, &argp_cmd_addr_history, "addr-history");
+		} else if (strcmp(arg, "watch") == 0) {
+			opt_command = CMD_WALLET_WATCH;
+			parse_secondary_cmd(state, &argp_cmd_watch, "watch");
+		} else if (strcmp(arg, "balance") == 0) {
+			opt_command = CMD_WALLET_BALANCE;
+			parse_secondary_cmd(state, &argp_cmd_balance, "balance");
 		} else {
 			argp_error(state, "%s is not a valid command", arg);
 		}
@@ -451,6 +505,128 @@ static void list_dns_seeds(void)
 	printf("]\n");
 }
 
+static void utxo_info(const char *fn)
+{
+	struct bp_utxosnap_info info;
+
+	if (!bp_utxosnap_read_info(fn, &info)) {
+		fprintf(stderr, "%s: invalid or corrupt UTXO snapshot\n", fn);
+		exit(1);
+	}
+
+	char best_hex[BU256_STRSZ], snap_hex[BU256_STRSZ];
+	bu256_hex(best_hex, &info.best_hash);
+	bu256_hex(snap_hex, &info.snap_hash);
+
+	const struct chain_info *snap_chain = chain_find_by_netmagic(info.netmagic);
+
+	printf("{\n");
+	printf("  \"chain\": \"%s\",\n", snap_chain ? snap_chain->name : "");
+	printf("  \"best_hash\": \"%s\",\n", best_hex);
+	printf("  \"height\": %u,\n", info.height);
+	printf("  \"n_coins\": %llu,\n", (unsigned long long) info.n_coins);
+	printf("  \"snapshot_hash\": \"%s\"\n", snap_hex);
+	printf("}\n");
+}
+
+/* scriptPubKey of a P2PKH or P2SH address on the current chain, or hex */
+static cstring *addr_script(const char *addr_str)
+{
+	unsigned char addrtype = 0;
+	cstring *payload = base58_decode_check(&addrtype, addr_str);
+	cstring *script = NULL;
+
+	if (payload && (payload->len == 20)) {
+		if (addrtype == chain->addr_pubkey)
+			script = bsp_make_pubkeyhash(payload);
+		else if (addrtype == chain->addr_script)
+			script = bsp_make_scripthash(payload);
+	}
+	if (payload)
+		cstr_free(payload, true);
+
+	if (!script)
+		script = hex2str(addr_str);
+	return script;
+}
+
+static void addr_history(const char *addr_str)
+{
+	char *fn = setting("addrindex");
+	if (!fn) {
+		fprintf(stderr, "addr-history: no addrindex setting\n");
+		exit(1);
+	}
+
+	cstring *script = addr_script(addr_str);
+	if (!script) {
+		fprintf(stderr, "%s: invalid address\n", addr_str);
+		exit(1);
+	}
+
+	/* read-only: brd may be appending to the index */
+	struct bp_addrindex idx;
+	if (!bp_addrindex_open(&idx, fn, true)) {
+		fprintf(stderr, "%s: invalid or corrupt address index\n", fn);
+		exit(1);
+	}
+
+	bu256_t scripthash;
+	bp_addrindex_scripthash(&scripthash, script);
+	cstr_free(script, true);
+
+	parr *hist = parr_new(0, free);
+	parr *unspent = parr_new(0, NULL);
+	if (!bp_addrindex_history(&idx, &scripthash, hist)) {
+		fprintf(stderr, "%s: address index read failed\n", fn);
+		exit(1);
+	}
+	bp_addrindex_unspent(hist, unspent);
+
+	int64_t balance = 0;
+	unsigned int i;
+	for (i = 0; i < unspent->len; i++) {
+		struct bp_addrindex_ent *ent = parr_idx(unspent, i);
+		balance += ent->value;
+	}
+
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &scripthash);
+
+	printf("{\n");
+	printf("  \"scripthash\": \"%s\",\n", hexstr);
+	printf("  \"index_height\": %d,\n", idx.best_height);
+	printf("  \"balance\": %lld,\n", (long long) balance);
+	printf("  \"n_unspent\": %zu,\n", unspent->len);
+	printf("  \"history\": [\n");
+
+	for (i = 0; i < hist->len; i++) {
+		struct bp_addrindex_ent *ent = parr_idx(hist, i);
+		bool is_in = (ent->kind == BP_ADDRINDEX_IN);
+
+		bu256_hex(hexstr, is_in ? &ent->spend_txid : &ent->txid);
+		printf("    { \"height\": %u, \"txid\": \"%s\", "
+		       "\"%s\": %u, \"value\": %lld",
+		       ent->height, hexstr, is_in ? "vin" : "vout",
+		       is_in ? ent->spend_n : ent->n,
+		       (long long) (is_in ? -ent->value : ent->value));
+
+		if (is_in) {
+			bu256_hex(hexstr, &ent->txid);
+			printf(", \"prevout\": \"%s:%u\"", hexstr, ent->n);
+		}
+
+		printf(" }%s\n", (i == (hist->len - 1)) ? "" : ",");
+	}
+
+	printf("  ]\n");
+	printf("}\n");
+
+	parr_free(unspent, true);
+	parr_free(hist, true);
+	bp_addrindex_close(&idx);
+}
+
 static void chain_set(void)
 {
 	char *name = setting("chain");
@@ -515,6 +691,34 @@ static void init_peers(struct net_child_info *nci)
 	nci->peers = peers;
 }
 
+static char *blkdb_ckpt_fn(void)
+{
+	static char ckpt_fn[1024];
+
+	char *fn = setting("blkdb.ckpt");
+	if (fn)
+		return fn;
+
+	snprintf(ckpt_fn, sizeof(ckpt_fn), "%s.ckpt", setting("blkdb"));
+	return ckpt_fn;
+}
+
+static void write_blkdb_ckpt(void)
+{
+	if ((db.fd < 0) || !db.best_chain)
+		return;
+
+	off_t log_ofs = lseek(db.fd, 0, SEEK_END);
+	if ((log_ofs == (off_t)-1) ||
+	    !blkdb_ckpt_write(&db, blkdb_ckpt_fn(), log_ofs)) {
+		log_info("%s: blkdb checkpoint write failed", prog_name);
+		return;
+	}
+
+	log_debug("%s: blkdb checkpoint written, %u blocks",
+		  prog_name, bp_hashtab_size(db.blocks));
+}
+
 static void init_blkdb(void)
 {
 	if (!blkdb_init(&db, chain->netmagic, &chain_genesis)) {
@@ -526,8 +730,11 @@ static void init_blkdb(void)
 	if (!blkdb_fn)
 		return;
 
+	char *ckpt_fn = blkdb_ckpt_fn();
+	bool ckpt_stale = false;
+
 	if ((access(blkdb_fn, F_OK) == 0) &&
-	    !blkdb_read(&db, blkdb_fn)) {
+	    !blkdb_read_ckpt(&db, blkdb_fn, ckpt_fn, &ckpt_stale)) {
 		log_info("%s: blkdb read failed", prog_name);
 		exit(1);
 	}
@@ -539,6 +746,10 @@ static void init_blkdb(void)
 		exit(1);
 	}
 
+	/* upgrade path: checkpoint a log that was replayed in full */
+	if (ckpt_stale)
+		write_blkdb_ckpt();
+
     log_debug("%s: blkdb opened", prog_name);
 }
 
@@ -553,6 +764,254 @@ static void shutdown_nci(struct net_child_info *nci)
 	event_base_free(nci->eb);
 }
 
+/*
+ * SPV netsync.  With a coin tracker file (see "watch"), peers are sent
+ * a BIP 37 filter of the wallet's keys and coins, and the tracker is
+ * brought up to date from their filtered blocks.  Block headers go to
+ * blkdb; the filtered blocks are kept until the tracker takes them,
+ * which it does in best chain order.
+ */
+static struct net_child_info *spv_nci;
+static struct wallet_tracker spv_wt;
+static bool have_spv = false;
+static struct bloom spv_filter;
+static unsigned int spv_n_keys;
+static parr *spv_blocks;		/* struct bp_block, newest last */
+
+static struct bp_block *spv_block_find(const bu256_t *hash)
+{
+	unsigned int i;
+	for (i = spv_blocks->len; i > 0; i--) {
+		struct bp_block *block = parr_idx(spv_blocks, i - 1);
+		if (bu256_equal(&block->sha256, hash))
+			return block;
+	}
+
+	return NULL;
+}
+
+/* keep a copy of a filtered block, and no more than a journal's worth */
+static void spv_block_keep(const struct bp_block *block)
+{
+	cstring *s = cstr_new_sz(1024);
+	ser_bp_block(s, block);
+
+	struct bp_block *copy = calloc(1, sizeof(*copy));
+	bp_block_init(copy);
+	struct const_buffer buf = { s->str, s->len };
+	bool ok = deser_bp_block(copy, &buf);
+	cstr_free(s, true);
+
+	if (!ok) {
+		bp_block_freep(copy);
+		return;
+	}
+
+	bp_block_calc_sha256(copy);
+	parr_add(spv_blocks, copy);
+	if (spv_blocks->len > WALLET_TRACK_DEPTH)
+		parr_remove_range(spv_blocks, 0,
+				  spv_blocks->len - WALLET_TRACK_DEPTH);
+}
+
+/* a new filter, with a new tweak, to every peer */
+static bool spv_filter_load(void)
+{
+	uint32_t nTweak;
+	if (prng_get_random_bytes((unsigned char *) &nTweak,
+				  sizeof(nTweak)) < 0)
+		return false;
+
+	bloom_free(&spv_filter);
+	if (!wallet_track_filter(&spv_wt, &spv_filter, 0.0001, nTweak))
+		return false;
+
+	spv_n_keys = bp_hashtab_size(spv_wt.keys);
+	nc_filter_load(spv_nci, &spv_filter);
+	return true;
+}
+
+/*
+ * Bring the tracker to the best chain: take back its blocks that left
+ * it, then take the filtered blocks that follow it.  Further blocks
+ * are asked for from the tracker's best block on.  A reorg past the
+ * tracker's journal means a rescan from the genesis block.
+ */
+static bool spv_sync(void)
+{
+	while (spv_wt.best_height >= 0) {
+		struct blkinfo *bi = blkdb_at_height(&db, spv_wt.best_height);
+		if (bi && bu256_equal(&bi->hash, &spv_wt.best_hash))
+			break;
+
+		if (!wallet_track_disconnect(&spv_wt, &spv_wt.best_hash)) {
+			log_info("%s: wallet coins: reorg too deep, rescanning",
+				 prog_name);
+			wallet_track_reset(&spv_wt);
+		}
+	}
+
+	/* no filtered block is sent for the genesis block */
+	struct blkinfo *bi = blkdb_at_height(&db, 0);
+	if ((spv_wt.best_height < 0) &&
+	    (!bi || !wallet_track_connect(&spv_wt, &bi->hdr, 0)))
+		return false;
+
+	int height;
+	for (height = spv_wt.best_height + 1;
+	     (bi = blkdb_at_height(&db, height)) != NULL; height++) {
+		struct bp_block *block = spv_block_find(&bi->hash);
+		if (!block)
+			break;
+		if (!wallet_track_connect(&spv_wt, block, height))
+			return false;
+	}
+
+	spv_nci->getblocks_tip = blkdb_at_height(&db, spv_wt.best_height);
+
+	/* payments moved the lookahead: watch the new keys too */
+	if (bp_hashtab_size(spv_wt.keys) != spv_n_keys)
+		return spv_filter_load();
+
+	return true;
+}
+
+static bool spv_block_process(struct bp_block *block)
+{
+	struct blkinfo *bi = blkdb_lookup(&db, &block->sha256);
+	if (!bi) {
+		struct blkdb_reorg reorg;
+
+		bi = bi_new();
+		bu256_copy(&bi->hash, &block->sha256);
+		bp_block_copy_hdr(&bi->hdr, block);
+
+		if (!blkdb_add(&db, bi, &reorg)) {
+			log_info("%s: blkdb add fail", prog_name);
+			bi_free(bi);
+			return false;
+		}
+	}
+
+	if (!spv_block_find(&block->sha256))
+		spv_block_keep(block);
+
+	if (!spv_sync()) {
+		log_info("%s: wallet coins scan failed at height %d",
+			 prog_name, bi->height);
+		return false;
+	}
+
+	return true;
+}
+
+/* in SPV mode, blocks known but not yet scanned are wanted again */
+static bool inv_block_process(bu256_t *hash)
+{
+	if (!have_spv)
+		return false;
+
+	struct blkinfo *bi = blkdb_lookup(&db, hash);
+	return !bi ||
+	       ((bi->height > spv_wt.best_height) && !spv_block_find(hash));
+}
+
+/* genesis block headers, with an empty tx list */
+static const char *genesis_hdr_bitcoin =
+"0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a29ab5f49ffff001d1dac2b7c00";
+static const char *genesis_hdr_testnet =
+"0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4adae5494dffff001d1aa4ae1800";
+
+/* filtered blocks chain onto the genesis block, which none is sent for */
+static bool spv_init_block0(void)
+{
+	if (bp_hashtab_size(db.blocks) > 0)
+		return true;
+
+	const char *hdr_hex;
+	switch (chain->chain_id) {
+	case CHAIN_BITCOIN:	hdr_hex = genesis_hdr_bitcoin; break;
+	case CHAIN_TESTNET3:	hdr_hex = genesis_hdr_testnet; break;
+	default:		return false;
+	}
+
+	unsigned char raw[81];
+	size_t raw_len = 0;
+	if (!decode_hex(raw, sizeof(raw), hdr_hex, &raw_len))
+		return false;
+
+	struct blkinfo *bi = bi_new();
+	struct const_buffer buf = { raw, raw_len };
+	struct blkdb_reorg reorg;
+
+	if (!deser_bp_block(&bi->hdr, &buf))
+		goto err_out;
+	bp_block_calc_sha256(&bi->hdr);
+	bu256_copy(&bi->hash, &bi->hdr.sha256);
+	bp_block_free(&bi->hdr);		/* empty vtx */
+
+	if (!blkdb_add(&db, bi, &reorg))
+		goto err_out;
+	return true;
+
+err_out:
+	bi_free(bi);
+	return false;
+}
+
+static void init_spv(struct net_child_info *nci)
+{
+	char *fn = setting("wallet.coins");
+	if (!fn || (access(fn, F_OK) != 0))
+		return;
+
+	if (!wallet_track_read(&spv_wt, fn)) {
+		log_info("%s: wallet coins %s read failed", prog_name, fn);
+		return;
+	}
+	if (memcmp(spv_wt.netmagic, chain->netmagic, 4)) {
+		log_info("%s: wallet coins %s: wrong chain", prog_name, fn);
+		wallet_track_free(&spv_wt);
+		return;
+	}
+
+	spv_nci = nci;
+	spv_blocks = parr_new(0, bp_block_freep);
+	__bloom_init(&spv_filter);
+
+	if (!spv_init_block0() || !spv_sync() || !spv_filter_load()) {
+		log_info("%s: wallet coins %s: filter failed", prog_name, fn);
+		bloom_free(&spv_filter);
+		parr_free(spv_blocks, true);
+		wallet_track_free(&spv_wt);
+		nci->getblocks_tip = NULL;
+		return;
+	}
+
+	have_spv = true;
+	nci->merkle_block_process = spv_block_process;
+	nci->last_getblocks = 0;
+
+	log_info("%s: wallet coins: SPV from height %d, %u keys, %u coins",
+		 prog_name, spv_wt.best_height, spv_n_keys,
+		 wallet_track_n_coins(&spv_wt));
+}
+
+static void shutdown_spv(void)
+{
+	if (!have_spv)
+		return;
+
+	if (!wallet_track_write(&spv_wt, setting("wallet.coins"))) {
+		log_info("%s: wallet coins write failed", prog_name);
+	}
+
+	log_info("%s: wallet coins: height %d, %u coins, balance %lld",
+		 prog_name, spv_wt.best_height,
+		 wallet_track_n_coins(&spv_wt),
+		 (long long) wallet_track_balance(&spv_wt));
+}
+
 static void init_nci(struct net_child_info *nci)
 {
 	memset(nci, 0, sizeof(*nci));
@@ -561,6 +1020,7 @@ static void init_nci(struct net_child_info *nci)
 	nci->db = &db;
 	nci->conns = parr_new(NC_MAX_CONN, NULL);
 	nci->eb = event_base_new();
+	nci->inv_block_process = inv_block_process;
 	nci->net_conn_timeout = net_conn_timeout;
 	nci->chain = chain;
 	nci->instance_nonce = &instance_nonce;
@@ -593,7 +1053,7 @@ static void network_child(int read_fd, int write_fd)
 
     init_blkdb();
     init_peers(&nci);
-
+	init_spv(&nci);
 
 	/* main loop (child) */
 	do {
@@ -603,6 +1063,8 @@ static void network_child(int read_fd, int write_fd)
 
 	/* cleanup: just the minimum for file I/O correctness */
 	peerman_write(nci.peers, setting("peers"), nci.chain);
+	shutdown_spv();
+	write_blkdb_ckpt();
 	blkdb_free(nci.db);
 	shutdown_nci(&nci);
 	exit(0);
@@ -663,6 +1125,10 @@ int main (int argc, char *argv[])
 	case CMD_WALLET_INFO:	cur_wallet_info(); break;
 	case CMD_ACCT_CREATE:	cur_wallet_createAccount(opt_arg1); break;
 	case CMD_ACCT_DEFAULT:	cur_wallet_defaultAccount(opt_arg1); break;
+	case CMD_UTXO_INFO:	utxo_info(opt_arg1); break;
+	case CMD_ADDR_HISTORY:	addr_history(opt_arg1); break;
+	case CMD_WALLET_WATCH:	cur_wallet_watch(); break;
+	case CMD_WALLET_BALANCE: cur_wallet_balance(); break;
 	}
 
 	free(log_state);
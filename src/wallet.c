@@ -11,6 +11,7 @@
 #include <ccoin/base58.h>               // for base58_encode
 #include <ccoin/buffer.h>               // for const_buffer
 #include <ccoin/coredefs.h>             // for chain_info
+#include <ccoin/crypto/aes_recfile.h>   // for aes_recfile, etc
 #include <ccoin/crypto/aes_util.h>      // for read_aes_file, etc
 #include <ccoin/crypto/prng.h>          // for prng_get_random_bytes
 #include <ccoin/cstr.h>                 // for cstring, cstr_free, etc
@@ -19,6 +20,7 @@
 #include <ccoin/key.h>                  // for bp_privkey_get, etc
 #include <ccoin/parr.h>                 // for parr, parr_idx
 #include <ccoin/wallet.h>               // for wallet, wallet_free, etc
+#include <ccoin/wallettrack.h>          // for wallet_tracker, etc
 #include <ccoin/compat.h>               // for parr_new
 
 #include <jansson.h>                    // for json_object_set_new, etc
@@ -44,6 +46,13 @@ static bool write_ek_ser_prv(struct hd_extended_key_serialized *out,
 	return hd_extended_key_ser_priv(ek, &s);
 }
 
+/*
+ * The open wallet file.  Changes are appended to it as records, so the
+ * passphrase is stretched once per run rather than once per change.
+ */
+static struct aes_recfile wallet_rf = { .fd = -1 };
+static bool wallet_rf_open;
+
 static char *wallet_filename(void)
 {
 	char *filename = setting("wallet");
@@ -66,8 +75,14 @@ static struct wallet *load_wallet(void)
 		return NULL;
 	}
 
-	cstring *data = read_aes_file(filename, passphrase, strlen(passphrase),
-				      100 * 1024 * 1024);
+	cstring *data = NULL;
+	if (aes_recfile_is(filename)) {
+		if (aes_recfile_open(&wallet_rf, filename, passphrase,
+				     strlen(passphrase), &data))
+			wallet_rf_open = true;
+	} else
+		data = read_aes_file(filename, passphrase, strlen(passphrase),
+				     100 * 1024 * 1024);
 	if (!data) {
 		fprintf(stderr, "wallet: missing or invalid\n");
 		return NULL;
@@ -98,11 +113,19 @@ static struct wallet *load_wallet(void)
 		goto err_out;
 	}
 
+	memset(data->str, 0, data->len);
+	cstr_free(data, true);
 	return wlt;
 
 err_out:
 	fprintf(stderr, "wallet: invalid data found\n");
+	if (wallet_rf_open) {
+		aes_recfile_close(&wallet_rf);
+		wallet_rf_open = false;
+	}
 	wallet_free(wlt);
+	free(wlt);
+	memset(data->str, 0, data->len);
 	cstr_free(data, true);
 	return NULL;
 }
@@ -119,12 +142,20 @@ static bool store_wallet(struct wallet *wlt)
 	if (!filename)
 		return false;
 
+	/* new wallet, or first store of an old-format one: new keys */
+	if (!wallet_rf_open) {
+		if (!aes_recfile_new(&wallet_rf, passphrase,
+				     strlen(passphrase)))
+			return false;
+		wallet_rf_open = true;
+	}
+
 	cstring *plaintext = ser_wallet(wlt);
 	if (!plaintext)
 		return false;
 
-	bool rc = write_aes_file(filename, passphrase, strlen(passphrase),
-				 plaintext->str, plaintext->len);
+	bool rc = aes_recfile_write(&wallet_rf, filename,
+				    plaintext->str, plaintext->len);
 
 	memset(plaintext->str, 0, plaintext->len);
 	cstr_free(plaintext, true);
@@ -132,6 +163,29 @@ static bool store_wallet(struct wallet *wlt)
 	return rc;
 }
 
+/*
+ * Append one changed record (from ser_wallet_*_rec) to the wallet file,
+ * rewriting the whole wallet instead when the file is not yet in the
+ * record format or has collected enough records to be worth compacting.
+ */
+static bool store_wallet_rec(struct wallet *wlt, cstring *rec)
+{
+	bool rc;
+
+	if (!rec)
+		return false;
+
+	if (!wallet_rf_open || aes_recfile_want_compact(&wallet_rf))
+		rc = store_wallet(wlt);
+	else
+		rc = aes_recfile_append(&wallet_rf, rec->str, rec->len);
+
+	memset(rec->str, 0, rec->len);
+	cstr_free(rec, true);
+
+	return rc;
+}
+
 static bool cur_wallet_load(void)
 {
 	if (!cur_wallet)
@@ -152,8 +206,14 @@ void cur_wallet_new_address(void)
 	cstring *btc_addr;
 
 	btc_addr = wallet_new_address(wlt);
+	if (!btc_addr) {
+		fprintf(stderr, "wallet: failed to create address\n");
+		return;
+	}
 
-	store_wallet(wlt);
+	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
+	if (!store_wallet_rec(wlt, ser_wallet_account_rec(wlt, acct)))
+		fprintf(stderr, "wallet: failed to store\n");
 
 	printf("%s\n", btc_addr->str);
 
@@ -162,6 +222,11 @@ void cur_wallet_new_address(void)
 
 void cur_wallet_free(void)
 {
+	if (wallet_rf_open) {
+		aes_recfile_close(&wallet_rf);
+		wallet_rf_open = false;
+	}
+
 	if (!cur_wallet)
 		return;
 
@@ -416,7 +481,8 @@ void cur_wallet_createAccount(const char *acct_name)
 		return;
 	}
 
-	if (!store_wallet(wlt)) {
+	struct wallet_account *acct = account_byname(wlt, acct_name);
+	if (!store_wallet_rec(wlt, ser_wallet_account_rec(wlt, acct))) {
 		fprintf(stderr, "wallet: failed to store\n");
 		return;
 	}
@@ -442,9 +508,109 @@ void cur_wallet_defaultAccount(const char *acct_name)
 	cstr_free(wlt->def_acct, true);
 	wlt->def_acct = cstr_new(acct_name);
 
-	if (!store_wallet(wlt)) {
+	if (!store_wallet_rec(wlt, ser_wallet_root_rec(wlt))) {
 		fprintf(stderr, "wallet: failed to store\n");
 		return;
 	}
 }
 
+
+static char *wallet_coins_filename(void)
+{
+	char *filename = setting("wallet.coins");
+	if (!filename)
+		fprintf(stderr, "wallet: no wallet.coins setting\n");
+	return filename;
+}
+
+/*
+ * Write the wallet's public keys to the coin tracker file, which brd
+ * keeps up to date when run with the same wallet.coins setting.  Stop
+ * brd first: it rewrites the file on exit.
+ */
+void cur_wallet_watch(void)
+{
+	char *filename = wallet_coins_filename();
+	if (!filename || !cur_wallet_load())
+		return;
+
+	struct wallet_tracker wt;
+	if (access(filename, F_OK) == 0) {
+		if (!wallet_track_read(&wt, filename)) {
+			fprintf(stderr, "wallet: %s: invalid or corrupt\n",
+				filename);
+			return;
+		}
+		if (memcmp(wt.netmagic, chain->netmagic, 4)) {
+			fprintf(stderr, "wallet: %s: wrong chain\n", filename);
+			wallet_track_free(&wt);
+			return;
+		}
+	} else
+		wallet_track_init(&wt, chain->netmagic);
+
+	if (!wallet_track_watch(&wt, cur_wallet) ||
+	    !wallet_track_write(&wt, filename)) {
+		fprintf(stderr, "wallet: failed to store %s\n", filename);
+		wallet_track_free(&wt);
+		return;
+	}
+
+	printf("{\n");
+	printf("  \"n_chains\": %zu,\n", wt.chains->len);
+	printf("  \"n_keys\": %u,\n", bp_hashtab_size(wt.keys));
+	printf("  \"height\": %d\n", wt.best_height);
+	printf("}\n");
+
+	wallet_track_free(&wt);
+}
+
+/* The balance and coins found by brd.  Needs no passphrase. */
+void cur_wallet_balance(void)
+{
+	char *filename = wallet_coins_filename();
+	if (!filename)
+		return;
+
+	struct wallet_tracker wt;
+	if (!wallet_track_read(&wt, filename)) {
+		fprintf(stderr, "wallet: %s: invalid or corrupt\n", filename);
+		return;
+	}
+
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &wt.best_hash);
+
+	parr *coins = parr_new(0, NULL);
+	wallet_track_unspent(&wt, coins);
+
+	printf("{\n");
+	printf("  \"height\": %d,\n", wt.best_height);
+	printf("  \"best_hash\": \"%s\",\n", hexstr);
+	printf("  \"balance\": %lld,\n",
+	       (long long) wallet_track_balance(&wt));
+	printf("  \"unspent\": [\n");
+
+	unsigned int i;
+	for (i = 0; i < coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(coins, i);
+		cstring *addr = base58_encode_check(chain->addr_pubkey, true,
+						    &coin->pkhash,
+						    sizeof(coin->pkhash));
+
+		bu256_hex(hexstr, &coin->outpt.hash);
+		printf("    { \"txid\": \"%s\", \"vout\": %u, "
+		       "\"value\": %lld, \"height\": %u, \"address\": \"%s\" }%s\n",
+		       hexstr, coin->outpt.n, (long long) coin->value,
+		       coin->height, addr->str,
+		       (i == (coins->len - 1)) ? "" : ",");
+
+		cstr_free(addr, true);
+	}
+
+	printf("  ]\n");
+	printf("}\n");
+
+	parr_free(coins, true);
+	wallet_track_free(&wt);
+}
@@ -12,6 +12,8 @@ extern void cur_wallet_defaultAccount(const char *acct_name);
 extern void cur_wallet_info(void);
 extern void cur_wallet_dump(void);
 extern void cur_wallet_addresses(void);
+extern void cur_wallet_watch(void);
+extern void cur_wallet_balance(void);
 extern void cur_wallet_free(void);
 
 #endif /* __PICOCOIN_WALLET_H__ */
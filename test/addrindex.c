@@ -0,0 +1,407 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/addrindex.h>
+#include <ccoin/message.h>
+#include <ccoin/mbr.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static const char *idx_fn = "addrindex.out";
+static const char *idx_log_fn = "addrindex.out.log";
+
+/* a chain of blocks, with the undo data each was connected with */
+struct test_chain {
+	parr		*blocks;	/* of struct bp_block */
+	parr		*undo;		/* of parr of struct bp_utxo_undo */
+};
+
+static void connect_uset(struct bp_utxo_set *uset, const struct bp_block *block,
+			 unsigned int height, parr *undo)
+{
+	unsigned int i, j;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		bp_tx_calc_sha256(tx);
+
+		for (j = 0; (i > 0) && (j < tx->vin->len); j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			assert(bp_utxo_spend_undo(uset, &txin->prevout, undo));
+		}
+
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		assert(bp_utxo_from_tx(coin, tx, (i == 0), height));
+		bp_utxo_set_add(uset, coin);
+	}
+}
+
+static cstring *test_script(unsigned char tag)
+{
+	cstring *hash = cstr_new_sz(20);
+	unsigned char v[20];
+	memset(v, tag, sizeof(v));
+	cstr_append_buf(hash, v, sizeof(v));
+
+	cstring *script = bsp_make_pubkeyhash(hash);
+	cstr_free(hash, true);
+	return script;
+}
+
+static struct bp_tx *test_tx(const struct bp_outpt *prevout, int64_t value,
+			     unsigned char tag)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(1, bp_txin_freep);
+	tx->vout = parr_new(1, bp_txout_freep);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	if (prevout)
+		bp_outpt_copy(&txin->prevout, prevout);
+	else {
+		bu256_zero(&txin->prevout.hash);
+		txin->prevout.n = 0xffffffff;
+	}
+	txin->scriptSig = cstr_new_sz(1);
+	cstr_append_c(txin->scriptSig, tag);	/* unique coinbases */
+	txin->nSequence = 0xffffffff;
+	parr_add(tx->vin, txin);
+
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = value;
+	txout->scriptPubKey = test_script(tag);
+	parr_add(tx->vout, txout);
+
+	bp_tx_calc_sha256(tx);
+	return tx;
+}
+
+/*
+ * Block 10 on top of blks10.ser: a coinbase paying script 0xa1, a tx
+ * moving block 1's coinbase to 0xa2, and one moving that on to 0xa3.
+ */
+static struct bp_block *test_block(struct bp_block *prev)
+{
+	struct bp_block *block = calloc(1, sizeof(*block));
+	bp_block_init(block);
+	bp_block_copy_hdr(block, prev);
+	bp_block_calc_sha256(prev);
+	bu256_copy(&block->hashPrevBlock, &prev->sha256);
+	block->nTime++;
+	block->vtx = parr_new(3, bp_tx_freep);
+
+	parr_add(block->vtx, test_tx(NULL, 5000000000LL, 0xa1));
+	return block;
+}
+
+static void read_chain(struct test_chain *tc, const char *ser_fn)
+{
+	int fd = file_seq_open(ser_fn);
+	if (fd < 0) {
+		perror(ser_fn);
+		exit(1);
+	}
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+	tc->blocks = parr_new(0, NULL);
+	tc->undo = parr_new(0, NULL);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	while (fread_block(fd, &msg, &read_ok)) {
+		struct bp_block *block = calloc(1, sizeof(*block));
+		bp_block_init(block);
+
+		struct const_buffer buf = { msg.data, msg.hdr.data_len };
+		assert(deser_bp_block(block, &buf));
+		parr_add(tc->blocks, block);
+	}
+	assert(read_ok);
+	close(fd);
+	free(msg.data);
+
+	/* the synthetic block spends block 1's coinbase */
+	struct bp_block *last = parr_idx(tc->blocks, tc->blocks->len - 1);
+	struct bp_block *block = test_block(last);
+	struct bp_block *blk1 = parr_idx(tc->blocks, 1);
+	struct bp_tx *cb1 = parr_idx(blk1->vtx, 0);
+	bp_tx_calc_sha256(cb1);
+
+	struct bp_outpt prevout = { cb1->sha256, 0 };
+	struct bp_tx *tx = test_tx(&prevout, 5000000000LL, 0xa2);
+	parr_add(block->vtx, tx);
+
+	bu256_copy(&prevout.hash, &tx->sha256);
+	parr_add(block->vtx, test_tx(&prevout, 4000000000LL, 0xa3));
+	parr_add(tc->blocks, block);
+
+	unsigned int i;
+	for (i = 0; i < tc->blocks->len; i++) {
+		parr *undo = parr_new(0, bp_utxo_undo_freep);
+		connect_uset(&uset, parr_idx(tc->blocks, i), i, undo);
+		parr_add(tc->undo, undo);
+	}
+
+	bp_utxo_set_free(&uset);
+}
+
+static void free_chain(struct test_chain *tc)
+{
+	unsigned int i;
+	for (i = 0; i < tc->blocks->len; i++) {
+		struct bp_block *block = parr_idx(tc->blocks, i);
+		bp_block_free(block);
+		free(block);
+		parr_free(parr_idx(tc->undo, i), true);
+	}
+	parr_free(tc->blocks, true);
+	parr_free(tc->undo, true);
+}
+
+static void connect_blocks(struct bp_addrindex *idx, struct test_chain *tc,
+			   unsigned int start, unsigned int end)
+{
+	unsigned int i;
+	for (i = start; i < end; i++)
+		assert(bp_addrindex_connect(idx, parr_idx(tc->blocks, i), i,
+					    parr_idx(tc->undo, i)));
+}
+
+static parr *history_of(const struct bp_addrindex *idx, const cstring *script)
+{
+	bu256_t sh;
+	bp_addrindex_scripthash(&sh, script);
+
+	parr *hist = parr_new(0, free);
+	assert(bp_addrindex_history(idx, &sh, hist));
+	return hist;
+}
+
+static int64_t balance_of(const struct bp_addrindex *idx, unsigned char tag,
+			  unsigned int *n_hist)
+{
+	cstring *script = test_script(tag);
+	parr *hist = history_of(idx, script);
+	parr *unspent = parr_new(0, NULL);
+	bp_addrindex_unspent(hist, unspent);
+
+	int64_t total = 0;
+	unsigned int i;
+	for (i = 0; i < unspent->len; i++) {
+		struct bp_addrindex_ent *ent = parr_idx(unspent, i);
+		total += ent->value;
+	}
+
+	*n_hist = hist->len;
+	parr_free(unspent, true);
+	parr_free(hist, true);
+	cstr_free(script, true);
+	return total;
+}
+
+/* every output of blocks [0, end) in its script's history */
+static void check_chain(const struct bp_addrindex *idx, struct test_chain *tc,
+			unsigned int end)
+{
+	unsigned int i, j, k;
+
+	assert(idx->best_height == (int) end - 1);
+
+	for (i = 0; i < end; i++) {
+		struct bp_block *block = parr_idx(tc->blocks, i);
+
+		for (j = 0; j < block->vtx->len; j++) {
+			struct bp_tx *tx = parr_idx(block->vtx, j);
+			struct bp_txout *txout = parr_idx(tx->vout, 0);
+			parr *hist = history_of(idx, txout->scriptPubKey);
+
+			for (k = 0; k < hist->len; k++) {
+				struct bp_addrindex_ent *ent = parr_idx(hist, k);
+				if ((ent->kind == BP_ADDRINDEX_OUT) &&
+				    bu256_equal(&ent->txid, &tx->sha256))
+					break;
+			}
+			assert(k < hist->len);
+
+			struct bp_addrindex_ent *ent = parr_idx(hist, k);
+			assert(ent->height == i);
+			assert(ent->n == 0);
+			assert(ent->value == txout->nValue);
+			parr_free(hist, true);
+		}
+	}
+
+	/* block 1's coinbase is spent by the synthetic block only */
+	struct bp_block *blk1 = parr_idx(tc->blocks, 1);
+	struct bp_tx *cb1 = parr_idx(blk1->vtx, 0);
+	struct bp_txout *txout = parr_idx(cb1->vout, 0);
+	parr *hist = history_of(idx, txout->scriptPubKey);
+	parr *unspent = parr_new(0, NULL);
+	bp_addrindex_unspent(hist, unspent);
+
+	bool spent = (end == tc->blocks->len);
+	assert(hist->len == (spent ? 2 : 1));
+	assert(unspent->len == (spent ? 0 : 1));
+	if (spent) {
+		struct bp_addrindex_ent *in = parr_idx(hist, 1);
+		struct bp_block *last = parr_idx(tc->blocks, end - 1);
+		struct bp_tx *spender = parr_idx(last->vtx, 1);
+		assert(in->kind == BP_ADDRINDEX_IN);
+		assert(in->height == end - 1);
+		assert(bu256_equal(&in->txid, &cb1->sha256));
+		assert(bu256_equal(&in->spend_txid, &spender->sha256));
+		assert(in->spend_n == 0);
+		assert(in->value == txout->nValue);
+	}
+	parr_free(unspent, true);
+	parr_free(hist, true);
+
+	/* spent within its own block */
+	unsigned int n_hist;
+	assert(balance_of(idx, 0xa1, &n_hist) == (spent ? 5000000000LL : 0));
+	assert(balance_of(idx, 0xa2, &n_hist) == 0);
+	assert(n_hist == (spent ? 2 : 0));
+	assert(balance_of(idx, 0xa3, &n_hist) == (spent ? 4000000000LL : 0));
+	assert(n_hist == (spent ? 1 : 0));
+}
+
+static void test_chain_ops(struct test_chain *tc)
+{
+	unsigned int n = tc->blocks->len;
+	struct bp_addrindex idx;
+
+	assert(bp_addrindex_open(&idx, NULL, false));
+
+	/* must start at genesis, and follow the best block */
+	assert(!bp_addrindex_connect(&idx, parr_idx(tc->blocks, 1), 1,
+				     parr_idx(tc->undo, 1)));
+	connect_blocks(&idx, tc, 0, 2);
+	assert(!bp_addrindex_connect(&idx, parr_idx(tc->blocks, 1), 2,
+				     parr_idx(tc->undo, 1)));
+	assert(!bp_addrindex_connect(&idx, parr_idx(tc->blocks, 3), 2,
+				     parr_idx(tc->undo, 3)));
+	connect_blocks(&idx, tc, 2, n);
+	check_chain(&idx, tc, n);
+
+	/* only the best block comes off; then it comes back */
+	assert(!bp_addrindex_disconnect(&idx, parr_idx(tc->blocks, n - 2),
+					parr_idx(tc->undo, n - 2)));
+	assert(bp_addrindex_disconnect(&idx, parr_idx(tc->blocks, n - 1),
+				       parr_idx(tc->undo, n - 1)));
+	check_chain(&idx, tc, n - 1);
+	connect_blocks(&idx, tc, n - 1, n);
+	check_chain(&idx, tc, n);
+
+	/* undo data not matching the block */
+	assert(bp_addrindex_disconnect(&idx, parr_idx(tc->blocks, n - 1),
+				       parr_idx(tc->undo, n - 1)));
+	assert(!bp_addrindex_connect(&idx, parr_idx(tc->blocks, n - 1), n - 1,
+				     parr_idx(tc->undo, 0)));
+
+	bp_addrindex_close(&idx);
+}
+
+static void test_persist(struct test_chain *tc)
+{
+	unsigned int n = tc->blocks->len, half = n / 2;
+	struct bp_addrindex idx;
+
+	unlink(idx_fn);
+	unlink(idx_log_fn);
+
+	/* log only, then replayed */
+	assert(bp_addrindex_open(&idx, idx_fn, false));
+	assert(idx.best_height == -1);
+	connect_blocks(&idx, tc, 0, half);
+	bp_addrindex_close(&idx);
+
+	assert(bp_addrindex_open(&idx, idx_fn, false));
+	assert(idx.bf.n_base == 0);
+	check_chain(&idx, tc, half);
+
+	/* compacted, then more blocks on top */
+	assert(bp_addrindex_compact(&idx));
+	assert(bp_hashtab_size(idx.recent) == 0);
+	assert(idx.bf.n_base > 0);
+	check_chain(&idx, tc, half);
+	connect_blocks(&idx, tc, half, n);
+	check_chain(&idx, tc, n);
+	bp_addrindex_close(&idx);
+
+	/* reorg out the last block across compactions */
+	assert(bp_addrindex_open(&idx, idx_fn, false));
+	check_chain(&idx, tc, n);
+	assert(bp_addrindex_compact(&idx));
+	uint64_t n_full = idx.bf.n_base;
+	assert(bp_addrindex_disconnect(&idx, parr_idx(tc->blocks, n - 1),
+				       parr_idx(tc->undo, n - 1)));
+	check_chain(&idx, tc, n - 1);
+	bp_addrindex_close(&idx);
+
+	assert(bp_addrindex_open(&idx, idx_fn, false));
+	check_chain(&idx, tc, n - 1);
+	assert(bp_addrindex_compact(&idx));
+	assert(idx.bf.n_base < n_full);
+	check_chain(&idx, tc, n - 1);
+	connect_blocks(&idx, tc, n - 1, n);
+	bp_addrindex_close(&idx);
+
+	/* torn block at the end of the log: read-only opens skip it,
+	 * writable ones drop it
+	 */
+	unsigned char torn[BP_ADDRINDEX_ENT_SZ + 7];
+	memset(torn, 0x77, sizeof(torn));
+	int log_fd = open(idx_log_fn, O_WRONLY | O_APPEND);
+	assert(log_fd >= 0);
+	assert(write(log_fd, torn, sizeof(torn)) == sizeof(torn));
+	close(log_fd);
+
+	struct stat st;
+	assert(stat(idx_log_fn, &st) == 0);
+	off_t log_len = st.st_size;
+
+	assert(bp_addrindex_open(&idx, idx_fn, true));
+	check_chain(&idx, tc, n);
+	assert(!bp_addrindex_disconnect(&idx, parr_idx(tc->blocks, n - 1),
+					parr_idx(tc->undo, n - 1)));
+	bp_addrindex_close(&idx);
+	assert(stat(idx_log_fn, &st) == 0 && st.st_size == log_len);
+
+	assert(bp_addrindex_open(&idx, idx_fn, false));
+	check_chain(&idx, tc, n);
+	bp_addrindex_close(&idx);
+	assert(stat(idx_log_fn, &st) == 0 &&
+	       st.st_size == log_len - sizeof(torn));
+
+	unlink(idx_fn);
+	unlink(idx_log_fn);
+}
+
+int main (int argc, char *argv[])
+{
+	struct test_chain tc;
+	char *fn = test_filename("data/blks10.ser");
+	read_chain(&tc, fn);
+	free(fn);
+
+	test_chain_ops(&tc);
+	test_persist(&tc);
+	free_chain(&tc);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/crypto/aes_recfile.h>   // for aes_recfile_open, etc
+#include <ccoin/crypto/aes_util.h>      // for write_aes_file
+#include <ccoin/cstr.h>
+#include <ccoin/util.h>                 // for bu_read_file, bu_write_file
+
+#include <assert.h>                     // for assert
+#include <stdio.h>                      // for fprintf
+#include <stdlib.h>                     // for free
+#include <string.h>                     // for strlen, memcmp
+#include <fcntl.h>                      // for open
+#include <unistd.h>                     // for unlink, truncate, pread
+
+#include "libtest.h"                    // for now_ms
+
+static const char s_password[] = "test_picocoin_password";
+static const char filename[] = "aes_recfile.dat";
+
+static const char *recs[] = {
+	"root record",
+	"first appended record",
+	"",
+	"a longer record, long enough to need more than one AES block "
+	"of key stream, and not a multiple of the block size either",
+};
+
+static cstring *expected(unsigned int n)
+{
+	cstring *s = cstr_new(NULL);
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		cstr_append_buf(s, recs[i], strlen(recs[i]));
+	return s;
+}
+
+static void check_open(unsigned int n_recs)
+{
+	struct aes_recfile rf;
+	cstring *contents = NULL;
+
+	assert(aes_recfile_is(filename));
+	assert(aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				&contents));
+	assert(rf.n_recs == n_recs);
+
+	cstring *expect = expected(n_recs);
+	assert(contents->len == expect->len);
+	assert(!memcmp(contents->str, expect->str, expect->len));
+
+	cstr_free(expect, true);
+	cstr_free(contents, true);
+	aes_recfile_close(&rf);
+}
+
+static void flip_byte(size_t ofs)
+{
+	void *data;
+	size_t len;
+
+	assert(bu_read_file(filename, &data, &len, 1024 * 1024));
+	assert(ofs < len);
+	((unsigned char *) data)[ofs] ^= 0x01;
+	assert(bu_write_file(filename, data, len));
+	free(data);
+}
+
+static void test_recfile(void)
+{
+	struct aes_recfile rf;
+	cstring *contents = NULL;
+	unsigned int i;
+
+	assert(aes_recfile_new(&rf, s_password, strlen(s_password)));
+	assert(aes_recfile_write(&rf, filename, recs[0], strlen(recs[0])));
+	for (i = 1; i < ARRAY_SIZE(recs) - 1; i++)
+		assert(aes_recfile_append(&rf, recs[i], strlen(recs[i])));
+
+	/* the header, as it was before the last append */
+	unsigned char prev_hdr[AES_RECFILE_HDR_SZ];
+	assert(pread(rf.fd, prev_hdr, sizeof(prev_hdr), 0) == sizeof(prev_hdr));
+
+	const char *last = recs[ARRAY_SIZE(recs) - 1];
+	assert(aes_recfile_append(&rf, last, strlen(last)));
+	uint64_t end = rf.end;
+	aes_recfile_close(&rf);
+
+	check_open(ARRAY_SIZE(recs));
+
+	/* wrong passphrase */
+	assert(!aes_recfile_open(&rf, filename, "wrong", 5, &contents));
+
+	/* a crash after the last append, before its header rewrite: the
+	 * record is kept
+	 */
+	int fd = open(filename, O_WRONLY);
+	assert(fd >= 0);
+	assert(pwrite(fd, prev_hdr, sizeof(prev_hdr), 0) == sizeof(prev_hdr));
+	close(fd);
+	check_open(ARRAY_SIZE(recs));
+
+	/* a torn last record is dropped, and overwritten by the next append */
+	assert(truncate(filename, end - 3) == 0);
+	check_open(ARRAY_SIZE(recs) - 1);
+
+	assert(aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				&contents));
+	cstr_free(contents, true);
+	assert(aes_recfile_append(&rf, last, strlen(last)));
+	assert(rf.end == end);
+	aes_recfile_close(&rf);
+
+	check_open(ARRAY_SIZE(recs));
+
+	/* a damaged record that is not the last is an error */
+	flip_byte(AES_RECFILE_HDR_SZ + 4 + AES_RECFILE_IV_SZ + 2);
+	assert(!aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				 &contents));
+	flip_byte(AES_RECFILE_HDR_SZ + 4 + AES_RECFILE_IV_SZ + 2);
+	check_open(ARRAY_SIZE(recs));
+
+	/* rewrite: one record, same keys, and appends continue after it */
+	assert(aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				&contents));
+	unsigned char salt[AES_RECFILE_SALT_SZ];
+	memcpy(salt, rf.salt, sizeof(salt));
+	assert(aes_recfile_write(&rf, filename, contents->str, contents->len));
+	cstr_free(contents, true);
+	assert(rf.n_recs == 1);
+	assert(!memcmp(salt, rf.salt, sizeof(salt)));
+	assert(aes_recfile_append(&rf, "!", 1));
+	aes_recfile_close(&rf);
+
+	assert(aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				&contents));
+	cstring *expect = expected(ARRAY_SIZE(recs));
+	cstr_append_buf(expect, "!", 1);
+	assert(rf.n_recs == 2);
+	assert(contents->len == expect->len);
+	assert(!memcmp(contents->str, expect->str, expect->len));
+	cstr_free(expect, true);
+	cstr_free(contents, true);
+	end = rf.end;
+	aes_recfile_close(&rf);
+
+	/* a whole record dropped from the end is an error */
+	assert(truncate(filename, end - (4 + AES_RECFILE_IV_SZ + 1 +
+					 AES_RECFILE_MAC_SZ)) == 0);
+	assert(!aes_recfile_open(&rf, filename, s_password, strlen(s_password),
+				 &contents));
+
+	assert(unlink(filename) == 0);
+
+	/* the old format is told apart */
+	assert(write_aes_file(filename, (char *) s_password,
+			      strlen(s_password), recs[0], strlen(recs[0])));
+	assert(!aes_recfile_is(filename));
+	assert(unlink(filename) == 0);
+}
+
+/* n small changes: appended records, versus a full rewrite each time */
+static void bench_updates(unsigned int n)
+{
+	struct aes_recfile rf;
+	unsigned int i;
+	char rec[64] = {};
+
+	cstring *wallet = cstr_new_sz(16 * 1024);
+	for (i = 0; i < 200; i++)
+		cstr_append_buf(wallet, rec, sizeof(rec));
+
+	double t0 = now_ms();
+	assert(aes_recfile_new(&rf, s_password, strlen(s_password)));
+	assert(aes_recfile_write(&rf, filename, wallet->str, wallet->len));
+	for (i = 0; i < n; i++)
+		assert(aes_recfile_append(&rf, rec, sizeof(rec)));
+	aes_recfile_close(&rf);
+
+	double t1 = now_ms();
+	for (i = 0; i < n; i++)
+		assert(write_aes_file(filename, (char *) s_password,
+				      strlen(s_password),
+				      wallet->str, wallet->len));
+	double t2 = now_ms();
+
+	fprintf(stderr, "aes-recfile: %u updates: appended %.2f ms, "
+		"rewritten %.2f ms\n", n, t1 - t0, t2 - t1);
+
+	cstr_free(wallet, true);
+	assert(unlink(filename) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	test_recfile();
+	if (test_bench(argc, argv))
+		bench_updates(10);
+
+	return 0;
+}
@@ -9,7 +9,10 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ccoin/blkdb.h>
+#include <ccoin/message.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/buint.h>
 #include <ccoin/buffer.h>
@@ -61,6 +64,8 @@ static void test_blkinfo_prev(struct blkdb *db)
 
 	while (tmp) {
 		assert(height == tmp->height);
+		assert(blkdb_at_height(db, height) == tmp);
+		assert(blkdb_ancestor(db, db->best_chain, height) == tmp);
 
 		height--;
 		tmp = tmp->prev;
@@ -69,6 +74,237 @@ static void test_blkinfo_prev(struct blkdb *db)
 	assert(height == -1);
 }
 
+static struct blkinfo *add_child(struct blkdb *db, struct blkinfo *prev,
+				  uint32_t nBits, struct blkdb_reorg *reorg)
+{
+	struct blkinfo *bi = bi_new();
+	assert(bi != NULL);
+
+	bp_block_copy_hdr(&bi->hdr, &prev->hdr);
+	bu256_copy(&bi->hdr.hashPrevBlock, &prev->hash);
+	bi->hdr.nBits = nBits;
+	bi->hdr.nNonce = 0xfeedf00d;
+	bi->hdr.sha256_valid = false;
+	bp_block_calc_sha256(&bi->hdr);
+	bu256_copy(&bi->hash, &bi->hdr.sha256);
+
+	assert(blkdb_add(db, bi, reorg) == true);
+	return bi;
+}
+
+static void test_fork(struct blkdb *db)
+{
+	struct blkdb_reorg reorg;
+	struct blkinfo *old_best = db->best_chain;
+	int height = old_best->height;
+	struct blkinfo *fork = blkdb_at_height(db, height - 3);
+
+	/* low-work side chain: active chain unchanged */
+	struct blkinfo *side = add_child(db, fork, 0x207fffff, &reorg);
+	assert(reorg.conn == 0);
+	assert(db->best_chain == old_best);
+	assert(blkdb_at_height(db, side->height) != side);
+	assert(blkdb_ancestor(db, side, fork->height) == fork);
+	assert(blkdb_ancestor(db, side, 1) == blkdb_at_height(db, 1));
+
+	/* high-work side chain overtakes the old tip */
+	struct blkinfo *bi = add_child(db, fork, 0x1b0404cb, &reorg);
+	assert(reorg.old_best == old_best);
+	assert(reorg.conn == 1);
+	assert(reorg.disconn == 3);
+	assert(db->best_chain == bi);
+	assert(db->chain->len == (height - 1));
+	assert(blkdb_at_height(db, height - 2) == bi);
+	assert(blkdb_at_height(db, height) == NULL);
+
+	/* old tip is now on a side branch */
+	assert(blkdb_ancestor(db, old_best, fork->height) == fork);
+	assert(blkdb_ancestor(db, old_best, height - 2) != bi);
+	assert(blkdb_ancestor(db, old_best, 0) == blkdb_at_height(db, 0));
+
+	bi = add_child(db, bi, 0x1b0404cb, &reorg);
+	assert(reorg.conn == 1);
+	assert(reorg.disconn == 0);
+	assert(blkdb_at_height(db, bi->height) == bi);
+
+	struct bp_locator locator;
+	bp_locator_init(&locator);
+	blkdb_locator(db, NULL, &locator);
+	assert(bu256_equal(parr_idx(locator.vHave, 0), &bi->hash));
+	assert(bu256_equal(parr_idx(locator.vHave, 1), &bi->prev->hash));
+	assert(bu256_equal(parr_idx(locator.vHave, locator.vHave->len - 1),
+			   &db->block0));
+	bp_locator_free(&locator);
+
+	test_blkinfo_prev(db);
+}
+
+static void test_invalid(struct blkdb *db, const struct chain_info *chain,
+			 const bu256_t *block0)
+{
+	const char *ckpt_fn = "blkdb-bad-ckpt.out";
+	const char *log_fn = "blkdb-bad-log.out";
+	const char *end_ckpt_fn = "blkdb-end-ckpt.out";
+	struct blkdb_reorg reorg;
+	struct blkinfo *old_best = db->best_chain;
+	struct blkinfo *fork = old_best->prev;
+
+	/* checkpoint the index as it stands, and log what follows */
+	assert(blkdb_ckpt_write(db, ckpt_fn, 0));
+	db->fd = open(log_fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	assert(db->fd >= 0);
+
+	/* fork <- a <- b <- c, heavier than the active chain from b on */
+	struct blkinfo *a = add_child(db, fork, 0x207fffff, &reorg);
+	assert(reorg.conn == 0);
+	struct blkinfo *b = add_child(db, a, 0x1b0404cb, &reorg);
+	assert(reorg.old_best == old_best);
+	assert(reorg.conn == 2);
+	assert(reorg.disconn == 1);
+	struct blkinfo *c = add_child(db, b, 0x1b0404cb, &reorg);
+	assert(db->best_chain == c);
+
+	/* b fails to connect: back to the old chain */
+	assert(blkdb_invalidate(db, b, &reorg));
+	assert(b->invalid && c->invalid && !a->invalid);
+	assert(reorg.old_best == c);
+	assert(reorg.disconn == 3);
+	assert(reorg.conn == 1);
+	assert(db->best_chain == old_best);
+	assert(blkdb_at_height(db, old_best->height + 1) == NULL);
+	test_blkinfo_prev(db);
+
+	/* descendants of an invalid block are invalid on arrival */
+	struct blkinfo *d = add_child(db, c, 0x1b0404cb, &reorg);
+	assert(d->invalid);
+	assert(reorg.conn == 0);
+	assert(db->best_chain == old_best);
+
+	/* genesis cannot be invalidated */
+	assert(!blkdb_invalidate(db, blkdb_at_height(db, 0), &reorg));
+
+	close(db->fd);
+	db->fd = -1;
+
+	/* the log carries the verdict across a restart */
+	struct blkdb db2;
+	bool ckpt_stale;
+	assert(blkdb_init(&db2, chain->netmagic, block0));
+	assert(blkdb_read_ckpt(&db2, log_fn, ckpt_fn, &ckpt_stale));
+	assert(bu256_equal(&db2.best_chain->hash, &old_best->hash));
+	assert(blkdb_lookup(&db2, &b->hash)->invalid);
+	assert(blkdb_lookup(&db2, &d->hash)->invalid);
+	assert(!blkdb_lookup(&db2, &a->hash)->invalid);
+
+	/* and a checkpoint leaves invalid blocks out */
+	struct stat st;
+	assert(stat(log_fn, &st) == 0);
+	assert(blkdb_ckpt_write(&db2, end_ckpt_fn, st.st_size));
+	assert(blkdb_ckpt_write(&db2, ckpt_fn, 0));
+	blkdb_free(&db2);
+
+	uint64_t log_ofs;
+	assert(blkdb_init(&db2, chain->netmagic, block0));
+	assert(blkdb_ckpt_read(&db2, ckpt_fn, &log_ofs));
+	assert(blkdb_lookup(&db2, &a->hash) != NULL);
+	assert(blkdb_lookup(&db2, &b->hash) == NULL);
+	assert(blkdb_lookup(&db2, &d->hash) == NULL);
+	assert(bu256_equal(&db2.best_chain->hash, &old_best->hash));
+	blkdb_free(&db2);
+
+	/* a checkpoint at the end of the log replays nothing */
+	assert(blkdb_init(&db2, chain->netmagic, block0));
+	assert(blkdb_read_ckpt(&db2, log_fn, end_ckpt_fn, &ckpt_stale));
+	assert(!ckpt_stale);
+	assert(blkdb_lookup(&db2, &b->hash) == NULL);
+	assert(bu256_equal(&db2.best_chain->hash, &old_best->hash));
+	blkdb_free(&db2);
+
+	/* a different log of the same length: a, b, c, d, bad(b).  The
+	 * checkpoint must not be applied to it; this log alone, without
+	 * the headers before the fork, cannot rebuild the index either.
+	 */
+	const size_t rec_sz = P2P_HDR_SZ + 32 + 80;
+	const size_t bad_sz = P2P_HDR_SZ + 32;
+	void *data = NULL;
+	size_t log_len = 0;
+	assert(bu_read_file(log_fn, &data, &log_len, 1024 * 1024));
+	assert(log_len == st.st_size);
+	assert(log_len == (4 * rec_sz) + bad_sz);
+	unsigned char *log = data;
+	unsigned char *log2 = malloc(log_len);
+	memcpy(log2, log, 3 * rec_sz);
+	memcpy(log2 + (3 * rec_sz), log + (3 * rec_sz) + bad_sz, rec_sz);
+	memcpy(log2 + (4 * rec_sz), log + (3 * rec_sz), bad_sz);
+	assert(bu_write_file(log_fn, log2, log_len));
+	free(log);
+	free(log2);
+
+	assert(blkdb_init(&db2, chain->netmagic, block0));
+	assert(!blkdb_read_ckpt(&db2, log_fn, end_ckpt_fn, &ckpt_stale));
+	assert(ckpt_stale);
+	blkdb_free(&db2);
+
+	assert(unlink(end_ckpt_fn) == 0);
+	assert(unlink(ckpt_fn) == 0);
+	assert(unlink(log_fn) == 0);
+}
+
+static void test_ckpt(struct blkdb *db, const struct chain_info *chain,
+		      const bu256_t *block0)
+{
+	const char *ckpt_fn = "blkdb-ckpt.out";
+	bool rc = blkdb_ckpt_write(db, ckpt_fn, 12345);
+	assert(rc);
+
+	struct blkdb db2;
+	rc = blkdb_init(&db2, chain->netmagic, block0);
+	assert(rc);
+
+	uint64_t log_ofs = 0;
+	rc = blkdb_ckpt_read(&db2, ckpt_fn, &log_ofs);
+	assert(rc);
+	assert(log_ofs == 12345);
+
+	assert(bp_hashtab_size(db2.blocks) == bp_hashtab_size(db->blocks));
+	assert(db2.best_chain->height == db->best_chain->height);
+	assert(bu256_equal(&db2.best_chain->hash, &db->best_chain->hash));
+	assert(bu256_equal(&db2.best_chain->work, &db->best_chain->work));
+	assert(bu256_equal(&db2.best_chain->hdr.hashPrevBlock,
+			   &db->best_chain->hdr.hashPrevBlock));
+
+	/* restored headers must hash to their recorded ids */
+	struct bp_block hdr;
+	bp_block_copy_hdr(&hdr, &db2.best_chain->hdr);
+	hdr.sha256_valid = false;
+	bp_block_calc_sha256(&hdr);
+	assert(bu256_equal(&hdr.sha256, &db->best_chain->hash));
+
+	test_blkinfo_prev(&db2);
+
+	blkdb_free(&db2);
+
+	/* corrupt one byte; checksum must reject the file */
+	void *data = NULL;
+	size_t data_len = 0;
+	rc = bu_read_file(ckpt_fn, &data, &data_len, 512 * 1024 * 1024);
+	assert(rc);
+	((unsigned char *)data)[data_len / 2] ^= 0x01;
+	rc = bu_write_file(ckpt_fn, data, data_len);
+	assert(rc);
+	free(data);
+
+	rc = blkdb_init(&db2, chain->netmagic, block0);
+	assert(rc);
+	rc = blkdb_ckpt_read(&db2, ckpt_fn, &log_ofs);
+	assert(!rc);
+	assert(bp_hashtab_size(db2.blocks) == 0);
+	assert(db2.best_chain == NULL);
+	blkdb_free(&db2);
+
+	assert(unlink(ckpt_fn) == 0);
+}
+
 static void runtest(const char *ser_base_fn, const struct chain_info *chain,
 		    unsigned int check_height, const char *check_hash)
 {
@@ -91,6 +327,9 @@ static void runtest(const char *ser_base_fn, const struct chain_info *chain,
 	assert(bu256_equal(&db.best_chain->hash, &best_block));
 
 	test_blkinfo_prev(&db);
+	test_ckpt(&db, chain, &block0);
+	test_fork(&db);
+	test_invalid(&db, chain, &block0);
 
 	blkdb_free(&db);
 }
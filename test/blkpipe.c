@@ -0,0 +1,235 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/blkpipe.h>
+#include <ccoin/mbr.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+struct pipe_state {
+	unsigned int	n_blocks;
+	unsigned int	stop_at;
+	int64_t		next_fpos;
+	bu256_t		prev_hash;
+};
+
+static bool check_block(struct bp_block *block,
+			const struct p2p_message_hdr *hdr,
+			int64_t fpos, void *priv)
+{
+	struct pipe_state *st = priv;
+
+	/* blocks arrive in file order, hashed */
+	assert(fpos == st->next_fpos);
+	assert(block->sha256_valid);
+	if (st->n_blocks > 0)
+		assert(bu256_equal(&block->hashPrevBlock, &st->prev_hash));
+
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		assert(tx->sha256_valid);
+	}
+
+	bu256_copy(&st->prev_hash, &block->sha256);
+	st->next_fpos += 8 + hdr->data_len;	/* blockfile header */
+	st->n_blocks++;
+
+	return (st->n_blocks != st->stop_at);
+}
+
+static void runtest(const char *ser_fn_base, unsigned int n_threads,
+		    bool validate, unsigned int stop_at)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	int fd = file_seq_open(ser_fn);
+	if (fd < 0) {
+		perror(ser_fn);
+		exit(1);
+	}
+
+	struct pipe_state st = {};
+	st.stop_at = stop_at;
+
+	struct blkpipe_opts opts = {
+		.read_f		= fread_block,
+		.n_threads	= n_threads,
+		.queue_len	= 2,
+		.validate	= validate,
+	};
+	struct blkpipe_stats stats;
+	struct blkpipe_result res;
+
+	bool rc = blkpipe_run(fd, &opts, check_block, &st, &stats, &res);
+	assert(res.read_ok);
+
+	if (stop_at) {
+		assert(!rc);
+		assert(st.n_blocks == stop_at);
+		assert(res.fail_reason != NULL);
+	} else {
+		assert(rc);
+		assert(st.n_blocks == 11);
+		assert(res.fail_fpos == -1);
+	}
+
+	assert(stats.n_blocks == st.n_blocks);
+	assert(stats.stage[BLKPIPE_PROCESS].n_items == st.n_blocks);
+	if (!stop_at) {
+		assert(stats.stage[BLKPIPE_READ].n_items == 11);
+		assert(stats.stage[BLKPIPE_DESER].n_items == 11);
+		assert(stats.stage[BLKPIPE_VALID].n_items ==
+		       (validate ? 11 : 0));
+	}
+
+	cstring *s = blkpipe_stats_str(&stats);
+	assert(s && s->len > 0);
+	cstr_free(s, true);
+
+	close(fd);
+	free(ser_fn);
+}
+
+struct shard_state {
+	const struct blkpipe_shard *shard;
+	unsigned int	n_blocks;
+	int64_t		next_fpos;
+	bu256_t		prev_hash;
+	int64_t		stop_fpos;
+};
+
+static bool check_shard_block(struct bp_block *block,
+			      const struct p2p_message_hdr *hdr,
+			      int64_t fpos, void *priv)
+{
+	struct shard_state *st = priv;
+
+	/* in file order within the shard, and only the shard's */
+	assert(fpos == st->next_fpos);
+	assert(fpos < st->shard->end);
+	assert(block->sha256_valid);
+	if (st->n_blocks > 0)
+		assert(bu256_equal(&block->hashPrevBlock, &st->prev_hash));
+
+	bu256_copy(&st->prev_hash, &block->sha256);
+	st->next_fpos += 8 + hdr->data_len;
+	st->n_blocks++;
+
+	return (fpos != st->stop_fpos);
+}
+
+static void runtest_shards(const char *ser_fn_base, unsigned int max_shards,
+			   unsigned int stop_at)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	int fd = file_seq_open(ser_fn);
+	if (fd < 0) {
+		perror(ser_fn);
+		exit(1);
+	}
+
+	struct blkpipe_shard shards[max_shards];
+	unsigned int n_shards, i;
+	struct blkpipe_result res;
+
+	assert(blkpipe_split(fd, fread_block, 0, max_shards, shards,
+			     &n_shards, &res));
+	assert(n_shards == MIN(max_shards, 11));
+
+	/* contiguous, non-empty, covering the file */
+	uint64_t seq = 0;
+	for (i = 0; i < n_shards; i++) {
+		assert(shards[i].first_seq == seq);
+		assert(shards[i].n_blocks > 0);
+		assert(shards[i].start < shards[i].end);
+		if (i > 0)
+			assert(shards[i].start == shards[i - 1].end);
+		seq += shards[i].n_blocks;
+	}
+	assert(seq == 11);
+	assert(shards[0].start == 0);
+	assert(shards[n_shards - 1].end == lseek(fd, 0, SEEK_END));
+
+	/* stop_at'th block, counting from 1, fails */
+	int64_t stop_fpos = -1;
+	struct shard_state st[n_shards];
+	void *privs[n_shards];
+	for (i = 0; i < n_shards; i++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i].shard = &shards[i];
+		st[i].next_fpos = shards[i].start;
+		st[i].stop_fpos = -1;
+		privs[i] = &st[i];
+
+		if (stop_at && (stop_at - 1 >= shards[i].first_seq) &&
+		    (stop_at - 1 < shards[i].first_seq + shards[i].n_blocks)) {
+			struct p2p_message msg = {};
+			bool read_ok;
+			unsigned int k;
+
+			assert(lseek(fd, shards[i].start, SEEK_SET) ==
+			       shards[i].start);
+			for (k = shards[i].first_seq; k < stop_at - 1; k++)
+				assert(fread_block(fd, &msg, &read_ok));
+			stop_fpos = lseek(fd, 0, SEEK_CUR);
+			st[i].stop_fpos = stop_fpos;
+			free(msg.data);
+		}
+	}
+
+	struct blkpipe_opts opts = {
+		.read_f		= fread_block,
+		.validate	= true,
+	};
+	struct blkpipe_stats stats;
+
+	bool rc = blkpipe_run_shards(ser_fn, &opts, shards, n_shards,
+				     check_shard_block, privs, &stats, &res);
+	assert(res.read_ok);
+
+	if (stop_at) {
+		assert(!rc);
+		assert(res.fail_fpos == stop_fpos);
+		assert(res.fail_reason != NULL);
+	} else {
+		assert(rc);
+		assert(res.fail_fpos == -1);
+		for (i = 0; i < n_shards; i++) {
+			assert(st[i].n_blocks == shards[i].n_blocks);
+			assert(st[i].next_fpos == shards[i].end);
+		}
+		assert(stats.n_blocks == 11);
+		assert(stats.stage[BLKPIPE_VALID].n_items == 11);
+	}
+	assert(stats.n_threads == n_shards);
+
+	cstring *s = blkpipe_stats_str(&stats);
+	assert(s && s->len > 0);
+	cstr_free(s, true);
+
+	close(fd);
+	free(ser_fn);
+}
+
+int main (int argc, char *argv[])
+{
+	runtest("data/blks10.ser", 1, false, 0);
+	runtest("data/blks10.ser", 1, true, 0);
+	runtest("data/blks10.ser", 4, true, 0);
+	runtest("data/blks10.ser", 4, true, 5);
+	runtest("data/blks10.ser", 3, false, 1);
+
+	runtest_shards("data/blks10.ser", 1, 0);
+	runtest_shards("data/blks10.ser", 4, 0);
+	runtest_shards("data/blks10.ser", 32, 0);
+	runtest_shards("data/blks10.ser", 4, 7);
+	runtest_shards("data/blks10.ser", 3, 1);
+	return 0;
+}
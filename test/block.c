@@ -12,6 +12,7 @@
 #include <jansson.h>
 #include <ccoin/message.h>
 #include <ccoin/mbr.h>
+#include <ccoin/parallel.h>
 #include <ccoin/util.h>
 #include <ccoin/key.h>
 #include "libtest.h"
@@ -51,6 +52,7 @@ static void runtest(const char *json_fn_base, const char *ser_fn_base)
 
 	rc = deser_bp_block(&block, &buf);
 	assert(rc);
+	assert(bp_block_ser_size(&block) == msg.hdr.data_len);
 
 	cstring *gs = cstr_new_sz(100000);
 	ser_bp_block(gs, &block);
@@ -84,11 +86,157 @@ static void runtest(const char *json_fn_base, const char *ser_fn_base)
 	json_decref(meta);
 }
 
+static void add_synth_tx(struct bp_block *block, unsigned int n_in,
+			 uint32_t seed)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(n_in, bp_txin_freep);
+	tx->vout = parr_new(2, bp_txout_freep);
+
+	unsigned char script[107];
+	memset(script, 0x51, sizeof(script));
+
+	unsigned int i;
+	for (i = 0; i < n_in; i++) {
+		struct bp_txin *txin = calloc(1, sizeof(*txin));
+		bp_txin_init(txin);
+		txin->prevout.hash.dword[0] = htole32(seed);
+		txin->prevout.hash.dword[1] = htole32(i);
+		txin->prevout.n = i;
+		txin->scriptSig = cstr_new_buf(script, sizeof(script));
+		txin->nSequence = 0xffffffffU;
+		parr_add(tx->vin, txin);
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		txout->nValue = 1000;
+		txout->scriptPubKey = cstr_new_buf(script, 25);
+		parr_add(tx->vout, txout);
+	}
+
+	parr_add(block->vtx, tx);
+}
+
+static void synth_block(struct bp_block *block, unsigned int target_sz)
+{
+	bp_block_init(block);
+	block->vtx = parr_new(0, bp_tx_freep);
+
+	/* coinbase */
+	add_synth_tx(block, 1, 0);
+	struct bp_tx *coinbase = parr_idx(block->vtx, 0);
+	struct bp_txin *txin = parr_idx(coinbase->vin, 0);
+	bu256_zero(&txin->prevout.hash);
+	txin->prevout.n = 0xffffffff;
+	cstr_resize(txin->scriptSig, 8);
+
+	/* mostly small txs, with an occasional large consolidation */
+	uint32_t seed = 1;
+	while (bp_block_ser_size(block) < target_sz) {
+		add_synth_tx(block, (seed % 50) ? 2 : 40, seed);
+		seed++;
+	}
+}
+
+static void reset_tx_hashes(struct bp_block *block)
+{
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		tx->sha256_valid = false;
+	}
+}
+
+/* tx hashing plus per-tx checks, the context-free work in a block */
+static double time_block_checks(struct bp_block *block, bool expect_valid)
+{
+	bu256_t merkle;
+
+	reset_tx_hashes(block);
+
+	double t0 = now_ms();
+	bp_block_merkle(&merkle, block);
+	bool rc = bp_block_valid_txs(block);
+	double t1 = now_ms();
+
+	assert(rc == expect_valid);
+	assert(bp_block_has_dup_spends(block) == !expect_valid);
+	return t1 - t0;
+}
+
+static void test_synthetic(unsigned int target_sz)
+{
+	struct bp_block block;
+	synth_block(&block, target_sz);
+
+	cstring *s = cstr_new_sz(target_sz + 1000);
+	ser_bp_block(s, &block);
+	assert(bp_block_ser_size(&block) == s->len);
+	cstr_free(s, true);
+
+	bp_parallel_set_threads(1);
+	double serial_ms = time_block_checks(&block, true);
+
+	bp_parallel_set_threads(0);
+	double par_ms = time_block_checks(&block, true);
+
+	fprintf(stderr, "block: synthetic %u KB, %u txs: "
+		"serial %.1f ms, parallel (%u threads) %.1f ms\n",
+		target_sz / 1000, (unsigned int) block.vtx->len,
+		serial_ms, bp_parallel_threads(), par_ms);
+
+	/* the same outpoint spent by two different txs */
+	assert(!bp_block_has_dup_spends(&block));
+
+	struct bp_tx *tx_first = parr_idx(block.vtx, 1);
+	struct bp_tx *tx_last = parr_idx(block.vtx, block.vtx->len - 1);
+	struct bp_txin *txin_first = parr_idx(tx_first->vin, 0);
+	struct bp_txin *txin_last = parr_idx(tx_last->vin, 1);
+	struct bp_outpt saved;
+	bp_outpt_copy(&saved, &txin_last->prevout);
+	bp_outpt_copy(&txin_last->prevout, &txin_first->prevout);
+
+	assert(bp_block_valid_txs(&block));	/* each tx alone is fine */
+	double t0 = now_ms();
+	assert(bp_block_has_dup_spends(&block));
+	double t1 = now_ms();
+	fprintf(stderr, "block: synthetic %u KB, dup spend check %.2f ms\n",
+		target_sz / 1000, t1 - t0);
+
+	bp_outpt_copy(&txin_last->prevout, &saved);
+	assert(!bp_block_has_dup_spends(&block));
+
+	/* duplicate inputs, in a large tx near the end of the block */
+	unsigned int idx = block.vtx->len - 1;
+	while (((struct bp_tx *) parr_idx(block.vtx, idx))->vin->len < 40)
+		idx--;
+	struct bp_tx *tx = parr_idx(block.vtx, idx);
+	struct bp_txin *txin_a = parr_idx(tx->vin, 3);
+	struct bp_txin *txin_b = parr_idx(tx->vin, 37);
+	bp_outpt_copy(&txin_b->prevout, &txin_a->prevout);
+
+	bp_parallel_set_threads(1);
+	time_block_checks(&block, false);
+	bp_parallel_set_threads(4);
+	time_block_checks(&block, false);
+	bp_parallel_set_threads(0);
+
+	bp_block_free(&block);
+}
+
 int main (int argc, char *argv[])
 {
 	runtest("data/blk0.json", "data/blk0.ser");
 	runtest("data/blk120383.json", "data/blk120383.ser");
 
+	test_synthetic(1000 * 1000);
+	if (test_bench(argc, argv))
+		test_synthetic(4 * 1000 * 1000);
+	bp_parallel_shutdown();
+
 	bp_key_static_shutdown();
 	return 0;
 }
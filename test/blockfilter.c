@@ -0,0 +1,667 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ccoin/blockfilter.h>
+#include <ccoin/core.h>
+#include <ccoin/filterindex.h>
+#include <ccoin/hexcode.h>
+#include <ccoin/mbr.h>
+#include <ccoin/message.h>
+#include <ccoin/parallel.h>
+#include <ccoin/script.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libtest.h"
+
+static const char *idx_fn = "blockfilter.out";
+
+/* BIP 158 test vector: testnet block 0 */
+static const char *tn_genesis =
+"0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4adae5494dffff001d1aa4ae180101000000010000000000000000000000000000000000000000000000000000000000000000ffffffff4d04ffff001d0104455468652054696d65732030332f4a616e2f32303039204368616e63656c6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f757420666f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+static const char *tn_genesis_filter = "019dfca8";
+static const char *tn_genesis_header =
+	"21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750";
+
+static void test_vector(void)
+{
+	unsigned char raw[512];
+	size_t raw_len;
+	assert(decode_hex(raw, sizeof(raw), tn_genesis, &raw_len));
+
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { raw, raw_len };
+	assert(deser_bp_block(&block, &buf));
+	bp_block_calc_sha256(&block);
+
+	cstring *filter = bp_block_filter_basic(&block, NULL);
+	char hexstr[BU256_STRSZ];
+	assert(filter->len * 2 < sizeof(hexstr));
+	encode_hex(hexstr, filter->str, filter->len);
+	assert(!strcmp(hexstr, tn_genesis_filter));
+
+	bu256_t prev, header;
+	bu256_zero(&prev);
+	bp_block_filter_header(&header, filter, &prev);
+	bu256_hex(hexstr, &header);
+	assert(!strcmp(hexstr, tn_genesis_header));
+
+	/* the coinbase output is in it; OP_RETURN outputs never are */
+	struct bp_tx *tx = parr_idx(block.vtx, 0);
+	struct bp_txout *txout = parr_idx(tx->vout, 0);
+	struct const_buffer item = { txout->scriptPubKey->str,
+				     txout->scriptPubKey->len };
+	unsigned char key[16];
+	memcpy(key, &block.sha256, sizeof(key));
+	assert(bp_gcs_match_any(filter->str, filter->len, key, &item, 1, NULL));
+
+	cstr_free(filter, true);
+	bp_block_free(&block);
+}
+
+/*
+ * Reference BIP 158 encoder, written from the BIP text and kept simple
+ * rather than fast: SipHash-2-4, a quadratic de-duplication, and one
+ * bit written at a time.
+ */
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND							\
+	do {								\
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;		\
+		v0 = ROTL64(v0, 32);					\
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;		\
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;		\
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;		\
+		v2 = ROTL64(v2, 32);					\
+	} while (0)
+
+static uint64_t ref_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static uint64_t ref_siphash(const unsigned char key[16],
+			    const unsigned char *p, size_t len)
+{
+	uint64_t k0 = ref_le64(key), k1 = ref_le64(key + 8);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t m = ref_le64(p + i);
+		v3 ^= m;
+		SIPROUND; SIPROUND;
+		v0 ^= m;
+	}
+
+	unsigned char last[8] = { 0 };
+	memcpy(last, p + i, len - i);
+	last[7] = len & 0xff;
+	uint64_t m = ref_le64(last);
+	v3 ^= m;
+	SIPROUND; SIPROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+struct ref_bits {
+	cstring		*s;
+	unsigned int	n_bits;
+};
+
+static void ref_put_bit(struct ref_bits *rb, unsigned int bit)
+{
+	if ((rb->n_bits % 8) == 0)
+		cstr_append_c(rb->s, 0);
+	if (bit)
+		rb->s->str[rb->s->len - 1] |= 0x80 >> (rb->n_bits % 8);
+	rb->n_bits++;
+}
+
+static cstring *ref_filter(const unsigned char key[16],
+			   const struct const_buffer *items, unsigned int n)
+{
+	struct const_buffer *set = calloc(n + 1, sizeof(*set));
+	uint64_t *h = calloc(n + 1, sizeof(uint64_t));
+	unsigned int i, j, n_set = 0;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n_set; j++)
+			if ((set[j].len == items[i].len) &&
+			    !memcmp(set[j].p, items[i].p, items[i].len))
+				break;
+		if (j == n_set)
+			set[n_set++] = items[i];
+	}
+
+	uint64_t f = (uint64_t) n_set * BP_BASIC_FILTER_M;
+	for (i = 0; i < n_set; i++)
+		h[i] = ((unsigned __int128) ref_siphash(key, set[i].p,
+							set[i].len) * f) >> 64;
+
+	for (i = 1; i < n_set; i++)
+		for (j = i; (j > 0) && (h[j - 1] > h[j]); j--) {
+			uint64_t t = h[j];
+			h[j] = h[j - 1];
+			h[j - 1] = t;
+		}
+
+	cstring *s = cstr_new_sz(64);
+	ser_varlen(s, n_set);
+
+	struct ref_bits rb = { s, 0 };
+	uint64_t last = 0, q;
+	for (i = 0; i < n_set; i++) {
+		uint64_t delta = h[i] - last;
+		last = h[i];
+
+		for (q = delta >> BP_BASIC_FILTER_P; q > 0; q--)
+			ref_put_bit(&rb, 1);
+		ref_put_bit(&rb, 0);
+		for (j = BP_BASIC_FILTER_P; j > 0; j--)
+			ref_put_bit(&rb, (delta >> (j - 1)) & 1);
+	}
+
+	free(h);
+	free(set);
+	return s;
+}
+
+/*
+ * A filter with many elements and spent output scripts, checked
+ * against the reference encoder: a real block, and undo data where
+ * inputs spent P2PKH outputs, outputs of the block itself (items
+ * appearing twice), and empty scripts (not filtered).
+ */
+static void test_reference(const void *data, size_t data_len)
+{
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { data, data_len };
+	assert(deser_bp_block(&block, &buf));
+	bp_block_calc_sha256(&block);
+
+	struct bp_tx *coinbase = parr_idx(block.vtx, 0);
+	struct bp_txout *cb_out = parr_idx(coinbase->vout, 0);
+
+	parr *undo = parr_new(0, bp_utxo_undo_freep);
+	unsigned int i, j, n_spent = 0;
+	for (i = 1; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		for (j = 0; j < tx->vin->len; j++, n_spent++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			struct bp_utxo_undo *u = calloc(1, sizeof(*u));
+			bp_utxo_undo_init(u);
+			bp_outpt_copy(&u->prevout, &txin->prevout);
+
+			if (n_spent % 5 == 1)
+				u->txout.scriptPubKey = cstr_new_sz(0);
+			else if (n_spent % 3 == 2)
+				u->txout.scriptPubKey =
+					cstr_new_buf(cb_out->scriptPubKey->str,
+						     cb_out->scriptPubKey->len);
+			else {
+				cstring *hash = cstr_new_buf(&txin->prevout.hash,
+							     20);
+				u->txout.scriptPubKey = bsp_make_pubkeyhash(hash);
+				cstr_free(hash, true);
+			}
+			parr_add(undo, u);
+		}
+	}
+
+	/* every output and spent script, as the BIP lists them */
+	unsigned int n_items = 0, max_items = n_spent;
+	for (i = 0; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		max_items += tx->vout->len;
+	}
+	struct const_buffer *items = calloc(max_items, sizeof(*items));
+	for (i = 0; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bp_txout *txout = parr_idx(tx->vout, j);
+			const cstring *script = txout->scriptPubKey;
+			if (!script->len ||
+			    ((unsigned char) script->str[0] == OP_RETURN))
+				continue;
+			items[n_items].p = script->str;
+			items[n_items++].len = script->len;
+		}
+	}
+	for (i = 0; i < undo->len; i++) {
+		struct bp_utxo_undo *u = parr_idx(undo, i);
+		if (!u->txout.scriptPubKey->len)
+			continue;
+		items[n_items].p = u->txout.scriptPubKey->str;
+		items[n_items++].len = u->txout.scriptPubKey->len;
+	}
+
+	unsigned char key[16];
+	memcpy(key, &block.sha256, sizeof(key));
+
+	cstring *filter = bp_block_filter_basic(&block, undo);
+	cstring *ref = ref_filter(key, items, n_items);
+	assert(filter->len == ref->len);
+	assert(!memcmp(filter->str, ref->str, ref->len));
+
+	/* several distinct elements, each found */
+	struct const_buffer nbuf = { filter->str, filter->len };
+	uint32_t n;
+	assert(deser_varlen(&n, &nbuf));
+	assert((n > 2) && (n <= n_items));
+	for (i = 0; i < n_items; i++)
+		assert(bp_gcs_match_any(filter->str, filter->len, key,
+					&items[i], 1, NULL));
+
+	cstr_free(ref, true);
+	cstr_free(filter, true);
+	free(items);
+	parr_free(undo, true);
+	bp_block_free(&block);
+}
+
+static void test_references(void)
+{
+	/* the SipHash paper's first vector: empty message */
+	unsigned char sip_key[16];
+	unsigned int i;
+	for (i = 0; i < sizeof(sip_key); i++)
+		sip_key[i] = i;
+	assert(ref_siphash(sip_key, (const unsigned char *) "", 0) ==
+	       0x726fdb47dd0e0e31ULL);
+
+	/* mainnet block 120383, in a "block" message */
+	char *fn = test_filename("data/blk120383.ser");
+	int fd = file_seq_open(fn);
+	assert(fd >= 0);
+	free(fn);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	assert(fread_message(fd, &msg, &read_ok) && read_ok);
+	close(fd);
+	test_reference(msg.data, msg.hdr.data_len);
+	free(msg.data);
+
+	/* testnet block 35133, raw */
+	void *data = NULL;
+	size_t data_len = 0;
+	fn = test_filename("data/tn_blk35133.ser");
+	assert(bu_read_file(fn, &data, &data_len, 1 << 20));
+	free(fn);
+	test_reference(data, data_len);
+	free(data);
+}
+
+static void make_items(struct const_buffer *items, unsigned char *data,
+		       unsigned int n, unsigned int item_len)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		unsigned char *p = data + (size_t) i * item_len;
+		unsigned int j;
+		for (j = 0; j < item_len; j++)
+			p[j] = rand();
+		items[i].p = p;
+		items[i].len = item_len;
+	}
+}
+
+static void test_gcs(void)
+{
+	const unsigned int n = 2000;
+	struct const_buffer *items = malloc(2 * n * sizeof(*items));
+	unsigned char *data = malloc(2 * n * 25);
+	unsigned char key[16];
+	unsigned int i, n_fp = 0;
+
+	srand(158);
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = rand();
+	make_items(items, data, 2 * n, 25);
+
+	/* duplicates count once */
+	items[1] = items[0];
+	cstring *filter = bp_gcs_build(key, items, n);
+	struct const_buffer buf = { filter->str, filter->len };
+	uint32_t n_filter;
+	assert(deser_varlen(&n_filter, &buf) && (n_filter == n - 1));
+
+	/* about P + 1.5 bits an item */
+	assert(filter->len * 8 < n * (BP_BASIC_FILTER_P + 3));
+
+	for (i = 0; i < n; i++)
+		assert(bp_gcs_match_any(filter->str, filter->len, key,
+					&items[i], 1, NULL));
+	for (i = n; i < 2 * n; i++)
+		n_fp += bp_gcs_match_any(filter->str, filter->len, key,
+					 &items[i], 1, NULL);
+	assert(n_fp < 3);
+
+	/* any of several, found wherever it sorts */
+	assert(!bp_gcs_match_any(filter->str, filter->len, key,
+				 &items[n], n - 2, NULL) || n_fp);
+	assert(bp_gcs_match_any(filter->str, filter->len, key,
+				&items[n / 2], n, NULL));
+	assert(!bp_gcs_match_any(filter->str, filter->len, key, items, 0,
+				 NULL));
+
+	/* a damaged filter ends the walk, without reading past it */
+	assert(!bp_gcs_match_any(filter->str, 2, key, &items[n - 1], 1,
+				 NULL));
+
+	cstr_free(filter, true);
+
+	filter = bp_gcs_build(key, NULL, 0);
+	assert((filter->len == 1) && (filter->str[0] == 0));
+	assert(!bp_gcs_match_any(filter->str, filter->len, key, items, 1,
+				 NULL));
+	cstr_free(filter, true);
+
+	free(data);
+	free(items);
+}
+
+static void read_blocks(parr *blocks, const char *ser_fn_base)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	int fd = file_seq_open(ser_fn);
+	assert(fd >= 0);
+	free(ser_fn);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	while (fread_block(fd, &msg, &read_ok)) {
+		struct bp_block *block = calloc(1, sizeof(*block));
+		bp_block_init(block);
+		struct const_buffer buf = { msg.data, msg.hdr.data_len };
+		assert(deser_bp_block(block, &buf));
+		bp_block_calc_sha256(block);
+		parr_add(blocks, block);
+	}
+	assert(read_ok);
+	close(fd);
+	free(msg.data);
+}
+
+static void check_index(const struct bp_filterindex *idx,
+			const struct bp_filterindex *ref, unsigned int n)
+{
+	unsigned int i;
+
+	assert(idx->best_height == (int) n - 1);
+	for (i = 0; i < n; i++) {
+		struct bp_filterindex_ent a, b;
+		cstring *fa, *fb;
+
+		assert(bp_filterindex_get(idx, i, &a, &fa));
+		assert(bp_filterindex_get(ref, i, &b, NULL));
+		assert(bu256_equal(&a.block_hash, &b.block_hash));
+		assert(bu256_equal(&a.header, &b.header));
+		assert(bp_filterindex_get(ref, i, NULL, &fb));
+		assert(cstr_equal(fa, fb));
+		cstr_free(fa, true);
+		cstr_free(fb, true);
+	}
+	assert(!bp_filterindex_get(idx, n, NULL, NULL));
+}
+
+static void test_index(void)
+{
+	parr *blocks = parr_new(0, NULL);
+	read_blocks(blocks, "data/blks10.ser");
+	unsigned int i, n = blocks->len;
+	assert(n >= 3);
+
+	/* the first blocks spend nothing: their undo data is empty */
+	parr *undo = parr_new(0, bp_utxo_undo_freep);
+
+	struct bp_filterindex mem, idx;
+	assert(bp_filterindex_open(&mem, NULL));
+	unlink(idx_fn);
+	assert(bp_filterindex_open(&idx, idx_fn));
+	assert(idx.best_height == -1);
+
+	assert(!bp_filterindex_connect(&idx, parr_idx(blocks, 1), 1, undo));
+	for (i = 0; i < n; i++) {
+		assert(bp_filterindex_connect(&mem, parr_idx(blocks, i), i,
+					      undo));
+		assert(bp_filterindex_connect(&idx, parr_idx(blocks, i), i,
+					      undo));
+	}
+	assert(!bp_filterindex_connect(&idx, parr_idx(blocks, 5), n, undo));
+	check_index(&idx, &mem, n);
+
+	/* each block's coinbase script is found in its own filter only */
+	struct bp_block *b5 = parr_idx(blocks, 5);
+	struct bp_tx *cb = parr_idx(b5->vtx, 0);
+	struct bp_txout *txout = parr_idx(cb->vout, 0);
+	struct const_buffer item = { txout->scriptPubKey->str,
+				     txout->scriptPubKey->len };
+	bool match[n];
+	assert(bp_filterindex_match(&idx, 0, n, &item, 1, match));
+	for (i = 0; i < n; i++)
+		assert(match[i] == (i == 5));
+	assert(bp_filterindex_match(&mem, 3, 3, &item, 1, match));
+	assert(!match[0] && !match[1] && match[2]);
+	assert(!bp_filterindex_match(&idx, n - 2, 3, &item, 1, match));
+
+	/* reopened */
+	bp_filterindex_close(&idx);
+	assert(bp_filterindex_open(&idx, idx_fn));
+	check_index(&idx, &mem, n);
+
+	/* only the best block comes off; then it comes back */
+	assert(!bp_filterindex_disconnect(&idx, parr_idx(blocks, n - 2)));
+	assert(bp_filterindex_disconnect(&idx, parr_idx(blocks, n - 1)));
+	assert(bp_filterindex_disconnect(&mem, parr_idx(blocks, n - 1)));
+	check_index(&idx, &mem, n - 1);
+	bp_filterindex_close(&idx);
+	assert(bp_filterindex_open(&idx, idx_fn));
+	check_index(&idx, &mem, n - 1);
+	assert(bp_filterindex_connect(&idx, parr_idx(blocks, n - 1), n - 1,
+				      undo));
+	assert(bp_filterindex_connect(&mem, parr_idx(blocks, n - 1), n - 1,
+				      undo));
+	bp_filterindex_close(&idx);
+
+	/* a torn last record is cut off */
+	struct stat st;
+	assert(stat(idx_fn, &st) == 0);
+	assert(truncate(idx_fn, st.st_size - 3) == 0);
+	assert(bp_filterindex_open(&idx, idx_fn));
+	check_index(&idx, &mem, n - 1);
+	assert(bp_filterindex_connect(&idx, parr_idx(blocks, n - 1), n - 1,
+				      undo));
+	check_index(&idx, &mem, n);
+	bp_filterindex_close(&idx);
+
+	/* as is a damaged one */
+	int fd = open(idx_fn, O_WRONLY);
+	assert(fd >= 0);
+	assert(pwrite(fd, "x", 1, st.st_size - 10) == 1);
+	close(fd);
+	assert(bp_filterindex_open(&idx, idx_fn));
+	check_index(&idx, &mem, n - 1);
+	bp_filterindex_close(&idx);
+
+	/* not an index */
+	assert(bu_write_file(idx_fn, "ccaddrix\1\0\0\0", 12));
+	assert(!bp_filterindex_open(&idx, idx_fn));
+
+	unlink(idx_fn);
+	bp_filterindex_close(&mem);
+	parr_free(undo, true);
+	for (i = 0; i < n; i++) {
+		bp_block_free(parr_idx(blocks, i));
+		free(parr_idx(blocks, i));
+	}
+	parr_free(blocks, true);
+}
+
+/*
+ * Filter build time for a real block, with made-up undo data, and
+ * match throughput over filters of mainnet size.
+ */
+static void bench_build(void)
+{
+	char *ser_fn = test_filename("data/blk120383.ser");
+	int fd = file_seq_open(ser_fn);
+	assert(fd >= 0);
+	free(ser_fn);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	assert(fread_message(fd, &msg, &read_ok) && read_ok);
+	close(fd);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	assert(deser_bp_block(&block, &buf));
+	bp_block_calc_sha256(&block);
+
+	/* each input spent a P2PKH output */
+	parr *undo = parr_new(0, bp_utxo_undo_freep);
+	unsigned int i, j, n_rounds = 200;
+	for (i = 1; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			struct bp_utxo_undo *u = calloc(1, sizeof(*u));
+			bp_utxo_undo_init(u);
+			bp_outpt_copy(&u->prevout, &txin->prevout);
+			cstring *hash = cstr_new_buf(&txin->prevout.hash, 20);
+			u->txout.scriptPubKey = bsp_make_pubkeyhash(hash);
+			cstr_free(hash, true);
+			parr_add(undo, u);
+		}
+	}
+
+	double t0 = now_ms();
+	size_t filter_len = 0;
+	for (i = 0; i < n_rounds; i++) {
+		cstring *filter = bp_block_filter_basic(&block, undo);
+		filter_len = filter->len;
+		cstr_free(filter, true);
+	}
+	double t1 = now_ms();
+
+	fprintf(stderr, "blockfilter: block of %zu txs, %zu spends: "
+		"%zu byte filter, built in %.3f ms\n",
+		block.vtx->len, undo->len, filter_len, (t1 - t0) / n_rounds);
+
+	parr_free(undo, true);
+	bp_block_free(&block);
+	free(msg.data);
+}
+
+static void bench_match(void)
+{
+	const unsigned int n_filters = 1000, n_per = 5000, n_query = 100;
+	struct const_buffer *items = malloc(n_per * sizeof(*items));
+	unsigned char *data = malloc(n_per * 25);
+	struct const_buffer *query = malloc(n_query * sizeof(*query));
+	unsigned char *qdata = malloc(n_query * 25);
+	struct bp_block_filter_ref *refs = calloc(n_filters, sizeof(*refs));
+	bu256_t *hashes = calloc(n_filters, sizeof(bu256_t));
+	cstring **filters = calloc(n_filters, sizeof(cstring *));
+	bool *match = calloc(n_filters, sizeof(bool));
+	unsigned int i, n_match = 0;
+	size_t total_len = 0;
+
+	srand(5000);
+	make_items(query, qdata, n_query, 25);
+	for (i = 0; i < n_filters; i++) {
+		make_items(items, data, n_per, 25);
+		if (i % 100 == 0)
+			items[i % n_per] = query[i % n_query];
+		hashes[i].dword[0] = i;
+		hashes[i].dword[1] = rand();
+		filters[i] = bp_gcs_build((unsigned char *) &hashes[i], items,
+					  n_per);
+		refs[i].block_hash = &hashes[i];
+		refs[i].filter = filters[i]->str;
+		refs[i].filter_len = filters[i]->len;
+		total_len += filters[i]->len;
+	}
+
+	unsigned int threads = bp_parallel_threads();
+	bp_parallel_set_threads(1);
+	double t0 = now_ms();
+	assert(bp_block_filter_match_batch(refs, n_filters, query, n_query,
+					   match));
+	double t1 = now_ms();
+	for (i = 0; i < n_filters; i++)
+		n_match += match[i];
+
+	bp_parallel_set_threads(0);
+	memset(match, 0, n_filters * sizeof(bool));
+	double t2 = now_ms();
+	assert(bp_block_filter_match_batch(refs, n_filters, query, n_query,
+					   match));
+	double t3 = now_ms();
+	for (i = 0; i < n_filters; i++) {
+		if (i % 100 == 0)
+			assert(match[i]);
+		n_match -= match[i];
+	}
+	assert(n_match == 0);
+	bp_parallel_set_threads(threads);
+
+	fprintf(stderr, "blockfilter: %u filters of %u items (%.1f KB avg), "
+		"%u queries: %.1f us/filter serial, %.1f us/filter with "
+		"%u threads\n",
+		n_filters, n_per, total_len / 1024.0 / n_filters, n_query,
+		(t1 - t0) * 1000.0 / n_filters,
+		(t3 - t2) * 1000.0 / n_filters, bp_parallel_threads());
+
+	for (i = 0; i < n_filters; i++)
+		cstr_free(filters[i], true);
+	free(match);
+	free(filters);
+	free(hashes);
+	free(refs);
+	free(qdata);
+	free(query);
+	free(data);
+	free(items);
+}
+
+int main(int argc, char *argv[])
+{
+	test_vector();
+	test_references();
+	test_gcs();
+	test_index();
+	if (test_bench(argc, argv)) {
+		bench_build();
+		bench_match();
+	}
+	bp_parallel_shutdown();
+	return 0;
+}
@@ -4,10 +4,16 @@
  */
 #include "picocoin-config.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdio.h>
 #include <ccoin/crypto/sha2.h>
 #include <ccoin/bloom.h>
+#include <ccoin/core.h>
+#include <ccoin/hexcode.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
 #include "libtest.h"
 
 static const char *data1 = "foo";
@@ -54,9 +60,341 @@ static void runtest (void)
 	cstr_free(ser, true);
 }
 
+/* BIP 37 hash function nHashNum, one byte at a time */
+static unsigned int ref_hash(uint32_t nTweak, unsigned int n_bits,
+			     unsigned int nHashNum,
+			     const unsigned char *p, size_t len)
+{
+	uint32_t h1 = (nHashNum * 0xFBA4C795U) + nTweak;
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32_t k1 = p[i] | (p[i+1] << 8) | (p[i+2] << 16) |
+			      ((uint32_t) p[i+3] << 24);
+		k1 *= 0xcc9e2d51;
+		k1 = (k1 << 15) | (k1 >> 17);
+		k1 *= 0x1b873593;
+		h1 ^= k1;
+		h1 = (h1 << 13) | (h1 >> 19);
+		h1 = h1*5+0xe6546b64;
+	}
+
+	uint32_t k1 = 0;
+	switch (len & 3) {
+	case 3: k1 ^= p[i+2] << 16;	/* fall through */
+	case 2: k1 ^= p[i+1] << 8;	/* fall through */
+	case 1: k1 ^= p[i];
+		k1 *= 0xcc9e2d51;
+		k1 = (k1 << 15) | (k1 >> 17);
+		k1 *= 0x1b873593;
+		h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h1 ^= h1 >> 16;
+	h1 *= 0x85ebca6b;
+	h1 ^= h1 >> 13;
+	h1 *= 0xc2b2ae35;
+	h1 ^= h1 >> 16;
+
+	return h1 % n_bits;
+}
+
+/* filters built by bloom_insert() are bit-for-bit BIP 37's */
+static void test_bip37_bits(void)
+{
+	static const unsigned int ks[] = { 2, 3, 8, 9, 17, 50 };
+	unsigned char data[64];
+	unsigned int i, j, len;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (i * 37) ^ 0x5a;
+
+	for (i = 0; i < ARRAY_SIZE(ks); i++) {
+		struct bloom bf;
+		assert(bloom_init(&bf, 200, 0.01) == true);
+		bf.nHashFuncs = ks[i];
+		bf.nTweak = i * 0x9e3779b9U;
+
+		unsigned int n_bits = bf.vData->len * 8;
+		unsigned char *ref = calloc(1, bf.vData->len);
+
+		for (len = 0; len < sizeof(data); len++) {
+			bloom_insert(&bf, data + (len % 3), len);
+			for (j = 0; j < ks[i]; j++) {
+				unsigned int idx = ref_hash(bf.nTweak, n_bits, j,
+							    data + (len % 3),
+							    len);
+				ref[idx >> 3] |= 1 << (idx & 7);
+			}
+			assert(bloom_contains(&bf, data + (len % 3), len));
+		}
+
+		assert(!memcmp(bf.vData->str, ref, bf.vData->len));
+
+		free(ref);
+		bloom_free(&bf);
+	}
+}
+
+/* filters of the BIP 37 reference implementation, as serialized */
+static void check_vector(uint32_t nTweak, const char *hexser)
+{
+	static const char *items[] = {
+		"99108ad8ed9bb6274d3980bab5a85c048f0950c8",
+		"b5a2c786d9ef4658287ced5914b37a1b4aa32eee",
+		"b9300670b4c5366e95b2699e8b18bc75e5f729c5",
+	};
+	struct bloom bf;
+	unsigned int i;
+
+	assert(bloom_init(&bf, 3, 0.01) == true);
+	bf.nTweak = nTweak;
+	bf.nFlags = BLOOM_UPDATE_ALL;
+
+	for (i = 0; i < ARRAY_SIZE(items); i++) {
+		cstring *v = hex2str(items[i]);
+		bloom_insert(&bf, v->str, v->len);
+		assert(bloom_contains(&bf, v->str, v->len));
+		cstr_free(v, true);
+	}
+
+	cstring *v = hex2str("19108ad8ed9bb6274d3980bab5a85c048f0950c8");
+	assert(!bloom_contains(&bf, v->str, v->len));
+	cstr_free(v, true);
+
+	cstring *ser = cstr_new(NULL);
+	ser_bloom(ser, &bf);
+	cstring *expect = hex2str(hexser);
+	assert(ser->len == expect->len);
+	assert(!memcmp(ser->str, expect->str, expect->len));
+
+	struct bloom bf2;
+	__bloom_init(&bf2);
+	struct const_buffer buf = { ser->str, ser->len };
+	assert(deser_bloom(&bf2, &buf) && (buf.len == 0));
+	assert((bf2.nTweak == nTweak) && (bf2.nFlags == BLOOM_UPDATE_ALL));
+
+	bloom_free(&bf2);
+	cstr_free(expect, true);
+	cstr_free(ser, true);
+	bloom_free(&bf);
+}
+
+static void make_tx(struct bp_tx *tx, const struct bp_outpt *prevout,
+		    const bu160_t *pkhash)
+{
+	bp_tx_init(tx);
+	tx->vin = parr_new(1, bp_txin_freep);
+	tx->vout = parr_new(1, bp_txout_freep);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	bp_outpt_copy(&txin->prevout, prevout);
+	txin->scriptSig = cstr_new_sz(8);
+	bsp_push_data(txin->scriptSig, "sig", 3);
+	parr_add(tx->vin, txin);
+
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = 5000;
+	cstring hash = { (char *) pkhash, sizeof(*pkhash), sizeof(*pkhash) };
+	txout->scriptPubKey = bsp_make_pubkeyhash(&hash);
+	parr_add(tx->vout, txout);
+
+	bp_tx_calc_sha256(tx);
+}
+
+/* paid by a key hash in the filter; spends of it match when updated */
+static void check_tx_match(enum bloom_flags flags)
+{
+	struct bp_tx pay, spend, other;
+	struct bp_outpt outpt;
+	bu160_t mine, theirs;
+	struct bloom bf;
+
+	memset(&mine, 0x11, sizeof(mine));
+	memset(&theirs, 0x22, sizeof(theirs));
+	bu256_set_u64(&outpt.hash, 7);
+	outpt.n = 1;
+
+	make_tx(&pay, &outpt, &mine);
+	bu256_copy(&outpt.hash, &pay.sha256);
+	outpt.n = 0;
+	make_tx(&spend, &outpt, &theirs);
+	make_tx(&other, &outpt, &theirs);
+	other.nLockTime = 1;
+	bp_tx_calc_sha256(&other);
+
+	assert(bloom_init(&bf, 10, 0.000001) == true);
+	bf.nTweak = 5;
+	bf.nFlags = flags;
+	bloom_insert(&bf, &mine, sizeof(mine));
+
+	assert(bloom_tx_match(&bf, &pay));
+	assert(bloom_tx_match(&bf, &spend) == (flags == BLOOM_UPDATE_ALL));
+
+	/* by txid alone */
+	assert(bloom_tx_match(&bf, &other) == (flags == BLOOM_UPDATE_ALL));
+	bloom_free(&bf);
+	assert(bloom_init(&bf, 10, 0.000001) == true);
+	bloom_insert(&bf, &other.sha256, sizeof(other.sha256));
+	assert(bloom_tx_match(&bf, &other));
+	assert(!bloom_tx_match(&bf, &pay));
+
+	bloom_free(&bf);
+	bp_tx_free(&pay);
+	bp_tx_free(&spend);
+	bp_tx_free(&other);
+}
+
+static void item(unsigned char *md, unsigned int n)
+{
+	sha256_Raw((unsigned char *) &n, sizeof(n), md);
+}
+
+static void test_local(bool blocked)
+{
+	const unsigned int n = 10000, n_probe = 100000;
+	const double fp_rate = 0.001;
+	struct bloom_local bf;
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	unsigned int i, n_fp = 0;
+
+	assert(bloom_local_init(&bf, n, fp_rate, blocked));
+	assert((((uintptr_t) bf.bits) & 63) == 0);
+
+	for (i = 0; i < n; i++) {
+		item(md, i);
+		bloom_local_insert(&bf, md, sizeof(md));
+	}
+	for (i = 0; i < n; i++) {
+		item(md, i);
+		assert(bloom_local_contains(&bf, md, sizeof(md)));
+	}
+	for (i = n; i < n + n_probe; i++) {
+		item(md, i);
+		if (bloom_local_contains(&bf, md, sizeof(md)))
+			n_fp++;
+	}
+	assert(n_fp < (n_probe * fp_rate * 2));
+
+	/* batches agree with single items, and fill filters alike */
+	unsigned char (*mds)[SHA256_DIGEST_LENGTH] = calloc(2 * n, sizeof(md));
+	struct const_buffer *items = calloc(2 * n, sizeof(*items));
+	bool *match = calloc(2 * n, sizeof(bool));
+	for (i = 0; i < 2 * n; i++) {
+		item(mds[i], i);
+		items[i].p = mds[i];
+		items[i].len = sizeof(md);
+	}
+
+	unsigned int n_match = bloom_local_contains_batch(&bf, items, 2 * n,
+							  match);
+	for (i = 0; i < 2 * n; i++)
+		assert(match[i] ==
+		       bloom_local_contains(&bf, mds[i], sizeof(md)));
+	assert(n_match >= n);
+
+	struct bloom_local bf2;
+	assert(bloom_local_init(&bf2, n, fp_rate, blocked));
+	bloom_local_insert_batch(&bf2, items, n);
+	assert(!memcmp(bf.bits, bf2.bits, bf.n_bits / 8));
+	bloom_local_free(&bf2);
+
+	free(match);
+	free(items);
+	free(mds);
+	bloom_local_free(&bf);
+}
+
+/* lookups in a 1M-item filter: BIP 37, and local flat and blocked */
+static void bench_contains(void)
+{
+	const unsigned int n = 1000000, n_probe = 1000000;
+	unsigned char (*mds)[20] = calloc(n_probe, 20);
+	struct const_buffer *items = calloc(n_probe, sizeof(*items));
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	unsigned int i, n_match = 0;
+
+	for (i = 0; i < n_probe; i++) {
+		item(md, i * 2);	/* half are members */
+		memcpy(mds[i], md, 20);
+		items[i].p = mds[i];
+		items[i].len = 20;
+	}
+
+	struct bloom bf;
+	bf.vData = cstr_new_sz(MAX_BLOOM_FILTER_SIZE);
+	cstr_resize(bf.vData, MAX_BLOOM_FILTER_SIZE);
+	memset(bf.vData->str, 0, MAX_BLOOM_FILTER_SIZE);
+	bf.nHashFuncs = 11;
+	for (i = 0; i < n_probe; i += 2)
+		bloom_insert(&bf, mds[i], 20);
+
+	unsigned int n_bits = bf.vData->len * 8;
+	double t0 = now_ms();
+	for (i = 0; i < n_probe; i++) {
+		unsigned int j;
+		for (j = 0; j < bf.nHashFuncs; j++) {
+			unsigned int idx = ref_hash(bf.nHashFuncs, n_bits, j,
+						    mds[i], 20);
+			if (!(bf.vData->str[idx >> 3] & (1 << (idx & 7))))
+				break;
+		}
+		n_match += (j == bf.nHashFuncs);
+	}
+	double t1 = now_ms();
+	for (i = 0; i < n_probe; i++)
+		n_match += bloom_contains(&bf, mds[i], 20);
+	double t2 = now_ms();
+	bloom_free(&bf);
+
+	fprintf(stderr, "bloom: %u BIP37 lookups: hash by hash %.1f ms, "
+		"lanes %.1f ms\n", n_probe, t1 - t0, t2 - t1);
+
+	for (i = 0; i < 2; i++) {
+		struct bloom_local lbf;
+		bool blocked = (i == 1);
+		unsigned int j;
+
+		assert(bloom_local_init(&lbf, n, 0.001, blocked));
+		for (j = 0; j < n; j++) {
+			item(md, j * 2);
+			bloom_local_insert(&lbf, md, 20);
+		}
+
+		t0 = now_ms();
+		for (j = 0; j < n_probe; j++)
+			n_match += bloom_local_contains(&lbf, mds[j], 20);
+		t1 = now_ms();
+		n_match += bloom_local_contains_batch(&lbf, items, n_probe,
+						      NULL);
+		t2 = now_ms();
+
+		fprintf(stderr, "bloom: %u local %s lookups, %u items: "
+			"single %.1f ms, batch %.1f ms\n", n_probe,
+			blocked ? "blocked" : "flat", n, t1 - t0, t2 - t1);
+		bloom_local_free(&lbf);
+	}
+
+	assert(n_match > 0);
+	free(items);
+	free(mds);
+}
+
 int main (int argc, char *argv[])
 {
 	runtest();
+	test_bip37_bits();
+	check_vector(0, "03614e9b050000000000000001");
+	check_vector(2147483649U, "03ce4299050000000100008001");
+	check_tx_match(BLOOM_UPDATE_ALL);
+	check_tx_match(BLOOM_UPDATE_NONE);
+	test_local(false);
+	test_local(true);
+	if (test_bench(argc, argv))
+		bench_contains();
 
 	return 0;
 }
@@ -0,0 +1,298 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/bucketfile.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static const char *fn = "bucketfile.out";
+static const char *log_fn = "bucketfile.out.log";
+static const char magic[8] = "cctestbf";
+
+/* records: a 32-byte key and a u64; a zero key commits a block, its
+ * u64 holding the block's record count
+ */
+enum {
+	TEST_VERSION	= 1,
+	TEST_HDR_SZ	= BP_BUCKETFILE_HDR_SZ + 8,
+	TEST_ENT_SZ	= 32 + 8,
+};
+
+struct test_replay {
+	unsigned int	n_pending;
+	unsigned int	n_committed;
+};
+
+static void test_rec(unsigned char *rec, unsigned char k0, unsigned char k1,
+		     unsigned char k2, uint64_t v)
+{
+	memset(rec, 0, TEST_ENT_SZ);
+	rec[0] = k0;
+	rec[1] = k1;
+	rec[2] = k2;
+	memcpy(rec + 32, &v, sizeof(v));
+}
+
+static int test_replay_rec(void *priv, const unsigned char *rec)
+{
+	static const unsigned char zero[32];
+	struct test_replay *r = priv;
+	uint64_t v;
+
+	if (memcmp(rec, zero, sizeof(zero))) {
+		r->n_pending++;
+		return 0;
+	}
+
+	memcpy(&v, rec + 32, sizeof(v));
+	if (v != r->n_pending)
+		return -1;
+
+	r->n_committed += r->n_pending;
+	r->n_pending = 0;
+	return 1;
+}
+
+static void open_file(struct bp_bucketfile *bf, bool read_only,
+		      struct test_replay *r)
+{
+	memset(r, 0, sizeof(*r));
+	bp_bucketfile_init(bf, magic, TEST_VERSION, TEST_HDR_SZ, TEST_ENT_SZ);
+	assert(bp_bucketfile_open(bf, fn, read_only));
+	assert(bp_bucketfile_replay_log(bf, test_replay_rec, r));
+}
+
+/* a block of n records, with its commit record */
+static void append_block(struct bp_bucketfile *bf, unsigned char tag,
+			 unsigned int n)
+{
+	unsigned char s[(n + 1) * TEST_ENT_SZ];
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		test_rec(s + (i * TEST_ENT_SZ), tag, i, 0, i);
+	test_rec(s + (n * TEST_ENT_SZ), 0, 0, 0, n);
+
+	assert(bp_bucketfile_log_append(bf, s, sizeof(s)));
+}
+
+static off_t file_size(const char *path)
+{
+	struct stat st;
+	assert(stat(path, &st) == 0);
+	return st.st_size;
+}
+
+static void test_log(void)
+{
+	struct bp_bucketfile bf;
+	struct test_replay r;
+
+	unlink(fn);
+	unlink(log_fn);
+
+	/* memory only: nothing on disk, and nothing to replay */
+	bp_bucketfile_init(&bf, magic, TEST_VERSION, TEST_HDR_SZ, TEST_ENT_SZ);
+	assert(bp_bucketfile_open(&bf, NULL, false));
+	assert(bp_bucketfile_replay_log(&bf, test_replay_rec, &r));
+	assert(bp_bucketfile_log_append(&bf, "x", 1));
+	assert(bp_bucketfile_lower_bound(&bf, magic, 8) == 0);
+	bp_bucketfile_close(&bf);
+
+	/* no FILE yet; a read-only open needs no log either */
+	open_file(&bf, true, &r);
+	struct const_buffer hdr;
+	assert(!bp_bucketfile_hdr(&bf, &hdr));
+	assert(bf.log_fd < 0);
+	bp_bucketfile_close(&bf);
+
+	open_file(&bf, false, &r);
+	append_block(&bf, 1, 3);
+	append_block(&bf, 2, 5);
+	bp_bucketfile_close(&bf);
+
+	open_file(&bf, false, &r);
+	assert(r.n_committed == 8);
+	assert(r.n_pending == 0);
+
+	/* a block with no commit record, then half a record */
+	unsigned char s[2 * TEST_ENT_SZ + 7];
+	test_rec(s, 3, 0, 0, 0);
+	test_rec(s + TEST_ENT_SZ, 3, 1, 0, 1);
+	assert(bp_bucketfile_log_append(&bf, s, sizeof(s)));
+	bp_bucketfile_close(&bf);
+
+	off_t log_len = file_size(log_fn);
+	off_t commit_len = log_len - sizeof(s);
+
+	/* read-only opens skip it, writable ones cut it off */
+	open_file(&bf, true, &r);
+	assert(r.n_committed == 8);
+	bp_bucketfile_close(&bf);
+	assert(file_size(log_fn) == log_len);
+
+	open_file(&bf, false, &r);
+	assert(r.n_committed == 8);
+	assert(r.n_pending == 2);
+	bp_bucketfile_close(&bf);
+	assert(file_size(log_fn) == commit_len);
+
+	/* a commit not matching its block ends the log there */
+	open_file(&bf, false, &r);
+	test_rec(s, 4, 0, 0, 0);
+	test_rec(s + TEST_ENT_SZ, 0, 0, 0, 2);
+	assert(bp_bucketfile_log_append(&bf, s, 2 * TEST_ENT_SZ));
+	append_block(&bf, 5, 1);
+	bp_bucketfile_close(&bf);
+
+	open_file(&bf, false, &r);
+	assert(r.n_committed == 8);
+	bp_bucketfile_close(&bf);
+	assert(file_size(log_fn) == commit_len);
+}
+
+static void test_compact(void)
+{
+	struct bp_bucketfile bf;
+	struct bp_bucketfile_writer w;
+	struct test_replay r;
+	unsigned char rec[TEST_ENT_SZ];
+	unsigned int i;
+
+	open_file(&bf, false, &r);
+	assert(r.n_committed == 8);
+
+	/* keys sharing a bucket, and buckets left empty between them */
+	static const unsigned char keys[][3] = {
+		{ 0x00, 0x01, 0x00 },
+		{ 0x00, 0x01, 0x07 },
+		{ 0x00, 0x01, 0x09 },
+		{ 0x12, 0x34, 0x00 },
+		{ 0xff, 0xff, 0x01 },
+		{ 0xff, 0xff, 0x02 },
+	};
+	const unsigned int n_keys = ARRAY_SIZE(keys);
+
+	assert(bp_bucketfile_write_begin(&bf, &w));
+	for (i = 0; i < n_keys; i++) {
+		test_rec(rec, keys[i][0], keys[i][1], keys[i][2], i);
+		bp_bucketfile_write_put(&w, rec);
+	}
+
+	cstring *hdr = cstr_new_sz(8);
+	ser_u64(hdr, 0x1122334455667788ULL);
+	assert(bp_bucketfile_write_end(&w, hdr));
+	assert(bp_bucketfile_reload(&bf));
+	assert(file_size(log_fn) == 0);
+	bp_bucketfile_close(&bf);
+
+	open_file(&bf, true, &r);
+	assert(r.n_committed == 0);
+	assert(bf.n_base == n_keys);
+
+	struct const_buffer buf;
+	uint64_t v;
+	assert(bp_bucketfile_hdr(&bf, &buf));
+	assert(deser_u64(&v, &buf) && (v == 0x1122334455667788ULL));
+	assert(buf.len == 0);
+
+	for (i = 0; i < n_keys; i++) {
+		test_rec(rec, keys[i][0], keys[i][1], keys[i][2], 0);
+		assert(bp_bucketfile_lower_bound(&bf, rec, 32) == i);
+		assert(!memcmp(bp_bucketfile_ent(&bf, i), rec, 32));
+	}
+
+	/* missing keys: where they would go */
+	test_rec(rec, 0x00, 0x01, 0x08, 0);
+	assert(bp_bucketfile_lower_bound(&bf, rec, 32) == 2);
+	test_rec(rec, 0x00, 0x01, 0x0a, 0);
+	assert(bp_bucketfile_lower_bound(&bf, rec, 32) == 3);
+	test_rec(rec, 0x55, 0x00, 0x00, 0);
+	assert(bp_bucketfile_lower_bound(&bf, rec, 32) == 4);
+	test_rec(rec, 0xff, 0xff, 0x03, 0);
+	assert(bp_bucketfile_lower_bound(&bf, rec, 32) == n_keys);
+	bp_bucketfile_close(&bf);
+
+	/* a header of the wrong size is refused, keeping the old FILE */
+	off_t len = file_size(fn);
+	open_file(&bf, false, &r);
+	assert(bp_bucketfile_write_begin(&bf, &w));
+	bp_bucketfile_write_put(&w, rec);
+	cstr_resize(hdr, 4);
+	assert(!bp_bucketfile_write_end(&w, hdr));
+	bp_bucketfile_close(&bf);
+	assert(file_size(fn) == len);
+
+	cstr_free(hdr, true);
+}
+
+/* damage FILE at ofs, and expect it refused */
+static void test_damaged(size_t ofs, unsigned char val, bool truncate)
+{
+	void *data = NULL;
+	size_t data_len = 0;
+	assert(bu_read_file(fn, &data, &data_len, 1024 * 1024));
+
+	unsigned char *p = data;
+	unsigned char old = p[ofs];
+	p[ofs] = val;
+	assert(bu_write_file(fn, data, truncate ? ofs : data_len));
+
+	struct bp_bucketfile bf;
+	bp_bucketfile_init(&bf, magic, TEST_VERSION, TEST_HDR_SZ, TEST_ENT_SZ);
+	assert(!bp_bucketfile_open(&bf, fn, true));
+	assert(bf.map == NULL);
+	bp_bucketfile_close(&bf);
+
+	p[ofs] = old;
+	assert(bu_write_file(fn, data, data_len));
+	free(data);
+}
+
+static void test_corrupt(void)
+{
+	const size_t tab = TEST_HDR_SZ;
+	const size_t ents = TEST_HDR_SZ + BP_BUCKETFILE_TAB_SZ;
+
+	test_damaged(0, 'x', false);			/* magic */
+	test_damaged(8, TEST_VERSION + 1, false);	/* version */
+	test_damaged(16, 7, false);			/* record count */
+	test_damaged(tab + (0x1234 * 8), 0x40, false);	/* bucket order */
+	test_damaged(tab + 7, 0x01, false);		/* first bucket */
+	test_damaged(ents + TEST_ENT_SZ, 0, true);	/* short records */
+	test_damaged(ents - 1, 0, true);		/* short table */
+
+	/* not a bucketfile at all: refuse, rather than map garbage */
+	unsigned char junk[TEST_HDR_SZ + BP_BUCKETFILE_TAB_SZ];
+	memset(junk, 0, sizeof(junk));
+	assert(bu_write_file(fn, junk, sizeof(junk)));
+
+	struct bp_bucketfile bf;
+	bp_bucketfile_init(&bf, magic, TEST_VERSION, TEST_HDR_SZ, TEST_ENT_SZ);
+	assert(!bp_bucketfile_open(&bf, fn, false));
+	bp_bucketfile_close(&bf);
+	assert(!bp_bucketfile_open(&bf, fn, true));
+	bp_bucketfile_close(&bf);
+}
+
+int main (int argc, char *argv[])
+{
+	test_log();
+	test_compact();
+	test_corrupt();
+
+	unlink(fn);
+	unlink(log_fn);
+	return 0;
+}
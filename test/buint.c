@@ -0,0 +1,99 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <ccoin/buint.h>
+#include "libtest.h"
+
+static void check_compact(uint32_t compact, bool valid, const char *hexstr)
+{
+	bu256_t target, expected;
+
+	bool rc = bu256_set_compact(&target, compact);
+	assert(rc == valid);
+
+	if (hexstr) {
+		rc = hex_bu256(&expected, hexstr);
+		assert(rc);
+		assert(bu256_equal(&target, &expected));
+	}
+}
+
+static void test_compact(void)
+{
+	check_compact(0x1d00ffff, true,
+	"00000000ffff0000000000000000000000000000000000000000000000000000");
+	check_compact(0x1b0404cb, true,
+	"00000000000404cb000000000000000000000000000000000000000000000000");
+	check_compact(0x05009234, true,
+	"0000000000000000000000000000000000000000000000000000000092340000");
+	check_compact(0x02123456, true,
+	"0000000000000000000000000000000000000000000000000000000000001234");
+	check_compact(0x01003456, true,
+	"0000000000000000000000000000000000000000000000000000000000000000");
+	check_compact(0x04923456, false, NULL);		/* negative */
+	check_compact(0xff123456, false, NULL);		/* overflow */
+	check_compact(0x23000001, false, NULL);		/* overflow */
+}
+
+static void test_arith(void)
+{
+	bu256_t a, b, c, expected;
+
+	bu256_set_u64(&a, 0xffffffffffffffffULL);
+	bu256_set_u64(&b, 1);
+	bu256_add(&c, &a, &b);
+
+	bool rc = hex_bu256(&expected,
+	"0000000000000000000000000000000000000000000000010000000000000000");
+	assert(rc);
+	assert(bu256_equal(&c, &expected));
+
+	assert(bu256_cmp(&a, &b) > 0);
+	assert(bu256_cmp(&b, &a) < 0);
+	assert(bu256_cmp(&c, &a) > 0);
+	assert(bu256_cmp(&c, &expected) == 0);
+
+	bu256_sub(&c, &c, &a);
+	assert(bu256_equal(&c, &b));
+}
+
+static void test_work(void)
+{
+	bu256_t target, work, expected;
+
+	/* difficulty 1 */
+	bu256_set_compact(&target, 0x1d00ffff);
+	bu256_target_work(&work, &target);
+	bu256_set_u64(&expected, 0x100010001ULL);
+	assert(bu256_equal(&work, &expected));
+
+	/* block 100000 difficulty */
+	bu256_set_compact(&target, 0x1b04864c);
+	bu256_target_work(&work, &target);
+	bu256_set_u64(&expected, 0x38946224e37eULL);
+	assert(bu256_equal(&work, &expected));
+
+	/* target 1: half of all hashes */
+	bu256_set_u64(&target, 1);
+	bu256_target_work(&work, &target);
+	bool rc = hex_bu256(&expected,
+	"8000000000000000000000000000000000000000000000000000000000000000");
+	assert(rc);
+	assert(bu256_equal(&work, &expected));
+
+	bu256_zero(&target);
+	bu256_target_work(&work, &target);
+	assert(bu256_is_zero(&work));
+}
+
+int main (int argc, char *argv[])
+{
+	test_compact();
+	test_arith();
+	test_work();
+	return 0;
+}
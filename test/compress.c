@@ -0,0 +1,304 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/compress.h>
+#include <ccoin/hexcode.h>
+#include <ccoin/key.h>
+#include <ccoin/message.h>
+#include <ccoin/mbr.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static void check_varint(uint64_t v, const char *hexstr)
+{
+	cstring *s = cstr_new(NULL);
+	ser_varint(s, v);
+
+	if (hexstr) {
+		cstring *hex = str2hex(s->str, s->len);
+		assert(!strcmp(hex->str, hexstr));
+		cstr_free(hex, true);
+	}
+
+	struct const_buffer buf = { s->str, s->len };
+	uint64_t v2 = 0;
+	assert(deser_varint(&v2, &buf));
+	assert(v2 == v);
+	assert(buf.len == 0);
+
+	/* truncated input must fail */
+	struct const_buffer short_buf = { s->str, s->len - 1 };
+	assert(!deser_varint(&v2, &short_buf));
+
+	cstr_free(s, true);
+}
+
+static void test_varint(void)
+{
+	check_varint(0, "00");
+	check_varint(127, "7f");
+	check_varint(128, "8000");
+	check_varint(255, "807f");
+	check_varint(16383, "fe7f");
+	check_varint(16384, "ff00");
+	check_varint(16511, "ff7f");
+	check_varint(65535, "82fe7f");
+	check_varint(0x1234, "a334");
+	check_varint(0x123456, "c7e756");
+	check_varint(0x80123456, "86ffc7e756");
+	check_varint(0xffffffff, "8efefefe7f");
+	check_varint(0x7fffffffffffffffULL, "fefefefefefefefe7f");
+	check_varint(UINT64_MAX, "80fefefefefefefefe7f");
+
+	unsigned int i;
+	for (i = 0; i < 64; i++) {
+		check_varint((1ULL << i) - 1, NULL);
+		check_varint(1ULL << i, NULL);
+	}
+
+	/* longer than any uint64_t encoding */
+	static const unsigned char ovf[] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+	};
+	struct const_buffer buf = { ovf, sizeof(ovf) };
+	uint64_t v;
+	assert(!deser_varint(&v, &buf));
+}
+
+static void test_amount(void)
+{
+	const uint64_t COIN = 100000000ULL;
+
+	assert(bp_amount_compress(0) == 0);
+	assert(bp_amount_compress(1) == 1);
+	assert(bp_amount_compress(1000000) == 7);
+	assert(bp_amount_compress(COIN) == 9);
+	assert(bp_amount_compress(50 * COIN) == 0x32);
+	assert(bp_amount_compress(21000000 * COIN) == 0x1406f40);
+
+	uint64_t i;
+	for (i = 0; i < 100000; i++) {
+		assert(bp_amount_decompress(bp_amount_compress(i)) == i);
+		assert(bp_amount_compress(bp_amount_decompress(i)) == i);
+		assert(bp_amount_decompress(bp_amount_compress(i * COIN / 1000))
+		       == i * COIN / 1000);
+	}
+}
+
+static void check_script(const char *hexstr, unsigned int expect_len)
+{
+	cstring *script = *hexstr ? hex2str(hexstr) : cstr_new(NULL);
+	assert(script != NULL);
+
+	cstring *s = cstr_new(NULL);
+	bp_script_compress(s, script);
+	assert(s->len == expect_len);
+
+	struct const_buffer buf = { s->str, s->len };
+	cstring *out = NULL;
+	assert(bp_script_decompress(&out, &buf));
+	assert(buf.len == 0);
+	assert(cstr_equal(out, script));
+
+	cstr_free(out, true);
+	cstr_free(s, true);
+	cstr_free(script, true);
+}
+
+static void test_script(void)
+{
+	/* P2PKH, P2SH */
+	check_script("76a91462e907b15cbf27d5425399ebf6f0fb50ebb88f1888ac", 21);
+	check_script("a914748284390f9e263a4b766a75d0633c50426eb87587", 21);
+
+	/* P2PK, compressed and uncompressed (genesis coinbase) */
+	check_script("2102ce2e5a0bd0cb3a5c58fc4d3a35e9b8a0a5e3d28f8b04f53b4cd3d7ee05"
+		     "f63d1fac", 33);
+	check_script("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f"
+		     "61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b"
+		     "6bf11d5fac", 33);
+
+	/* uncompressed key not on the curve: stored raw */
+	check_script("4104000000000000000000000000000000000000000000000000000000000000"
+		     "0000000000000000000000000000000000000000000000000000000000000000"
+		     "0000ac", 1 + 67);
+
+	/* nonstandard and empty */
+	check_script("6a0b68656c6c6f20776f726c64", 1 + 13);
+	check_script("", 1);
+}
+
+static void test_script_invalid(void)
+{
+	/* special tag with short payload */
+	static const unsigned char short_p2pkh[] = { 0x00, 0x01, 0x02 };
+	struct const_buffer buf = { short_p2pkh, sizeof(short_p2pkh) };
+	cstring *out = NULL;
+	assert(!bp_script_decompress(&out, &buf));
+
+	/* raw length past end of input */
+	static const unsigned char short_raw[] = { 0x10, 0x6a };
+	buf.p = short_raw;
+	buf.len = sizeof(short_raw);
+	assert(!bp_script_decompress(&out, &buf));
+
+	/* x with no point on the curve */
+	unsigned char bad_x[33];
+	memset(bad_x, 0xff, sizeof(bad_x));
+	bad_x[0] = 0x04;
+	buf.p = bad_x;
+	buf.len = sizeof(bad_x);
+	assert(!bp_script_decompress(&out, &buf));
+	assert(out == NULL);
+}
+
+struct uset_stats {
+	unsigned int	n_txout;
+	unsigned int	n_special;
+	size_t		heap_bytes;	/* txout + cstring + script buffer */
+	size_t		ser_bytes;	/* ser_bp_txout() */
+	size_t		comp_bytes;	/* ser_bp_txout_compressed() */
+};
+
+static void stats_iter(void *key, void *value, void *priv)
+{
+	struct bp_utxo *coin = value;
+	struct uset_stats *st = priv;
+	cstring *s = cstr_new_sz(128);
+	unsigned int i;
+
+	for (i = 0; i < coin->vout->len; i++) {
+		struct bp_txout *txout = parr_idx(coin->vout, i);
+		if (!txout)
+			continue;
+
+		st->n_txout++;
+		st->heap_bytes += sizeof(*txout) + sizeof(cstring) +
+				  txout->scriptPubKey->alloc;
+
+		cstr_resize(s, 0);
+		ser_bp_txout(s, txout);
+		st->ser_bytes += s->len;
+
+		cstr_resize(s, 0);
+		ser_bp_txout_compressed(s, txout);
+		st->comp_bytes += s->len;
+
+		struct bp_txout txout2;
+		bp_txout_init(&txout2);
+		struct const_buffer buf = { s->str, s->len };
+		uint64_t amount;
+		assert(deser_varint(&amount, &buf));
+		if (((const unsigned char *) buf.p)[0] < BP_SCRIPT_N_SPECIAL)
+			st->n_special++;
+
+		buf.p = s->str;
+		buf.len = s->len;
+		assert(deser_bp_txout_compressed(&txout2, &buf));
+		assert(buf.len == 0);
+		assert(txout2.nValue == txout->nValue);
+		assert(cstr_equal(txout2.scriptPubKey, txout->scriptPubKey));
+		bp_txout_free(&txout2);
+	}
+
+	cstr_free(s, true);
+}
+
+static void connect_block(struct bp_utxo_set *uset, const struct p2p_message *msg)
+{
+	struct bp_block block;
+	bp_block_init(&block);
+
+	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+	assert(deser_bp_block(&block, &buf));
+
+	unsigned int i, j;
+	for (i = 0; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		bp_tx_calc_sha256(tx);
+
+		if (!bp_tx_coinbase(tx))
+			for (j = 0; j < tx->vin->len; j++) {
+				struct bp_txin *txin = parr_idx(tx->vin, j);
+				bp_utxo_spend(uset, &txin->prevout);
+			}
+
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		assert(bp_utxo_from_tx(coin, tx, bp_tx_coinbase(tx), 0));
+		bp_utxo_set_add(uset, coin);
+	}
+
+	bp_block_free(&block);
+}
+
+/* build the UTXO set left by a block file; compare stored sizes */
+static void test_uset(const char *ser_fn, bool is_msg)
+{
+	int fd = file_seq_open(ser_fn);
+	if (fd < 0) {
+		perror(ser_fn);
+		exit(1);
+	}
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	unsigned int n_blocks = 0;
+	while (is_msg ? fread_message(fd, &msg, &read_ok) :
+			fread_block(fd, &msg, &read_ok)) {
+		connect_block(&uset, &msg);
+		n_blocks++;
+		if (is_msg)
+			break;
+	}
+	assert(read_ok);
+	close(fd);
+	free(msg.data);
+
+	struct uset_stats st = {};
+	bp_hashtab_iter(uset.map, stats_iter, &st);
+	assert(st.n_txout > 0);
+
+	fprintf(stderr, "compress: %s: %u blocks, %u outputs (%u standard): "
+		"%zu bytes in memory, %zu serialized, %zu compressed\n",
+		ser_fn, n_blocks, st.n_txout, st.n_special,
+		st.heap_bytes, st.ser_bytes, st.comp_bytes);
+	assert(st.comp_bytes < st.ser_bytes);
+
+	bp_utxo_set_free(&uset);
+}
+
+int main (int argc, char *argv[])
+{
+	test_varint();
+	test_amount();
+	test_script();
+	test_script_invalid();
+
+	char *fn = test_filename("data/blks10.ser");
+	test_uset(fn, false);
+	free(fn);
+
+	fn = test_filename("data/blk120383.ser");
+	test_uset(fn, true);
+	free(fn);
+
+	/* optional: a full chain file, as in chain-verf */
+	const char *chain_fn = getenv("TEST_MAINNET_VERF");
+	if (chain_fn)
+		test_uset(chain_fn, false);
+
+	bp_key_static_shutdown();
+	return 0;
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include <ccoin/crypto/sha1.h>
+#include <ccoin/crypto/siphash.h>
 
 static void print_n(const void *_data, size_t len)
 {
@@ -82,9 +83,42 @@ static void test_sha1()
 	}
 }
 
+/* reference vectors from the SipHash paper's implementation:
+ * key 00 01 .. 0f, message 00 01 .. (len - 1)
+ */
+static void test_siphash()
+{
+	static const struct {
+		size_t		len;
+		uint64_t	expect;
+	} vectors[] = {
+		{ 0,	0x726fdb47dd0e0e31ULL },
+		{ 8,	0x93f5f5799a932462ULL },
+		{ 15,	0xa129ca6149be45e5ULL },
+	};
+	uint8_t key[16], msg[16];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = msg[i] = i;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		uint64_t v = siphash24(key, msg, vectors[i].len);
+		if (v != vectors[i].expect) {
+			printf("SipHash for len %d broken\n",
+			       (int) vectors[i].len);
+			printf(" expect: %016llx\n",
+			       (unsigned long long) vectors[i].expect);
+			printf(" actual: %016llx\n", (unsigned long long) v);
+			abort();
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	test_sha1();
+	test_siphash();
 
 	return 0;
 }
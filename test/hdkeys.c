@@ -8,6 +8,7 @@
 
 #include <assert.h>
 #include <ccoin/base58.h>
+#include <ccoin/parallel.h>
 #include <ccoin/util.h>
 
 #define MAIN_PUBLIC 0x1EB28804
@@ -632,15 +633,113 @@ static void test_vector_2()
 	hd_extended_key_free(&m);
 }
 
+static void test_pub_derivation()
+{
+	printf("TEST: test_pub_derivation\n");
+
+	// Watch-only: m/0H xpub -> m/0H/1 -> m/0H/1/2H refused
+
+	struct hd_extended_key_serialized tv1_m_0H_1_xpub;
+	read_ek_ser_from_base58(s_tv1_m_0H_1_xpub, &tv1_m_0H_1_xpub);
+
+	struct hd_extended_key m_0H;
+	hd_extended_key_init(&m_0H);
+	assert(hd_extended_key_deser_base58(&m_0H, s_tv1_m_0H_xpub));
+
+	struct hd_extended_key m_0H_1;
+	hd_extended_key_init(&m_0H_1);
+	assert(hd_extended_key_generate_child_pub(&m_0H, 1, &m_0H_1));
+	assert(compare_serialized_pub(&m_0H_1, &tv1_m_0H_1_xpub));
+	assert(!hd_extended_key_generate_child_pub(&m_0H, 0x80000001,
+						   &m_0H_1));
+
+	uint8_t priv[32];
+	assert(!bp_key_secret_get(&priv[0], sizeof(priv), &m_0H_1.key));
+
+	// Bad checksum, or an address rather than a key
+
+	char bad[sizeof(s_tv1_m_0H_xpub)];
+	strcpy(bad, s_tv1_m_0H_xpub);
+	bad[20] = (bad[20] == 'a') ? 'b' : 'a';
+	assert(!hd_extended_key_deser_base58(&m_0H, bad));
+	assert(!hd_extended_key_deser_base58(&m_0H,
+			"1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa"));
+
+	// CKDpub from a private parent matches CKDpriv, and is public
+
+	struct hd_extended_key m;
+	hd_extended_key_init(&m);
+	assert(hd_extended_key_generate_master(&m, s_tv1_seed,
+					       sizeof(s_tv1_seed)));
+
+	struct hd_extended_key m_7, m_7_pub;
+	hd_extended_key_init(&m_7);
+	hd_extended_key_init(&m_7_pub);
+	assert(hd_extended_key_generate_child(&m, 7, &m_7));
+	assert(hd_extended_key_generate_child_pub(&m, 7, &m_7_pub));
+	assert(check_keys_match(&m_7, &m_7_pub));
+	assert(!bp_key_secret_get(&priv[0], sizeof(priv), &m_7_pub.key));
+
+	struct hd_extended_key_serialized m_7_xpub;
+	assert(write_ek_ser_pub(&m_7_xpub, &m_7));
+	assert(compare_serialized_pub(&m_7_pub, &m_7_xpub));
+
+	hd_extended_key_neuter(&m_7);
+	assert(!bp_key_secret_get(&priv[0], sizeof(priv), &m_7.key));
+	assert(!hd_extended_key_generate_child(&m_7, 0x80000000, &m_7_pub));
+
+	// Batches match one-at-a-time derivation, serial or parallel
+
+	const unsigned int n = 50;
+	const uint32_t first = 1000;
+	struct hd_pub_child batch[n];
+	unsigned int threads, i;
+
+	for (threads = 1; threads <= 4; threads += 3) {
+		bp_parallel_set_threads(threads);
+		memset(batch, 0, sizeof(batch));
+		assert(hd_derive_pub_batch(&m_0H, first, n, batch));
+
+		for (i = 0; i < n; i++) {
+			struct hd_extended_key child;
+			hd_extended_key_init(&child);
+			assert(hd_extended_key_generate_child(&m_0H, first + i,
+							      &child));
+
+			uint8_t pub[BP_PUBKEY_SZ], md160[20];
+			assert(bp_pubkey_get_buf(&child.key, pub));
+			bu_Hash160(md160, pub, sizeof(pub));
+			assert(0 == memcmp(batch[i].pubkey, pub, sizeof(pub)));
+			assert(0 == memcmp(batch[i].pubkey_hash, md160,
+					   sizeof(md160)));
+
+			hd_extended_key_free(&child);
+		}
+	}
+	bp_parallel_set_threads(0);
+
+	assert(hd_derive_pub_batch(&m_0H, 0x7fffffff, 1, batch));
+	assert(!hd_derive_pub_batch(&m_0H, 0x7fffffff, 2, batch));
+	assert(!hd_derive_pub_batch(&m_0H, 0x80000000, 1, batch));
+
+	hd_extended_key_free(&m_7_pub);
+	hd_extended_key_free(&m_7);
+	hd_extended_key_free(&m);
+	hd_extended_key_free(&m_0H_1);
+	hd_extended_key_free(&m_0H);
+}
+
 int main(int argc, char **argv)
 {
 	test_extended_key();
 	test_serialize();
 	test_vector_1();
 	test_vector_2();
+	test_pub_derivation();
 
 	// Keep valgrind happy
 	bp_key_static_shutdown();
+	bp_parallel_shutdown();
 
 	return 0;
 }
@@ -5,11 +5,22 @@
 #include "picocoin-config.h"
 
 #include <assert.h>                     // for assert
+#include <fcntl.h>                      // for open
+#include <gmp.h>                        // for mpz_t
+#include <stdio.h>                      // for fprintf
+#include <stdlib.h>                     // for rand, free
 #include <string.h>                     // for NULL, memset
+#include <unistd.h>                     // for close
 
 #include <ccoin/crypto/ripemd160.h>     // for RIPEMD160_DIGEST_LENGTH
 #include <ccoin/crypto/sha2.h>          // for sha256_Raw
+#include <ccoin/addr_match.h>           // for bp_txout_match, etc
+#include <ccoin/clist.h>                // for clist_free_ext
+#include <ccoin/core.h>                 // for bp_block, bp_txout, etc
 #include <ccoin/key.h>                  // for bpks_lookup, bp_key, etc
+#include <ccoin/mbr.h>                  // for fread_message
+#include <ccoin/message.h>              // for p2p_message
+#include <ccoin/script.h>               // for bsp_addr_parse, etc
 #include <ccoin/util.h>                 // for ARRAY_SIZE, bu_Hash160
 #include "libtest.h"
 
@@ -142,11 +153,410 @@ static void runtest(void)
 	}
 }
 
+/* the match bp_txout_match made before scripts were kept: parse, then
+ * look up each key and key hash found
+ */
+static bool parse_match(const struct bp_keyset *ks, const cstring *script)
+{
+	struct bscript_addr addrs;
+	struct const_buffer *buf;
+	bool rc = false;
+	clist *tmp;
+
+	if (!bsp_addr_parse(&addrs, script->str, script->len))
+		return false;
+
+	for (tmp = addrs.pub; tmp && !rc; tmp = tmp->next) {
+		buf = tmp->data;
+		rc = bpks_lookup(ks, buf->p, buf->len, false);
+	}
+	for (tmp = addrs.pubhash; tmp && !rc; tmp = tmp->next) {
+		buf = tmp->data;
+		rc = bpks_lookup(ks, buf->p, buf->len, true);
+	}
+
+	bsp_addr_free(&addrs);
+	return rc;
+}
+
+static bool script_match(const struct bp_keyset *ks, const cstring *script)
+{
+	struct bp_txout txout;
+
+	bp_txout_init(&txout);
+	txout.scriptPubKey = (cstring *) script;
+	return bp_txout_match(&txout, ks);
+}
+
+static void test_scripts(void)
+{
+	struct bp_key key, other;
+	struct bp_keyset ks;
+	unsigned char md160[RIPEMD160_DIGEST_LENGTH];
+	void *pubkey;
+	size_t pklen;
+
+	bp_key_init(&key);
+	bp_key_init(&other);
+	assert(bp_key_generate(&key) && bp_key_generate(&other));
+
+	bpks_init(&ks);
+	assert(bpks_add(&ks, &key));
+	assert(bp_pubkey_get(&key, &pubkey, &pklen));
+	bu_Hash160(md160, pubkey, pklen);
+
+	/* P2PK and P2PKH pay the key */
+	cstring *p2pk = cstr_new_sz(pklen + 2);
+	bsp_push_data(p2pk, pubkey, pklen);
+	bsp_push_op(p2pk, OP_CHECKSIG);
+	cstring *hash = cstr_new_buf(md160, sizeof(md160));
+	cstring *p2pkh = bsp_make_pubkeyhash(hash);
+	cstring *p2sh = bsp_make_scripthash(hash);
+
+	assert(script_match(&ks, p2pk) && parse_match(&ks, p2pk));
+	assert(script_match(&ks, p2pkh) && parse_match(&ks, p2pkh));
+
+	/* a script hash equal to a key hash is a different payee */
+	assert(!script_match(&ks, p2sh) && !parse_match(&ks, p2sh));
+	assert(bpks_add_scripthash(&ks, md160));
+	assert(script_match(&ks, p2sh));
+
+	/* trailing bytes make another script */
+	cstr_append_c(p2pkh, OP_NOP);
+	assert(!script_match(&ks, p2pkh));
+	cstr_resize(p2pkh, p2pkh->len - 1);
+
+	/* known only by hash */
+	free(pubkey);
+	assert(bp_pubkey_get(&other, &pubkey, &pklen));
+	bu_Hash160(md160, pubkey, pklen);
+	cstr_free(hash, true);
+	hash = cstr_new_buf(md160, sizeof(md160));
+	cstring *other_p2pkh = bsp_make_pubkeyhash(hash);
+	assert(!script_match(&ks, other_p2pkh));
+	assert(bpks_add_pubhash(&ks, md160));
+	assert(script_match(&ks, other_p2pkh) && parse_match(&ks, other_p2pkh));
+	assert(bpks_lookup(&ks, md160, sizeof(md160), true));
+
+	struct bp_txout txout;
+	bp_txout_init(&txout);
+	assert(!bp_txout_match(&txout, &ks));
+
+	cstr_free(other_p2pkh, true);
+	cstr_free(p2sh, true);
+	cstr_free(p2pkh, true);
+	cstr_free(p2pk, true);
+	cstr_free(hash, true);
+	free(pubkey);
+	bpks_free(&ks);
+	bp_key_free(&other);
+	bp_key_free(&key);
+}
+
+/*
+ * blkscan's inner loop, with 1M watched addresses: every output of a
+ * real block, matched by parsing, then by script lookup.
+ */
+static void bench_scan(void)
+{
+	const unsigned int n_addrs = 1000000, n_rounds = 20;
+	struct bp_keyset ks;
+	unsigned int i, j, k;
+
+	char *fn = test_filename("data/blk120383.ser");
+	int fd = file_seq_open(fn);
+	assert(fd >= 0);
+	free(fn);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	assert(fread_message(fd, &msg, &read_ok) && read_ok);
+	close(fd);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	assert(deser_bp_block(&block, &buf));
+
+	/* random hashes, plus every 10th P2PKH payee of the block */
+	srand(49);
+	bpks_init(&ks);
+	for (i = 0; i < n_addrs; i++) {
+		unsigned char md160[RIPEMD160_DIGEST_LENGTH];
+		for (j = 0; j < sizeof(md160); j++)
+			md160[j] = rand();
+		bpks_add_pubhash(&ks, md160);
+	}
+
+	unsigned int n_out = 0, n_match = 0, n_parse = 0;
+	for (i = 0; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bp_txout *txout = parr_idx(tx->vout, j);
+			const cstring *script = txout->scriptPubKey;
+			if ((n_out++ % 10 == 0) && (script->len == 25))
+				bpks_add_pubhash(&ks, script->str + 3);
+		}
+	}
+
+	double t0 = now_ms();
+	for (k = 0; k < n_rounds; k++)
+		for (i = 0; i < block.vtx->len; i++) {
+			struct bp_tx *tx = parr_idx(block.vtx, i);
+			for (j = 0; j < tx->vout->len; j++) {
+				struct bp_txout *txout = parr_idx(tx->vout, j);
+				n_parse += parse_match(&ks,
+						       txout->scriptPubKey);
+			}
+		}
+	double t1 = now_ms();
+	for (k = 0; k < n_rounds; k++)
+		for (i = 0; i < block.vtx->len; i++) {
+			struct bp_tx *tx = parr_idx(block.vtx, i);
+			for (j = 0; j < tx->vout->len; j++)
+				n_match += bp_txout_match(parr_idx(tx->vout, j),
+							  &ks);
+		}
+	double t2 = now_ms();
+
+	assert(n_match && (n_match == n_parse));
+
+	fprintf(stderr, "keyset: %u addresses, %u outputs x %u: "
+		"parse %.0f, script lookup %.0f outputs/ms\n",
+		n_addrs, n_out, n_rounds, n_out * n_rounds / (t1 - t0),
+		n_out * n_rounds / (t2 - t1));
+
+	bp_block_free(&block);
+	free(msg.data);
+	bpks_free(&ks);
+}
+
+static struct bp_tx *wide_tx(unsigned int n_vout, const cstring *mine,
+			     const unsigned int *pay, unsigned int n_pay)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	unsigned int i, j;
+
+	bp_tx_init(tx);
+	tx->vin = parr_new(0, bp_txin_freep);
+	tx->vout = parr_new(n_vout, bp_txout_freep);
+	for (i = 0; i < n_vout; i++) {
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		txout->nValue = i;
+		txout->scriptPubKey = cstr_new_sz(mine->len);
+		for (j = 0; j < n_pay; j++)
+			if (pay[j] == i)
+				cstr_append_buf(txout->scriptPubKey, mine->str,
+						mine->len);
+		if (!txout->scriptPubKey->len)
+			cstr_append_c(txout->scriptPubKey, OP_TRUE);
+		parr_add(tx->vout, txout);
+	}
+	return tx;
+}
+
+static bool stop_at_first(void *ctx, unsigned int n, const uint64_t *mask,
+			  unsigned int n_words)
+{
+	unsigned int *calls = ctx;
+
+	(*calls)++;
+	return false;
+}
+
+/* masks of one word, of several, and past the stack buffer */
+static void test_block_match(void)
+{
+	static const unsigned int pay1[] = { 0, 63 };
+	static const unsigned int pay3[] = { 1, 64, 129 };
+	static const unsigned int pay4[] = { 2000 };
+	unsigned char md160[RIPEMD160_DIGEST_LENGTH];
+	struct bp_keyset ks;
+
+	memset(md160, 0x49, sizeof(md160));
+	bpks_init(&ks);
+	assert(bpks_add_pubhash(&ks, md160));
+	cstring *hash = cstr_new_buf(md160, sizeof(md160));
+	cstring *mine = bsp_make_pubkeyhash(hash);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	block.vtx = parr_new(0, bp_tx_freep);
+	parr_add(block.vtx, wide_tx(3, mine, NULL, 0));
+	parr_add(block.vtx, wide_tx(64, mine, pay1, ARRAY_SIZE(pay1)));
+	parr_add(block.vtx, wide_tx(5, mine, NULL, 0));
+	parr_add(block.vtx, wide_tx(130, mine, pay3, ARRAY_SIZE(pay3)));
+	parr_add(block.vtx, wide_tx(2001, mine, pay4, ARRAY_SIZE(pay4)));
+
+	struct bp_block_matches bm;
+	unsigned int i, round;
+	bbm_init(&bm);
+
+	/* twice: the second reuses the storage of the first */
+	for (round = 0; round < 2; round++) {
+		assert(bp_block_match(&bm, &block, &ks));
+		assert(bm.len == 3);
+
+		const uint64_t *mask = bbm_mask(&bm, &bm.match[0]);
+		assert((bm.match[0].n == 1) && (bm.match[0].n_words == 1));
+		assert(mask[0] == ((1ULL << 63) | 1));
+
+		mask = bbm_mask(&bm, &bm.match[1]);
+		assert((bm.match[1].n == 3) && (bm.match[1].n_words == 3));
+		for (i = 0; i < 130; i++)
+			assert(bp_mask_test(mask, i) ==
+			       ((i == 1) || (i == 64) || (i == 129)));
+
+		mask = bbm_mask(&bm, &bm.match[2]);
+		assert((bm.match[2].n == 4) && (bm.match[2].n_words == 32));
+		for (i = 0; i < 2001; i++)
+			assert(bp_mask_test(mask, i) == (i == 2000));
+		assert(bm.spill_len == 3 + 32);
+	}
+
+	/* the walk stops when the callback says so */
+	unsigned int calls = 0;
+	assert(!bp_block_match_each(&block, &ks, stop_at_first, &calls));
+	assert(calls == 1);
+
+	bbm_free(&bm);
+	bp_block_free(&block);
+	cstr_free(mine, true);
+	cstr_free(hash, true);
+	bpks_free(&ks);
+}
+
+/* bp_block_match as it was: a parr of one mpz_t mask per matched tx */
+struct mpz_match {
+	unsigned int	n;
+	mpz_t		mask;
+};
+
+static void mpz_match_free(void *p)
+{
+	struct mpz_match *match = p;
+
+	mpz_clear(match->mask);
+	free(match);
+}
+
+static parr *mpz_block_match(const struct bp_block *block,
+			     const struct bp_keyset *ks)
+{
+	parr *arr = parr_new(block->vtx->len, mpz_match_free);
+	mpz_t tmp_mask;
+	unsigned int n, i;
+
+	mpz_init(tmp_mask);
+	for (n = 0; n < block->vtx->len; n++) {
+		struct bp_tx *tx = parr_idx(block->vtx, n);
+
+		mpz_set_ui(tmp_mask, 0);
+		for (i = 0; i < tx->vout->len; i++)
+			if (bp_txout_match(parr_idx(tx->vout, i), ks))
+				mpz_setbit(tmp_mask, i);
+
+		if (mpz_sgn(tmp_mask) != 0) {
+			struct mpz_match *match = malloc(sizeof(*match));
+			match->n = n;
+			mpz_init_set(match->mask, tmp_mask);
+			parr_add(arr, match);
+		}
+	}
+	mpz_clear(tmp_mask);
+	return arr;
+}
+
+static bool count_match(void *ctx, unsigned int n, const uint64_t *mask,
+			unsigned int n_words)
+{
+	unsigned int *count = ctx;
+
+	(*count)++;
+	return true;
+}
+
+/* whole-chain matching, where most blocks have a match or two */
+static void bench_block_match(void)
+{
+	const unsigned int n_rounds = 2000;
+	struct bp_keyset ks;
+	unsigned int i, j, k;
+
+	char *fn = test_filename("data/blk120383.ser");
+	int fd = file_seq_open(fn);
+	assert(fd >= 0);
+	free(fn);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	assert(fread_message(fd, &msg, &read_ok) && read_ok);
+	close(fd);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	assert(deser_bp_block(&block, &buf));
+
+	/* every 4th P2PKH payee */
+	bpks_init(&ks);
+	for (i = 0, k = 0; i < block.vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block.vtx, i);
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bp_txout *txout = parr_idx(tx->vout, j);
+			const cstring *script = txout->scriptPubKey;
+			if ((k++ % 4 == 0) && (script->len == 25))
+				bpks_add_pubhash(&ks, script->str + 3);
+		}
+	}
+
+	unsigned int n_mpz = 0, n_bbm = 0, n_each = 0;
+	double t0 = now_ms();
+	for (k = 0; k < n_rounds; k++) {
+		parr *arr = mpz_block_match(&block, &ks);
+		n_mpz += arr->len;
+		parr_free(arr, true);
+	}
+	double t1 = now_ms();
+
+	struct bp_block_matches bm;
+	bbm_init(&bm);
+	for (k = 0; k < n_rounds; k++) {
+		assert(bp_block_match(&bm, &block, &ks));
+		n_bbm += bm.len;
+	}
+	bbm_free(&bm);
+	double t2 = now_ms();
+
+	for (k = 0; k < n_rounds; k++)
+		assert(bp_block_match_each(&block, &ks, count_match, &n_each));
+	double t3 = now_ms();
+
+	assert(n_mpz && (n_mpz == n_bbm) && (n_bbm == n_each));
+
+	fprintf(stderr, "keyset: block match, %zu txs, %u matched: "
+		"mpz %.1f us, bitsets %.1f us, streamed %.1f us/block\n",
+		block.vtx->len, n_bbm / n_rounds,
+		(t1 - t0) * 1000.0 / n_rounds, (t2 - t1) * 1000.0 / n_rounds,
+		(t3 - t2) * 1000.0 / n_rounds);
+
+	bp_block_free(&block);
+	free(msg.data);
+	bpks_free(&ks);
+}
+
 int main (int argc, char *argv[])
 {
 	keytest_secp256k1();
 	keytest();
 	runtest();
+	test_scripts();
+	test_block_match();
+	if (test_bench(argc, argv)) {
+		bench_scan();
+		bench_block_match();
+	}
 
 	bp_key_static_shutdown();
 	return 0;
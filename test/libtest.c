@@ -11,6 +11,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <time.h>
 #include <jansson.h>
 #include <ccoin/cstr.h>
 #include <ccoin/parr.h>
@@ -179,3 +180,16 @@ cstring *parse_script_str(const char *enc)
 	return script;
 }
 
+/* monotonic clock, for timing benchmarks */
+double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+/* benchmarks stay out of "make check"; run "<test> bench" for them */
+bool test_bench(int argc, char *argv[])
+{
+	return (argc > 1) && !strcmp(argv[1], "bench");
+}
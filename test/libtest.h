@@ -5,6 +5,7 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.
  */
 
+#include <stdbool.h>
 #include <jansson.h>
 #include <ccoin/cstr.h>
 
@@ -12,5 +13,7 @@ extern json_t *read_json(const char *filename);
 extern char *test_filename(const char *basename);
 extern void dumphex(const char *prefix, const void *p_, size_t len);
 extern cstring *parse_script_str(const char *enc);
+extern double now_ms(void);
+extern bool test_bench(int argc, char *argv[]);
 
 #endif /* __LIBTEST_H__ */
@@ -0,0 +1,248 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/bloom.h>
+#include <ccoin/core.h>
+#include <ccoin/mbr.h>
+#include <ccoin/merkleblock.h>
+#include <ccoin/message.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libtest.h"
+
+static struct bp_tx *make_tx(uint32_t lock_time)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(1, bp_txin_freep);
+	tx->vout = parr_new(1, bp_txout_freep);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	bu256_set_u64(&txin->prevout.hash, 1);
+	txin->scriptSig = cstr_new_sz(4);
+	parr_add(tx->vin, txin);
+
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = 1000;
+	txout->scriptPubKey = cstr_new_sz(4);
+	parr_add(tx->vout, txout);
+
+	tx->nLockTime = lock_time;
+	bp_tx_calc_sha256(tx);
+	return tx;
+}
+
+static void make_block(struct bp_block *block, unsigned int n_tx)
+{
+	unsigned int i;
+
+	bp_block_init(block);
+	block->vtx = parr_new(n_tx, bp_tx_freep);
+	for (i = 0; i < n_tx; i++)
+		parr_add(block->vtx, make_tx(i));
+	bp_block_merkle(&block->hashMerkleRoot, block);
+}
+
+/* extract(build(block, match)) gives back exactly the matched txids */
+static void check_roundtrip(const struct bp_block *block, const bool *match)
+{
+	struct bp_merkle_block mb, mb2;
+	unsigned int i, n_match = 0;
+
+	bp_merkle_block_init(&mb);
+	bp_merkle_block_init(&mb2);
+	assert(bp_merkle_block_build(&mb, block, match));
+
+	cstring *s = cstr_new(NULL);
+	ser_bp_merkle_block(s, &mb);
+	struct const_buffer buf = { s->str, s->len };
+	assert(deser_bp_merkle_block(&mb2, &buf) && (buf.len == 0));
+	cstr_free(s, true);
+
+	parr *txids = parr_new(0, bu256_freep);
+	assert(bp_merkle_block_extract(&mb2, txids));
+
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		if (!match[i])
+			continue;
+		assert(n_match < txids->len);
+		assert(bu256_equal(parr_idx(txids, n_match), &tx->sha256));
+		n_match++;
+	}
+	assert(n_match == txids->len);
+
+	/* a damaged hash no longer proves the root */
+	bu256_t *h = parr_idx(mb2.vHash, mb2.vHash->len / 2);
+	h->dword[0] ^= 1;
+	assert(!bp_merkle_block_extract(&mb2, txids));
+	assert(txids->len == n_match);
+	h->dword[0] ^= 1;
+
+	/* nor do unused flag bytes */
+	cstr_append_c(mb2.vBits, 0);
+	assert(!bp_merkle_block_extract(&mb2, txids));
+	cstr_resize(mb2.vBits, mb2.vBits->len - 1);
+	assert(bp_merkle_block_extract(&mb2, txids));
+
+	parr_free(txids, true);
+	bp_merkle_block_free(&mb);
+	bp_merkle_block_free(&mb2);
+}
+
+static void test_trees(void)
+{
+	static const unsigned int sizes[] = {
+		1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 100, 513,
+	};
+	unsigned int i, j, k;
+
+	srand(37);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		unsigned int n = sizes[i];
+		struct bp_block block;
+		bool match[n];
+
+		make_block(&block, n);
+
+		memset(match, 0, sizeof(match));
+		check_roundtrip(&block, match);
+
+		memset(match, 1, sizeof(match));
+		check_roundtrip(&block, match);
+
+		for (j = 0; j < MIN(n, 8); j++) {
+			memset(match, 0, sizeof(match));
+			match[(j * 7) % n] = true;
+			match[n - 1] = (j & 1);
+			check_roundtrip(&block, match);
+		}
+
+		for (j = 0; j < 8; j++) {
+			for (k = 0; k < n; k++)
+				match[k] = ((rand() % 8) == 0);
+			check_roundtrip(&block, match);
+		}
+
+		bp_block_free(&block);
+	}
+}
+
+/* [a b c c] has the root of [a b c]; its proof must not be accepted */
+static void test_duplicate_txs(void)
+{
+	struct bp_block block;
+	struct bp_merkle_block mb;
+	bool match[4] = { false, false, false, true };
+
+	make_block(&block, 3);
+	parr_add(block.vtx, make_tx(2));
+
+	bu256_t root;
+	bp_block_merkle(&root, &block);
+	assert(bu256_equal(&root, &block.hashMerkleRoot));
+
+	bp_merkle_block_init(&mb);
+	assert(bp_merkle_block_build(&mb, &block, match));
+
+	parr *txids = parr_new(0, bu256_freep);
+	assert(!bp_merkle_block_extract(&mb, txids));
+	assert(txids->len == 0);
+
+	mb.nTransactions = 0;
+	assert(!bp_merkle_block_extract(&mb, txids));
+
+	parr_free(txids, true);
+	bp_merkle_block_free(&mb);
+	bp_block_free(&block);
+}
+
+/* a real block, filtered on the first data push paying one of its txs */
+static void test_filter(const char *ser_fn_base)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	int fd = file_seq_open(ser_fn);
+	assert(fd >= 0);
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	assert(fread_message(fd, &msg, &read_ok) && read_ok);
+	close(fd);
+	free(ser_fn);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	struct const_buffer buf = { msg.data, msg.hdr.data_len };
+	assert(deser_bp_block(&block, &buf));
+
+	unsigned int n_tx = block.vtx->len;
+	unsigned int want = n_tx / 2;
+	assert(n_tx > 2);
+
+	struct bp_tx *tx = parr_idx(block.vtx, want);
+	struct bp_txout *txout = parr_idx(tx->vout, 0);
+	struct const_buffer sbuf = { txout->scriptPubKey->str,
+				     txout->scriptPubKey->len };
+	struct bscript_parser bp;
+	struct bscript_op op;
+	bsp_start(&bp, &sbuf);
+	while (bsp_getop(&op, &bp) && !op.data.len)
+		;
+	assert(op.data.len);
+
+	struct bloom bf;
+	assert(bloom_init(&bf, 10, 0.000001));
+	bf.nTweak = 12345;
+	bf.nFlags = BLOOM_UPDATE_ALL;
+	bloom_insert(&bf, op.data.p, op.data.len);
+
+	struct bp_merkle_block mb;
+	bool match[n_tx];
+	bp_merkle_block_init(&mb);
+	assert(bp_merkle_block_filter(&mb, &block, &bf, match));
+	assert(match[want]);
+
+	parr *txids = parr_new(0, bu256_freep);
+	assert(bp_merkle_block_extract(&mb, txids));
+
+	unsigned int i, n_match = 0;
+	bool found = false;
+	for (i = 0; i < n_tx; i++)
+		n_match += match[i];
+	for (i = 0; i < txids->len; i++)
+		found |= bu256_equal(parr_idx(txids, i), &tx->sha256);
+	assert(found && (txids->len == n_match));
+
+	/* the proof is much smaller than the block */
+	cstring *s = cstr_new(NULL);
+	ser_bp_merkle_block(s, &mb);
+	assert(s->len < msg.hdr.data_len / 4);
+	cstr_free(s, true);
+
+	parr_free(txids, true);
+	bp_merkle_block_free(&mb);
+	bloom_free(&bf);
+	bp_block_free(&block);
+	free(msg.data);
+}
+
+int main(int argc, char *argv[])
+{
+	test_trees();
+	test_duplicate_txs();
+	test_filter("data/blk120383.ser");
+	return 0;
+}
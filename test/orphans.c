@@ -0,0 +1,222 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/mbr.h>
+#include <ccoin/orphans.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static void set_hash(bu256_t *hash, uint32_t n)
+{
+	bu256_zero(hash);
+	hash->dword[0] = htole32(n);
+}
+
+static bool add(struct bp_orphan_pool *pool, uint32_t n, uint32_t prev,
+		size_t len)
+{
+	bu256_t hash, prev_hash;
+	char data[len];
+
+	set_hash(&hash, n);
+	set_hash(&prev_hash, prev);
+	memset(data, n, len);
+
+	return bp_orphan_add(pool, &hash, &prev_hash, data, len);
+}
+
+static bool have(struct bp_orphan_pool *pool, uint32_t n)
+{
+	bu256_t hash;
+	set_hash(&hash, n);
+	return bp_orphan_have(pool, &hash);
+}
+
+static void test_children(void)
+{
+	struct bp_orphan_pool pool;
+	bp_orphan_pool_init(&pool, 1000);
+
+	/* 1 <- {2, 3}, 2 <- 4 */
+	assert(add(&pool, 2, 1, 10));
+	assert(add(&pool, 3, 1, 20));
+	assert(add(&pool, 4, 2, 30));
+	assert(!add(&pool, 4, 2, 30));		/* duplicate */
+	assert(bp_orphan_count(&pool) == 3);
+	assert(bp_orphan_bytes(&pool) == 60);
+
+	bu256_t parent;
+	parr *out = parr_new(0, bp_orphan_freep);
+
+	set_hash(&parent, 1);
+	assert(bp_orphan_take_children(&pool, &parent, out) == 2);
+	assert(out->len == 2);
+	struct bp_orphan *orphan = parr_idx(out, 0);
+	assert(le32toh(orphan->hash.dword[0]) == 2);
+	assert(orphan->data->len == 10);
+	assert(((unsigned char *)orphan->data->p)[0] == 2);
+	orphan = parr_idx(out, 1);
+	assert(le32toh(orphan->hash.dword[0]) == 3);
+
+	assert(!have(&pool, 2) && !have(&pool, 3) && have(&pool, 4));
+	assert(bp_orphan_count(&pool) == 1);
+	assert(bp_orphan_bytes(&pool) == 30);
+
+	/* no children left under 1 */
+	assert(bp_orphan_take_children(&pool, &parent, out) == 0);
+
+	set_hash(&parent, 2);
+	assert(bp_orphan_take_children(&pool, &parent, out) == 1);
+	assert(bp_orphan_count(&pool) == 0);
+	assert(bp_orphan_bytes(&pool) == 0);
+	assert(pool.oldest == NULL && pool.newest == NULL);
+
+	parr_free(out, true);
+	bp_orphan_pool_free(&pool);
+}
+
+static void test_evict(void)
+{
+	struct bp_orphan_pool pool;
+	bp_orphan_pool_init(&pool, 100);
+
+	uint32_t n;
+	for (n = 1; n <= 10; n++)
+		assert(add(&pool, n, 1000, 10));
+	assert(bp_orphan_bytes(&pool) == 100);
+	assert(pool.n_evicted == 0);
+
+	/* oldest two make room */
+	assert(add(&pool, 11, 1000, 15));
+	assert(pool.n_evicted == 2);
+	assert(!have(&pool, 1) && !have(&pool, 2) && have(&pool, 3));
+	assert(bp_orphan_count(&pool) == 9);
+	assert(bp_orphan_bytes(&pool) == 95);
+
+	/* larger than the whole budget */
+	assert(!add(&pool, 12, 1000, 101));
+	assert(bp_orphan_count(&pool) == 9);
+
+	/* evicted entries are gone from the prev index too */
+	bu256_t parent;
+	parr *out = parr_new(0, bp_orphan_freep);
+	set_hash(&parent, 1000);
+	assert(bp_orphan_take_children(&pool, &parent, out) == 9);
+	assert(bp_orphan_bytes(&pool) == 0);
+
+	parr_free(out, true);
+
+	/* pool frees what is left */
+	assert(add(&pool, 20, 1, 50));
+	assert(add(&pool, 21, 20, 50));
+	bp_orphan_pool_free(&pool);
+}
+
+static void connect_block(struct bp_utxo_set *uset,
+			  const struct bp_block *block, unsigned int height)
+{
+	struct bp_utxo_view view;
+	bp_utxo_view_init(&view, uset, block);
+
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+
+		assert(bp_utxo_from_tx(coin, tx, (i == 0), height));
+		assert(bp_utxo_view_add(&view, coin));
+	}
+
+	assert(bp_utxo_view_flush(&view, NULL));
+	bp_utxo_view_free(&view);
+}
+
+/*
+ * A child block arrives before its parent, as the daemon sees it:
+ * held serialized, then decoded and connected once the parent is in.
+ */
+static void test_connect(void)
+{
+	char *fn = test_filename("data/blks10.ser");
+	int fd = file_seq_open(fn);
+	assert(fd >= 0);
+
+	struct p2p_message msg[3] = {};
+	struct bp_block block[3];
+	bool read_ok = true;
+	unsigned int i;
+
+	for (i = 0; i < 3; i++) {
+		struct const_buffer buf;
+
+		assert(fread_block(fd, &msg[i], &read_ok));
+		buf.p = msg[i].data;
+		buf.len = msg[i].hdr.data_len;
+		bp_block_init(&block[i]);
+		assert(deser_bp_block(&block[i], &buf));
+		bp_block_calc_sha256(&block[i]);
+	}
+	close(fd);
+	assert(bu256_equal(&block[2].hashPrevBlock, &block[1].sha256));
+
+	struct bp_orphan_pool pool;
+	bp_orphan_pool_init(&pool, 1000000);
+
+	/* block 2, parent unknown */
+	assert(bp_orphan_add(&pool, &block[2].sha256, &block[2].hashPrevBlock,
+			     msg[2].data, msg[2].hdr.data_len));
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+
+	/* the parent arrives, fully hashed as the network code gives it */
+	for (i = 0; i < block[1].vtx->len; i++)
+		bp_tx_calc_sha256(parr_idx(block[1].vtx, i));
+	connect_block(&uset, &block[1], 1);
+
+	parr *out = parr_new(0, bp_orphan_freep);
+	assert(bp_orphan_take_children(&pool, &block[1].sha256, out) == 1);
+
+	struct bp_block child;
+	bp_block_init(&child);
+	assert(bp_orphan_block(parr_idx(out, 0), &child));
+	assert(bu256_equal(&child.sha256, &block[2].sha256));
+	connect_block(&uset, &child, 2);
+
+	struct bp_tx *coinbase = parr_idx(child.vtx, 0);
+	assert(bp_utxo_lookup(&uset, &coinbase->sha256) != NULL);
+	assert(bp_hashtab_size(uset.map) == 2);
+
+	/* held under the wrong hash: refused */
+	struct bp_orphan *orphan = parr_idx(out, 0);
+	bu256_copy(&orphan->hash, &block[0].sha256);
+	bp_block_free(&child);
+	bp_block_init(&child);
+	assert(!bp_orphan_block(orphan, &child));
+
+	bp_block_free(&child);
+	parr_free(out, true);
+	bp_utxo_set_free(&uset);
+	bp_orphan_pool_free(&pool);
+	for (i = 0; i < 3; i++) {
+		bp_block_free(&block[i]);
+		free(msg[i].data);
+	}
+	free(fn);
+}
+
+int main (int argc, char *argv[])
+{
+	test_children();
+	test_evict();
+	test_connect();
+	return 0;
+}
@@ -0,0 +1,253 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <ccoin/core.h>
+#include <ccoin/key.h>
+#include <ccoin/parallel.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libtest.h"
+
+enum {
+	N_KEYS		= 8,
+};
+
+static struct bp_keystore ks;
+static struct bp_key *keys[N_KEYS];
+static struct bp_key stranger;
+
+/* pays key: P2PKH for even n, P2PK for odd */
+static cstring *make_script(const struct bp_key *key, unsigned int n)
+{
+	uint8_t pubkey[BP_PUBKEY_SZ];
+	assert(bp_pubkey_get_buf(key, pubkey));
+
+	if (n & 1) {
+		cstring *s = cstr_new_sz(40);
+		bsp_push_data(s, pubkey, sizeof(pubkey));
+		bsp_push_op(s, OP_CHECKSIG);
+		return s;
+	}
+
+	bu160_t pkhash;
+	bu_Hash160((unsigned char *) &pkhash, pubkey, sizeof(pubkey));
+	cstring hash = { (char *) &pkhash, sizeof(pkhash), sizeof(pkhash) };
+	return bsp_make_pubkeyhash(&hash);
+}
+
+/* a tx spending n outputs of the keystore's keys, to two outputs */
+static void make_tx(struct bp_tx *tx, cstring **scripts, unsigned int n)
+{
+	unsigned int i;
+
+	bp_tx_init(tx);
+	tx->vin = parr_new(n, bp_txin_freep);
+	tx->vout = parr_new(2, bp_txout_freep);
+
+	for (i = 0; i < n; i++) {
+		struct bp_txin *txin = calloc(1, sizeof(*txin));
+		bp_txin_init(txin);
+		bu256_set_u64(&txin->prevout.hash, 1000 + (i / 3));
+		txin->prevout.n = i % 3;
+		txin->nSequence = 0xffffffffU;
+		parr_add(tx->vin, txin);
+
+		scripts[i] = make_script(keys[i % N_KEYS], i);
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		txout->nValue = 5000 * (i + 1);
+		txout->scriptPubKey = make_script(keys[i], 0);
+		parr_add(tx->vout, txout);
+	}
+}
+
+static void free_tx(struct bp_tx *tx, cstring **scripts, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		cstr_free(scripts[i], true);
+	bp_tx_free(tx);
+}
+
+static const cstring *const *const_scripts(cstring **scripts)
+{
+	return (const cstring *const *) scripts;
+}
+
+/* batch signatures equal one-at-a-time ones, and verify */
+static void check_sign(unsigned int n, int nHashType)
+{
+	struct bp_tx tx, tx2;
+	cstring *scripts[n], *scripts2[n];
+	enum bp_sign_result results[n];
+	unsigned int i;
+
+	make_tx(&tx, scripts, n);
+	make_tx(&tx2, scripts2, n);
+	assert(bp_tx_sign(&ks, &tx, const_scripts(scripts), nHashType,
+			  results) == n);
+
+	for (i = 0; i < n; i++) {
+		assert(results[i] == BP_SIGN_OK);
+		assert(bp_script_sign(&ks, scripts[i], &tx2, i, nHashType));
+
+		struct bp_txin *txin = parr_idx(tx.vin, i);
+		struct bp_txin *txin2 = parr_idx(tx2.vin, i);
+		assert(txin->scriptSig->len == txin2->scriptSig->len);
+		assert(!memcmp(txin->scriptSig->str, txin2->scriptSig->str,
+			       txin->scriptSig->len));
+
+		assert(bp_script_verify(txin->scriptSig, scripts[i], &tx, i,
+					SCRIPT_VERIFY_STRICTENC, 0));
+	}
+
+	free_tx(&tx, scripts, n);
+	free_tx(&tx2, scripts2, n);
+}
+
+static void check_sighasher(void)
+{
+	struct bp_tx tx;
+	struct bp_tx_sighasher sh;
+	cstring *scripts[5];
+	unsigned int i;
+
+	make_tx(&tx, scripts, 5);
+	assert(bp_tx_sighasher_init(&sh, &tx));
+
+	for (i = 0; i < 6; i++) {
+		bu256_t h1, h2;
+		const cstring *code = (i < 5) ? scripts[i] : scripts[0];
+
+		bp_tx_sighash(&h1, code, &tx, i, SIGHASH_ALL);
+		bp_tx_sighasher_hash(&sh, &h2, code, i);
+		assert(bu256_equal(&h1, &h2));
+	}
+
+	/* OP_CODESEPARATOR is skipped alike */
+	cstring *code = cstr_new_buf(scripts[2]->str, scripts[2]->len);
+	bsp_push_op(code, OP_CODESEPARATOR);
+	bsp_push_op(code, OP_CHECKSIG);
+	bu256_t h1, h2;
+	bp_tx_sighash(&h1, code, &tx, 2, SIGHASH_ALL);
+	bp_tx_sighasher_hash(&sh, &h2, code, 2);
+	assert(bu256_equal(&h1, &h2));
+	cstr_free(code, true);
+
+	bp_tx_sighasher_free(&sh);
+	free_tx(&tx, scripts, 5);
+}
+
+/* inputs that cannot be signed are reported, and left alone */
+static void check_results(void)
+{
+	struct bp_tx tx;
+	cstring *scripts[4];
+	enum bp_sign_result results[4];
+
+	make_tx(&tx, scripts, 4);
+
+	cstring *skipped = scripts[1];
+	scripts[1] = NULL;
+
+	cstring *op_return = scripts[2];
+	scripts[2] = cstr_new_sz(4);
+	bsp_push_op(scripts[2], OP_RETURN);
+
+	cstring *unknown = scripts[3];
+	scripts[3] = make_script(&stranger, 3);
+
+	assert(bp_tx_sign(&ks, &tx, const_scripts(scripts), SIGHASH_ALL,
+			  results) == 1);
+	assert(results[0] == BP_SIGN_OK);
+	assert(results[1] == BP_SIGN_SKIPPED);
+	assert(results[2] == BP_SIGN_NONSTANDARD);
+	assert(results[3] == BP_SIGN_NO_KEY);
+
+	unsigned int i;
+	for (i = 1; i < 4; i++) {
+		struct bp_txin *txin = parr_idx(tx.vin, i);
+		assert(txin->scriptSig == NULL || txin->scriptSig->len == 0);
+	}
+
+	cstr_free(skipped, true);
+	cstr_free(op_return, true);
+	cstr_free(unknown, true);
+	free_tx(&tx, scripts, 4);
+}
+
+/* a consolidation tx of n inputs: batch, versus input by input */
+static void bench_sign(unsigned int n, bool one_by_one)
+{
+	struct bp_tx tx;
+	cstring **scripts = calloc(n, sizeof(cstring *));
+	unsigned int i;
+
+	make_tx(&tx, scripts, n);
+
+	double t0 = now_ms();
+	assert(bp_tx_sign(&ks, &tx, const_scripts(scripts), SIGHASH_ALL,
+			  NULL) == n);
+	double t1 = now_ms();
+
+	fprintf(stderr, "tx-sign: %u inputs: batch %.1f ms (%u threads)",
+		n, t1 - t0, bp_parallel_threads());
+
+	if (one_by_one) {
+		for (i = 0; i < n; i++)
+			assert(bp_script_sign(&ks, scripts[i], &tx, i,
+					      SIGHASH_ALL));
+		fprintf(stderr, ", one by one %.1f ms", now_ms() - t1);
+	}
+	fprintf(stderr, "\n");
+
+	free_tx(&tx, scripts, n);
+	free(scripts);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	bkeys_init(&ks);
+	for (i = 0; i < N_KEYS; i++) {
+		keys[i] = calloc(1, sizeof(struct bp_key));
+		bp_key_init(keys[i]);
+		assert(bp_key_generate(keys[i]));
+		assert(bkeys_add(&ks, keys[i]));
+	}
+	bp_key_init(&stranger);
+	assert(bp_key_generate(&stranger));
+
+	check_sighasher();
+	check_sign(1, SIGHASH_ALL);
+	check_sign(37, SIGHASH_ALL);
+	check_sign(37, SIGHASH_ALL | SIGHASH_ANYONECANPAY);
+	check_sign(37, SIGHASH_NONE);
+	check_results();
+
+	if (test_bench(argc, argv)) {
+		bench_sign(1000, true);
+		bench_sign(5000, true);
+		bench_sign(10000, true);
+	}
+
+	bp_key_free(&stranger);
+	bkeys_free(&ks);
+	bp_parallel_shutdown();
+	bp_key_static_shutdown();
+	return 0;
+}
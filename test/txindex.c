@@ -0,0 +1,251 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <sys/types.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/message.h>
+#include <ccoin/mbr.h>
+#include <ccoin/serialize.h>
+#include <ccoin/txindex.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static const char *idx_fn = "txindex.out";
+static const char *idx_log_fn = "txindex.out.log";
+
+struct test_block {
+	struct bp_block	block;
+	uint64_t	pos;
+	unsigned int	hdr_len;
+};
+
+/* read every block of a blocks file, with its position */
+static parr *read_blocks(const char *ser_fn, bool is_msg)
+{
+	int fd = file_seq_open(ser_fn);
+	if (fd < 0) {
+		perror(ser_fn);
+		exit(1);
+	}
+
+	parr *blocks = parr_new(0, NULL);
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	off_t pos = 0;
+
+	while (is_msg ? fread_message(fd, &msg, &read_ok) :
+			fread_block(fd, &msg, &read_ok)) {
+		struct test_block *tb = calloc(1, sizeof(*tb));
+		bp_block_init(&tb->block);
+		tb->pos = pos;
+		tb->hdr_len = is_msg ? P2P_HDR_SZ :
+				       sizeof(struct p2p_blockfile_hdr);
+
+		struct const_buffer buf = { msg.data, msg.hdr.data_len };
+		assert(deser_bp_block(&tb->block, &buf));
+		parr_add(blocks, tb);
+
+		pos = lseek(fd, 0, SEEK_CUR);
+	}
+	assert(read_ok);
+
+	close(fd);
+	free(msg.data);
+	return blocks;
+}
+
+static void free_blocks(parr *blocks)
+{
+	unsigned int i;
+	for (i = 0; i < blocks->len; i++) {
+		struct test_block *tb = parr_idx(blocks, i);
+		bp_block_free(&tb->block);
+		free(tb);
+	}
+	parr_free(blocks, true);
+}
+
+static void add_blocks(struct bp_txindex *idx, parr *blocks,
+		       unsigned int start, unsigned int end)
+{
+	unsigned int i;
+	for (i = start; i < end; i++) {
+		struct test_block *tb = parr_idx(blocks, i);
+		assert(bp_txindex_add_block(idx, &tb->block, tb->pos,
+					    tb->hdr_len));
+	}
+}
+
+/* every tx of blocks [0, end) found, and read back byte-exact */
+static void check_blocks(const struct bp_txindex *idx, parr *blocks,
+			 unsigned int end, int fd)
+{
+	unsigned int i, j;
+	for (i = 0; i < end; i++) {
+		struct test_block *tb = parr_idx(blocks, i);
+
+		for (j = 0; j < tb->block.vtx->len; j++) {
+			struct bp_tx *tx = parr_idx(tb->block.vtx, j);
+			struct bp_txindex_ent ent;
+
+			assert(bp_txindex_lookup(idx, &tx->sha256, &ent));
+			assert(ent.blk_pos == tb->pos);
+			assert(ent.tx_len == bp_tx_ser_size(tx));
+
+			struct bp_tx tx2;
+			bp_tx_init(&tx2);
+			assert(bp_txindex_read_tx(fd, &ent, &tx2));
+			assert(bu256_equal(&tx2.sha256, &tx->sha256));
+			bp_tx_free(&tx2);
+		}
+	}
+
+	bu256_t missing;
+	memset(&missing, 0x5a, sizeof(missing));
+	struct bp_txindex_ent ent;
+	assert(!bp_txindex_lookup(idx, &missing, &ent));
+}
+
+static uint64_t blocks_end(parr *blocks, unsigned int end)
+{
+	struct test_block *tb = parr_idx(blocks, end - 1);
+	return tb->pos + tb->hdr_len + bp_block_ser_size(&tb->block);
+}
+
+static void test_persist(const char *ser_fn, bool is_msg)
+{
+	parr *blocks = read_blocks(ser_fn, is_msg);
+	unsigned int n = blocks->len, half = n / 2;
+	struct bp_txindex idx;
+
+	int fd = open(ser_fn, O_RDONLY);
+	assert(fd >= 0);
+
+	unlink(idx_fn);
+	unlink(idx_log_fn);
+
+	/* memory only */
+	assert(bp_txindex_open(&idx, NULL));
+	add_blocks(&idx, blocks, 0, n);
+	check_blocks(&idx, blocks, n, fd);
+	assert(bp_txindex_compact(&idx));
+	bp_txindex_close(&idx);
+
+	/* log only, then replayed */
+	assert(bp_txindex_open(&idx, idx_fn));
+	assert(idx.blocks_end == 0);
+	add_blocks(&idx, blocks, 0, half);
+	bp_txindex_close(&idx);
+
+	assert(bp_txindex_open(&idx, idx_fn));
+	assert(idx.bf.n_base == 0);
+	if (half)
+		assert(idx.blocks_end == blocks_end(blocks, half));
+	check_blocks(&idx, blocks, half, fd);
+
+	/* compacted, then more blocks on top */
+	assert(bp_txindex_compact(&idx));
+	assert(bp_hashtab_size(idx.recent) == 0);
+	add_blocks(&idx, blocks, half, n);
+	check_blocks(&idx, blocks, n, fd);
+	bp_txindex_close(&idx);
+
+	assert(bp_txindex_open(&idx, idx_fn));
+	assert(idx.blocks_end == blocks_end(blocks, n));
+	check_blocks(&idx, blocks, n, fd);
+
+	/* re-adding a block is harmless */
+	add_blocks(&idx, blocks, n - 1, n);
+	assert(bp_txindex_compact(&idx));
+	check_blocks(&idx, blocks, n, fd);
+	bp_txindex_close(&idx);
+
+	close(fd);
+	free_blocks(blocks);
+	unlink(idx_fn);
+	unlink(idx_log_fn);
+}
+
+/* one tx by index, versus reloading and hashing its whole block */
+static void bench_read(const char *ser_fn)
+{
+	parr *blocks = read_blocks(ser_fn, true);
+	struct test_block *tb = parr_idx(blocks, 0);
+	struct bp_txindex idx;
+	unsigned int i;
+
+	assert(bp_txindex_open(&idx, NULL));
+	add_blocks(&idx, blocks, 0, 1);
+
+	int fd = open(ser_fn, O_RDONLY);
+	assert(fd >= 0);
+
+	unsigned int n_tx = tb->block.vtx->len;
+	double t0 = now_ms();
+	for (i = 0; i < n_tx; i++) {
+		struct bp_tx *tx = parr_idx(tb->block.vtx, i);
+		struct p2p_message msg = {};
+		bool read_ok;
+		struct bp_block block;
+		bp_block_init(&block);
+
+		assert(lseek(fd, tb->pos, SEEK_SET) == tb->pos);
+		assert(fread_message(fd, &msg, &read_ok));
+		struct const_buffer buf = { msg.data, msg.hdr.data_len };
+		assert(deser_bp_block(&block, &buf));
+
+		unsigned int j;
+		for (j = 0; j < block.vtx->len; j++) {
+			struct bp_tx *tx2 = parr_idx(block.vtx, j);
+			bp_tx_calc_sha256(tx2);
+			if (bu256_equal(&tx2->sha256, &tx->sha256))
+				break;
+		}
+		assert(j < block.vtx->len);
+
+		bp_block_free(&block);
+		free(msg.data);
+	}
+
+	double t1 = now_ms();
+	for (i = 0; i < n_tx; i++) {
+		struct bp_tx *tx = parr_idx(tb->block.vtx, i);
+		struct bp_txindex_ent ent;
+		struct bp_tx tx2;
+		bp_tx_init(&tx2);
+
+		assert(bp_txindex_lookup(&idx, &tx->sha256, &ent));
+		assert(bp_txindex_read_tx(fd, &ent, &tx2));
+		bp_tx_free(&tx2);
+	}
+	double t2 = now_ms();
+
+	fprintf(stderr, "txindex: %u txs: block reload %.2f ms, "
+		"indexed read %.2f ms\n", n_tx, t1 - t0, t2 - t1);
+
+	close(fd);
+	bp_txindex_close(&idx);
+	free_blocks(blocks);
+}
+
+int main (int argc, char *argv[])
+{
+	char *fn = test_filename("data/blks10.ser");
+	test_persist(fn, false);
+	free(fn);
+
+	fn = test_filename("data/blk120383.ser");
+	test_persist(fn, true);
+	if (test_bench(argc, argv))
+		bench_read(fn);
+	free(fn);
+
+	return 0;
+}
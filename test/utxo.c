@@ -0,0 +1,625 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <ccoin/core.h>
+#include <ccoin/serialize.h>
+#include "libtest.h"
+
+enum {
+	BASE_HEIGHT	= 20,
+};
+
+static struct bp_tx *new_tx(void)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(2, bp_txin_freep);
+	tx->vout = parr_new(2, bp_txout_freep);
+	return tx;
+}
+
+static void tx_add_in(struct bp_tx *tx, const bu256_t *hash, uint32_t n)
+{
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	if (hash)
+		bu256_copy(&txin->prevout.hash, hash);
+	txin->prevout.n = n;
+	txin->scriptSig = cstr_new("");
+	txin->nSequence = 0xffffffffU;
+	parr_add(tx->vin, txin);
+}
+
+static void tx_add_out(struct bp_tx *tx, int64_t value)
+{
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = value;
+	txout->scriptPubKey = cstr_new_buf("\x51", 1);	/* OP_TRUE */
+	parr_add(tx->vout, txout);
+}
+
+/*
+ * Block at height on branch tag.  Beyond the coinbase, it spends the
+ * previous block's coinbase and change output, then chains a second
+ * tx off the first within the block.
+ */
+static struct bp_block *make_block(unsigned int height, uint32_t tag,
+				   const struct bp_block *prev)
+{
+	struct bp_block *block = calloc(1, sizeof(*block));
+	bp_block_init(block);
+	block->vtx = parr_new(3, bp_tx_freep);
+
+	struct bp_tx *coinbase = new_tx();
+	tx_add_in(coinbase, NULL, 0xffffffffU);
+	struct bp_txin *txin = parr_idx(coinbase->vin, 0);
+	uint32_t le_height = htole32(height), le_tag = htole32(tag);
+	cstr_append_buf(txin->scriptSig, &le_height, sizeof(le_height));
+	cstr_append_buf(txin->scriptSig, &le_tag, sizeof(le_tag));
+	tx_add_out(coinbase, 25);
+	tx_add_out(coinbase, 25);
+	bp_tx_calc_sha256(coinbase);
+	parr_add(block->vtx, coinbase);
+
+	if (!prev)
+		return block;
+
+	struct bp_tx *prev_cb = parr_idx(prev->vtx, 0);
+	struct bp_tx *tx1 = new_tx();
+	tx_add_in(tx1, &prev_cb->sha256, 0);
+	if (prev->vtx->len > 1) {
+		struct bp_tx *prev_tx1 = parr_idx(prev->vtx, 1);
+		tx_add_in(tx1, &prev_tx1->sha256, 1);
+	}
+	tx_add_out(tx1, 10);
+	tx_add_out(tx1, 10);
+	bp_tx_calc_sha256(tx1);
+	parr_add(block->vtx, tx1);
+
+	struct bp_tx *tx2 = new_tx();
+	tx_add_in(tx2, &tx1->sha256, 0);
+	tx_add_out(tx2, 5);
+	bp_tx_calc_sha256(tx2);
+	parr_add(block->vtx, tx2);
+
+	return block;
+}
+
+static void connect_block(struct bp_utxo_set *uset,
+			  const struct bp_block *block,
+			  unsigned int height, parr *undo)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		for (j = 0; i > 0 && j < tx->vin->len; j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			bool rc = bp_utxo_spend_undo(uset, &txin->prevout,
+						     undo);
+			assert(rc);
+		}
+
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		bool rc = bp_utxo_from_tx(coin, tx, (i == 0), height);
+		assert(rc);
+		bp_utxo_set_add(uset, coin);
+	}
+}
+
+static void disconnect_block(struct bp_utxo_set *uset,
+			     struct bp_block *block, const parr *undo)
+{
+	/* round-trip undo data through its on-disk encoding */
+	cstring *s = cstr_new_sz(1024);
+	ser_bp_block_undo(s, undo);
+
+	parr *undo2 = NULL;
+	struct const_buffer buf = { s->str, s->len };
+	bool rc = deser_bp_block_undo(&undo2, &buf);
+	assert(rc);
+	assert(buf.len == 0);
+	assert(undo2->len == undo->len);
+
+	rc = bp_utxo_disconnect_block(uset, block, undo2);
+	assert(rc);
+
+	parr_free(undo2, true);
+	cstr_free(s, true);
+}
+
+struct utxo_cmp {
+	struct bp_utxo_set	*other;
+	bool			equal;
+};
+
+static void utxo_cmp_iter(void *key, void *value, void *priv)
+{
+	struct bp_utxo *coin = value;
+	struct utxo_cmp *cmp = priv;
+	struct bp_utxo *other = bp_utxo_lookup(cmp->other, &coin->hash);
+
+	if (!other || (other->is_coinbase != coin->is_coinbase) ||
+	    (other->height != coin->height) ||
+	    (other->version != coin->version)) {
+		cmp->equal = false;
+		return;
+	}
+
+	unsigned int i, len = coin->vout->len;
+	if (other->vout->len > len)
+		len = other->vout->len;
+
+	for (i = 0; i < len; i++) {
+		struct bp_txout *a = NULL, *b = NULL;
+		if (i < coin->vout->len)
+			a = parr_idx(coin->vout, i);
+		if (i < other->vout->len)
+			b = parr_idx(other->vout, i);
+
+		if (!a && !b)
+			continue;
+		if (!a || !b || (a->nValue != b->nValue) ||
+		    !cstr_equal(a->scriptPubKey, b->scriptPubKey))
+			cmp->equal = false;
+	}
+}
+
+static bool utxo_set_equal(struct bp_utxo_set *a, struct bp_utxo_set *b)
+{
+	if (bp_hashtab_size(a->map) != bp_hashtab_size(b->map))
+		return false;
+
+	struct utxo_cmp cmp = { b, true };
+	bp_hashtab_iter(a->map, utxo_cmp_iter, &cmp);
+	return cmp.equal;
+}
+
+static parr *make_branch(const struct bp_block *prev, unsigned int height,
+			 unsigned int n, uint32_t tag)
+{
+	parr *blocks = parr_new(n, NULL);
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct bp_block *block = make_block(height + i, tag, prev);
+		parr_add(blocks, block);
+		prev = block;
+	}
+
+	return blocks;
+}
+
+static void free_branch(parr *blocks)
+{
+	unsigned int i;
+	for (i = 0; i < blocks->len; i++) {
+		struct bp_block *block = parr_idx(blocks, i);
+		bp_block_free(block);
+		free(block);
+	}
+	parr_free(blocks, true);
+}
+
+static void connect_branch(struct bp_utxo_set *uset, parr *blocks,
+			   unsigned int height, parr *undos)
+{
+	unsigned int i;
+	for (i = 0; i < blocks->len; i++) {
+		parr *undo = parr_new(0, bp_utxo_undo_freep);
+		connect_block(uset, parr_idx(blocks, i), height + i, undo);
+		if (undos)
+			parr_add(undos, undo);
+		else
+			parr_free(undo, true);
+	}
+}
+
+static void test_reorg(unsigned int depth)
+{
+	parr *base = make_branch(NULL, 0, BASE_HEIGHT, 0);
+	struct bp_block *fork = parr_idx(base, base->len - 1);
+	parr *branch_a = make_branch(fork, BASE_HEIGHT, depth, 1);
+	parr *branch_b = make_branch(fork, BASE_HEIGHT, depth + 1, 2);
+
+	/* reference sets, built directly */
+	struct bp_utxo_set uset_base, uset_b;
+	bp_utxo_set_init(&uset_base);
+	bp_utxo_set_init(&uset_b);
+	connect_branch(&uset_base, base, 0, NULL);
+	connect_branch(&uset_b, base, 0, NULL);
+	connect_branch(&uset_b, branch_b, BASE_HEIGHT, NULL);
+
+	/* base + A, then reorg to base + B */
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+	parr *undos = parr_new(depth, NULL);
+	connect_branch(&uset, base, 0, NULL);
+	connect_branch(&uset, branch_a, BASE_HEIGHT, undos);
+	assert(!utxo_set_equal(&uset, &uset_b));
+
+	double t0 = now_ms();
+
+	unsigned int i = depth;
+	while (i-- > 0)
+		disconnect_block(&uset, parr_idx(branch_a, i),
+				 parr_idx(undos, i));
+
+	double t1 = now_ms();
+	assert(utxo_set_equal(&uset, &uset_base));
+
+	connect_branch(&uset, branch_b, BASE_HEIGHT, NULL);
+
+	double t2 = now_ms();
+	assert(utxo_set_equal(&uset, &uset_b));
+
+	fprintf(stderr, "utxo: reorg depth %u: disconnect %.3f ms, "
+		"connect %.3f ms\n", depth, t1 - t0, t2 - t1);
+
+	for (i = 0; i < undos->len; i++)
+		parr_free(parr_idx(undos, i), true);
+	parr_free(undos, true);
+	bp_utxo_set_free(&uset);
+	bp_utxo_set_free(&uset_b);
+	bp_utxo_set_free(&uset_base);
+	free_branch(branch_b);
+	free_branch(branch_a);
+	free_branch(base);
+}
+
+static void test_unspend(void)
+{
+	struct bp_block *block = make_block(1, 0, NULL);
+	struct bp_tx *coinbase = parr_idx(block->vtx, 0);
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+	connect_block(&uset, block, 1, NULL);
+
+	struct bp_outpt outpt;
+	bu256_copy(&outpt.hash, &coinbase->sha256);
+	outpt.n = 0;
+
+	parr *undo = parr_new(0, bp_utxo_undo_freep);
+	bool rc = bp_utxo_spend_undo(&uset, &outpt, undo);
+	assert(rc);
+	assert(undo->len == 1);
+	assert(bp_utxo_is_spent(&uset, &outpt));
+
+	/* double spend fails, and records nothing */
+	rc = bp_utxo_spend_undo(&uset, &outpt, undo);
+	assert(!rc);
+	assert(undo->len == 1);
+
+	struct bp_utxo_undo *ent = parr_idx(undo, 0);
+	assert(ent->is_coinbase);
+	assert(ent->height == 1);
+	assert(ent->txout.nValue == 25);
+
+	rc = bp_utxo_unspend(&uset, ent);
+	assert(rc);
+	assert(!bp_utxo_is_spent(&uset, &outpt));
+
+	/* output already unspent */
+	rc = bp_utxo_unspend(&uset, ent);
+	assert(!rc);
+
+	/* spend both outputs, deleting the coin, then recreate it */
+	outpt.n = 1;
+	rc = bp_utxo_spend_undo(&uset, &outpt, undo);
+	assert(rc);
+	outpt.n = 0;
+	rc = bp_utxo_spend_undo(&uset, &outpt, undo);
+	assert(rc);
+	assert(bp_utxo_lookup(&uset, &coinbase->sha256) == NULL);
+
+	rc = bp_utxo_unspend(&uset, parr_idx(undo, 2));
+	assert(rc);
+	struct bp_utxo *coin = bp_utxo_lookup(&uset, &coinbase->sha256);
+	assert(coin != NULL);
+	assert(coin->is_coinbase && coin->height == 1);
+	assert(!bp_utxo_is_spent(&uset, &outpt));
+	outpt.n = 1;
+	assert(bp_utxo_is_spent(&uset, &outpt));
+
+	parr_free(undo, true);
+	bp_utxo_set_free(&uset);
+	bp_block_free(block);
+	free(block);
+}
+
+/* stage block in view, without flushing */
+static bool stage_block_view(struct bp_utxo_set *uset,
+			     const struct bp_block *block,
+			     unsigned int height, struct bp_utxo_view *view)
+{
+	unsigned int i, j;
+
+	bp_utxo_view_init(view, uset, block);
+
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = parr_idx(block->vtx, i);
+
+		for (j = 0; i > 0 && j < tx->vin->len; j++) {
+			struct bp_txin *txin = parr_idx(tx->vin, j);
+			struct bp_utxo *coin;
+			coin = bp_utxo_view_next(view, &txin->prevout);
+			if (!coin ||
+			    !bp_utxo_view_spend(view, coin, &txin->prevout))
+				return false;
+		}
+
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		bool rc = bp_utxo_from_tx(coin, tx, (i == 0), height);
+		assert(rc);
+		rc = bp_utxo_view_add(view, coin);
+		assert(rc);
+	}
+
+	return true;
+}
+
+static void test_view(void)
+{
+	parr *blocks = make_branch(NULL, 0, 30, 0);
+
+	struct bp_utxo_set uset_ref, uset;
+	bp_utxo_set_init(&uset_ref);
+	bp_utxo_set_init(&uset);
+	parr *undos_ref = parr_new(blocks->len, NULL);
+	connect_branch(&uset_ref, blocks, 0, undos_ref);
+
+	unsigned int i;
+	for (i = 0; i < blocks->len; i++) {
+		struct bp_block *block = parr_idx(blocks, i);
+		struct bp_utxo_view view;
+		parr *undo = parr_new(0, bp_utxo_undo_freep);
+
+		bool rc = stage_block_view(&uset, block, i, &view);
+		assert(rc);
+
+		/* tx1 spends the last block; tx2 spends tx1, in-block */
+		if (i > 1) {
+			assert(view.n_resolved == 2);
+			assert(view.n_late == 0);
+		}
+
+		/* nothing reaches the set before the flush */
+		struct bp_tx *coinbase = parr_idx(block->vtx, 0);
+		assert(!bp_utxo_lookup(&uset, &coinbase->sha256));
+
+		rc = bp_utxo_view_flush(&view, undo);
+		assert(rc);
+		assert(bp_utxo_lookup(&uset, &coinbase->sha256) != NULL);
+		bp_utxo_view_free(&view);
+
+		/* same undo data as spending directly */
+		parr *undo_ref = parr_idx(undos_ref, i);
+		assert(undo->len == undo_ref->len);
+		unsigned int j;
+		for (j = 0; j < undo->len; j++) {
+			struct bp_utxo_undo *a = parr_idx(undo, j);
+			struct bp_utxo_undo *b = parr_idx(undo_ref, j);
+			assert(bp_outpt_equal(&a->prevout, &b->prevout));
+			assert(a->txout.nValue == b->txout.nValue);
+		}
+
+		parr_free(undo, true);
+	}
+
+	assert(utxo_set_equal(&uset, &uset_ref));
+
+	/* a block failing midway leaves the set untouched */
+	struct bp_block *last = parr_idx(blocks, blocks->len - 1);
+	struct bp_block *bad = make_block(blocks->len, 0, last);
+	struct bp_tx *tx2 = parr_idx(bad->vtx, 2);
+	struct bp_tx *tx1 = parr_idx(bad->vtx, 1);
+	struct bp_txin *txin1 = parr_idx(tx1->vin, 0);
+	tx_add_in(tx2, &txin1->prevout.hash, txin1->prevout.n);
+	bp_tx_calc_sha256(tx2);
+
+	struct bp_utxo_view view;
+	bool rc = stage_block_view(&uset, bad, blocks->len, &view);
+	assert(!rc);
+	bp_utxo_view_free(&view);
+	assert(utxo_set_equal(&uset, &uset_ref));
+
+	/* unknown coin */
+	struct bp_tx *tx3 = new_tx();
+	bu256_t missing;
+	memset(&missing, 0xee, sizeof(missing));
+	tx_add_in(tx3, &missing, 0);
+	tx_add_out(tx3, 1);
+	bp_tx_calc_sha256(tx3);
+	parr_add(bad->vtx, tx3);
+	parr_remove_idx(tx2->vin, tx2->vin->len - 1);
+
+	rc = stage_block_view(&uset, bad, blocks->len, &view);
+	assert(!rc);
+	bp_utxo_view_free(&view);
+	assert(utxo_set_equal(&uset, &uset_ref));
+
+	bp_block_free(bad);
+	free(bad);
+	for (i = 0; i < undos_ref->len; i++)
+		parr_free(parr_idx(undos_ref, i), true);
+	parr_free(undos_ref, true);
+	bp_utxo_set_free(&uset);
+	bp_utxo_set_free(&uset_ref);
+	free_branch(blocks);
+}
+
+enum {
+	REPLAY_COINS	= 200000,
+	REPLAY_BLOCKS	= 50,
+	REPLAY_INPUTS	= 2000,		/* per block */
+};
+
+static uint32_t replay_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void replay_fill(struct bp_utxo_set *uset, const bu256_t *hashes)
+{
+	unsigned int i;
+	for (i = 0; i < REPLAY_COINS; i++) {
+		struct bp_utxo *coin = calloc(1, sizeof(*coin));
+		bp_utxo_init(coin);
+		bu256_copy(&coin->hash, &hashes[i]);
+		coin->height = 1;
+		coin->vout = parr_new(2, bp_txout_freep);
+
+		unsigned int j;
+		for (j = 0; j < 2; j++) {
+			struct bp_txout *txout = calloc(1, sizeof(*txout));
+			bp_txout_init(txout);
+			txout->nValue = 1000;
+			txout->scriptPubKey = cstr_new_buf("\x51", 1);
+			parr_add(coin->vout, txout);
+		}
+
+		bp_utxo_set_add(uset, coin);
+	}
+}
+
+static double replay_plain(struct bp_utxo_set *uset,
+			   const struct bp_block *block)
+{
+	unsigned int j, k;
+	double t0 = now_ms();
+
+	for (j = 1; j < block->vtx->len; j++) {
+		struct bp_tx *tx = parr_idx(block->vtx, j);
+		for (k = 0; k < tx->vin->len; k++) {
+			struct bp_txin *txin = parr_idx(tx->vin, k);
+			struct bp_utxo *coin;
+			coin = bp_utxo_lookup(uset, &txin->prevout.hash);
+			assert(coin && coin->height == 1);
+			bool rc = bp_utxo_spend(uset, &txin->prevout);
+			assert(rc);
+		}
+	}
+
+	return now_ms() - t0;
+}
+
+static double replay_view(struct bp_utxo_set *uset,
+			  const struct bp_block *block)
+{
+	struct bp_utxo_view view;
+	unsigned int j, k;
+	double t0 = now_ms();
+
+	bp_utxo_view_init(&view, uset, block);
+	for (j = 1; j < block->vtx->len; j++) {
+		struct bp_tx *tx = parr_idx(block->vtx, j);
+		for (k = 0; k < tx->vin->len; k++) {
+			struct bp_txin *txin = parr_idx(tx->vin, k);
+			struct bp_utxo *coin;
+			coin = bp_utxo_view_next(&view, &txin->prevout);
+			assert(coin && coin->height == 1);
+			bool rc = bp_utxo_view_spend(&view, coin,
+						     &txin->prevout);
+			assert(rc);
+		}
+	}
+	assert(view.n_late == 0);
+	bool rc = bp_utxo_view_flush(&view, NULL);
+	assert(rc);
+	bp_utxo_view_free(&view);
+
+	return now_ms() - t0;
+}
+
+/* blocks spending random coins of a large set: direct vs through a view */
+static void test_view_replay(void)
+{
+	bu256_t *hashes = calloc(REPLAY_COINS, sizeof(bu256_t));
+	uint32_t state = 2463534242U;
+	unsigned int i, j, k;
+
+	for (i = 0; i < REPLAY_COINS; i++)
+		for (k = 0; k < BU256_WORDS; k++)
+			hashes[i].dword[k] = replay_rand(&state);
+
+	struct bp_utxo_set uset_plain, uset_view;
+	bp_utxo_set_init(&uset_plain);
+	bp_utxo_set_init(&uset_view);
+	replay_fill(&uset_plain, hashes);
+	replay_fill(&uset_view, hashes);
+
+	/* each block: one tx per two inputs, spending random coins */
+	parr *blocks = parr_new(REPLAY_BLOCKS, NULL);
+	unsigned int next_coin = 0;
+	for (i = 0; i < REPLAY_BLOCKS; i++) {
+		struct bp_block *block = calloc(1, sizeof(*block));
+		bp_block_init(block);
+		block->vtx = parr_new(REPLAY_INPUTS / 2 + 1, bp_tx_freep);
+		parr_add(block->vtx, new_tx());		/* coinbase */
+
+		for (j = 0; j < REPLAY_INPUTS / 2; j++) {
+			struct bp_tx *tx = new_tx();
+			for (k = 0; k < 2; k++) {
+				/* a permutation, so no coin is reused */
+				uint32_t c = (next_coin++ * 7919U) %
+					     REPLAY_COINS;
+				tx_add_in(tx, &hashes[c],
+					  replay_rand(&state) % 2);
+			}
+			parr_add(block->vtx, tx);
+		}
+		parr_add(blocks, block);
+	}
+
+	/* interleaved, so both see the same machine state */
+	double plain_ms = 0.0, view_ms = 0.0;
+	for (i = 0; i < blocks->len; i++) {
+		struct bp_block *block = parr_idx(blocks, i);
+		plain_ms += replay_plain(&uset_plain, block);
+		view_ms += replay_view(&uset_view, block);
+	}
+
+	assert(utxo_set_equal(&uset_plain, &uset_view));
+
+	fprintf(stderr, "utxo: replay %u inputs over %u coins: "
+		"direct %.2f ms, view %.2f ms\n",
+		REPLAY_BLOCKS * REPLAY_INPUTS, REPLAY_COINS, plain_ms, view_ms);
+
+	for (i = 0; i < blocks->len; i++) {
+		struct bp_block *block = parr_idx(blocks, i);
+		bp_block_free(block);
+		free(block);
+	}
+	parr_free(blocks, true);
+	bp_utxo_set_free(&uset_view);
+	bp_utxo_set_free(&uset_plain);
+	free(hashes);
+}
+
+int main (int argc, char *argv[])
+{
+	test_unspend();
+	test_reorg(1);
+	test_reorg(10);
+	test_reorg(100);
+	test_view();
+	if (test_bench(argc, argv))
+		test_view_replay();
+	return 0;
+}
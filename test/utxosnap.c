@@ -0,0 +1,334 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/parallel.h>
+#include <ccoin/utxosnap.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static const unsigned char netmagic[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
+
+static uint32_t snap_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/* coin idx of a deterministic set: 1-5 outputs, some spent */
+static struct bp_utxo *make_coin(unsigned int idx)
+{
+	uint32_t state = 0x9e3779b9U ^ (idx * 2654435761U);
+	unsigned int i;
+
+	if (!state)
+		state = 1;
+
+	struct bp_utxo *coin = calloc(1, sizeof(*coin));
+	bp_utxo_init(coin);
+	for (i = 0; i < BU256_WORDS; i++)
+		coin->hash.dword[i] = snap_rand(&state);
+	coin->height = idx % 500000;
+	coin->version = 1;
+	coin->is_coinbase = ((idx % 17) == 0);
+
+	unsigned int n_vout = 1 + (snap_rand(&state) % 5);
+	coin->vout = parr_new(n_vout, bp_txout_freep);
+
+	bool have_unspent = false;
+	for (i = 0; i < n_vout; i++) {
+		bool spent = (snap_rand(&state) % 3) == 0;
+		if (spent && (have_unspent || i + 1 < n_vout)) {
+			parr_add(coin->vout, NULL);
+			continue;
+		}
+
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		txout->nValue = snap_rand(&state);
+		unsigned char script[25];
+		memset(script, idx & 0xff, sizeof(script));
+		txout->scriptPubKey = cstr_new_buf(script,
+				1 + (snap_rand(&state) % sizeof(script)));
+		parr_add(coin->vout, txout);
+		have_unspent = true;
+	}
+
+	return coin;
+}
+
+static void fill_set(struct bp_utxo_set *uset, unsigned int n, bool reverse)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		bp_utxo_set_add(uset, make_coin(reverse ? (n - 1 - i) : i));
+}
+
+struct set_cmp {
+	struct bp_utxo_set	*other;
+	bool			equal;
+};
+
+static void set_cmp_iter(void *key, void *value, void *priv)
+{
+	struct bp_utxo *coin = value;
+	struct set_cmp *cmp = priv;
+	struct bp_utxo *other = bp_utxo_lookup(cmp->other, &coin->hash);
+
+	if (!other || (other->is_coinbase != coin->is_coinbase) ||
+	    (other->height != coin->height) ||
+	    (other->version != coin->version)) {
+		cmp->equal = false;
+		return;
+	}
+
+	/* trailing spent outputs are not kept */
+	unsigned int i, len = MAX(coin->vout->len, other->vout->len);
+	for (i = 0; i < len; i++) {
+		struct bp_txout *a = NULL, *b = NULL;
+		if (i < coin->vout->len)
+			a = parr_idx(coin->vout, i);
+		if (i < other->vout->len)
+			b = parr_idx(other->vout, i);
+
+		if (!a && !b)
+			continue;
+		if (!a || !b || (a->nValue != b->nValue) ||
+		    !cstr_equal(a->scriptPubKey, b->scriptPubKey))
+			cmp->equal = false;
+	}
+}
+
+static bool set_equal(struct bp_utxo_set *a, struct bp_utxo_set *b)
+{
+	if (bp_hashtab_size(a->map) != bp_hashtab_size(b->map))
+		return false;
+
+	struct set_cmp cmp = { b, true };
+	bp_hashtab_iter(a->map, set_cmp_iter, &cmp);
+	return cmp.equal;
+}
+
+static void test_snapshot(unsigned int n_coins)
+{
+	const char *fn_a = "utxosnap-a.out";
+	const char *fn_b = "utxosnap-b.out";
+
+	struct bp_utxo_set uset_a, uset_b;
+	bp_utxo_set_init(&uset_a);
+	bp_utxo_set_init(&uset_b);
+	fill_set(&uset_a, n_coins, false);
+	fill_set(&uset_b, n_coins, true);
+
+	bu256_t best;
+	memset(&best, 0x42, sizeof(best));
+
+	/* same set, built in a different order: identical snapshot */
+	struct bp_utxosnap_info info_a, info_b;
+	double t0 = now_ms();
+	bool rc = bp_utxosnap_write(fn_a, &uset_a, netmagic, &best, 1234,
+				    &info_a);
+	double t1 = now_ms();
+	assert(rc);
+	rc = bp_utxosnap_write(fn_b, &uset_b, netmagic, &best, 1234, &info_b);
+	assert(rc);
+	assert(bu256_equal(&info_a.snap_hash, &info_b.snap_hash));
+	assert(info_a.n_coins == n_coins);
+
+	void *data_a = NULL, *data_b = NULL;
+	size_t len_a = 0, len_b = 0;
+	rc = bu_read_file(fn_a, &data_a, &len_a, 512 * 1024 * 1024);
+	assert(rc);
+	rc = bu_read_file(fn_b, &data_b, &len_b, 512 * 1024 * 1024);
+	assert(rc);
+	assert(len_a == len_b && !memcmp(data_a, data_b, len_a));
+	free(data_b);
+
+	struct bp_utxosnap_info info;
+	rc = bp_utxosnap_read_info(fn_a, &info);
+	assert(rc);
+	assert(!memcmp(info.netmagic, netmagic, 4));
+	assert(bu256_equal(&info.best_hash, &best));
+	assert(info.height == 1234);
+	assert(info.n_coins == n_coins);
+	assert(bu256_equal(&info.snap_hash, &info_a.snap_hash));
+
+	/* load, serially and on the thread pool */
+	unsigned int threads[] = { 1, 0 };
+	double load_ms[2];
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		struct bp_utxo_set uset_c;
+		bp_utxo_set_init(&uset_c);
+		bp_parallel_set_threads(threads[i]);
+
+		double t2 = now_ms();
+		rc = bp_utxosnap_load(fn_a, &uset_c, &info);
+		load_ms[i] = now_ms() - t2;
+		assert(rc);
+		assert(bu256_equal(&info.snap_hash, &info_a.snap_hash));
+		assert(set_equal(&uset_a, &uset_c));
+
+		/* only into an empty set */
+		if (n_coins)
+			assert(!bp_utxosnap_load(fn_a, &uset_c, &info));
+		bp_utxo_set_free(&uset_c);
+	}
+	bp_parallel_set_threads(0);
+
+	fprintf(stderr, "utxosnap: %u coins, %zu bytes: write %.1f ms, "
+		"load %.1f ms serial, %.1f ms with %u threads\n",
+		n_coins, len_a, t1 - t0, load_ms[0], load_ms[1],
+		bp_parallel_threads());
+
+	/* corrupt one byte; checksum must reject the file */
+	((unsigned char *)data_a)[len_a / 2] ^= 0x01;
+	rc = bu_write_file(fn_a, data_a, len_a);
+	assert(rc);
+	free(data_a);
+
+	struct bp_utxo_set uset_d;
+	bp_utxo_set_init(&uset_d);
+	assert(!bp_utxosnap_read_info(fn_a, &info));
+	assert(!bp_utxosnap_load(fn_a, &uset_d, &info));
+	assert(bp_hashtab_size(uset_d.map) == 0);
+	bp_utxo_set_free(&uset_d);
+
+	assert(unlink(fn_a) == 0);
+	assert(unlink(fn_b) == 0);
+	bp_utxo_set_free(&uset_b);
+	bp_utxo_set_free(&uset_a);
+}
+
+static void snap_hash(struct bp_utxo_set *uset, bu256_t *hash)
+{
+	const char *fn = "utxosnap-r.out";
+	struct bp_utxosnap_info info;
+	bu256_t best;
+
+	memset(&best, 0x42, sizeof(best));
+	assert(bp_utxosnap_write(fn, uset, netmagic, &best, 1234, &info));
+	bu256_copy(hash, &info.snap_hash);
+	assert(unlink(fn) == 0);
+}
+
+static struct bp_tx *make_tx(const struct bp_outpt *prevout, int64_t value)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(1, bp_txin_freep);
+	tx->vout = parr_new(3, bp_txout_freep);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	if (prevout)
+		bp_outpt_copy(&txin->prevout, prevout);
+	else
+		txin->prevout.n = 0xffffffffU;
+	txin->scriptSig = cstr_new_buf(&value, sizeof(value));
+	txin->nSequence = 0xffffffffU;
+	parr_add(tx->vin, txin);
+
+	unsigned int i;
+	for (i = 0; i < 3; i++) {
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+		bp_txout_init(txout);
+		txout->nValue = value + i;
+		txout->scriptPubKey = cstr_new_buf("\x51", 1);
+		parr_add(tx->vout, txout);
+	}
+
+	bp_tx_calc_sha256(tx);
+	return tx;
+}
+
+/*
+ * A block spends the first output of a coin whose other outputs were
+ * spent before.  Disconnecting the block recreates that coin with one
+ * output, not its tx's three; the snapshot must not tell the difference.
+ */
+static void test_reorg(void)
+{
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+	fill_set(&uset, 50, false);
+
+	struct bp_tx *prev_tx = make_tx(NULL, 1000);
+	struct bp_utxo *coin = calloc(1, sizeof(*coin));
+	bp_utxo_init(coin);
+	assert(bp_utxo_from_tx(coin, prev_tx, false, 100));
+	bp_utxo_set_add(&uset, coin);
+
+	struct bp_outpt outpt;
+	bu256_copy(&outpt.hash, &prev_tx->sha256);
+	for (outpt.n = 1; outpt.n < 3; outpt.n++)
+		assert(bp_utxo_spend(&uset, &outpt));
+	outpt.n = 0;
+
+	struct bp_block block;
+	bp_block_init(&block);
+	block.vtx = parr_new(2, bp_tx_freep);
+	parr_add(block.vtx, make_tx(NULL, 50));
+	parr_add(block.vtx, make_tx(&outpt, 10));
+
+	bu256_t hash_before, hash_connected, hash;
+	snap_hash(&uset, &hash_before);
+
+	unsigned int round, i;
+	for (round = 0; round < 2; round++) {
+		parr *undo = parr_new(1, bp_utxo_undo_freep);
+
+		for (i = 0; i < block.vtx->len; i++) {
+			struct bp_tx *tx = parr_idx(block.vtx, i);
+			if (i > 0)
+				assert(bp_utxo_spend_undo(&uset, &outpt, undo));
+
+			coin = calloc(1, sizeof(*coin));
+			bp_utxo_init(coin);
+			assert(bp_utxo_from_tx(coin, tx, (i == 0), 200));
+			bp_utxo_set_add(&uset, coin);
+		}
+
+		snap_hash(&uset, &hash);
+		if (round == 0)
+			bu256_copy(&hash_connected, &hash);
+		assert(bu256_equal(&hash, &hash_connected));
+
+		assert(bp_utxo_disconnect_block(&uset, &block, undo));
+		parr_free(undo, true);
+
+		coin = bp_utxo_lookup(&uset, &outpt.hash);
+		assert(coin && (coin->vout->len == 1));
+
+		snap_hash(&uset, &hash);
+		assert(bu256_equal(&hash, &hash_before));
+	}
+
+	bp_block_free(&block);
+	bp_tx_free(prev_tx);
+	free(prev_tx);
+	bp_utxo_set_free(&uset);
+}
+
+int main (int argc, char *argv[])
+{
+	test_reorg();
+	test_snapshot(0);
+	test_snapshot(1);
+	test_snapshot(5000);
+	if (test_bench(argc, argv))
+		test_snapshot(200000);
+
+	bp_parallel_shutdown();
+	return 0;
+}
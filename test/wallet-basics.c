@@ -109,12 +109,12 @@ static void runtest(const char *json_base_fn, const char *ser_in_fn,
 	assert(bpks_add(&ks, &key) == true);
 
 	/* find key matches in block */
-	parr *matches;
-	matches = bp_block_match(&block_in, &ks);
-	assert(matches != NULL);
-	assert(matches->len == 1);
+	struct bp_block_matches matches;
+	bbm_init(&matches);
+	assert(bp_block_match(&matches, &block_in, &ks));
+	assert(matches.len == 1);
 
-	struct bp_block_match *match = parr_idx(matches, 0);
+	struct bp_block_match *match = &matches.match[0];
 	assert(match->n == 1);			/* match 2nd tx, index 1 */
 
 	/* get matching transaction */
@@ -127,10 +127,8 @@ static void runtest(const char *json_base_fn, const char *ser_in_fn,
 	assert(strcmp(tx_hexstr, tx_in_hash) == 0);
 
 	/* verify mask matches 2nd txout (1 << 1) */
-	mpz_t tmp_mask;
-	mpz_init_set_ui(tmp_mask,1);
-	mpz_mul_2exp(tmp_mask, tmp_mask, 1);
-	assert(mpz_cmp(tmp_mask, match->mask) == 0);
+	assert(match->n_words == 1);
+	assert(bbm_mask(&matches, match)[0] == (1ULL << 1));
 
 	/* build merkle tree, tx's branch */
 	parr *mtree = bp_block_merkle_tree(&block_in);
@@ -146,8 +144,7 @@ static void runtest(const char *json_base_fn, const char *ser_in_fn,
 	/* release resources */
 	parr_free(mtree, true);
 	parr_free(mbranch, true);
-	mpz_clear(tmp_mask);
-	parr_free(matches, true);
+	bbm_free(&matches);
 	bpks_free(&ks);
 	bp_key_free(&key);
 	bp_block_free(&block_in);
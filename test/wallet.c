@@ -2,12 +2,17 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <ccoin/address.h>
 #include <ccoin/buffer.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/cstr.h>
 #include <ccoin/key.h>
 #include <ccoin/wallet.h>
 #include <ccoin/hdkeys.h>
+#include <ccoin/util.h>
+#include "libtest.h"
+
+static bool bench;
 
 static bool key_eq(const struct bp_key *key1,
 		   const struct bp_key *key2)
@@ -93,6 +98,92 @@ static void check_serialization(const struct wallet *wlt)
 	wallet_free(&deser);
 }
 
+/* records appended after a full ser_wallet() supersede earlier ones */
+static void check_record_replay(const struct wallet *wlt)
+{
+	struct wallet_account *acct1 = parr_idx(wlt->accounts, 1);
+	struct wallet_account changed = *acct1;
+	struct wallet deser;
+
+	changed.next_key_idx = acct1->next_key_idx + 7;
+
+	cstring *ser = ser_wallet(wlt);
+	cstring *rec = ser_wallet_account_rec(wlt, &changed);
+	cstr_append_buf(ser, rec->str, rec->len);
+	cstr_free(rec, true);
+
+	struct const_buffer buf = { ser->str, ser->len };
+
+	assert(wallet_init(&deser, wlt->chain));
+	assert(deser_wallet(&deser, &buf));
+	assert(deser.accounts->len == wlt->accounts->len);
+
+	struct wallet_account *d_acct1 = parr_idx(deser.accounts, 1);
+	assert(d_acct1->acct_idx == acct1->acct_idx);
+	assert(d_acct1->next_key_idx == changed.next_key_idx);
+	assert(!strcmp(d_acct1->name->str, acct1->name->str));
+
+	cstr_free(ser, true);
+	wallet_free(&deser);
+}
+
+/* address idx of acct, derived from the master key along the whole path */
+static cstring *full_path_address(const struct wallet *wlt,
+				  const struct wallet_account *acct,
+				  uint32_t idx)
+{
+	struct hd_path_seg hdpath[] = {
+		{ 44, true },
+		{ 0, true },
+		{ acct->acct_idx, true },
+		{ 0, false },
+		{ idx, false },
+	};
+	struct hd_extended_key *master = parr_idx(wlt->hdmaster, 0);
+	struct hd_extended_key child;
+
+	hd_extended_key_init(&child);
+	assert(hd_derive(&child, master, hdpath, ARRAY_SIZE(hdpath)));
+	cstring *rs = bp_pubkey_get_address(&child.key,
+					    wlt->chain->addr_pubkey);
+	hd_extended_key_free(&child);
+
+	return rs;
+}
+
+static void check_address(const struct wallet *wlt,
+			  const struct wallet_account *acct,
+			  uint32_t idx, const cstring *addr)
+{
+	cstring *expect = full_path_address(wlt, acct, idx);
+	assert(addr && expect);
+	assert(!strcmp(addr->str, expect->str));
+	cstr_free(expect, true);
+}
+
+/* one batch from the cached chain key, versus whole-path derivations */
+static void bench_addresses(struct wallet *wlt, unsigned int n)
+{
+	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
+	uint32_t first = acct->next_key_idx;
+	unsigned int i;
+
+	double t0 = now_ms();
+	for (i = 0; i < n; i++)
+		cstr_free(full_path_address(wlt, acct, first + i), true);
+
+	double t1 = now_ms();
+	parr *addrs = wallet_new_addresses(wlt, n);
+	double t2 = now_ms();
+
+	assert(addrs && (addrs->len == n));
+	assert(acct->next_key_idx == first + n);
+	parr_free(addrs, true);
+
+	fprintf(stderr, "wallet: %u addresses: full path %.2f ms, "
+		"cached batch %.2f ms\n", n, t1 - t0, t2 - t1);
+}
+
 // Seed (hex): 000102030405060708090a0b0c0d0e0f
 static const uint8_t test_seed[16] = {
     0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
@@ -126,11 +217,41 @@ static void check_with_chain(const struct chain_info *chain)
 
 		addr = wallet_new_address(&wlt);
 		assert(addr != NULL);
+		if (i < 5)
+			check_address(&wlt, acct0, i, addr);
 
 		cstr_free(addr, true);
 	}
 
+	/* a batch continues where single addresses left off */
+	parr *addrs = wallet_new_addresses(&wlt, 20);
+	assert(addrs && (addrs->len == 20));
+	assert(acct0->next_key_idx == 120);
+	for (i = 0; i < addrs->len; i += 7)
+		check_address(&wlt, acct0, 100 + i, parr_idx(addrs, i));
+	parr_free(addrs, true);
+
+	/* other accounts use chain keys of their own */
+	cstr_free(wlt.def_acct, true);
+	wlt.def_acct = cstr_new("test1");
+	addrs = wallet_new_addresses(&wlt, 2);
+	assert(addrs && (addrs->len == 2));
+	check_address(&wlt, acct1, 1, parr_idx(addrs, 1));
+	parr_free(addrs, true);
+	assert(acct1->chain_keys[WALLET_CHAIN_EXTERNAL] !=
+	       acct0->chain_keys[WALLET_CHAIN_EXTERNAL]);
+
+	/* none left */
+	acct1->next_key_idx = 0x7fffffff;
+	assert(wallet_new_addresses(&wlt, 2) == NULL);
+	assert(acct1->next_key_idx == 0x7fffffff);
+	acct1->next_key_idx = 2;
+
+	if (bench && (chain == &chain_metadata[CHAIN_BITCOIN]))
+		bench_addresses(&wlt, 200);
+
 	check_serialization(&wlt);
+	check_record_replay(&wlt);
 
 	wallet_free(&wlt);
 }
@@ -139,6 +260,8 @@ int main(int argc, char *argv[])
 {
 	unsigned int i;
 
+	bench = test_bench(argc, argv);
+
 	assert(wallet_valid_name(NULL) == false);
 	assert(wallet_valid_name("") == false);
 	assert(wallet_valid_name("foo") == true);
@@ -0,0 +1,393 @@
+/* Copyright 2017 Bloq, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ccoin/bloom.h>
+#include <ccoin/coredefs.h>
+#include <ccoin/hdkeys.h>
+#include <ccoin/key.h>
+#include <ccoin/parallel.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+#include <ccoin/wallet.h>
+#include <ccoin/wallettrack.h>
+#include "libtest.h"
+
+static const char *track_fn = "wallettrack.out";
+
+// Seed (hex): 000102030405060708090a0b0c0d0e0f
+static const uint8_t test_seed[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static struct wallet wlt;
+
+/* P2PKH script, or compressed P2PK, paying key index of an account chain */
+static cstring *chain_script(enum wallet_chain chain, uint32_t index,
+			     bool p2pk)
+{
+	struct wallet_account *acct = parr_idx(wlt.accounts, 0);
+	const struct hd_extended_key *xpub =
+		wallet_account_chain_key(&wlt, acct, chain);
+	struct hd_pub_child kid;
+
+	assert(xpub && hd_derive_pub_batch(xpub, index, 1, &kid));
+
+	if (!p2pk) {
+		cstring *hash = cstr_new_buf(kid.pubkey_hash, 20);
+		cstring *script = bsp_make_pubkeyhash(hash);
+		cstr_free(hash, true);
+		return script;
+	}
+
+	cstring *script = cstr_new_sz(35);
+	cstr_append_c(script, sizeof(kid.pubkey));
+	cstr_append_buf(script, kid.pubkey, sizeof(kid.pubkey));
+	cstr_append_c(script, OP_CHECKSIG);
+	return script;
+}
+
+static cstring *other_script(unsigned char tag)
+{
+	unsigned char v[20];
+	memset(v, tag, sizeof(v));
+
+	cstring *hash = cstr_new_buf(v, sizeof(v));
+	cstring *script = bsp_make_pubkeyhash(hash);
+	cstr_free(hash, true);
+	return script;
+}
+
+static void tx_add_out(struct bp_tx *tx, int64_t value, cstring *script)
+{
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = value;
+	txout->scriptPubKey = script;
+	parr_add(tx->vout, txout);
+}
+
+/* a tx spending prevout, or a coinbase tagged tag; outputs added later */
+static struct bp_tx *test_tx(struct bp_block *block,
+			     const struct bp_outpt *prevout, unsigned char tag)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->vin = parr_new(1, bp_txin_freep);
+	tx->vout = parr_new(1, bp_txout_freep);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	if (prevout)
+		bp_outpt_copy(&txin->prevout, prevout);
+	else {
+		bu256_zero(&txin->prevout.hash);
+		txin->prevout.n = 0xffffffff;
+	}
+	txin->scriptSig = cstr_new_sz(1);
+	cstr_append_c(txin->scriptSig, tag);	/* unique coinbases */
+	txin->nSequence = 0xffffffff;
+	parr_add(tx->vin, txin);
+
+	parr_add(block->vtx, tx);
+	return tx;
+}
+
+static struct bp_block *test_block(const struct bp_block *prev)
+{
+	struct bp_block *block = calloc(1, sizeof(*block));
+	bp_block_init(block);
+	if (prev) {
+		bp_block_copy_hdr(block, prev);
+		bu256_copy(&block->hashPrevBlock, &prev->sha256);
+		block->nTime++;
+		block->sha256_valid = false;
+	}
+	block->vtx = parr_new(0, bp_tx_freep);
+	return block;
+}
+
+/* the outpoint of output n of the last tx added to block */
+static struct bp_outpt last_out(struct bp_block *block, uint32_t n)
+{
+	struct bp_tx *tx = parr_idx(block->vtx, block->vtx->len - 1);
+	struct bp_outpt outpt;
+
+	bp_tx_calc_sha256(tx);
+	bu256_copy(&outpt.hash, &tx->sha256);
+	outpt.n = n;
+	return outpt;
+}
+
+static void block_done(struct bp_block *block)
+{
+	unsigned int i;
+	for (i = 0; i < block->vtx->len; i++)
+		bp_tx_calc_sha256(parr_idx(block->vtx, i));
+	bp_block_calc_sha256(block);
+}
+
+static void free_block(struct bp_block *block)
+{
+	bp_block_free(block);
+	free(block);
+}
+
+static const struct wallet_track_chain *track_chain(struct wallet_tracker *wt,
+						    enum wallet_chain chain)
+{
+	unsigned int i;
+	for (i = 0; i < wt->chains->len; i++) {
+		struct wallet_track_chain *ch = parr_idx(wt->chains, i);
+		if ((ch->acct_idx == 0) && (ch->chain == chain))
+			return ch;
+	}
+	assert(0);
+	return NULL;
+}
+
+/* running balance agrees with the coins */
+static void check_balance(struct wallet_tracker *wt, int64_t want,
+			  unsigned int n_want)
+{
+	parr *coins = parr_new(0, NULL);
+	int64_t sum = 0;
+	unsigned int i;
+
+	wallet_track_unspent(wt, coins);
+	for (i = 0; i < coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(coins, i);
+		sum += coin->value;
+		if (i > 0) {
+			struct wallet_coin *prev = parr_idx(coins, i - 1);
+			assert(prev->height <= coin->height);
+		}
+	}
+
+	assert(wallet_track_balance(wt) == want);
+	assert(sum == want);
+	assert(wallet_track_n_coins(wt) == n_want);
+	assert(coins->len == n_want);
+	parr_free(coins, true);
+}
+
+/* the SPV filter matches payments to, and spends from, the wallet */
+static void check_filter(struct wallet_tracker *wt, struct bp_block *b1,
+			 struct bp_block *b2)
+{
+	struct bloom bf;
+	assert(wallet_track_filter(wt, &bf, 0.000001, 7));
+	assert(bf.nFlags == BLOOM_UPDATE_ALL);
+
+	/* P2PKH, then P2PK */
+	struct bp_tx *tx = parr_idx(b1->vtx, 2);
+	assert(bloom_tx_match(&bf, parr_idx(b1->vtx, 1)));
+	assert(bloom_tx_match(&bf, tx));
+
+	/* pays someone else, spending a coin no longer held */
+	assert(!bloom_tx_match(&bf, parr_idx(b2->vtx, 2)));
+
+	/* spends the key 22 coin */
+	struct bp_outpt coin = { .n = 0 };
+	bu256_copy(&coin.hash, &tx->sha256);
+	struct bp_block *b3 = test_block(b2);
+	struct bp_tx *spend = test_tx(b3, &coin, 99);
+	tx_add_out(spend, 60, other_script(0x55));
+	block_done(b3);
+	assert(bloom_tx_match(&bf, spend));
+
+	free_block(b3);
+	bloom_free(&bf);
+}
+
+static void test_track(void)
+{
+	struct wallet_tracker wt;
+	unsigned int i;
+
+	assert(wallet_init(&wlt, &chain_metadata[CHAIN_BITCOIN]));
+	assert(wallet_create(&wlt, test_seed, sizeof(test_seed)));
+	struct wallet_account *acct = parr_idx(wlt.accounts, 0);
+	acct->next_key_idx = 3;
+
+	wallet_track_init(&wt, wlt.chain->netmagic);
+	assert(wallet_track_watch(&wt, &wlt));
+	assert(wt.chains->len == 2);
+	assert(track_chain(&wt, WALLET_CHAIN_EXTERNAL)->n_watched ==
+	       3 + WALLET_TRACK_GAP);
+	assert(track_chain(&wt, WALLET_CHAIN_CHANGE)->n_watched ==
+	       WALLET_TRACK_GAP);
+	/* watching again adds nothing */
+	unsigned int n_keys = bp_hashtab_size(wt.keys);
+	assert(wallet_track_watch(&wt, &wlt));
+	assert(bp_hashtab_size(wt.keys) == n_keys);
+
+	/* 0: coinbase paying external key 0, and someone else */
+	struct bp_block *b0 = test_block(NULL);
+	struct bp_tx *tx = test_tx(b0, NULL, 0);
+	tx_add_out(tx, 5000, chain_script(WALLET_CHAIN_EXTERNAL, 0, false));
+	tx_add_out(tx, 100, other_script(0x11));
+	struct bp_outpt cb0 = last_out(b0, 0);
+	struct bp_outpt cb0_other = last_out(b0, 1);
+	block_done(b0);
+
+	assert(wallet_track_connect(&wt, b0, 0));
+	check_balance(&wt, 5000, 1);
+
+	/* 1: external key 22 (the last watched), paid by P2PK, moves
+	 * the lookahead; key 40 is then watched, though paid earlier in
+	 * the same block
+	 */
+	struct bp_block *b1 = test_block(b0);
+	test_tx(b1, NULL, 1);
+	struct bp_outpt ext;
+	memset(&ext.hash, 0x44, sizeof(ext.hash));
+	ext.n = 0;
+	tx = test_tx(b1, &ext, 3);
+	tx_add_out(tx, 20, chain_script(WALLET_CHAIN_EXTERNAL, 40, false));
+	tx_add_out(tx, 9, chain_script(WALLET_CHAIN_CHANGE, 5, false));
+	struct bp_outpt out40 = last_out(b1, 0);
+	tx = test_tx(b1, &cb0_other, 2);
+	tx_add_out(tx, 70, chain_script(WALLET_CHAIN_EXTERNAL, 22, true));
+	block_done(b1);
+
+	assert(wallet_track_connect(&wt, b1, 1));
+	check_balance(&wt, 5000 + 70 + 20 + 9, 4);
+	assert(track_chain(&wt, WALLET_CHAIN_EXTERNAL)->n_used == 41);
+	assert(track_chain(&wt, WALLET_CHAIN_EXTERNAL)->n_watched ==
+	       41 + WALLET_TRACK_GAP);
+	assert(track_chain(&wt, WALLET_CHAIN_CHANGE)->n_used == 6);
+
+	/* 2: spends coinbase 0 and the key 40 coin, to key 100 (not
+	 * watched) and to an output spent again in the same block
+	 */
+	struct bp_block *b2 = test_block(b1);
+	test_tx(b2, NULL, 4);
+	tx = test_tx(b2, &cb0, 5);
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	bp_outpt_copy(&txin->prevout, &out40);
+	txin->scriptSig = cstr_new_sz(0);
+	parr_add(tx->vin, txin);
+	tx_add_out(tx, 4000, chain_script(WALLET_CHAIN_EXTERNAL, 100, false));
+	tx_add_out(tx, 1000, chain_script(WALLET_CHAIN_EXTERNAL, 1, false));
+	struct bp_outpt out1 = last_out(b2, 1);
+	tx = test_tx(b2, &out1, 6);
+	tx_add_out(tx, 990, other_script(0x22));
+	block_done(b2);
+
+	assert(!wallet_track_connect(&wt, b2, 3));	/* not best + 1 */
+	assert(!wallet_track_connect(&wt, b1, 2));	/* not on best */
+	assert(wallet_track_connect(&wt, b2, 2));
+	check_balance(&wt, 70 + 9, 2);
+	assert(wt.best_height == 2);
+	assert(bu256_equal(&wt.best_hash, &b2->sha256));
+
+	/* disconnect and reconnect */
+	assert(!wallet_track_disconnect(&wt, &b1->sha256));
+	assert(wallet_track_disconnect(&wt, &b2->sha256));
+	check_balance(&wt, 5000 + 70 + 20 + 9, 4);
+	assert(wt.best_height == 1);
+	assert(bu256_equal(&wt.best_hash, &b1->sha256));
+	assert(wallet_track_connect(&wt, b2, 2));
+	check_balance(&wt, 70 + 9, 2);
+	check_filter(&wt, b1, b2);
+
+	/* stored and read back, journal included */
+	assert(wallet_track_write(&wt, track_fn));
+	struct wallet_tracker wt2;
+	assert(wallet_track_read(&wt2, track_fn));
+	assert(!memcmp(wt2.netmagic, wlt.chain->netmagic, 4));
+	assert(wt2.best_height == 2);
+	assert(bu256_equal(&wt2.best_hash, &b2->sha256));
+	assert(bp_hashtab_size(wt2.keys) == bp_hashtab_size(wt.keys));
+	assert(wt2.journal->len == 3);
+	check_balance(&wt2, 70 + 9, 2);
+
+	assert(wallet_track_disconnect(&wt2, &b2->sha256));
+	assert(wallet_track_disconnect(&wt2, &b1->sha256));
+	check_balance(&wt2, 5000, 1);
+	assert(wallet_track_disconnect(&wt2, &b0->sha256));
+	check_balance(&wt2, 0, 0);
+	assert(wt2.best_height == -1);
+	wallet_track_free(&wt2);
+
+	/* a torn file is refused */
+	void *data;
+	size_t data_len;
+	assert(bu_read_file(track_fn, &data, &data_len, 1 << 20));
+	((unsigned char *) data)[data_len / 2] ^= 1;
+	assert(bu_write_file(track_fn, data, data_len));
+	free(data);
+	assert(!wallet_track_read(&wt2, track_fn));
+	unlink(track_fn);
+
+	/* only WALLET_TRACK_DEPTH blocks can be disconnected */
+	struct bp_block *prev = b2;
+	parr *more = parr_new(0, NULL);
+	for (i = 0; i < WALLET_TRACK_DEPTH + 10; i++) {
+		struct bp_block *b = test_block(prev);
+		test_tx(b, NULL, 7 + i);
+		tx_add_out(b->vtx->data[0], 1, other_script(0x33));
+		block_done(b);
+		assert(wallet_track_connect(&wt, b, 3 + i));
+		parr_add(more, b);
+		prev = b;
+	}
+	assert(wt.journal->len == WALLET_TRACK_DEPTH);
+	for (i = more->len; i > 10; i--) {
+		struct bp_block *b = parr_idx(more, i - 1);
+		assert(wallet_track_disconnect(&wt, &b->sha256));
+	}
+	prev = parr_idx(more, 9);
+	assert(!wallet_track_disconnect(&wt, &prev->sha256));
+	check_balance(&wt, 70 + 9, 2);
+
+	/* issuing addresses past the lookahead, or a new key, needs a
+	 * rescan
+	 */
+	acct->next_key_idx = 50;
+	assert(wallet_track_watch(&wt, &wlt));
+	assert(wt.best_height == 12);
+	acct->next_key_idx = 71;
+	assert(wallet_track_watch(&wt, &wlt));
+	assert(wt.best_height == -1);
+	check_balance(&wt, 0, 0);
+	assert(track_chain(&wt, WALLET_CHAIN_EXTERNAL)->n_watched ==
+	       71 + WALLET_TRACK_GAP);
+
+	assert(wallet_track_connect(&wt, b0, 0));
+	struct bp_key key;
+	bp_key_init(&key);
+	assert(bp_key_generate(&key));
+	assert(wallet_track_add_key(&wt, &key));
+	assert(wallet_track_add_key(&wt, &key));
+	assert(wt.loose->len == 1);
+	assert(wt.best_height == -1);
+	bp_key_free(&key);
+
+	for (i = 0; i < more->len; i++)
+		free_block(parr_idx(more, i));
+	parr_free(more, true);
+	free_block(b0);
+	free_block(b1);
+	free_block(b2);
+	wallet_track_free(&wt);
+	wallet_free(&wlt);
+}
+
+int main(int argc, char *argv[])
+{
+	test_track();
+
+	bp_parallel_shutdown();
+	bp_key_static_shutdown();
+	return 0;
+}